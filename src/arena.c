@@ -0,0 +1,173 @@
+/**
+ * arena.c
+ * Bump-pointer allocator for memory that only lives as long as a request.
+ *
+ * Allocations are carved out of blocks one after the other and are never
+ * freed on their own. Instead the whole arena is reset once the request is
+ * done with, which keeps its first block around to be reused by the next one
+ * and lets all of the strings and objects of a request be thrown away at once
+ * without having to keep track of who owns each of them.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defaults.h"
+
+/* Alignment of every allocation. */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(len) \
+	(((len) + (ARENA_ALIGN - 1)) & ~((size_t)ARENA_ALIGN - 1))
+
+/* Space taken by the header of each block. */
+#define ARENA_HDR_LEN ARENA_ROUND(sizeof(arena_block_t))
+
+/* Private functions. */
+static void arena_free_until(arena_t *arena, arena_block_t *stop);
+
+/**
+ * Initializes an empty arena.
+ *
+ * @param arena Arena object to be initialized.
+ */
+void arena_init(arena_t *arena) {
+	arena->head = NULL;
+}
+
+/**
+ * Throws away everything that was allocated from an arena, keeping its first
+ * block to be reused.
+ *
+ * @param arena Arena object to be reset.
+ */
+void arena_reset(arena_t *arena) {
+	arena_block_t *first;
+
+	/* Find the block that was allocated first. */
+	first = arena->head;
+	if (first == NULL)
+		return;
+	while (first->next != NULL)
+		first = first->next;
+
+	arena_free_until(arena, first);
+	first->used = 0;
+}
+
+/**
+ * Frees up every block of an arena, leaving it empty.
+ *
+ * @param arena Arena object to be freed.
+ */
+void arena_free(arena_t *arena) {
+	arena_free_until(arena, NULL);
+}
+
+/**
+ * Allocates memory from an arena.
+ *
+ * @param arena Arena object.
+ * @param len   Number of bytes to allocate.
+ *
+ * @return Pointer to the memory, aligned for any type, or NULL if an error
+ *         occurred.
+ */
+void *arena_alloc(arena_t *arena, size_t len) {
+	arena_block_t *block;
+	size_t size;
+
+	/* Carve it out of the current block if it fits. */
+	len = ARENA_ROUND(len);
+	block = arena->head;
+	if ((block != NULL) && ((block->size - block->used) >= len)) {
+		block->used += len;
+		return (char *)block + ARENA_HDR_LEN + block->used - len;
+	}
+
+	/* Start a new block, large enough for allocations bigger than usual. */
+	size = (len > GL_ARENA_BLOCK_LEN) ? len : GL_ARENA_BLOCK_LEN;
+	block = (arena_block_t *)malloc(ARENA_HDR_LEN + size);
+	if (block == NULL)
+		return NULL;
+	block->next = arena->head;
+	block->size = size;
+	block->used = len;
+	arena->head = block;
+
+	return (char *)block + ARENA_HDR_LEN;
+}
+
+/**
+ * Duplicates a string into an arena.
+ *
+ * @param arena Arena object.
+ * @param str   String to be duplicated.
+ *
+ * @return Copy of the string or NULL if an error occurred.
+ */
+char *arena_strdup(arena_t *arena, const char *str) {
+	size_t len;
+	char *dup;
+
+	len = strlen(str) + 1;
+	dup = (char *)arena_alloc(arena, len);
+	if (dup != NULL)
+		memcpy(dup, str, len);
+
+	return dup;
+}
+
+/**
+ * Marks the current position of an arena so that whatever is allocated after
+ * it can be thrown away without resetting the entire arena.
+ *
+ * @param arena Arena object.
+ *
+ * @return Current position of the arena.
+ *
+ * @see arena_rewind
+ */
+arena_mark_t arena_mark(const arena_t *arena) {
+	arena_mark_t mark;
+
+	mark.block = arena->head;
+	mark.used = (mark.block != NULL) ? mark.block->used : 0;
+
+	return mark;
+}
+
+/**
+ * Throws away everything that was allocated from an arena since it was
+ * marked.
+ *
+ * @param arena Arena object.
+ * @param mark  Position returned by arena_mark.
+ *
+ * @see arena_mark
+ */
+void arena_rewind(arena_t *arena, arena_mark_t mark) {
+	arena_free_until(arena, mark.block);
+	if (mark.block != NULL)
+		mark.block->used = mark.used;
+}
+
+/**
+ * Frees up the blocks of an arena that were allocated after a given one.
+ *
+ * @param arena Arena object.
+ * @param stop  Block that will become the current one, or NULL to free all of
+ *              them.
+ */
+static void arena_free_until(arena_t *arena, arena_block_t *stop) {
+	arena_block_t *block;
+
+	while ((arena->head != NULL) && (arena->head != stop)) {
+		block = arena->head;
+		arena->head = block->next;
+		free(block);
+	}
+}
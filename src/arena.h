@@ -0,0 +1,59 @@
+/**
+ * arena.h
+ * Bump-pointer allocator for memory that only lives as long as a request.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_ARENA_H
+#define _GL_ARENA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Block of memory that allocations are carved out of. Its data follows it.
+ */
+typedef struct arena_block_s {
+	struct arena_block_s *next;
+	size_t size;
+	size_t used;
+} arena_block_t;
+
+/**
+ * Arena object. Blocks are only allocated once something is allocated from it,
+ * so an arena that's never used costs nothing.
+ */
+typedef struct {
+	arena_block_t *head;
+} arena_t;
+
+/**
+ * Position in an arena that it can be rewound back to.
+ */
+typedef struct {
+	arena_block_t *block;
+	size_t used;
+} arena_mark_t;
+
+/* Lifetime. */
+void arena_init(arena_t *arena);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+/* Allocating. */
+void *arena_alloc(arena_t *arena, size_t len);
+char *arena_strdup(arena_t *arena, const char *str);
+
+/* Rewinding. */
+arena_mark_t arena_mark(const arena_t *arena);
+void arena_rewind(arena_t *arena, arena_mark_t mark);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_ARENA_H */
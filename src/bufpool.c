@@ -0,0 +1,191 @@
+/**
+ * bufpool.c
+ * Shared pool of large buffers that are borrowed while moving the contents of
+ * a transfer.
+ *
+ * Buffers of GL_IOBUF_LEN bytes are carved out of slabs that are backed by
+ * huge pages whenever the system lets us, and are never given back to it.
+ * Instead they're kept in a list shared by every thread, with each thread
+ * holding on to a few of them that it can get and put back without taking the
+ * lock. A connection only borrows one while it's actually moving data, so
+ * idle connections don't hold on to any.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "bufpool.h"
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+#endif /* _WIN32 */
+#include <stddef.h>
+
+#include "logging.h"
+#include "thread.h"
+
+/* Number of buffers carved out of each slab. */
+#define BUFPOOL_SLAB_BUFS (GL_BUFPOOL_SLAB_LEN / GL_IOBUF_LEN)
+
+/**
+ * Buffer that's waiting in the shared list, which is kept inside of it.
+ */
+typedef struct bufpool_free_s {
+	struct bufpool_free_s *next;
+} bufpool_free_t;
+
+/* Buffers shared by every thread. */
+static mutex_t bufpool_lock;
+static bufpool_free_t *bufpool_free;
+
+/* Buffers held by the current thread. */
+static THREAD_LOCAL uint8_t *bufpool_cache[GL_BUFPOOL_CACHE];
+static THREAD_LOCAL unsigned int bufpool_ncached;
+
+/* Private functions. */
+static void bufpool_push(uint8_t *buf);
+static uint8_t *bufpool_slab_alloc(void);
+
+/**
+ * Initializes the pool. Must be called before any threads are started.
+ */
+void bufpool_init(void) {
+	mutex_init(&bufpool_lock);
+	bufpool_free = NULL;
+}
+
+/**
+ * Hands the buffers held by the current thread back to the pool. Must be
+ * called by every thread that used the pool before it exits.
+ */
+void bufpool_thread_exit(void) {
+	mutex_lock(&bufpool_lock);
+	while (bufpool_ncached > 0)
+		bufpool_push(bufpool_cache[--bufpool_ncached]);
+	mutex_unlock(&bufpool_lock);
+}
+
+/**
+ * Borrows a buffer from the pool.
+ *
+ * @return Buffer of GL_IOBUF_LEN bytes or NULL if an error occurred.
+ *
+ * @see bufpool_put
+ */
+uint8_t *bufpool_get(void) {
+	uint8_t *slab;
+	uint8_t *buf;
+	size_t i;
+
+	/* Use one of the buffers we are holding on to. */
+	if (bufpool_ncached > 0)
+		return bufpool_cache[--bufpool_ncached];
+
+	/* Take one from the shared list. */
+	mutex_lock(&bufpool_lock);
+	if (bufpool_free != NULL) {
+		buf = (uint8_t *)bufpool_free;
+		bufpool_free = bufpool_free->next;
+		mutex_unlock(&bufpool_lock);
+
+		return buf;
+	}
+	mutex_unlock(&bufpool_lock);
+
+	/* Carve a new slab into buffers and share the ones we don't need. */
+	slab = bufpool_slab_alloc();
+	if (slab == NULL)
+		return NULL;
+	mutex_lock(&bufpool_lock);
+	for (i = 1; i < BUFPOOL_SLAB_BUFS; i++)
+		bufpool_push(slab + (i * GL_IOBUF_LEN));
+	mutex_unlock(&bufpool_lock);
+
+	return slab;
+}
+
+/**
+ * Gives a buffer back to the pool.
+ *
+ * @param buf Buffer returned by bufpool_get. Ignored if NULL.
+ *
+ * @see bufpool_get
+ */
+void bufpool_put(uint8_t *buf) {
+	if (buf == NULL)
+		return;
+
+	/* Hold on to it if we have room for it. */
+	if (bufpool_ncached < GL_BUFPOOL_CACHE) {
+		bufpool_cache[bufpool_ncached++] = buf;
+		return;
+	}
+
+	mutex_lock(&bufpool_lock);
+	bufpool_push(buf);
+	mutex_unlock(&bufpool_lock);
+}
+
+/**
+ * Adds a buffer to the shared list. Must be called with the lock held.
+ *
+ * @param buf Buffer to be shared.
+ */
+static void bufpool_push(uint8_t *buf) {
+	bufpool_free_t *node;
+
+	node = (bufpool_free_t *)buf;
+	node->next = bufpool_free;
+	bufpool_free = node;
+}
+
+/**
+ * Allocates a slab of GL_BUFPOOL_SLAB_LEN bytes, backed by huge pages if
+ * possible.
+ *
+ * @return Slab of memory or NULL if it couldn't be allocated.
+ */
+static uint8_t *bufpool_slab_alloc(void) {
+	void *slab;
+
+#ifdef _WIN32
+	SIZE_T large;
+
+	/* Large pages require a privilege that we most likely don't have. */
+	large = GetLargePageMinimum();
+	slab = NULL;
+	if ((large > 0) && ((GL_BUFPOOL_SLAB_LEN % large) == 0)) {
+		slab = VirtualAlloc(NULL, GL_BUFPOOL_SLAB_LEN, MEM_RESERVE |
+			MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+	}
+	if (slab == NULL) {
+		slab = VirtualAlloc(NULL, GL_BUFPOOL_SLAB_LEN, MEM_RESERVE |
+			MEM_COMMIT, PAGE_READWRITE);
+	}
+#else
+	slab = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	/* Only works if the system has set huge pages aside for us. */
+	slab = mmap(NULL, GL_BUFPOOL_SLAB_LEN, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif /* MAP_HUGETLB */
+	if (slab == MAP_FAILED) {
+		slab = mmap(NULL, GL_BUFPOOL_SLAB_LEN, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED)
+			slab = NULL;
+#ifdef MADV_HUGEPAGE
+		/* Let the kernel back it with transparent huge pages instead. */
+		if (slab != NULL)
+			madvise(slab, GL_BUFPOOL_SLAB_LEN, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+	}
+#endif /* _WIN32 */
+
+	if (slab == NULL)
+		log_syserr(LOG_CRIT, "Failed to allocate a slab of transfer buffers");
+
+	return (uint8_t *)slab;
+}
@@ -0,0 +1,32 @@
+/**
+ * bufpool.h
+ * Shared pool of large buffers that are borrowed while moving the contents of
+ * a transfer.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_BUFPOOL_H
+#define _GL_BUFPOOL_H
+
+#include <stdint.h>
+
+#include "defaults.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pool. */
+void bufpool_init(void);
+void bufpool_thread_exit(void);
+
+/* Buffers. */
+uint8_t *bufpool_get(void);
+void bufpool_put(uint8_t *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_BUFPOOL_H */
@@ -0,0 +1,133 @@
+/**
+ * cdc.c
+ * Content-defined chunking, which splits contents at points chosen by the
+ * contents themselves so that the same data ends up in the same chunks no
+ * matter where it's located in a file.
+ *
+ * Cut points are found using FastCDC: a gear hash is rolled over the contents,
+ * skipping the minimum chunk size, and a cut is made where enough of its upper
+ * bits are zero. A stricter mask is used before the average chunk size and a
+ * looser one after it, which keeps chunk sizes close to the average.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "cdc.h"
+
+#include <string.h>
+
+#include "defaults.h"
+
+/* Masks used before and after the average chunk size. */
+#define CDC_MASK(bits) (((((uint64_t)1) << (bits)) - 1) << (64 - (bits)))
+
+/* Table of random values for each byte used by the gear hash. */
+static uint64_t gear[256];
+
+/* Private functions. */
+static unsigned int cdc_log2(uint64_t n);
+
+/**
+ * Initializes the table used by the gear hash. It must be the same everywhere
+ * for the same contents to be split into the same chunks, so it's generated
+ * from a fixed seed.
+ */
+void cdc_init(void) {
+	uint64_t state;
+	uint64_t z;
+	int i;
+
+	/* SplitMix64 with a fixed seed. */
+	state = 0x676C6364635F6765ULL;
+	for (i = 0; i < 256; i++) {
+		state += 0x9E3779B97F4A7C15ULL;
+		z = state;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/**
+ * Finds where the chunk at the beginning of a buffer ends.
+ *
+ * @param buf Contents to be split.
+ * @param len Length of the contents. Must be at least GL_CDC_MAX unless these
+ *            are the last bytes of the contents.
+ *
+ * @return Length of the chunk.
+ */
+size_t cdc_cut(const uint8_t *buf, size_t len) {
+	uint64_t mask_s;
+	uint64_t mask_l;
+	uint64_t hash;
+	size_t normal;
+	size_t i;
+
+	/* Chunks can't be smaller than the minimum nor larger than the maximum. */
+	if (len <= GL_CDC_MIN)
+		return len;
+	if (len > GL_CDC_MAX)
+		len = GL_CDC_MAX;
+	normal = (len < GL_CDC_AVG) ? len : GL_CDC_AVG;
+	mask_s = CDC_MASK(cdc_log2(GL_CDC_AVG) + 2);
+	mask_l = CDC_MASK(cdc_log2(GL_CDC_AVG) - 2);
+
+	/* Look for a cut point, being stricter before the average size. */
+	hash = 0;
+	for (i = GL_CDC_MIN; i < normal; i++) {
+		hash = (hash << 1) + gear[buf[i]];
+		if (!(hash & mask_s))
+			return i + 1;
+	}
+	for (; i < len; i++) {
+		hash = (hash << 1) + gear[buf[i]];
+		if (!(hash & mask_l))
+			return i + 1;
+	}
+
+	return len;
+}
+
+/**
+ * Encodes a chunk reference to be sent over the network.
+ *
+ * @param buf   Buffer of at least CDC_ENTRY_LEN bytes.
+ * @param chunk Chunk reference to be encoded.
+ */
+void cdc_chunk_pack(uint8_t *buf, const cdc_chunk_t *chunk) {
+	buf[0] = (uint8_t)((chunk->len >> 24) & 0xFF);
+	buf[1] = (uint8_t)((chunk->len >> 16) & 0xFF);
+	buf[2] = (uint8_t)((chunk->len >> 8) & 0xFF);
+	buf[3] = (uint8_t)(chunk->len & 0xFF);
+	memcpy(buf + 4, chunk->hash, CDC_HASH_LEN);
+}
+
+/**
+ * Decodes a chunk reference that was received from the network.
+ *
+ * @param buf   Encoded chunk reference.
+ * @param chunk Returns the chunk reference, without its offset.
+ */
+void cdc_chunk_unpack(const uint8_t *buf, cdc_chunk_t *chunk) {
+	chunk->offset = 0;
+	chunk->len = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+		((uint32_t)buf[2] << 8) | buf[3];
+	memcpy(chunk->hash, buf + 4, CDC_HASH_LEN);
+}
+
+/**
+ * Calculates the base 2 logarithm of a power of two.
+ *
+ * @param n Power of two.
+ *
+ * @return Logarithm of the number.
+ */
+static unsigned int cdc_log2(uint64_t n) {
+	unsigned int bits;
+
+	for (bits = 0; n > 1; n >>= 1)
+		bits++;
+
+	return bits;
+}
@@ -0,0 +1,54 @@
+/**
+ * cdc.h
+ * Content-defined chunking, which splits contents at points chosen by the
+ * contents themselves so that the same data ends up in the same chunks no
+ * matter where it's located in a file.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_CDC_H
+#define _GL_CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sha256.h"
+
+/**
+ * Length of the hash that identifies a chunk.
+ */
+#define CDC_HASH_LEN SHA256_LEN
+
+/**
+ * Length of a chunk reference when sent over the network.
+ */
+#define CDC_ENTRY_LEN (4 + CDC_HASH_LEN)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Reference to a chunk of a file.
+ */
+typedef struct {
+	uint64_t offset;
+	uint32_t len;
+	uint8_t hash[CDC_HASH_LEN];
+} cdc_chunk_t;
+
+/* Chunking. */
+void cdc_init(void);
+size_t cdc_cut(const uint8_t *buf, size_t len);
+
+/* Wire encoding. */
+void cdc_chunk_pack(uint8_t *buf, const cdc_chunk_t *chunk);
+void cdc_chunk_unpack(const uint8_t *buf, cdc_chunk_t *chunk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_CDC_H */
@@ -0,0 +1,389 @@
+/**
+ * chunkstore.c
+ * Persistent store of the chunks of contents that were received, used to
+ * assemble files out of chunks that we already have.
+ *
+ * The contents of the chunks are appended to a data file, and an index of them
+ * is kept in a separate file laid out exactly as it's used in memory: a header
+ * followed by an open-addressing hash table keyed by the hash of each chunk.
+ * The index is mapped straight into memory and updated in place, so lookups
+ * cost the same no matter how many chunks are stored, and it's only rebuilt
+ * when the table has to grow.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "chunkstore.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defaults.h"
+#include "logging.h"
+#include "utils.h"
+
+/* Identification of the index file. */
+#define CHUNKSTORE_MAGIC   0x4B434C47UL
+#define CHUNKSTORE_VERSION 1
+
+/* Smallest number of slots in the hash table. */
+#define CHUNKSTORE_SLOTS_MIN 4096
+
+/**
+ * Header of the index file.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t nslots;
+	uint64_t count;
+	uint64_t datalen;
+} chunkstore_hdr_t;
+
+/**
+ * Slot of the hash table of the index.
+ */
+typedef struct {
+	uint8_t hash[CDC_HASH_LEN];
+	uint64_t offset;
+	uint32_t len;
+	uint32_t used;
+} chunkstore_slot_t;
+
+/* Private functions. */
+static bool chunkstore_valid(const chunkstore_t *store);
+static uint8_t *chunkstore_create(const char *path, uint64_t nslots,
+                                  size_t *len);
+static chunkstore_slot_t *chunkstore_slot(uint8_t *map, const uint8_t *hash);
+static const chunkstore_slot_t *chunkstore_find(const chunkstore_t *store,
+                                                const cdc_chunk_t *chunk);
+static bool chunkstore_grow(chunkstore_t *store);
+
+/**
+ * Opens the chunk store, starting a new one if it doesn't exist or is
+ * damaged.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param store Store object to be populated.
+ * @param ipath Path to the index file.
+ * @param dpath Path to the data file.
+ *
+ * @return TRUE if the store can be used, FALSE if no chunks will be kept.
+ *
+ * @see chunkstore_close
+ */
+bool chunkstore_open(chunkstore_t *store, const char *ipath,
+                     const char *dpath) {
+	memset(store, 0, sizeof(chunkstore_t));
+	store->ipath = strdup(ipath);
+	if (store->ipath == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate chunk store path");
+		return false;
+	}
+
+	/* Reuse the store we already have if it's intact. */
+	store->map = (uint8_t *)file_map(ipath, &store->len, true);
+	store->data = file_open(dpath, "r+b");
+	if (chunkstore_valid(store))
+		return true;
+
+	/* Start over with an empty store. */
+	file_unmap(store->map, store->len);
+	if (store->data != NULL)
+		fclose(store->data);
+	store->data = file_open(dpath, "w+b");
+	store->map = chunkstore_create(ipath, CHUNKSTORE_SLOTS_MIN, &store->len);
+	if ((store->data == NULL) || (store->map == NULL)) {
+		log_syserr(LOG_WARNING, "Failed to create chunk store \"%s\"", ipath);
+		chunkstore_close(store);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Frees up the resources allocated by the store.
+ *
+ * @param store Store object to be freed.
+ */
+void chunkstore_close(chunkstore_t *store) {
+	file_unmap(store->map, store->len);
+	store->map = NULL;
+	store->len = 0;
+	if (store->data != NULL) {
+		fclose(store->data);
+		store->data = NULL;
+	}
+	free(store->ipath);
+	store->ipath = NULL;
+}
+
+/**
+ * Checks if a chunk is in the store.
+ *
+ * @param store Store object.
+ * @param chunk Chunk to look for.
+ *
+ * @return TRUE if we have the chunk, FALSE otherwise.
+ */
+bool chunkstore_has(const chunkstore_t *store, const cdc_chunk_t *chunk) {
+	return chunkstore_find(store, chunk) != NULL;
+}
+
+/**
+ * Reads the contents of a chunk from the store.
+ *
+ * @param store Store object.
+ * @param chunk Chunk to be read.
+ * @param buf   Buffer with room for the entire chunk.
+ *
+ * @return TRUE if the chunk was read, FALSE otherwise.
+ */
+bool chunkstore_read(const chunkstore_t *store, const cdc_chunk_t *chunk,
+                     uint8_t *buf) {
+	const chunkstore_slot_t *slot;
+
+	slot = chunkstore_find(store, chunk);
+	if (slot == NULL)
+		return false;
+
+	return file_pread(store->data, buf, slot->len, slot->offset);
+}
+
+/**
+ * Adds a chunk to the store, unless it's already there or the store is full.
+ *
+ * @param store Store object.
+ * @param chunk Chunk to be added. Its hash must already have been verified.
+ * @param buf   Contents of the chunk.
+ *
+ * @return TRUE if the chunk is in the store, FALSE otherwise.
+ */
+bool chunkstore_add(chunkstore_t *store, const cdc_chunk_t *chunk,
+                    const uint8_t *buf) {
+	chunkstore_hdr_t *hdr;
+	chunkstore_slot_t *slot;
+
+	/* Check if there's anything to do. */
+	if (store->map == NULL)
+		return false;
+	if (chunkstore_has(store, chunk))
+		return true;
+	hdr = (chunkstore_hdr_t *)store->map;
+	if ((hdr->datalen + chunk->len) > GL_CHUNK_STORE_MAX)
+		return false;
+
+	/* Keep the table at most half full. */
+	if (((hdr->count + 1) * 2) > hdr->nslots) {
+		if (!chunkstore_grow(store))
+			return false;
+		hdr = (chunkstore_hdr_t *)store->map;
+	}
+
+	/* Only index the contents once they're in the data file. */
+	if (!file_pwrite(store->data, buf, chunk->len, hdr->datalen)) {
+		log_syserr(LOG_ERROR, "Failed to write to the chunk store");
+		return false;
+	}
+	slot = chunkstore_slot(store->map, chunk->hash);
+	memcpy(slot->hash, chunk->hash, CDC_HASH_LEN);
+	slot->offset = hdr->datalen;
+	slot->len = chunk->len;
+	hdr->datalen += chunk->len;
+	hdr->count++;
+	slot->used = 1;
+
+	return true;
+}
+
+/**
+ * Checks if the index and data files of a store are intact.
+ *
+ * @param store Store object with the mapped index and opened data file.
+ *
+ * @return TRUE if the store can be used as it is, FALSE otherwise.
+ */
+static bool chunkstore_valid(const chunkstore_t *store) {
+	const chunkstore_hdr_t *hdr;
+	uint64_t mtime;
+	uint64_t size;
+	uint64_t dev;
+	uint64_t ino;
+
+	if ((store->map == NULL) || (store->data == NULL) ||
+			(store->len < sizeof(chunkstore_hdr_t))) {
+		return false;
+	}
+
+	/* Check the layout of the table. */
+	hdr = (const chunkstore_hdr_t *)store->map;
+	if ((hdr->magic != CHUNKSTORE_MAGIC) ||
+			(hdr->version != CHUNKSTORE_VERSION) ||
+			(hdr->nslots < CHUNKSTORE_SLOTS_MIN) ||
+			(hdr->nslots & (hdr->nslots - 1)) || (hdr->count >= hdr->nslots) ||
+			(store->len != (sizeof(chunkstore_hdr_t) +
+			(hdr->nslots * sizeof(chunkstore_slot_t))))) {
+		return false;
+	}
+
+	/* Ensure every indexed chunk is in the data file. */
+	return file_ident(store->data, &dev, &ino, &size, &mtime) &&
+		(size >= hdr->datalen);
+}
+
+/**
+ * Creates an empty index file and maps it into memory.
+ *
+ * @warning The mapping must be released later.
+ *
+ * @param path   Path to the index file.
+ * @param nslots Number of slots in the hash table.
+ * @param len    Returns the length of the mapping.
+ *
+ * @return Index file mapped into memory or NULL if an error occurred.
+ */
+static uint8_t *chunkstore_create(const char *path, uint64_t nslots,
+                                  size_t *len) {
+	chunkstore_hdr_t hdr;
+	uint8_t zeros[4096];
+	uint64_t left;
+	size_t n;
+	FILE *fh;
+
+	/* Write the header followed by the empty table. */
+	fh = file_open(path, "wb");
+	if (fh == NULL)
+		return NULL;
+	memset(&hdr, 0, sizeof(chunkstore_hdr_t));
+	hdr.magic = CHUNKSTORE_MAGIC;
+	hdr.version = CHUNKSTORE_VERSION;
+	hdr.nslots = nslots;
+	fwrite(&hdr, sizeof(chunkstore_hdr_t), 1, fh);
+	memset(zeros, 0, sizeof(zeros));
+	for (left = nslots * sizeof(chunkstore_slot_t); left > 0; left -= n) {
+		n = (left > sizeof(zeros)) ? sizeof(zeros) : (size_t)left;
+		if (fwrite(zeros, 1, n, fh) != n)
+			break;
+	}
+	if ((fclose(fh) != 0) || (left > 0)) {
+		file_remove(path);
+		return NULL;
+	}
+
+	return (uint8_t *)file_map(path, len, true);
+}
+
+/**
+ * Finds the slot of the hash table where a chunk is or should be.
+ *
+ * @param map  Index mapped into memory.
+ * @param hash Hash of the chunk to look for.
+ *
+ * @return Slot with the chunk or the empty slot where it should go.
+ */
+static chunkstore_slot_t *chunkstore_slot(uint8_t *map, const uint8_t *hash) {
+	chunkstore_slot_t *slots;
+	chunkstore_slot_t *slot;
+	uint64_t mask;
+	uint64_t i;
+	int j;
+
+	/* Hashes are already uniformly distributed. */
+	slots = (chunkstore_slot_t *)(map + sizeof(chunkstore_hdr_t));
+	mask = ((chunkstore_hdr_t *)map)->nslots - 1;
+	i = 0;
+	for (j = 0; j < 8; j++)
+		i = (i << 8) | hash[j];
+
+	for (i &= mask; ; i = (i + 1) & mask) {
+		slot = &slots[i];
+		if (!slot->used || (memcmp(slot->hash, hash, CDC_HASH_LEN) == 0))
+			return slot;
+	}
+}
+
+/**
+ * Looks up a chunk in the store.
+ *
+ * @param store Store object.
+ * @param chunk Chunk to look for.
+ *
+ * @return Slot of the chunk or NULL if we don't have it.
+ */
+static const chunkstore_slot_t *chunkstore_find(const chunkstore_t *store,
+                                                const cdc_chunk_t *chunk) {
+	const chunkstore_slot_t *slot;
+
+	if (store->map == NULL)
+		return NULL;
+
+	slot = chunkstore_slot(store->map, chunk->hash);
+	if (!slot->used || (slot->len != chunk->len) || ((slot->offset +
+			slot->len) > ((chunkstore_hdr_t *)store->map)->datalen)) {
+		return NULL;
+	}
+
+	return slot;
+}
+
+/**
+ * Doubles the size of the hash table, rebuilding the index in a new file that
+ * then replaces the old one.
+ *
+ * @param store Store object.
+ *
+ * @return TRUE if the table has grown, FALSE otherwise.
+ */
+static bool chunkstore_grow(chunkstore_t *store) {
+	chunkstore_slot_t *slots;
+	chunkstore_hdr_t *hdr;
+	uint8_t *map;
+	char *tmpname;
+	size_t len;
+	uint64_t i;
+
+	/* Create the larger table. */
+	hdr = (chunkstore_hdr_t *)store->map;
+	tmpname = (char *)malloc(strlen(store->ipath) + 5);
+	if (tmpname == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate chunk index path");
+		return false;
+	}
+	sprintf(tmpname, "%s.tmp", store->ipath);
+	map = chunkstore_create(tmpname, hdr->nslots * 2, &len);
+	if (map == NULL) {
+		log_syserr(LOG_ERROR, "Failed to grow the chunk index");
+		free(tmpname);
+		return false;
+	}
+
+	/* Move every chunk over to it. */
+	slots = (chunkstore_slot_t *)(store->map + sizeof(chunkstore_hdr_t));
+	for (i = 0; i < hdr->nslots; i++) {
+		if (slots[i].used)
+			*chunkstore_slot(map, slots[i].hash) = slots[i];
+	}
+	((chunkstore_hdr_t *)map)->count = hdr->count;
+	((chunkstore_hdr_t *)map)->datalen = hdr->datalen;
+
+	/* Replace the old index with it. */
+	file_unmap(store->map, store->len);
+	store->map = NULL;
+	if (!file_replace(tmpname, store->ipath)) {
+		log_syserr(LOG_ERROR, "Failed to replace the chunk index");
+		file_unmap(map, len);
+		file_remove(tmpname);
+		free(tmpname);
+
+		/* Go back to the index we had. */
+		store->map = (uint8_t *)file_map(store->ipath, &store->len, true);
+		return false;
+	}
+	store->map = map;
+	store->len = len;
+	free(tmpname);
+
+	return true;
+}
@@ -0,0 +1,50 @@
+/**
+ * chunkstore.h
+ * Persistent store of the chunks of contents that were received, used to
+ * assemble files out of chunks that we already have.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_CHUNKSTORE_H
+#define _GL_CHUNKSTORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cdc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Chunk store object, made up of a file with the contents of the chunks and an
+ * index of them that's mapped into memory.
+ */
+typedef struct {
+	char *ipath;
+	uint8_t *map;
+	size_t len;
+
+	FILE *data;
+} chunkstore_t;
+
+/* Opening the store. */
+bool chunkstore_open(chunkstore_t *store, const char *ipath,
+                     const char *dpath);
+void chunkstore_close(chunkstore_t *store);
+
+/* Chunks. */
+bool chunkstore_has(const chunkstore_t *store, const cdc_chunk_t *chunk);
+bool chunkstore_read(const chunkstore_t *store, const cdc_chunk_t *chunk,
+                     uint8_t *buf);
+bool chunkstore_add(chunkstore_t *store, const cdc_chunk_t *chunk,
+                    const uint8_t *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_CHUNKSTORE_H */
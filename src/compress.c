@@ -0,0 +1,881 @@
+/**
+ * compress.c
+ * Compression of transferred content in independent self-describing blocks.
+ *
+ * Every block is preceded by a header with the method used to compress it,
+ * followed by its original length and the length of what's actually sent, both
+ * in network byte order. Blocks that don't get any smaller are sent as they
+ * are, and an empty block marks the end of the content.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef GL_USE_ZSTD
+	#include <zstd.h>
+#endif /* GL_USE_ZSTD */
+
+#include "defaults.h"
+#include "logging.h"
+#include "lz.h"
+#include "utils.h"
+
+/* Smallest block that we'll bother trying to compress. */
+#define COMPRESS_BLOCK_MIN 64
+
+/* Number of windows sampled across a block to estimate its entropy. */
+#define COMPRESS_WINDOWS 16
+
+/* Fades out older measurements so that the newer ones weigh more. */
+#define COMPRESS_DECAY(x) ((x) - ((x) / 8))
+
+/**
+ * Signature of a file format whose contents are already compressed.
+ */
+typedef struct {
+	size_t offset;
+	size_t len;
+	const char *magic;
+} packed_magic_t;
+
+/**
+ * How hard a block is compressed.
+ */
+typedef struct {
+	compmethod_t method;
+	int level;
+} compstep_t;
+
+/* Steps ordered from the fastest to the one that compresses the hardest. */
+static const compstep_t compress_steps[COMPRESS_STEPS] = {
+	{ COMPRESS_NONE, 0 },
+	{ COMPRESS_LZ, 0 },
+#ifdef GL_USE_ZSTD
+	{ COMPRESS_ZSTD, 1 },
+	{ COMPRESS_ZSTD, GL_ZSTD_LEVEL },
+	{ COMPRESS_ZSTD, 9 },
+	{ COMPRESS_ZSTD, 19 }
+#endif /* GL_USE_ZSTD */
+};
+
+/* Private functions. */
+static bool compress_is_packed(const uint8_t *buf, size_t len);
+static bool compress_entropy_low(const uint8_t *buf, size_t len);
+static void comppool_process(const comppool_t *pool, compblock_t *block);
+static thread_ret_t THREAD_CALL comppool_worker(void *arg);
+static void compress_pack32(uint8_t *buf, uint32_t val);
+static uint32_t compress_unpack32(const uint8_t *buf);
+static bool comptune_usable(const comptune_t *tune, unsigned int step);
+static double comptune_rate(const comptune_t *tune, unsigned int step);
+static unsigned int comptune_best(const comptune_t *tune);
+
+/* Formats that are pointless to compress again. */
+static const packed_magic_t packed_magics[] = {
+	{ 0, 3, "\xFF\xD8\xFF" },             /* JPEG */
+	{ 0, 4, "\x89PNG" },                  /* PNG */
+	{ 0, 4, "GIF8" },                     /* GIF */
+	{ 8, 4, "WEBP" },                     /* WebP */
+	{ 4, 4, "ftyp" },                     /* MP4, MOV, HEIC */
+	{ 0, 4, "\x1A\x45\xDF\xA3" },         /* Matroska, WebM */
+	{ 0, 4, "OggS" },                     /* Ogg */
+	{ 0, 3, "ID3" },                      /* MP3 */
+	{ 0, 4, "fLaC" },                     /* FLAC */
+	{ 0, 4, "PK\x03\x04" },               /* ZIP, JAR, Office documents */
+	{ 0, 2, "\x1F\x8B" },                 /* Gzip */
+	{ 0, 3, "BZh" },                      /* Bzip2 */
+	{ 0, 6, "\xFD" "7zXZ\x00" },          /* XZ */
+	{ 0, 6, "7z\xBC\xAF\x27\x1C" },       /* 7-Zip */
+	{ 0, 4, "Rar!" },                     /* RAR */
+	{ 0, 4, "\x28\xB5\x2F\xFD" },         /* Zstandard */
+	{ 0, 4, "\x04\x22\x4D\x18" },         /* LZ4 */
+	{ 0, 0, NULL }
+};
+
+/**
+ * Picks the best compression method out of the ones that were agreed upon.
+ *
+ * @param flags Request flags accepted by the server.
+ *
+ * @return Compression method to be used or COMPRESS_NONE if content shouldn't
+ *         be compressed.
+ */
+compmethod_t compress_method(uint16_t flags) {
+#ifdef GL_USE_ZSTD
+	if (flags & REQ_FLAG_ZSTD)
+		return COMPRESS_ZSTD;
+#endif /* GL_USE_ZSTD */
+	if (flags & REQ_FLAG_LZ)
+		return COMPRESS_LZ;
+
+	return COMPRESS_NONE;
+}
+
+/**
+ * Gets a human-readable name of a compression method.
+ *
+ * @param method Compression method.
+ *
+ * @return Name of the compression method.
+ */
+const char *compress_method_name(compmethod_t method) {
+	switch (method) {
+		case COMPRESS_LZ:
+			return "LZ";
+		case COMPRESS_ZSTD:
+			return "Zstandard";
+		default:
+			return "none";
+	}
+}
+
+/**
+ * Checks if a sample of some content looks like it would benefit from being
+ * compressed.
+ *
+ * @param buf Sample taken from the beginning of the content.
+ * @param len Length of the sample.
+ *
+ * @return TRUE if the content is worth compressing, FALSE otherwise.
+ */
+bool compress_worthwhile(const uint8_t *buf, size_t len) {
+	return !compress_is_packed(buf, len) && compress_entropy_low(buf, len);
+}
+
+/**
+ * Checks if a file looks like it would benefit from being compressed by
+ * sampling its beginning and middle.
+ *
+ * @param fh   File to be checked.
+ * @param size Size of the file.
+ *
+ * @return TRUE if the file is worth compressing, FALSE otherwise.
+ */
+bool compress_file_worthwhile(FILE *fh, uint64_t size) {
+	uint8_t buf[GL_COMPRESS_SAMPLE];
+	size_t len;
+
+	/* Check the beginning of the file, where the format is identified. */
+	len = (size > GL_COMPRESS_SAMPLE) ? GL_COMPRESS_SAMPLE : (size_t)size;
+	if (!file_pread(fh, buf, len, 0))
+		return false;
+	if (compress_is_packed(buf, len))
+		return false;
+	if (compress_entropy_low(buf, len))
+		return true;
+
+	/* Headers might be dense, so give the middle of the file a chance. */
+	if (size <= (2 * GL_COMPRESS_SAMPLE))
+		return false;
+	if (!file_pread(fh, buf, GL_COMPRESS_SAMPLE, size / 2))
+		return false;
+
+	return compress_entropy_low(buf, GL_COMPRESS_SAMPLE);
+}
+
+/**
+ * Compresses a block of content into a frame ready to be sent. Blocks that
+ * don't look compressible or that wouldn't get any smaller are stored as they
+ * are. An empty block produces the frame that ends the content.
+ *
+ * @param method Compression method to be used.
+ * @param level  Compression level for methods that have them.
+ * @param src    Content to be compressed.
+ * @param len    Length of the content.
+ * @param frame  Buffer of at least COMPRESS_HDR_LEN + len bytes where the frame
+ *               will be stored.
+ *
+ * @return Length of the entire frame.
+ */
+size_t compress_block(compmethod_t method, int level, const uint8_t *src,
+                      size_t len, uint8_t *frame) {
+	uint8_t *dst;
+	size_t clen;
+
+	/* Try to compress the block if it's worth it. */
+	dst = frame + COMPRESS_HDR_LEN;
+	clen = 0;
+	if ((len >= COMPRESS_BLOCK_MIN) && compress_entropy_low(src, len)) {
+		switch (method) {
+			case COMPRESS_LZ:
+				clen = lz_compress(src, len, dst, len - 1);
+				break;
+#ifdef GL_USE_ZSTD
+			case COMPRESS_ZSTD:
+				clen = ZSTD_compress(dst, len - 1, src, len, level);
+				if (ZSTD_isError(clen))
+					clen = 0;
+				break;
+#endif /* GL_USE_ZSTD */
+			default:
+				(void)level;
+				break;
+		}
+	}
+
+	/* Store the block as it is if compressing didn't help. */
+	if (clen == 0) {
+		method = COMPRESS_NONE;
+		memcpy(dst, src, len);
+		clen = len;
+	}
+
+	/* Build up the header. */
+	frame[0] = (uint8_t)method;
+	compress_pack32(frame + 1, (uint32_t)len);
+	compress_pack32(frame + 5, (uint32_t)clen);
+
+	return COMPRESS_HDR_LEN + clen;
+}
+
+/**
+ * Parses and validates the header of a compressed block.
+ *
+ * @param hdr    Header of COMPRESS_HDR_LEN bytes.
+ * @param method Where to store the method used to compress the block.
+ * @param rawlen Where to store the length of the block once decompressed. A
+ *               length of 0 marks the end of the content.
+ * @param len    Where to store the length of the block that follows.
+ *
+ * @return TRUE if the header is valid, FALSE otherwise.
+ */
+bool compress_frame_parse(const uint8_t *hdr, compmethod_t *method,
+                          uint32_t *rawlen, uint32_t *len) {
+	*method = (compmethod_t)hdr[0];
+	*rawlen = compress_unpack32(hdr + 1);
+	*len = compress_unpack32(hdr + 5);
+
+	/* Check if we are able to decompress it. */
+	switch (*method) {
+		case COMPRESS_NONE:
+			return (*rawlen <= GL_COMPRESS_BLOCK_MAX) && (*len == *rawlen);
+		case COMPRESS_LZ:
+#ifdef GL_USE_ZSTD
+		case COMPRESS_ZSTD:
+#endif /* GL_USE_ZSTD */
+			return (*rawlen <= GL_COMPRESS_BLOCK_MAX) && (*len > 0) &&
+				(*len < *rawlen);
+		default:
+			return false;
+	}
+}
+
+/**
+ * Decompresses a block of content.
+ *
+ * @param method Method used to compress the block.
+ * @param src    Compressed block.
+ * @param len    Length of the compressed block.
+ * @param dst    Buffer where the decompressed content will be stored.
+ * @param rawlen Length of the decompressed content.
+ *
+ * @return TRUE if the block was decompressed, FALSE if it's damaged.
+ */
+bool decompress_block(compmethod_t method, const uint8_t *src, size_t len,
+                      uint8_t *dst, size_t rawlen) {
+	switch (method) {
+		case COMPRESS_NONE:
+			if (len != rawlen)
+				return false;
+			memcpy(dst, src, len);
+			return true;
+		case COMPRESS_LZ:
+			return lz_decompress(src, len, dst, rawlen);
+#ifdef GL_USE_ZSTD
+		case COMPRESS_ZSTD:
+			len = ZSTD_decompress(dst, rawlen, src, len);
+			return !ZSTD_isError(len) && (len == rawlen);
+#endif /* GL_USE_ZSTD */
+		default:
+			return false;
+	}
+}
+
+/**
+ * Initializes a pool of workers that compress or decompress blocks in parallel.
+ * A pool with a single thread does all of the work as the blocks are submitted.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param pool       Pool object to be initialized.
+ * @param decompress Are the blocks going to be decompressed?
+ * @param method     Compression method used when compressing blocks.
+ * @param block      Size of the blocks of content.
+ * @param threads    Number of workers or 0 to use all of the processors.
+ *
+ * @return TRUE if the pool is ready to be used, FALSE otherwise.
+ *
+ * @see comppool_free
+ */
+bool comppool_init(comppool_t *pool, bool decompress, compmethod_t method,
+                   size_t block, unsigned int threads) {
+	compblock_t *b;
+	unsigned int i;
+
+	/* Work out how many workers we should have. */
+	memset(pool, 0, sizeof(comppool_t));
+	if (threads == 0)
+		threads = cpu_count();
+	if (threads > GL_COMPRESS_THREADS_MAX)
+		threads = GL_COMPRESS_THREADS_MAX;
+	pool->method = method;
+	pool->decompress = decompress;
+	pool->stopping = false;
+	mutex_init(&pool->lock);
+	cond_init(&pool->work);
+	cond_init(&pool->done);
+
+	/* Have enough blocks for the workers to never wait on us. */
+	pool->nblocks = (threads > 1) ? (threads * 2) : 1;
+	pool->blocks = (compblock_t *)calloc(pool->nblocks, sizeof(compblock_t));
+	if (pool->blocks == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate compression blocks");
+		comppool_free(pool);
+		return false;
+	}
+	for (i = 0; i < pool->nblocks; i++) {
+		b = &pool->blocks[i];
+		b->incap = block;
+		b->outcap = (decompress) ? block : (COMPRESS_HDR_LEN + block);
+		b->in = (uint8_t *)malloc(b->incap);
+		b->out = (uint8_t *)malloc(b->outcap);
+		if ((b->in == NULL) || (b->out == NULL)) {
+			log_syserr(LOG_CRIT, "Failed to allocate compression buffers");
+			comppool_free(pool);
+			return false;
+		}
+	}
+
+	/* Start up the workers. */
+	if (threads <= 1)
+		return true;
+	pool->threads = (thread_t *)malloc(threads * sizeof(thread_t));
+	if (pool->threads == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate compression workers");
+		comppool_free(pool);
+		return false;
+	}
+	for (i = 0; i < threads; i++) {
+		if (!thread_create(&pool->threads[i], comppool_worker, pool))
+			break;
+		pool->nthreads++;
+	}
+
+	/* Doing the work ourselves is always an option. */
+	if (pool->nthreads == 0) {
+		free(pool->threads);
+		pool->threads = NULL;
+	}
+
+	return true;
+}
+
+/**
+ * Gets the next block that's free to be filled in and submitted.
+ *
+ * @param pool Pool object.
+ *
+ * @return Free block or NULL if all of them are still in flight.
+ *
+ * @see comppool_submit
+ */
+compblock_t *comppool_get(comppool_t *pool) {
+	compblock_t *block;
+
+	if ((pool->next - pool->oldest) >= pool->nblocks)
+		return NULL;
+
+	block = &pool->blocks[pool->next % pool->nblocks];
+	block->inlen = 0;
+	block->outlen = 0;
+	block->method = pool->method;
+	block->level = GL_ZSTD_LEVEL;
+	block->step = 0;
+	block->usecs = 0;
+	block->ok = false;
+	block->done = false;
+
+	return block;
+}
+
+/**
+ * Ensures a block that's about to be decompressed has room for its contents.
+ *
+ * @param block Block object returned by comppool_get.
+ * @param len   Length of the block before and after being decompressed.
+ *
+ * @return TRUE if there's enough room in the block, FALSE otherwise.
+ */
+bool comppool_reserve(compblock_t *block, size_t len) {
+	uint8_t *buf;
+
+	if (block->incap < len) {
+		buf = (uint8_t *)realloc(block->in, len);
+		if (buf == NULL)
+			return false;
+		block->in = buf;
+		block->incap = len;
+	}
+
+	if (block->outcap < len) {
+		buf = (uint8_t *)realloc(block->out, len);
+		if (buf == NULL)
+			return false;
+		block->out = buf;
+		block->outcap = len;
+	}
+
+	return true;
+}
+
+/**
+ * Hands the block returned by comppool_get over to the workers.
+ *
+ * @param pool Pool object.
+ */
+void comppool_submit(comppool_t *pool) {
+	/* Do the work ourselves if we don't have any workers. */
+	if (pool->nthreads == 0) {
+		comppool_process(pool, &pool->blocks[pool->next % pool->nblocks]);
+		pool->blocks[pool->next % pool->nblocks].done = true;
+		pool->next++;
+		return;
+	}
+
+	mutex_lock(&pool->lock);
+	pool->next++;
+	cond_signal(&pool->work);
+	mutex_unlock(&pool->lock);
+}
+
+/**
+ * Gets the oldest block in flight once the workers are done with it.
+ *
+ * @param pool Pool object.
+ * @param wait Should we wait for the block to be done?
+ *
+ * @return Oldest block if it's done or NULL if there are no blocks in flight
+ *         or the oldest one isn't done and we shouldn't wait for it.
+ *
+ * @see comppool_release
+ */
+compblock_t *comppool_next(comppool_t *pool, bool wait) {
+	compblock_t *block;
+
+	/* Check if we have anything in flight. */
+	if (pool->oldest == pool->next)
+		return NULL;
+	block = &pool->blocks[pool->oldest % pool->nblocks];
+	if (pool->nthreads == 0)
+		return block;
+
+	/* Check if the block is done, waiting for it if needed. */
+	mutex_lock(&pool->lock);
+	while (!block->done && wait)
+		cond_wait(&pool->done, &pool->lock);
+	if (!block->done)
+		block = NULL;
+	mutex_unlock(&pool->lock);
+
+	return block;
+}
+
+/**
+ * Releases the block returned by comppool_next so that it can be used again.
+ *
+ * @param pool Pool object.
+ */
+void comppool_release(comppool_t *pool) {
+	pool->oldest++;
+}
+
+/**
+ * Stops the workers and frees up the resources allocated by a pool.
+ *
+ * @param pool Pool object to be freed.
+ */
+void comppool_free(comppool_t *pool) {
+	unsigned int i;
+
+	/* Stop the workers. */
+	mutex_lock(&pool->lock);
+	pool->stopping = true;
+	cond_broadcast(&pool->work);
+	mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		thread_join(pool->threads[i]);
+	pool->nthreads = 0;
+	free(pool->threads);
+	pool->threads = NULL;
+
+	/* Free the blocks. */
+	if (pool->blocks != NULL) {
+		for (i = 0; i < pool->nblocks; i++) {
+			free(pool->blocks[i].in);
+			free(pool->blocks[i].out);
+		}
+		free(pool->blocks);
+		pool->blocks = NULL;
+	}
+
+	mutex_free(&pool->lock);
+	cond_free(&pool->work);
+	cond_free(&pool->done);
+}
+
+/**
+ * Gets a transfer ready to adapt how hard its blocks are compressed, starting
+ * off with the method that would've been used otherwise.
+ *
+ * @param tune    Tuner object to be initialized.
+ * @param flags   Compression flags that were accepted for the transfer.
+ * @param threads Number of workers compressing the blocks.
+ */
+void comptune_init(comptune_t *tune, uint16_t flags, unsigned int threads) {
+	compmethod_t method;
+	unsigned int i;
+
+	memset(tune, 0, sizeof(comptune_t));
+	tune->flags = flags;
+	tune->threads = (threads > 0) ? threads : 1;
+	tune->up = false;
+
+	method = compress_method(flags);
+	for (i = 0; i < COMPRESS_STEPS; i++) {
+		if ((compress_steps[i].method == method) &&
+				((method != COMPRESS_ZSTD) ||
+				(compress_steps[i].level == GL_ZSTD_LEVEL))) {
+			tune->step = i;
+		}
+	}
+}
+
+/**
+ * Sets up a block to be compressed with the step currently picked.
+ *
+ * @param tune  Tuner object.
+ * @param block Block returned by comppool_get.
+ */
+void comptune_apply(const comptune_t *tune, compblock_t *block) {
+	block->step = tune->step;
+	block->method = compress_steps[tune->step].method;
+	block->level = compress_steps[tune->step].level;
+}
+
+/**
+ * Takes into account how a block did once it was sent and picks the step that
+ * should deliver the most content per second for the next ones. Every now and
+ * then one of its neighbours is tried out instead, in case things changed.
+ *
+ * @param tune   Tuner object.
+ * @param block  Block that has just been sent.
+ * @param sendus Microseconds it took for the block to be sent.
+ */
+void comptune_update(comptune_t *tune, const compblock_t *block,
+                     uint64_t sendus) {
+	compstat_t *stat;
+	unsigned int best;
+	unsigned int next;
+
+	/* Keep a fading history of the step and the connection. */
+	stat = &tune->steps[block->step];
+	stat->in = COMPRESS_DECAY(stat->in) + block->inlen;
+	stat->out = COMPRESS_DECAY(stat->out) + block->outlen;
+	stat->usecs = COMPRESS_DECAY(stat->usecs) + block->usecs;
+	stat->blocks++;
+	tune->sent = COMPRESS_DECAY(tune->sent) + block->outlen;
+	tune->sendus = COMPRESS_DECAY(tune->sendus) + sendus;
+
+	/* Give the connection some time to settle before judging it. */
+	tune->count++;
+	if (tune->count < GL_COMPRESS_PROBE)
+		return;
+	best = comptune_best(tune);
+	tune->step = best;
+	if ((tune->count % GL_COMPRESS_PROBE) != 0)
+		return;
+
+	/* Try out one of the neighbours of the best step. */
+	tune->up = !tune->up;
+	next = best;
+	while (tune->up && ((next + 1) < COMPRESS_STEPS)) {
+		if (comptune_usable(tune, ++next)) {
+			tune->step = next;
+			break;
+		}
+	}
+	while (!tune->up && (next > 0)) {
+		if (comptune_usable(tune, --next)) {
+			tune->step = next;
+			break;
+		}
+	}
+}
+
+/**
+ * Describes how many blocks of a transfer were compressed with each step.
+ *
+ * @param tune Tuner object.
+ * @param buf  Buffer of COMPRESS_SUMMARY_LEN bytes where the summary will be
+ *             stored.
+ */
+void comptune_summary(const comptune_t *tune, char *buf) {
+	const compstep_t *step;
+	size_t len;
+	unsigned int i;
+
+	buf[0] = '\0';
+	len = 0;
+	for (i = 0; (i < COMPRESS_STEPS) && (len < COMPRESS_SUMMARY_LEN); i++) {
+		if (tune->steps[i].blocks == 0)
+			continue;
+
+		step = &compress_steps[i];
+		if (step->method == COMPRESS_ZSTD) {
+			snprintf(buf + len, COMPRESS_SUMMARY_LEN - len, "%s%s %d: %lu "
+				"blocks", (len > 0) ? ", " : "",
+				compress_method_name(step->method), step->level,
+				(unsigned long)tune->steps[i].blocks);
+		} else {
+			snprintf(buf + len, COMPRESS_SUMMARY_LEN - len, "%s%s: %lu "
+				"blocks", (len > 0) ? ", " : "",
+				compress_method_name(step->method),
+				(unsigned long)tune->steps[i].blocks);
+		}
+		len += strlen(buf + len);
+	}
+}
+
+/**
+ * Checks if some content starts with the signature of a file format that is
+ * already compressed.
+ *
+ * @param buf Beginning of the content.
+ * @param len Length of the content.
+ *
+ * @return TRUE if the content is already compressed, FALSE otherwise.
+ */
+static bool compress_is_packed(const uint8_t *buf, size_t len) {
+	const packed_magic_t *m;
+
+	for (m = packed_magics; m->magic != NULL; m++) {
+		if (((m->offset + m->len) <= len) &&
+				(memcmp(buf + m->offset, m->magic, m->len) == 0)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Estimates if some content has low enough entropy to be compressed, by
+ * checking how likely it is for two of its bytes to be the same. Large blocks
+ * are sampled in windows spread throughout them.
+ *
+ * @param buf Content to be checked.
+ * @param len Length of the content.
+ *
+ * @return TRUE if the content looks compressible, FALSE otherwise.
+ */
+static bool compress_entropy_low(const uint8_t *buf, size_t len) {
+	uint32_t hist[256];
+	uint64_t sum;
+	uint64_t n;
+	size_t wlen;
+	size_t step;
+	size_t i;
+	size_t j;
+
+	/* Build the histogram of the sample. */
+	memset(hist, 0, sizeof(hist));
+	if (len <= GL_COMPRESS_SAMPLE) {
+		for (i = 0; i < len; i++)
+			hist[buf[i]]++;
+		n = len;
+	} else {
+		wlen = GL_COMPRESS_SAMPLE / COMPRESS_WINDOWS;
+		step = (len - wlen) / (COMPRESS_WINDOWS - 1);
+		for (i = 0; i < COMPRESS_WINDOWS; i++) {
+			for (j = 0; j < wlen; j++)
+				hist[buf[(i * step) + j]]++;
+		}
+		n = wlen * COMPRESS_WINDOWS;
+	}
+	if (n < COMPRESS_BLOCK_MIN)
+		return false;
+
+	/* Random data has a 1 in 256 chance of any two bytes being the same. */
+	sum = 0;
+	for (i = 0; i < 256; i++) {
+		if (hist[i] > 1)
+			sum += (uint64_t)hist[i] * (hist[i] - 1);
+	}
+
+	return (sum * 1024) > (5 * n * (n - 1));
+}
+
+/**
+ * Stores a 32-bit value in network byte order.
+ *
+ * @param buf Buffer with at least 4 bytes available.
+ * @param val Value to be stored.
+ */
+static void compress_pack32(uint8_t *buf, uint32_t val) {
+	buf[0] = (uint8_t)((val >> 24) & 0xFF);
+	buf[1] = (uint8_t)((val >> 16) & 0xFF);
+	buf[2] = (uint8_t)((val >> 8) & 0xFF);
+	buf[3] = (uint8_t)(val & 0xFF);
+}
+
+/**
+ * Reads a 32-bit value stored in network byte order.
+ *
+ * @param buf Buffer with at least 4 bytes.
+ *
+ * @return Value that was stored in the buffer.
+ */
+static uint32_t compress_unpack32(const uint8_t *buf) {
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+		((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+/**
+ * Compresses or decompresses a single block.
+ *
+ * @param pool  Pool object the block belongs to.
+ * @param block Block to be processed.
+ */
+static void comppool_process(const comppool_t *pool, compblock_t *block) {
+	uint64_t start;
+
+	start = clock_us();
+	if (pool->decompress) {
+		block->ok = decompress_block(block->method, block->in, block->inlen,
+			block->out, block->outlen);
+	} else {
+		block->outlen = compress_block(block->method, block->level, block->in,
+			block->inlen, block->out);
+		block->ok = true;
+	}
+	block->usecs = clock_us() - start;
+}
+
+/**
+ * Worker thread that processes the blocks in the order they were submitted.
+ *
+ * @param arg Pool object.
+ *
+ * @return Nothing.
+ */
+static thread_ret_t THREAD_CALL comppool_worker(void *arg) {
+	comppool_t *pool;
+	compblock_t *block;
+
+	pool = (comppool_t *)arg;
+	mutex_lock(&pool->lock);
+	while (!pool->stopping) {
+		/* Wait for something to do. */
+		if (pool->taken == pool->next) {
+			cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+
+		/* Take the next block and work on it without holding the lock. */
+		block = &pool->blocks[pool->taken % pool->nblocks];
+		pool->taken++;
+		mutex_unlock(&pool->lock);
+		comppool_process(pool, block);
+		mutex_lock(&pool->lock);
+
+		/* Let everyone know it's done. */
+		block->done = true;
+		cond_broadcast(&pool->done);
+	}
+	mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/**
+ * Checks if a compression step can be used in a transfer.
+ *
+ * @param tune Tuner object.
+ * @param step Step to be checked.
+ *
+ * @return TRUE if the other end is able to decompress it, FALSE otherwise.
+ */
+static bool comptune_usable(const comptune_t *tune, unsigned int step) {
+	switch (compress_steps[step].method) {
+		case COMPRESS_LZ:
+			return (tune->flags & REQ_FLAG_LZ) != 0;
+		case COMPRESS_ZSTD:
+			return (tune->flags & REQ_FLAG_ZSTD) != 0;
+		default:
+			return true;
+	}
+}
+
+/**
+ * Estimates how much content per second would be delivered with a compression
+ * step, which is limited either by how fast the workers compress it or by how
+ * fast the connection takes what they produce.
+ *
+ * @param tune Tuner object.
+ * @param step Step to be estimated.
+ *
+ * @return Bytes of content per second or 0 if we don't know yet.
+ */
+static double comptune_rate(const comptune_t *tune, unsigned int step) {
+	const compstat_t *stat;
+	double link;
+	double speed;
+
+	/* Sending blocks that never waited on the connection means it's fast. */
+	link = (double)tune->sent * 1000000.0 /
+		(double)((tune->sendus > 0) ? tune->sendus : 1);
+	if (compress_steps[step].method == COMPRESS_NONE)
+		return link;
+
+	/* Steps that haven't been tried out can't be judged. */
+	stat = &tune->steps[step];
+	if ((stat->in == 0) || (stat->out == 0))
+		return 0;
+
+	speed = (double)stat->in * 1000000.0 * tune->threads /
+		(double)((stat->usecs > 0) ? stat->usecs : 1);
+	link = link * (double)stat->in / (double)stat->out;
+
+	return (speed < link) ? speed : link;
+}
+
+/**
+ * Picks the compression step that should deliver the most content per second.
+ *
+ * @param tune Tuner object.
+ *
+ * @return Best step, preferring the cheapest one when they're equal.
+ */
+static unsigned int comptune_best(const comptune_t *tune) {
+	unsigned int best;
+	unsigned int i;
+	double rate;
+	double top;
+
+	best = 0;
+	top = comptune_rate(tune, 0);
+	for (i = 1; i < COMPRESS_STEPS; i++) {
+		if (!comptune_usable(tune, i))
+			continue;
+
+		rate = comptune_rate(tune, i);
+		if (rate > top) {
+			best = i;
+			top = rate;
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,163 @@
+/**
+ * compress.h
+ * Compression of transferred content in independent self-describing blocks.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_COMPRESS_H
+#define _GL_COMPRESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "request.h"
+#include "thread.h"
+
+/**
+ * Length of the header that precedes every compressed block.
+ */
+#define COMPRESS_HDR_LEN 9
+
+/**
+ * Request flags of the compression methods that were built in.
+ */
+#ifdef GL_USE_ZSTD
+	#define COMPRESS_FLAGS (REQ_FLAG_LZ | REQ_FLAG_ZSTD)
+#else
+	#define COMPRESS_FLAGS REQ_FLAG_LZ
+#endif /* GL_USE_ZSTD */
+
+/**
+ * Number of steps between not compressing at all and compressing the hardest
+ * that a transfer can pick from.
+ */
+#ifdef GL_USE_ZSTD
+	#define COMPRESS_STEPS 6
+#else
+	#define COMPRESS_STEPS 2
+#endif /* GL_USE_ZSTD */
+
+/**
+ * Length of the summary of the steps a transfer was compressed with.
+ */
+#define COMPRESS_SUMMARY_LEN 192
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Methods used to compress a block.
+ */
+typedef enum {
+	COMPRESS_NONE = 0,
+	COMPRESS_LZ   = 1,
+	COMPRESS_ZSTD = 2
+} compmethod_t;
+
+/**
+ * Block that is compressed or decompressed by a pool of workers.
+ */
+typedef struct {
+	uint8_t *in;
+	size_t inlen;
+	size_t incap;
+	uint8_t *out;
+	size_t outlen;
+	size_t outcap;
+
+	compmethod_t method;
+	int level;
+	unsigned int step;
+	uint64_t usecs;
+	bool ok;
+	bool done;
+} compblock_t;
+
+/**
+ * Pool of workers that compress or decompress blocks in parallel, handing them
+ * back in the same order they were submitted.
+ */
+typedef struct {
+	compblock_t *blocks;
+	unsigned int nblocks;
+	thread_t *threads;
+	unsigned int nthreads;
+
+	mutex_t lock;
+	cond_t work;
+	cond_t done;
+
+	uint64_t oldest;
+	uint64_t taken;
+	uint64_t next;
+
+	compmethod_t method;
+	bool decompress;
+	bool stopping;
+} comppool_t;
+
+/**
+ * Recent history of the blocks that were compressed with a given step.
+ */
+typedef struct {
+	uint64_t in;
+	uint64_t out;
+	uint64_t usecs;
+	uint64_t blocks;
+} compstat_t;
+
+/**
+ * Picks how hard each block of a transfer is compressed by weighing how fast
+ * the blocks are compressed against how fast the connection takes them.
+ */
+typedef struct {
+	compstat_t steps[COMPRESS_STEPS];
+	uint64_t sent;
+	uint64_t sendus;
+
+	uint16_t flags;
+	unsigned int threads;
+	unsigned int step;
+	uint64_t count;
+	bool up;
+} comptune_t;
+
+/* Choosing how to compress. */
+compmethod_t compress_method(uint16_t flags);
+const char *compress_method_name(compmethod_t method);
+bool compress_worthwhile(const uint8_t *buf, size_t len);
+bool compress_file_worthwhile(FILE *fh, uint64_t size);
+
+/* Compressing and decompressing blocks. */
+size_t compress_block(compmethod_t method, int level, const uint8_t *src,
+                      size_t len, uint8_t *frame);
+bool compress_frame_parse(const uint8_t *hdr, compmethod_t *method,
+                          uint32_t *rawlen, uint32_t *len);
+bool decompress_block(compmethod_t method, const uint8_t *src, size_t len,
+                      uint8_t *dst, size_t rawlen);
+
+/* Compressing and decompressing blocks in parallel. */
+bool comppool_init(comppool_t *pool, bool decompress, compmethod_t method,
+                   size_t block, unsigned int threads);
+compblock_t *comppool_get(comppool_t *pool);
+bool comppool_reserve(compblock_t *block, size_t len);
+void comppool_submit(comppool_t *pool);
+compblock_t *comppool_next(comppool_t *pool, bool wait);
+void comppool_release(comppool_t *pool);
+void comppool_free(comppool_t *pool);
+
+/* Adapting the compression to the connection. */
+void comptune_init(comptune_t *tune, uint16_t flags, unsigned int threads);
+void comptune_apply(const comptune_t *tune, compblock_t *block);
+void comptune_update(comptune_t *tune, const compblock_t *block,
+                     uint64_t sendus);
+void comptune_summary(const comptune_t *tune, char *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_COMPRESS_H */
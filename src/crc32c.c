@@ -0,0 +1,373 @@
+/**
+ * crc32c.c
+ * CRC-32C (Castagnoli) checksums using hardware instructions when available.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "crc32c.h"
+
+/* Hardware implementation for the current architecture and compiler. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define CRC32C_HW_X86
+	#define CRC32C_TARGET __attribute__((target("sse4.2")))
+	#include <nmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	#define CRC32C_HW_X86
+	#define CRC32C_TARGET
+	#include <intrin.h>
+	#include <nmmintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+	#define CRC32C_HW_ARM
+	#ifdef __linux__
+		#include <sys/auxv.h>
+		#ifndef HWCAP_CRC32
+			#define HWCAP_CRC32 (1 << 7)
+		#endif /* !HWCAP_CRC32 */
+	#endif /* __linux__ */
+#endif
+
+/* Reversed Castagnoli polynomial. */
+#define CRC32C_POLY 0x82F63B78UL
+
+/* Private functions. */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len);
+#if defined(CRC32C_HW_X86) || defined(CRC32C_HW_ARM)
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len);
+static bool crc32c_hw_detect(void);
+#endif /* CRC32C_HW_X86 || CRC32C_HW_ARM */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec);
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat);
+
+/* Slicing-by-8 lookup tables for the software implementation. */
+static uint32_t crc_table[8][256];
+
+/* Implementation in use. */
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *buf,
+                               size_t len) = crc32c_sw;
+
+/**
+ * Initializes the checksum lookup tables and picks the fastest implementation
+ * available on this machine. Must be called before any threads are started.
+ */
+void crc32c_init(void) {
+	uint32_t crc;
+	int i;
+	int j;
+
+	/* Build the byte-wise table. */
+	for (i = 0; i < 256; i++) {
+		crc = (uint32_t)i;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+		crc_table[0][i] = crc;
+	}
+
+	/* Build the tables used to process 8 bytes at a time. */
+	for (i = 0; i < 256; i++) {
+		crc = crc_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = (crc >> 8) ^ crc_table[0][crc & 0xFF];
+			crc_table[j][i] = crc;
+		}
+	}
+
+	/* Use the dedicated instructions if the processor has them. */
+#if defined(CRC32C_HW_X86) || defined(CRC32C_HW_ARM)
+	if (crc32c_hw_detect())
+		crc32c_impl = crc32c_hw;
+#endif /* CRC32C_HW_X86 || CRC32C_HW_ARM */
+}
+
+/**
+ * Checks if checksums are being calculated using hardware instructions.
+ *
+ * @return TRUE if the hardware implementation is in use, FALSE otherwise.
+ */
+bool crc32c_hw_enabled(void) {
+	return crc32c_impl != crc32c_sw;
+}
+
+/**
+ * Updates a running checksum with more data.
+ *
+ * @param crc Checksum of the previous data or 0 when starting a new one.
+ * @param buf Data to be added to the checksum.
+ * @param len Length of the data.
+ *
+ * @return Updated checksum.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	return ~crc32c_impl(~crc, (const uint8_t *)buf, len);
+}
+
+/**
+ * Combines the checksums of two consecutive blocks of data into the checksum
+ * of both blocks, as if they had been calculated in a single go.
+ *
+ * @param crc1 Checksum of the first block.
+ * @param crc2 Checksum of the second block.
+ * @param len2 Length of the second block.
+ *
+ * @return Checksum of both blocks.
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+	uint32_t even[32];
+	uint32_t odd[32];
+	uint32_t row;
+	int n;
+
+	/* Nothing to combine with. */
+	if (len2 == 0)
+		return crc1;
+
+	/* Operator for a single zero bit. */
+	odd[0] = CRC32C_POLY;
+	row = 1;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	/* Operators for two and four zero bits. */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	/* Apply len2 zero bytes to crc1, squaring the operator as we go. */
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+/**
+ * Stores a checksum in network byte order.
+ *
+ * @param buf Buffer with at least CRC32C_LEN bytes available.
+ * @param crc Checksum to be stored.
+ */
+void crc32c_pack(uint8_t *buf, uint32_t crc) {
+	buf[0] = (uint8_t)((crc >> 24) & 0xFF);
+	buf[1] = (uint8_t)((crc >> 16) & 0xFF);
+	buf[2] = (uint8_t)((crc >> 8) & 0xFF);
+	buf[3] = (uint8_t)(crc & 0xFF);
+}
+
+/**
+ * Reads a checksum stored in network byte order.
+ *
+ * @param buf Buffer with at least CRC32C_LEN bytes.
+ *
+ * @return Checksum that was stored in the buffer.
+ */
+uint32_t crc32c_unpack(const uint8_t *buf) {
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+		((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+/**
+ * Table-driven implementation that processes 8 bytes at a time.
+ *
+ * @param crc Inverted running checksum.
+ * @param buf Data to be processed.
+ * @param len Length of the data.
+ *
+ * @return Inverted updated checksum.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len) {
+	uint32_t lo;
+	uint32_t hi;
+
+	/* Get the buffer aligned. */
+	while ((len > 0) && ((size_t)buf & 7)) {
+		crc = crc_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+
+	/* Process the bulk of the data. */
+	while (len >= 8) {
+		lo = crc ^ ((uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+			((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24));
+		hi = (uint32_t)buf[4] | ((uint32_t)buf[5] << 8) |
+			((uint32_t)buf[6] << 16) | ((uint32_t)buf[7] << 24);
+		crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+			crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+			crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+			crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+
+	/* Deal with whatever is left. */
+	while (len > 0) {
+		crc = crc_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+
+	return crc;
+}
+
+#ifdef CRC32C_HW_X86
+/**
+ * SSE4.2 implementation.
+ *
+ * @param crc Inverted running checksum.
+ * @param buf Data to be processed.
+ * @param len Length of the data.
+ *
+ * @return Inverted updated checksum.
+ */
+CRC32C_TARGET
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len) {
+	/* Get the buffer aligned. */
+	while ((len > 0) && ((size_t)buf & 7)) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+
+	/* Process the bulk of the data. */
+#if defined(__x86_64__) || defined(_M_X64)
+	{
+		uint64_t crc64 = crc;
+
+		while (len >= 8) {
+			crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)buf);
+			buf += 8;
+			len -= 8;
+		}
+		crc = (uint32_t)crc64;
+	}
+#else
+	while (len >= 4) {
+		crc = _mm_crc32_u32(crc, *(const uint32_t *)buf);
+		buf += 4;
+		len -= 4;
+	}
+#endif /* __x86_64__ || _M_X64 */
+
+	/* Deal with whatever is left. */
+	while (len > 0) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+
+	return crc;
+}
+
+/**
+ * Checks if the processor supports SSE4.2.
+ *
+ * @return TRUE if the instructions are available, FALSE otherwise.
+ */
+static bool crc32c_hw_detect(void) {
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2") != 0;
+#endif /* _MSC_VER */
+}
+#endif /* CRC32C_HW_X86 */
+
+#ifdef CRC32C_HW_ARM
+/**
+ * ARMv8 CRC extension implementation.
+ *
+ * @param crc Inverted running checksum.
+ * @param buf Data to be processed.
+ * @param len Length of the data.
+ *
+ * @return Inverted updated checksum.
+ */
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len) {
+	/* Get the buffer aligned. */
+	while ((len > 0) && ((size_t)buf & 7)) {
+		__asm__(".arch_extension crc\n\tcrc32cb %w0, %w0, %w1"
+			: "+r" (crc) : "r" (*buf));
+		buf++;
+		len--;
+	}
+
+	/* Process the bulk of the data. */
+	while (len >= 8) {
+		__asm__(".arch_extension crc\n\tcrc32cx %w0, %w0, %x1"
+			: "+r" (crc) : "r" (*(const uint64_t *)buf));
+		buf += 8;
+		len -= 8;
+	}
+
+	/* Deal with whatever is left. */
+	while (len > 0) {
+		__asm__(".arch_extension crc\n\tcrc32cb %w0, %w0, %w1"
+			: "+r" (crc) : "r" (*buf));
+		buf++;
+		len--;
+	}
+
+	return crc;
+}
+
+/**
+ * Checks if the processor implements the CRC extension.
+ *
+ * @return TRUE if the instructions are available, FALSE otherwise.
+ */
+static bool crc32c_hw_detect(void) {
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+	return true;
+#elif defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	return false;
+#endif /* __ARM_FEATURE_CRC32 || __APPLE__ */
+}
+#endif /* CRC32C_HW_ARM */
+
+/**
+ * Multiplies a vector by a matrix over GF(2).
+ *
+ * @param mat Matrix of 32 rows.
+ * @param vec Vector to be multiplied.
+ *
+ * @return Resulting vector.
+ */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+	uint32_t sum;
+
+	sum = 0;
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+
+	return sum;
+}
+
+/**
+ * Squares a matrix over GF(2).
+ *
+ * @param square Where to store the resulting matrix of 32 rows.
+ * @param mat    Matrix of 32 rows to be squared.
+ */
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
@@ -0,0 +1,38 @@
+/**
+ * crc32c.h
+ * CRC-32C (Castagnoli) checksums using hardware instructions when available.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_CRC32C_H
+#define _GL_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Length of a checksum when sent over the wire.
+ */
+#define CRC32C_LEN 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Checksum calculation. */
+void crc32c_init(void);
+bool crc32c_hw_enabled(void);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+/* Wire encoding. */
+void crc32c_pack(uint8_t *buf, uint32_t crc);
+uint32_t crc32c_unpack(const uint8_t *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_CRC32C_H */
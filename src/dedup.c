@@ -0,0 +1,415 @@
+/**
+ * dedup.c
+ * Index of the contents of the files that were received, used to complete
+ * transfers of contents that we already have without them being sent again.
+ *
+ * The index is kept in memory as a hash table keyed by digest and persisted to
+ * a text file with a line per entry, which is appended to as files are added
+ * and compacted every time it's loaded. Entries are only trusted as long as
+ * the size and modification time of their files haven't changed.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defaults.h"
+#include "logging.h"
+#include "merkle.h"
+#include "utils.h"
+
+/* Smallest number of slots in the hash table. */
+#define DEDUP_SLOTS_MIN 64
+
+/* Longest line of the index file. */
+#define DEDUP_LINE_MAX ((REQ_DIGEST_LEN * 2) + 36 + GL_BINHDR_MAX)
+
+/* Private functions. */
+static dedup_entry_t *dedup_slot(const dedup_t *index, const uint8_t *digest);
+static bool dedup_put(dedup_t *index, const uint8_t *digest, uint64_t size,
+                      uint64_t mtime, const char *name);
+static bool dedup_write(FILE *fh, const dedup_entry_t *entry);
+static bool dedup_parse(char *line, uint8_t *digest, uint64_t *size,
+                        uint64_t *mtime, char **name);
+static bool dedup_unhex(const char *str, size_t len, uint8_t *buf);
+
+/**
+ * Calculates the digest that identifies the contents of a file, which is the
+ * root of its Merkle tree, hashing it in parallel.
+ *
+ * @param fh     File to be identified. Must not have pending writes.
+ * @param size   Size of the file.
+ * @param digest Returns the digest of the file.
+ *
+ * @return TRUE if the digest was calculated, FALSE otherwise.
+ */
+bool dedup_digest(FILE *fh, uint64_t size, uint8_t *digest) {
+	merkle_t tree;
+
+	if (!merkle_build(&tree, fh, size, REQ_DIGEST_LEAF, cpu_count()))
+		return false;
+	memcpy(digest, merkle_root(&tree), REQ_DIGEST_LEN);
+	merkle_free(&tree);
+
+	return true;
+}
+
+/**
+ * Loads the index from a file, leaving out the entries whose files have changed
+ * since, and keeps it open for the entries that will be added.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param index Index object to be populated.
+ * @param path  Path to the file where the index is persisted.
+ *
+ * @return TRUE if the index is ready to be used, FALSE otherwise.
+ *
+ * @see dedup_close
+ */
+bool dedup_open(dedup_t *index, const char *path) {
+	char line[DEDUP_LINE_MAX];
+	uint8_t digest[REQ_DIGEST_LEN];
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t fsize;
+	uint64_t fmtime;
+	char *name;
+	size_t i;
+	FILE *fh;
+
+	/* Start with an empty table. */
+	memset(index, 0, sizeof(dedup_t));
+	mutex_init(&index->lock);
+	index->nslots = DEDUP_SLOTS_MIN;
+	index->slots = (dedup_entry_t *)calloc(index->nslots,
+		sizeof(dedup_entry_t));
+	if (index->slots == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate content index");
+		mutex_free(&index->lock);
+		return false;
+	}
+
+	/* Load the entries whose files are still the same. */
+	fh = file_open(path, "rb");
+	if (fh != NULL) {
+		while (fgets(line, DEDUP_LINE_MAX, fh) != NULL) {
+			if (!dedup_parse(line, digest, &size, &mtime, &name))
+				continue;
+			if (!file_stat(name, &fsize, &fmtime) || (fsize != size) ||
+					(fmtime != mtime)) {
+				continue;
+			}
+
+			if (!dedup_put(index, digest, size, mtime, name)) {
+				fclose(fh);
+				return false;
+			}
+		}
+		fclose(fh);
+	}
+
+	/* Write the index back without any of the outdated entries. */
+	index->fh = file_open(path, "wb");
+	if (index->fh == NULL) {
+		log_syserr(LOG_WARNING, "Failed to open content index file \"%s\"",
+			path);
+		return true;
+	}
+	for (i = 0; i < index->nslots; i++) {
+		if ((index->slots[i].name != NULL) &&
+				!dedup_write(index->fh, &index->slots[i])) {
+			break;
+		}
+	}
+	fflush(index->fh);
+
+	return true;
+}
+
+/**
+ * Looks up a file with a specific content.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param index  Index object.
+ * @param digest Digest of the contents.
+ * @param size   Size of the contents.
+ *
+ * @return Name of a file that has exactly these contents or NULL if there's
+ *         none that we know of.
+ */
+char *dedup_lookup(dedup_t *index, const uint8_t *digest, uint64_t size) {
+	dedup_entry_t *entry;
+	uint64_t fsize;
+	uint64_t mtime;
+	char *name;
+
+	/* Find the entry and ensure its file hasn't changed since. */
+	name = NULL;
+	mutex_lock(&index->lock);
+	entry = dedup_slot(index, digest);
+	if ((entry->name != NULL) && (entry->size == size) &&
+			file_stat(entry->name, &fsize, &mtime) &&
+			(fsize == entry->size) && (mtime == entry->mtime)) {
+		name = strdup(entry->name);
+	}
+	mutex_unlock(&index->lock);
+
+	return name;
+}
+
+/**
+ * Adds a file to the index.
+ *
+ * @param index  Index object.
+ * @param digest Digest of the contents of the file.
+ * @param name   Path to the file.
+ *
+ * @return TRUE if the file was added, FALSE otherwise.
+ */
+bool dedup_add(dedup_t *index, const uint8_t *digest, const char *name) {
+	uint64_t size;
+	uint64_t mtime;
+	bool ret;
+
+	/* Names are stored one per line. */
+	if ((strchr(name, '\n') != NULL) || (strchr(name, '\r') != NULL) ||
+			(strlen(name) >= GL_BINHDR_MAX)) {
+		return false;
+	}
+	if (!file_stat(name, &size, &mtime))
+		return false;
+
+	/* Add it to the table and persist it. */
+	mutex_lock(&index->lock);
+	ret = dedup_put(index, digest, size, mtime, name);
+	if (ret && (index->fh != NULL)) {
+		dedup_write(index->fh, dedup_slot(index, digest));
+		fflush(index->fh);
+	}
+	mutex_unlock(&index->lock);
+
+	return ret;
+}
+
+/**
+ * Frees up the resources allocated by the index.
+ *
+ * @param index Index object to be freed.
+ */
+void dedup_close(dedup_t *index) {
+	size_t i;
+
+	/* Index was never opened. */
+	if (index->slots == NULL)
+		return;
+
+	for (i = 0; i < index->nslots; i++)
+		free(index->slots[i].name);
+	free(index->slots);
+	index->slots = NULL;
+	if (index->fh != NULL) {
+		fclose(index->fh);
+		index->fh = NULL;
+	}
+	mutex_free(&index->lock);
+}
+
+/**
+ * Finds the slot of the hash table where a digest is or should be.
+ *
+ * @param index  Index object.
+ * @param digest Digest to look for.
+ *
+ * @return Slot with the digest or the empty slot where it should go.
+ */
+static dedup_entry_t *dedup_slot(const dedup_t *index, const uint8_t *digest) {
+	dedup_entry_t *entry;
+	size_t slot;
+	size_t i;
+
+	/* Digests are already uniformly distributed. */
+	slot = 0;
+	for (i = 0; i < sizeof(size_t); i++)
+		slot = (slot << 8) | digest[i];
+
+	for (slot &= index->nslots - 1; ; slot = (slot + 1) & (index->nslots - 1)) {
+		entry = &index->slots[slot];
+		if ((entry->name == NULL) ||
+				(memcmp(entry->digest, digest, REQ_DIGEST_LEN) == 0)) {
+			return entry;
+		}
+	}
+}
+
+/**
+ * Puts an entry in the hash table, replacing the one with the same digest and
+ * growing the table if needed.
+ *
+ * @param index  Index object.
+ * @param digest Digest of the contents of the file.
+ * @param size   Size of the file.
+ * @param mtime  Modification time of the file.
+ * @param name   Path to the file.
+ *
+ * @return TRUE if the entry was put in the table, FALSE otherwise.
+ */
+static bool dedup_put(dedup_t *index, const uint8_t *digest, uint64_t size,
+                      uint64_t mtime, const char *name) {
+	dedup_entry_t *slots;
+	dedup_entry_t *entry;
+	size_t nslots;
+	size_t i;
+	char *dup;
+
+	/* Keep the table at most half full. */
+	if (((index->count + 1) * 2) > index->nslots) {
+		slots = index->slots;
+		nslots = index->nslots;
+		index->slots = (dedup_entry_t *)calloc(nslots * 2,
+			sizeof(dedup_entry_t));
+		if (index->slots == NULL) {
+			log_syserr(LOG_CRIT, "Failed to grow content index");
+			index->slots = slots;
+			return false;
+		}
+		index->nslots = nslots * 2;
+
+		for (i = 0; i < nslots; i++) {
+			if (slots[i].name != NULL)
+				*dedup_slot(index, slots[i].digest) = slots[i];
+		}
+		free(slots);
+	}
+
+	/* Fill in the entry. */
+	dup = strdup(name);
+	if (dup == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate content index entry");
+		return false;
+	}
+	entry = dedup_slot(index, digest);
+	if (entry->name == NULL) {
+		index->count++;
+	} else {
+		free(entry->name);
+	}
+	memcpy(entry->digest, digest, REQ_DIGEST_LEN);
+	entry->size = size;
+	entry->mtime = mtime;
+	entry->name = dup;
+
+	return true;
+}
+
+/**
+ * Writes an entry to the index file.
+ *
+ * @param fh    Index file handle.
+ * @param entry Entry to be written.
+ *
+ * @return TRUE if the entry was written, FALSE otherwise.
+ */
+static bool dedup_write(FILE *fh, const dedup_entry_t *entry) {
+	size_t i;
+
+	for (i = 0; i < REQ_DIGEST_LEN; i++)
+		fprintf(fh, "%02x", entry->digest[i]);
+	fprintf(fh, " %08lx%08lx %08lx%08lx %s\n",
+		(unsigned long)(entry->size >> 32),
+		(unsigned long)(entry->size & 0xFFFFFFFFUL),
+		(unsigned long)(entry->mtime >> 32),
+		(unsigned long)(entry->mtime & 0xFFFFFFFFUL), entry->name);
+
+	return !ferror(fh);
+}
+
+/**
+ * Parses a line of the index file.
+ *
+ * @param line   Line to be parsed. Will be modified.
+ * @param digest Returns the digest of the contents of the file.
+ * @param size   Returns the size of the file.
+ * @param mtime  Returns the modification time of the file.
+ * @param name   Returns a pointer into the line where the name of the file is.
+ *
+ * @return TRUE if the line is valid, FALSE otherwise.
+ */
+static bool dedup_parse(char *line, uint8_t *digest, uint64_t *size,
+                        uint64_t *mtime, char **name) {
+	uint8_t buf[8];
+	size_t len;
+	size_t i;
+
+	/* Check the layout of the line and strip the line ending. */
+	len = strlen(line);
+	while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+		line[--len] = '\0';
+	i = REQ_DIGEST_LEN * 2;
+	if ((len <= (i + 35)) || (line[i] != ' ') || (line[i + 17] != ' ') ||
+			(line[i + 34] != ' ')) {
+		return false;
+	}
+
+	/* Get the fields. */
+	if (!dedup_unhex(line, REQ_DIGEST_LEN * 2, digest))
+		return false;
+	if (!dedup_unhex(line + i + 1, 16, buf))
+		return false;
+	*size = 0;
+	for (len = 0; len < 8; len++)
+		*size = (*size << 8) | buf[len];
+	if (!dedup_unhex(line + i + 18, 16, buf))
+		return false;
+	*mtime = 0;
+	for (len = 0; len < 8; len++)
+		*mtime = (*mtime << 8) | buf[len];
+	*name = line + i + 35;
+
+	/* Don't let a tampered index point us at files outside of the directory. */
+	if (!fname_plain(*name)) {
+		log_printf(LOG_WARNING, "Ignored content index entry for \"%s\", which "
+			"isn't a file in the output directory", *name);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Decodes a hexadecimal string.
+ *
+ * @param str String to be decoded.
+ * @param len Number of characters to decode.
+ * @param buf Returns the decoded bytes.
+ *
+ * @return TRUE if the string was entirely valid, FALSE otherwise.
+ */
+static bool dedup_unhex(const char *str, size_t len, uint8_t *buf) {
+	uint8_t nibble;
+	size_t i;
+	char c;
+
+	for (i = 0; i < len; i++) {
+		c = str[i];
+		if ((c >= '0') && (c <= '9')) {
+			nibble = (uint8_t)(c - '0');
+		} else if ((c >= 'a') && (c <= 'f')) {
+			nibble = (uint8_t)(c - 'a' + 10);
+		} else {
+			return false;
+		}
+
+		if (i & 1) {
+			buf[i / 2] = (uint8_t)(buf[i / 2] | nibble);
+		} else {
+			buf[i / 2] = (uint8_t)(nibble << 4);
+		}
+	}
+
+	return true;
+}
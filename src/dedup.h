@@ -0,0 +1,58 @@
+/**
+ * dedup.h
+ * Index of the contents of the files that were received, used to complete
+ * transfers of contents that we already have without them being sent again.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_DEDUP_H
+#define _GL_DEDUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "request.h"
+#include "thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * File whose contents are known.
+ */
+typedef struct {
+	uint8_t digest[REQ_DIGEST_LEN];
+	uint64_t size;
+	uint64_t mtime;
+	char *name;
+} dedup_entry_t;
+
+/**
+ * Index of files by the digest of their contents, persisted to a file.
+ */
+typedef struct {
+	dedup_entry_t *slots;
+	size_t nslots;
+	size_t count;
+
+	FILE *fh;
+	mutex_t lock;
+} dedup_t;
+
+/* Identifying contents. */
+bool dedup_digest(FILE *fh, uint64_t size, uint8_t *digest);
+
+/* Index of contents. */
+bool dedup_open(dedup_t *index, const char *path);
+char *dedup_lookup(dedup_t *index, const uint8_t *digest, uint64_t size);
+bool dedup_add(dedup_t *index, const uint8_t *digest, const char *name);
+void dedup_close(dedup_t *index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_DEDUP_H */
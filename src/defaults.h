@@ -43,6 +43,360 @@
 	#define GL_REQLINE_MAX 400
 #endif /* GL_REQLINE_MAX */
 
+/**
+ * Binary request header's maximum length.
+ */
+#ifndef GL_BINHDR_MAX
+	#define GL_BINHDR_MAX 1024
+#endif /* GL_BINHDR_MAX */
+
+/**
+ * Length of the buffer each connection reads lines and small pieces of data
+ * into. Must be able to hold an entire binary request header.
+ */
+#ifndef GL_CONN_BUF_LEN
+	#define GL_CONN_BUF_LEN 4096
+#endif /* GL_CONN_BUF_LEN */
+
+/**
+ * Size of each block that the strings and objects of a request are allocated
+ * from. Enough for the names of the files involved in most requests.
+ */
+#ifndef GL_ARENA_BLOCK_LEN
+	#define GL_ARENA_BLOCK_LEN 4096
+#endif /* GL_ARENA_BLOCK_LEN */
+
+/**
+ * Length of the buffers that are borrowed from the shared pool while moving
+ * the contents of a transfer.
+ */
+#ifndef GL_IOBUF_LEN
+	#define GL_IOBUF_LEN (256 * 1024)
+#endif /* GL_IOBUF_LEN */
+
+/**
+ * Length of each slab of memory that's carved into transfer buffers. Must be a
+ * multiple of GL_IOBUF_LEN and of the size of a huge page.
+ */
+#ifndef GL_BUFPOOL_SLAB_LEN
+	#define GL_BUFPOOL_SLAB_LEN (2 * 1024 * 1024)
+#endif /* GL_BUFPOOL_SLAB_LEN */
+
+/**
+ * Number of transfer buffers each thread holds on to instead of sharing them.
+ */
+#ifndef GL_BUFPOOL_CACHE
+	#define GL_BUFPOOL_CACHE 2
+#endif /* GL_BUFPOOL_CACHE */
+
+/**
+ * Maximum length of a single chunk accepted in a chunked transfer.
+ */
+#ifndef GL_CHUNK_MAX
+	#define GL_CHUNK_MAX (1024L * 1024L)
+#endif /* GL_CHUNK_MAX */
+
+/**
+ * Size of each piece of a file that's striped across multiple connections.
+ */
+#ifndef GL_STRIPE_CHUNK
+	#define GL_STRIPE_CHUNK (4L * 1024L * 1024L)
+#endif /* GL_STRIPE_CHUNK */
+
+/**
+ * Maximum number of parallel connections used to send a single file.
+ */
+#ifndef GL_STRIPES_MAX
+	#define GL_STRIPES_MAX 8
+#endif /* GL_STRIPES_MAX */
+
+/**
+ * Interval in milliseconds between throughput measurements used to decide if
+ * another parallel connection should be opened.
+ */
+#ifndef GL_STRIPE_TUNE_MS
+	#define GL_STRIPE_TUNE_MS 1000
+#endif /* GL_STRIPE_TUNE_MS */
+
+/**
+ * Smallest piece of a striped file that the server accepts.
+ */
+#ifndef GL_STRIPE_CHUNK_MIN
+	#define GL_STRIPE_CHUNK_MIN (64L * 1024L)
+#endif /* GL_STRIPE_CHUNK_MIN */
+
+/**
+ * Maximum number of pieces that the server accepts a file to be striped into.
+ */
+#ifndef GL_STRIPE_CHUNKS_MAX
+	#define GL_STRIPE_CHUNKS_MAX (1024L * 1024L)
+#endif /* GL_STRIPE_CHUNKS_MAX */
+
+/**
+ * Time in milliseconds that a striped transfer may go without any stripes
+ * arriving before the server gives up on it.
+ */
+#ifndef GL_STRIPE_TIMEOUT_MS
+	#define GL_STRIPE_TIMEOUT_MS 30000
+#endif /* GL_STRIPE_TIMEOUT_MS */
+
+/**
+ * Minimum size of a file for it to be verified using a Merkle tree, which
+ * allows only the damaged parts of it to be sent again.
+ */
+#ifndef GL_MERKLE_MIN
+	#define GL_MERKLE_MIN (64L * 1024L * 1024L)
+#endif /* GL_MERKLE_MIN */
+
+/**
+ * Size of the pieces of a file that make up the leaves of its Merkle tree.
+ */
+#ifndef GL_MERKLE_LEAF
+	#define GL_MERKLE_LEAF (1024L * 1024L)
+#endif /* GL_MERKLE_LEAF */
+
+/**
+ * Smallest Merkle tree leaf size that the server will agree to.
+ */
+#ifndef GL_MERKLE_LEAF_MIN
+	#define GL_MERKLE_LEAF_MIN 4096L
+#endif /* GL_MERKLE_LEAF_MIN */
+
+/**
+ * Largest Merkle tree leaf size that the server will agree to.
+ */
+#ifndef GL_MERKLE_LEAF_MAX
+	#define GL_MERKLE_LEAF_MAX (16L * 1024L * 1024L)
+#endif /* GL_MERKLE_LEAF_MAX */
+
+/**
+ * Number of times damaged parts of a file may be sent again before giving up.
+ */
+#ifndef GL_MERKLE_RETRIES
+	#define GL_MERKLE_RETRIES 3
+#endif /* GL_MERKLE_RETRIES */
+
+/**
+ * Maximum number of threads used to hash the pieces of a file in parallel.
+ */
+#ifndef GL_HASH_THREADS_MAX
+	#define GL_HASH_THREADS_MAX 32
+#endif /* GL_HASH_THREADS_MAX */
+
+/**
+ * Minimum size of a file for it to be worth compressing.
+ */
+#ifndef GL_COMPRESS_MIN
+	#define GL_COMPRESS_MIN 4096L
+#endif /* GL_COMPRESS_MIN */
+
+/**
+ * Amount of content that is compressed at a time.
+ */
+#ifndef GL_COMPRESS_BLOCK
+	#define GL_COMPRESS_BLOCK (128L * 1024L)
+#endif /* GL_COMPRESS_BLOCK */
+
+/**
+ * Largest block of compressed content that the server will accept.
+ */
+#ifndef GL_COMPRESS_BLOCK_MAX
+	#define GL_COMPRESS_BLOCK_MAX (4L * 1024L * 1024L)
+#endif /* GL_COMPRESS_BLOCK_MAX */
+
+/**
+ * Maximum number of threads used to compress or decompress content.
+ */
+#ifndef GL_COMPRESS_THREADS_MAX
+	#define GL_COMPRESS_THREADS_MAX 64
+#endif /* GL_COMPRESS_THREADS_MAX */
+
+/**
+ * Amount of content sampled to decide if it's worth compressing.
+ */
+#ifndef GL_COMPRESS_SAMPLE
+	#define GL_COMPRESS_SAMPLE 4096
+#endif /* GL_COMPRESS_SAMPLE */
+
+/**
+ * Compression level that Zstandard starts off with before adapting to the
+ * connection.
+ */
+#ifndef GL_ZSTD_LEVEL
+	#define GL_ZSTD_LEVEL 3
+#endif /* GL_ZSTD_LEVEL */
+
+/**
+ * Number of compressed blocks between each time a neighbouring compression
+ * step is tried out to see if it would do any better.
+ */
+#ifndef GL_COMPRESS_PROBE
+	#define GL_COMPRESS_PROBE 16
+#endif /* GL_COMPRESS_PROBE */
+
+/**
+ * Smallest block size used to find the parts of a file that haven't changed.
+ */
+#ifndef GL_DELTA_BLOCK_MIN
+	#define GL_DELTA_BLOCK_MIN 2048L
+#endif /* GL_DELTA_BLOCK_MIN */
+
+/**
+ * Largest block size used to find the parts of a file that haven't changed.
+ */
+#ifndef GL_DELTA_BLOCK_MAX
+	#define GL_DELTA_BLOCK_MAX (128L * 1024L)
+#endif /* GL_DELTA_BLOCK_MAX */
+
+/**
+ * Largest run of new content sent in a single frame of a delta transfer.
+ */
+#ifndef GL_DELTA_LITERAL_MAX
+	#define GL_DELTA_LITERAL_MAX (64L * 1024L)
+#endif /* GL_DELTA_LITERAL_MAX */
+
+/**
+ * Smallest file worth identifying by its digest, letting the server reuse
+ * contents that it already has instead of receiving them again.
+ */
+#ifndef GL_DEDUP_MIN
+	#define GL_DEDUP_MIN (1024L * 1024L)
+#endif /* GL_DEDUP_MIN */
+
+/**
+ * File where the server keeps track of the contents it has received.
+ */
+#ifndef GL_DEDUP_INDEX
+	#define GL_DEDUP_INDEX ".glrecvd.idx"
+#endif /* GL_DEDUP_INDEX */
+
+/**
+ * Smallest chunk that content-defined chunking splits contents into.
+ */
+#ifndef GL_CDC_MIN
+	#define GL_CDC_MIN (16L * 1024L)
+#endif /* GL_CDC_MIN */
+
+/**
+ * Average size of the chunks that content-defined chunking aims for. Must be
+ * a power of two.
+ */
+#ifndef GL_CDC_AVG
+	#define GL_CDC_AVG (64L * 1024L)
+#endif /* GL_CDC_AVG */
+
+/**
+ * Largest chunk that content-defined chunking splits contents into.
+ */
+#ifndef GL_CDC_MAX
+	#define GL_CDC_MAX (256L * 1024L)
+#endif /* GL_CDC_MAX */
+
+/**
+ * Number of chunks whose hashes are sent at once, before the server asks for
+ * the ones it doesn't have. Must be small enough for a batch to be hashed well
+ * within the server's timeout.
+ */
+#ifndef GL_CDC_BATCH
+	#define GL_CDC_BATCH 256
+#endif /* GL_CDC_BATCH */
+
+/**
+ * File where the server keeps the index of the chunks it has received.
+ */
+#ifndef GL_CHUNK_INDEX
+	#define GL_CHUNK_INDEX ".glrecvd.cidx"
+#endif /* GL_CHUNK_INDEX */
+
+/**
+ * File where the server keeps the contents of the chunks it has received.
+ */
+#ifndef GL_CHUNK_DATA
+	#define GL_CHUNK_DATA ".glrecvd.chunks"
+#endif /* GL_CHUNK_DATA */
+
+/**
+ * Maximum amount of chunk contents kept by the server.
+ */
+#ifndef GL_CHUNK_STORE_MAX
+	#define GL_CHUNK_STORE_MAX ((uint64_t)16 << 30)
+#endif /* GL_CHUNK_STORE_MAX */
+
+/**
+ * Longest path of a file inside a directory that's being synchronized.
+ */
+#ifndef GL_SYNC_PATH_MAX
+	#define GL_SYNC_PATH_MAX 4096
+#endif /* GL_SYNC_PATH_MAX */
+
+/**
+ * Deepest level of subdirectories followed while synchronizing a directory.
+ */
+#ifndef GL_SYNC_DEPTH_MAX
+	#define GL_SYNC_DEPTH_MAX 64
+#endif /* GL_SYNC_DEPTH_MAX */
+
+/**
+ * Number of threads that look up the entries of a directory at the same time
+ * while walking through it, which hides the latency of network file systems.
+ */
+#ifndef GL_SYNC_STAT_THREADS
+	#define GL_SYNC_STAT_THREADS 8
+#endif /* GL_SYNC_STAT_THREADS */
+
+/**
+ * Directories with fewer entries than this are looked up by a single thread.
+ */
+#ifndef GL_SYNC_STAT_MIN
+	#define GL_SYNC_STAT_MIN 64
+#endif /* GL_SYNC_STAT_MIN */
+
+/**
+ * Size of the buffer used to send manifests of directories.
+ */
+#ifndef GL_SYNC_BUF
+	#define GL_SYNC_BUF (64L * 1024L)
+#endif /* GL_SYNC_BUF */
+
+/**
+ * Files smaller than this are packed together with other small files when
+ * synchronizing a directory instead of being sent on their own.
+ */
+#ifndef GL_SYNC_PACK_FILE_MAX
+	#define GL_SYNC_PACK_FILE_MAX (256L * 1024L)
+#endif /* GL_SYNC_PACK_FILE_MAX */
+
+/**
+ * Largest pack of small files sent at once when synchronizing a directory.
+ */
+#ifndef GL_SYNC_PACK_SIZE
+	#define GL_SYNC_PACK_SIZE (4L * 1024L * 1024L)
+#endif /* GL_SYNC_PACK_SIZE */
+
+/**
+ * File in the user's home directory where the sender keeps the hashes of the
+ * files it has sent, so that unchanged files don't have to be hashed again.
+ */
+#ifndef GL_HASHCACHE_FILE
+	#define GL_HASHCACHE_FILE ".glsend.cache"
+#endif /* GL_HASHCACHE_FILE */
+
+/**
+ * Maximum number of files kept in the sender's hash cache, not counting the
+ * ones that were used by the last run, which are always kept.
+ */
+#ifndef GL_HASHCACHE_ENTRIES
+	#define GL_HASHCACHE_ENTRIES 1024
+#endif /* GL_HASHCACHE_ENTRIES */
+
+/**
+ * Maximum size of the hashes kept in the sender's hash cache, not counting the
+ * ones of the files that were used by the last run.
+ */
+#ifndef GL_HASHCACHE_SIZE
+	#define GL_HASHCACHE_SIZE (16L * 1024L * 1024L)
+#endif /* GL_HASHCACHE_SIZE */
+
 /**
  * Server reply line's maximum length.
  */
@@ -58,4 +412,40 @@
 	#define RECV_TEXT_THRESHOLD RECV_BUF_LEN
 #endif /* RECV_TEXT_THRESHOLD */
 
+/**
+ * Number of log messages that can be waiting to be written out. Must be a
+ * power of two.
+ */
+#ifndef GL_LOG_RING_LEN
+	#define GL_LOG_RING_LEN 256
+#endif /* GL_LOG_RING_LEN */
+
+/**
+ * Longest log message that's written out in the background. Longer ones are
+ * written right away.
+ */
+#ifndef GL_LOG_RECORD_LEN
+	#define GL_LOG_RECORD_LEN 512
+#endif /* GL_LOG_RECORD_LEN */
+
+/**
+ * Interval in milliseconds between each time the log messages that are waiting
+ * are written out.
+ */
+#ifndef GL_LOG_FLUSH_MS
+	#define GL_LOG_FLUSH_MS 20
+#endif /* GL_LOG_FLUSH_MS */
+
+/**
+ * Most verbose log level that's compiled in. Messages that are less severe are
+ * left out of the program entirely, along with their arguments.
+ */
+#ifndef GL_LOG_MIN_LEVEL
+	#ifdef _DEBUG
+		#define GL_LOG_MIN_LEVEL LOG_DEBUG
+	#else
+		#define GL_LOG_MIN_LEVEL LOG_INFO
+	#endif /* _DEBUG */
+#endif /* GL_LOG_MIN_LEVEL */
+
 #endif /* _GL_DEFAULTS_H */
@@ -0,0 +1,703 @@
+/**
+ * delta.c
+ * Rolling checksum signatures of files, used to send only the parts of a file
+ * that changed since an older copy of it.
+ *
+ * The side that has the older copy splits it into fixed-size blocks and sends
+ * a weak rolling checksum and a strong hash of each of them. The side with the
+ * new version slides a window over it one byte at a time, which is cheap with
+ * the rolling checksum, and only hashes the window when its checksum matches
+ * one of the blocks. Anything that doesn't match is sent as a literal.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defaults.h"
+#include "logging.h"
+#include "thread.h"
+#include "utils.h"
+
+/* Smallest hash table used to look blocks up by their weak checksum. */
+#define DELTA_TABLE_MIN 16
+
+/**
+ * Range of blocks to be hashed by a single thread.
+ */
+typedef struct {
+	deltasig_t *sig;
+	FILE *fh;
+	uint64_t first;
+	uint64_t last;
+	bool ok;
+} delta_job_t;
+
+/**
+ * State of the instructions being generated to rebuild a file.
+ */
+typedef struct {
+	const deltasig_t *sig;
+	delta_emit_t emit;
+	void *arg;
+
+	uint64_t run;
+	uint64_t nrun;
+} delta_gen_t;
+
+/* Private functions. */
+static uint32_t delta_weak(const uint8_t *buf, size_t len);
+static uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t len);
+static void delta_strong(const uint8_t *buf, size_t len, uint8_t *strong);
+static uint64_t delta_slot(const deltasig_t *sig, uint32_t weak);
+static bool delta_find(const deltasig_t *sig, uint32_t weak, const uint8_t *buf,
+                       uint64_t hint, uint64_t *idx);
+static bool delta_copy(delta_gen_t *gen, uint64_t idx);
+static bool delta_flush_copy(delta_gen_t *gen);
+static bool delta_flush_literal(delta_gen_t *gen, const uint8_t *buf,
+                                size_t len);
+static thread_ret_t THREAD_CALL delta_worker(void *arg);
+
+/**
+ * Picks the block size for the signature of a file. Bigger blocks make for
+ * smaller signatures, while smaller ones can match around smaller changes.
+ *
+ * @param size Size of the file.
+ *
+ * @return Block size that's roughly the square root of the file size.
+ */
+uint32_t delta_block_size(uint64_t size) {
+	uint64_t block;
+
+	block = GL_DELTA_BLOCK_MIN;
+	while ((block < GL_DELTA_BLOCK_MAX) && ((block * block) < size))
+		block += 1024;
+
+	return (uint32_t)block;
+}
+
+/**
+ * Allocates an empty signature for a file.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param sig   Signature object to be allocated.
+ * @param size  Size of the file.
+ * @param block Size of each of the blocks.
+ *
+ * @return TRUE if the signature was allocated, FALSE otherwise.
+ *
+ * @see delta_sig_free
+ */
+bool delta_sig_alloc(deltasig_t *sig, uint64_t size, uint32_t block) {
+	memset(sig, 0, sizeof(deltasig_t));
+	if (block == 0)
+		return false;
+	sig->size = size;
+	sig->block = block;
+	sig->count = (size / block) + (((size % block) > 0) ? 1 : 0);
+
+	/* Ensure every block can be indexed and that it all fits in memory. */
+	if ((sig->count >= 0xFFFFFFFFUL) ||
+			(sig->count > (((size_t)-1) / DELTA_SIG_ENTRY_LEN))) {
+		log_printf(LOG_ERROR, "Delta signature with %lu blocks is too large",
+			(unsigned long)sig->count);
+		return false;
+	}
+	if (sig->count == 0)
+		return true;
+
+	/* Allocate the checksums. */
+	sig->weak = (uint32_t *)malloc((size_t)sig->count * sizeof(uint32_t));
+	sig->strong = (uint8_t *)malloc((size_t)sig->count * DELTA_STRONG_LEN);
+	if ((sig->weak == NULL) || (sig->strong == NULL)) {
+		log_syserr(LOG_CRIT, "Failed to allocate delta signature");
+		delta_sig_free(sig);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Builds the signature of a file, hashing its blocks in parallel.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param sig     Signature object to be populated.
+ * @param fh      File to build the signature of.
+ * @param size    Size of the file.
+ * @param block   Size of each of the blocks.
+ * @param threads Number of threads used to hash the blocks.
+ *
+ * @return TRUE if the signature was built, FALSE otherwise.
+ *
+ * @see delta_sig_free
+ */
+bool delta_sig_build(deltasig_t *sig, FILE *fh, uint64_t size, uint32_t block,
+                     unsigned int threads) {
+	thread_t handles[GL_HASH_THREADS_MAX];
+	delta_job_t jobs[GL_HASH_THREADS_MAX];
+	unsigned int started;
+	unsigned int i;
+	bool ok;
+
+	/* Allocate the signature. */
+	if (!delta_sig_alloc(sig, size, block))
+		return false;
+	if (sig->count == 0)
+		return true;
+
+	/* Spread the blocks between the threads. */
+	if (threads > GL_HASH_THREADS_MAX)
+		threads = GL_HASH_THREADS_MAX;
+	if ((uint64_t)threads > sig->count)
+		threads = (unsigned int)sig->count;
+	if (threads == 0)
+		threads = 1;
+	started = 0;
+	for (i = 0; i < threads; i++) {
+		jobs[i].sig = sig;
+		jobs[i].fh = fh;
+		jobs[i].first = (sig->count * i) / threads;
+		jobs[i].last = (sig->count * (i + 1)) / threads;
+		jobs[i].ok = false;
+
+		/* The first range is hashed by ourselves. */
+		if (i == 0)
+			continue;
+		if (!thread_create(&handles[started], delta_worker, &jobs[i]))
+			break;
+		started++;
+	}
+
+	/* Hash our own range, then whatever couldn't get a thread of its own. */
+	delta_worker(&jobs[0]);
+	for (i = started + 1; i < threads; i++)
+		delta_worker(&jobs[i]);
+	for (i = 0; i < started; i++)
+		thread_join(handles[i]);
+
+	/* Check if all of the blocks were hashed. */
+	ok = true;
+	for (i = 0; i < threads; i++)
+		ok = ok && jobs[i].ok;
+	if (!ok) {
+		delta_sig_free(sig);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Builds the hash table used to look up the blocks of a signature by their weak
+ * checksum. Blocks that are exact duplicates of another are left out.
+ *
+ * @param sig Signature object with all of its checksums populated.
+ *
+ * @return TRUE if the table was built, FALSE otherwise.
+ */
+bool delta_sig_index(deltasig_t *sig) {
+	uint64_t slots;
+	uint64_t slot;
+	uint64_t other;
+	uint64_t i;
+
+	/* Keep the table at most half full so that lookups stay short. */
+	slots = DELTA_TABLE_MIN;
+	while (slots < (sig->count * 2))
+		slots <<= 1;
+	sig->table = (uint32_t *)calloc((size_t)slots, sizeof(uint32_t));
+	if (sig->table == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate delta signature table");
+		return false;
+	}
+	sig->mask = slots - 1;
+
+	/* Only whole blocks can match the window that slides over the file. */
+	for (i = 0; i < sig->count; i++) {
+		if (delta_copy_len(sig, i, 1) < sig->block)
+			continue;
+
+		for (slot = delta_slot(sig, sig->weak[i]); sig->table[slot] != 0;
+				slot = (slot + 1) & sig->mask) {
+			other = sig->table[slot] - 1;
+			if ((sig->weak[other] == sig->weak[i]) &&
+					(memcmp(sig->strong + (other * DELTA_STRONG_LEN),
+					sig->strong + (i * DELTA_STRONG_LEN),
+					DELTA_STRONG_LEN) == 0)) {
+				break;
+			}
+		}
+		if (sig->table[slot] == 0)
+			sig->table[slot] = (uint32_t)(i + 1);
+	}
+
+	return true;
+}
+
+/**
+ * Frees up the resources allocated by a signature.
+ *
+ * @param sig Signature object to be freed.
+ */
+void delta_sig_free(deltasig_t *sig) {
+	free(sig->weak);
+	sig->weak = NULL;
+	free(sig->strong);
+	sig->strong = NULL;
+	free(sig->table);
+	sig->table = NULL;
+}
+
+/**
+ * Packs the checksums of some blocks of a signature to be sent over the
+ * network.
+ *
+ * @param sig   Signature object.
+ * @param first Index of the first block to be packed.
+ * @param count Number of blocks to be packed.
+ * @param buf   Buffer with room for count * DELTA_SIG_ENTRY_LEN bytes.
+ */
+void delta_sig_pack(const deltasig_t *sig, uint64_t first, uint64_t count,
+                    uint8_t *buf) {
+	uint64_t i;
+
+	for (i = first; i < (first + count); i++) {
+		*buf++ = (uint8_t)((sig->weak[i] >> 24) & 0xFF);
+		*buf++ = (uint8_t)((sig->weak[i] >> 16) & 0xFF);
+		*buf++ = (uint8_t)((sig->weak[i] >> 8) & 0xFF);
+		*buf++ = (uint8_t)(sig->weak[i] & 0xFF);
+		memcpy(buf, sig->strong + (i * DELTA_STRONG_LEN), DELTA_STRONG_LEN);
+		buf += DELTA_STRONG_LEN;
+	}
+}
+
+/**
+ * Unpacks the checksums of some blocks of a signature that were received from
+ * the network.
+ *
+ * @param sig   Signature object allocated with delta_sig_alloc.
+ * @param first Index of the first block to be unpacked.
+ * @param count Number of blocks to be unpacked.
+ * @param buf   Packed checksums.
+ */
+void delta_sig_unpack(deltasig_t *sig, uint64_t first, uint64_t count,
+                      const uint8_t *buf) {
+	uint64_t i;
+
+	for (i = first; i < (first + count); i++) {
+		sig->weak[i] = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+			((uint32_t)buf[2] << 8) | buf[3];
+		memcpy(sig->strong + (i * DELTA_STRONG_LEN), buf + 4,
+			DELTA_STRONG_LEN);
+		buf += DELTA_SIG_ENTRY_LEN;
+	}
+}
+
+/**
+ * Gets the length of the content covered by a run of blocks of a signature.
+ *
+ * @param sig   Signature object.
+ * @param idx   Index of the first block.
+ * @param count Number of blocks.
+ *
+ * @return Length of the run, which is only shorter than count blocks if it
+ *         includes the last one, or 0 if it goes past the end of the file.
+ */
+uint64_t delta_copy_len(const deltasig_t *sig, uint64_t idx, uint64_t count) {
+	uint64_t offset;
+	uint64_t len;
+
+	if ((idx >= sig->count) || (count > (sig->count - idx)))
+		return 0;
+
+	offset = idx * sig->block;
+	len = count * sig->block;
+	if (len > (sig->size - offset))
+		len = sig->size - offset;
+
+	return len;
+}
+
+/**
+ * Generates the instructions needed to rebuild a file from the older copy
+ * described by a signature. Consecutive blocks are copied in a single
+ * instruction and literals are split to never exceed GL_DELTA_LITERAL_MAX.
+ *
+ * @param sig    Signature of the older copy, indexed with delta_sig_index.
+ * @param fh     File to be rebuilt, read from its current position until EOF.
+ * @param emit   Function called with every instruction in order.
+ * @param arg    Opaque argument passed to the function.
+ * @param digest Returns the SHA-256 of the entire file.
+ *
+ * @return TRUE if all of the instructions were generated, FALSE otherwise.
+ */
+bool delta_generate(const deltasig_t *sig, FILE *fh, delta_emit_t emit,
+                    void *arg, uint8_t *digest) {
+	uint8_t strong[DELTA_STRONG_LEN];
+	delta_gen_t gen;
+	sha256_t ctx;
+	uint8_t *buf;
+	uint64_t idx;
+	uint32_t weak;
+	size_t block;
+	size_t start;
+	size_t pos;
+	size_t end;
+	size_t cap;
+	size_t len;
+	bool valid;
+	bool eof;
+	bool ret;
+
+	/* Initialize some variables. */
+	gen.sig = sig;
+	gen.emit = emit;
+	gen.arg = arg;
+	gen.run = 0;
+	gen.nrun = 0;
+	block = sig->block;
+	cap = GL_DELTA_LITERAL_MAX + (2 * block);
+	start = 0;
+	pos = 0;
+	end = 0;
+	weak = 0;
+	valid = false;
+	eof = false;
+	ret = false;
+	sha256_init(&ctx);
+
+	/* Allocate the window that slides over the file. */
+	buf = (uint8_t *)malloc(cap);
+	if (buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate delta window");
+		return false;
+	}
+
+	while (true) {
+		/* Always have an entire block and the byte right after it. */
+		if (!eof && ((end - pos) <= block)) {
+			if (!delta_flush_literal(&gen, buf + start, pos - start))
+				goto cleanup;
+			memmove(buf, buf + pos, end - pos);
+			end -= pos;
+			start = 0;
+			pos = 0;
+
+			len = fread(buf + end, sizeof(uint8_t), cap - end, fh);
+			if (len == 0) {
+				if (ferror(fh)) {
+					log_syserr(LOG_ERROR, "Failed to read the file to be "
+						"compared");
+					goto cleanup;
+				}
+				eof = true;
+			}
+			sha256_update(&ctx, buf + end, len);
+			end += len;
+			continue;
+		}
+		if ((end - pos) < block)
+			break;
+
+		/* Check if the other side already has this block. */
+		if (!valid) {
+			weak = delta_weak(buf + pos, block);
+			valid = true;
+		}
+		if (delta_find(sig, weak, buf + pos, gen.run + gen.nrun, &idx)) {
+			if (!delta_flush_literal(&gen, buf + start, pos - start))
+				goto cleanup;
+			if (!delta_copy(&gen, idx))
+				goto cleanup;
+
+			pos += block;
+			start = pos;
+			valid = false;
+			continue;
+		}
+
+		/* Slide the window over by a byte. */
+		if ((end - pos) > block) {
+			weak = delta_roll(weak, buf[pos], buf[pos + block], block);
+		} else {
+			valid = false;
+		}
+		pos++;
+	}
+
+	/* The last block of the older copy is usually shorter than the others. */
+	len = end - pos;
+	if ((len > 0) && (delta_copy_len(sig, sig->count - 1, 1) == len)) {
+		idx = sig->count - 1;
+		delta_strong(buf + pos, len, strong);
+		if ((sig->weak[idx] == delta_weak(buf + pos, len)) &&
+				(memcmp(sig->strong + (idx * DELTA_STRONG_LEN), strong,
+				DELTA_STRONG_LEN) == 0)) {
+			if (!delta_flush_literal(&gen, buf + start, pos - start))
+				goto cleanup;
+			if (!delta_copy(&gen, idx))
+				goto cleanup;
+			start = end;
+		}
+	}
+
+	/* Send whatever is left over. */
+	if (!delta_flush_literal(&gen, buf + start, end - start))
+		goto cleanup;
+	if (!delta_flush_copy(&gen))
+		goto cleanup;
+	sha256_final(&ctx, digest);
+	ret = true;
+
+cleanup:
+	free(buf);
+	return ret;
+}
+
+/**
+ * Calculates the weak checksum of a block, which is made up of two 16-bit sums
+ * that can be rolled over the data one byte at a time.
+ *
+ * @param buf Block to be summed.
+ * @param len Length of the block.
+ *
+ * @return Weak checksum of the block.
+ */
+static uint32_t delta_weak(const uint8_t *buf, size_t len) {
+	uint32_t a;
+	uint32_t b;
+	size_t i;
+
+	a = 0;
+	b = 0;
+	for (i = 0; i < len; i++) {
+		a += buf[i];
+		b += a;
+	}
+
+	return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+}
+
+/**
+ * Rolls the weak checksum of a window over by a single byte.
+ *
+ * @param weak Weak checksum of the current window.
+ * @param out  Byte that's leaving the window.
+ * @param in   Byte that's entering the window.
+ * @param len  Length of the window.
+ *
+ * @return Weak checksum of the window that starts one byte later.
+ */
+static uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t len) {
+	uint32_t a;
+	uint32_t b;
+
+	a = ((weak & 0xFFFF) - out + in) & 0xFFFF;
+	b = ((weak >> 16) - ((uint32_t)len * out) + a) & 0xFFFF;
+
+	return a | (b << 16);
+}
+
+/**
+ * Calculates the strong hash of a block.
+ *
+ * @param buf    Block to be hashed.
+ * @param len    Length of the block.
+ * @param strong Returns the first DELTA_STRONG_LEN bytes of its SHA-256.
+ */
+static void delta_strong(const uint8_t *buf, size_t len, uint8_t *strong) {
+	uint8_t digest[SHA256_LEN];
+
+	sha256(buf, len, digest);
+	memcpy(strong, digest, DELTA_STRONG_LEN);
+}
+
+/**
+ * Gets the slot of the hash table where a weak checksum should be.
+ *
+ * @param sig  Signature object.
+ * @param weak Weak checksum.
+ *
+ * @return Slot where to start looking for the checksum.
+ */
+static uint64_t delta_slot(const deltasig_t *sig, uint32_t weak) {
+	/* Spread the checksums, their sums are far from being uniform. */
+	weak ^= weak >> 16;
+	weak *= 0x45D9F3BUL;
+	weak ^= weak >> 16;
+
+	return weak & sig->mask;
+}
+
+/**
+ * Looks for a block of the signature that matches a window of the file,
+ * computing its strong hash only if the weak checksum matches.
+ *
+ * @param sig  Signature object.
+ * @param weak Weak checksum of the window.
+ * @param buf  Window, which is as long as a block.
+ * @param hint Block that's the most likely to match.
+ * @param idx  Returns the index of the matching block.
+ *
+ * @return TRUE if a matching block was found, FALSE otherwise.
+ */
+static bool delta_find(const deltasig_t *sig, uint32_t weak, const uint8_t *buf,
+                       uint64_t hint, uint64_t *idx) {
+	uint8_t strong[DELTA_STRONG_LEN];
+	uint64_t slot;
+	uint64_t i;
+	bool hashed;
+
+	/* The block right after the last one that matched is the likeliest. */
+	hashed = false;
+	if ((hint < sig->count) && (sig->weak[hint] == weak) &&
+			(delta_copy_len(sig, hint, 1) == sig->block)) {
+		delta_strong(buf, sig->block, strong);
+		hashed = true;
+		if (memcmp(sig->strong + (hint * DELTA_STRONG_LEN), strong,
+				DELTA_STRONG_LEN) == 0) {
+			*idx = hint;
+			return true;
+		}
+	}
+
+	/* Look for any other block with the same checksum. */
+	for (slot = delta_slot(sig, weak); sig->table[slot] != 0;
+			slot = (slot + 1) & sig->mask) {
+		i = sig->table[slot] - 1;
+		if (sig->weak[i] != weak)
+			continue;
+
+		if (!hashed) {
+			delta_strong(buf, sig->block, strong);
+			hashed = true;
+		}
+		if (memcmp(sig->strong + (i * DELTA_STRONG_LEN), strong,
+				DELTA_STRONG_LEN) == 0) {
+			*idx = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Adds a block to the run of blocks to be copied, starting a new one if it
+ * isn't right after the ones that are pending.
+ *
+ * @param gen Generator state.
+ * @param idx Index of the block to be copied.
+ *
+ * @return TRUE if the block was added, FALSE if an instruction failed.
+ */
+static bool delta_copy(delta_gen_t *gen, uint64_t idx) {
+	if ((gen->nrun > 0) && (idx == (gen->run + gen->nrun)) &&
+			(gen->nrun < 0xFFFFFFFFUL)) {
+		gen->nrun++;
+		return true;
+	}
+
+	if (!delta_flush_copy(gen))
+		return false;
+	gen->run = idx;
+	gen->nrun = 1;
+
+	return true;
+}
+
+/**
+ * Emits the pending run of blocks to be copied.
+ *
+ * @param gen Generator state.
+ *
+ * @return TRUE if the instruction was handled, FALSE otherwise.
+ */
+static bool delta_flush_copy(delta_gen_t *gen) {
+	if (gen->nrun == 0)
+		return true;
+
+	if (!gen->emit(gen->arg, DELTA_OP_COPY, NULL, (uint32_t)gen->nrun,
+			gen->run)) {
+		return false;
+	}
+	gen->nrun = 0;
+
+	return true;
+}
+
+/**
+ * Emits content that isn't in the older copy, after any pending copies.
+ *
+ * @param gen Generator state.
+ * @param buf New content.
+ * @param len Length of the new content.
+ *
+ * @return TRUE if the instructions were handled, FALSE otherwise.
+ */
+static bool delta_flush_literal(delta_gen_t *gen, const uint8_t *buf,
+                                size_t len) {
+	size_t n;
+
+	if (len == 0)
+		return true;
+	if (!delta_flush_copy(gen))
+		return false;
+
+	while (len > 0) {
+		n = (len > GL_DELTA_LITERAL_MAX) ? GL_DELTA_LITERAL_MAX : len;
+		if (!gen->emit(gen->arg, DELTA_OP_LITERAL, buf, (uint32_t)n, 0))
+			return false;
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/**
+ * Thread that hashes a range of blocks.
+ *
+ * @param arg Delta job object.
+ *
+ * @return Nothing.
+ */
+static thread_ret_t THREAD_CALL delta_worker(void *arg) {
+	delta_job_t *job;
+	uint8_t *buf;
+	uint64_t len;
+	uint64_t i;
+
+	/* Allocate a buffer for reading the blocks. */
+	job = (delta_job_t *)arg;
+	buf = (uint8_t *)malloc(job->sig->block);
+	if (buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate delta signature block buffer");
+		return 0;
+	}
+
+	/* Hash our range of blocks. */
+	for (i = job->first; i < job->last; i++) {
+		len = delta_copy_len(job->sig, i, 1);
+		if (!file_pread(job->fh, buf, (size_t)len, i * job->sig->block)) {
+			log_syserr(LOG_ERROR, "Failed to read file while building its "
+				"delta signature");
+			free(buf);
+			return 0;
+		}
+
+		job->sig->weak[i] = delta_weak(buf, (size_t)len);
+		delta_strong(buf, (size_t)len, job->sig->strong +
+			(i * DELTA_STRONG_LEN));
+	}
+	job->ok = true;
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * delta.h
+ * Rolling checksum signatures of files, used to send only the parts of a file
+ * that changed since an older copy of it.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_DELTA_H
+#define _GL_DELTA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "request.h"
+#include "sha256.h"
+
+/**
+ * Length of the strong hash of a block, which is a truncated SHA-256.
+ */
+#define DELTA_STRONG_LEN 16
+
+/**
+ * Length of the signature of a single block when sent over the network.
+ */
+#define DELTA_SIG_ENTRY_LEN (4 + DELTA_STRONG_LEN)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Signature of a file, made up of a weak rolling checksum and a strong hash of
+ * each of its blocks.
+ */
+typedef struct {
+	uint64_t size;
+	uint32_t block;
+	uint64_t count;
+
+	uint32_t *weak;
+	uint8_t *strong;
+
+	uint32_t *table;
+	uint64_t mask;
+} deltasig_t;
+
+/**
+ * Function called with every instruction needed to rebuild a file. Literals
+ * carry the new content, copies refer to a run of blocks of the signature.
+ *
+ * @param arg Opaque argument passed to delta_generate.
+ * @param op  Either DELTA_OP_LITERAL or DELTA_OP_COPY.
+ * @param buf New content for literals, NULL for copies.
+ * @param len Length of the literal or number of blocks to be copied.
+ * @param idx Index of the first block to be copied.
+ *
+ * @return TRUE if the instruction was handled, FALSE to stop generating.
+ */
+typedef bool (*delta_emit_t)(void *arg, deltaop_t op, const uint8_t *buf,
+                             uint32_t len, uint64_t idx);
+
+/* Building signatures. */
+uint32_t delta_block_size(uint64_t size);
+bool delta_sig_alloc(deltasig_t *sig, uint64_t size, uint32_t block);
+bool delta_sig_build(deltasig_t *sig, FILE *fh, uint64_t size, uint32_t block,
+                     unsigned int threads);
+bool delta_sig_index(deltasig_t *sig);
+void delta_sig_free(deltasig_t *sig);
+
+/* Exchanging signatures. */
+void delta_sig_pack(const deltasig_t *sig, uint64_t first, uint64_t count,
+                    uint8_t *buf);
+void delta_sig_unpack(deltasig_t *sig, uint64_t first, uint64_t count,
+                      const uint8_t *buf);
+
+/* Rebuilding files. */
+uint64_t delta_copy_len(const deltasig_t *sig, uint64_t idx, uint64_t count);
+bool delta_generate(const deltasig_t *sig, FILE *fh, delta_emit_t emit,
+                    void *arg, uint8_t *digest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_DELTA_H */
@@ -28,29 +28,136 @@
 #include "logging.h"
 #include "sockets.h"
 #include "request.h"
+#include "bufpool.h"
+#include "chunkstore.h"
+#include "compress.h"
+#include "dedup.h"
+#include "delta.h"
+#include "manifest.h"
+#include "merkle.h"
+#include "names.h"
+#include "scan.h"
+#include "thread.h"
 #include "utils.h"
 
 /* Server status flags */
 #define SERVER_RUNNING   0x01
 #define CLIENT_CONNECTED 0x02
 
+/* Request flags supported by this server. */
+#define SUPPORTED_FLAGS \
+	(REQ_FLAG_CHUNKED | REQ_FLAG_STRIPED | REQ_FLAG_CHECKSUM | \
+	 REQ_FLAG_MERKLE | REQ_FLAG_DELTA | REQ_FLAG_DIGEST | REQ_FLAG_CDC | \
+	 COMPRESS_FLAGS)
+
+/* Suffix of the file where a newer version of a file is rebuilt. */
+#define DELTA_TEMP_SUFFIX ".gldelta"
+
+/* Suffix of the file where a file of a synchronized directory is received. */
+#define SYNC_TEMP_SUFFIX ".glsync"
+
 /**
  * Configuration options passed as command line arguments.
  */
 typedef struct {
 	const char *addr;
 	const char *port;
+	const char *outdir;
+	unsigned int threads;
 	bool accept_all;
 } opts_t;
 
+/**
+ * File transfer whose contents are striped across multiple connections.
+ */
+typedef struct stripe_xfer_s {
+	uint8_t xid[REQ_XID_LEN];
+	conn_t conn;
+	FILE *fh;
+	char *fname;
+
+	size_t size;
+	size_t acclen;
+	uint32_t chunk;
+	size_t nchunks;
+	size_t ndone;
+	uint8_t *done;
+	uint32_t *crcs;
+
+	uint32_t leaf;
+	uint8_t digest[REQ_DIGEST_LEN];
+
+	uint64_t touched;
+	unsigned int refs;
+	bool checksums;
+	bool merkle;
+	bool dedup;
+	bool mismatch;
+	bool failed;
+	bool finished;
+
+	struct stripe_xfer_s *next;
+} stripe_xfer_t;
+
+/**
+ * Connection dedicated to receiving stripes of transfers.
+ */
+typedef struct {
+	conn_t conn;
+	reqline_t reqline;
+} stripe_conn_t;
+
 /* Private functions. */
 bool server_start(const char *addr, const char *port);
 void server_stop(void);
+bool server_running(void);
 void server_loop(int af, sockfd_t server);
 void server_process_request(sockfd_t *sock);
-bool process_file_req(const sockfd_t *sockfd, const reqline_t *reqline);
+size_t recv_bin_header(conn_t *conn, uint8_t *buf);
+FILE *accept_file(conn_t *conn, const reqline_t *reqline, char **fname,
+                  FILE **basis);
+bool fname_reserved(const char *fname);
+char *delta_temp_fname(arena_t *arena, const char *fname);
+bool dedup_recv(FILE **fh, const char *fname, const reqline_t *reqline);
+void dedup_remember(const char *fname, uint64_t size, const uint8_t *digest);
+uint16_t reply_continue(const sockfd_t *sockfd, const reqline_t *reqline,
+                        uint16_t supported);
+bool recv_crc(conn_t *conn, uint32_t *crc);
+uint16_t file_req_flags(const reqline_t *reqline);
+bool merkle_verify_recv(conn_t *conn, FILE *fh, const char *fname,
+                        uint64_t size, uint32_t leaf);
+bool process_file_req(conn_t *conn, const reqline_t *reqline);
 bool process_url_req(const sockfd_t *sockfd, const reqline_t *reqline);
-bool process_text_req(const sockfd_t *sockfd, const reqline_t *reqline);
+bool process_text_req(conn_t *conn, const reqline_t *reqline);
+bool process_sync_req(conn_t *conn, const reqline_t *reqline);
+uint8_t *sync_diff(conn_t *conn, const char *dname, uint64_t *count,
+                   uint64_t *nwant);
+bool sync_recv_file(conn_t *conn, const char *dname, const char *path,
+                    uint64_t size, uint64_t mtime, bool checksums,
+                    char *lastdir, bool *stored);
+bool sync_recv_pack(conn_t *conn, const char *dname, uint32_t count,
+                    uint64_t size, bool checksums, uint8_t *pack,
+                    char *lastdir, uint64_t *nrecv, uint64_t *nfail);
+FILE *sync_open(arena_t *arena, const char *dname, const char *path,
+                char *lastdir, char **fname, char **tmpname);
+bool sync_finish(FILE *fh, const char *fname, const char *tmpname,
+                 uint64_t mtime, bool ok);
+bool sync_read(void *arg, void *buf, size_t len);
+bool recv_chunked(conn_t *conn, FILE *fh, const char *name,
+                  int *last, bool checksums);
+bool recv_compressed(conn_t *conn, FILE *fh, const char *name,
+                     const reqline_t *reqline, uint16_t flags, int *last);
+bool recv_delta(conn_t *conn, FILE *fh, FILE *basis,
+                const char *fname, const reqline_t *reqline);
+bool recv_cdc(conn_t *conn, FILE *fh, const char *fname,
+              const reqline_t *reqline);
+bool stripe_xfer_start(conn_t *conn, const reqline_t *reqline, FILE *fh,
+                       char *fname);
+void stripe_xfer_finish(stripe_xfer_t *xfer);
+void stripe_xfer_reap(bool all);
+bool stripe_conn_start(conn_t *conn, const reqline_t *reqline);
+thread_ret_t THREAD_CALL stripe_conn_thread(void *arg);
+bool process_stripe_req(conn_t *conn, const reqline_t *reqline);
 void sigint_handler(int sig);
 void usage(const char *prog);
 #ifdef _WIN32
@@ -59,9 +166,16 @@ BOOL WINAPI ConsoleSignalHandler(DWORD dwCtrlType);
 
 /* State variables. */
 static uint8_t server_status;
+static volatile sig_atomic_t stop_signaled;
 static sockfd_t sockfd_server;
 static sockfd_t sockfd_client;
 static opts_t opts;
+static stripe_xfer_t *stripe_xfers;
+static mutex_t stripe_lock;
+static dedup_t dedup;
+static names_t names;
+static chunkstore_t chunks;
+static bool chunks_opened;
 
 /**
  * Program's main entry point.
@@ -89,10 +203,17 @@ int main(int argc, char **argv) {
 #endif /* _WIN32 */
 
 	/* Initialize defaults and subsystems. */
+	log_init();
 	ret = 0;
 	server_status = 0;
 	sockfd_server = SOCKERR;
 	sockfd_client = SOCKERR;
+	stripe_xfers = NULL;
+	mutex_init(&stripe_lock);
+	chunks_opened = false;
+	crc32c_init();
+	scan_init();
+	bufpool_init();
 	if (!socket_init()) {
 		ret = 1;
 		goto cleanup;
@@ -101,13 +222,20 @@ int main(int argc, char **argv) {
 	/* Catch the interrupt signal from the console. */
 	signal(SIGINT, sigint_handler);
 
+#ifndef _WIN32
+	/* Clients that went away are dealt with where we talk to them. */
+	signal(SIGPIPE, SIG_IGN);
+#endif /* !_WIN32 */
+
 	/* Populates the command line options object with defaults. */
 	opts.addr = "0.0.0.0";
 	opts.port = GL_SERVER_PORT;
+	opts.outdir = ".";
+	opts.threads = 0;
 	opts.accept_all = false;
 
 	/* Handle command line arguments. */
-	while ((opt = getopt(argc, argv, "l:p:yh")) != -1) {
+	while ((opt = getopt(argc, argv, "l:p:o:T:qvyh")) != -1) {
 		switch (opt) {
 			case 'l':
 				opts.addr = optarg;
@@ -115,6 +243,28 @@ int main(int argc, char **argv) {
 			case 'p':
 				opts.port = optarg;
 				break;
+			case 'o':
+				opts.outdir = optarg;
+				break;
+			case 'T':
+				opts.threads = (unsigned int)atoi(optarg);
+				if (opts.threads > GL_COMPRESS_THREADS_MAX) {
+					log_printf(LOG_ERROR, "Number of decompression threads "
+						"must be at most %u", GL_COMPRESS_THREADS_MAX);
+					ret = 1;
+					goto cleanup;
+				}
+				break;
+			case 'q':
+				log_set_level(LOG_WARNING);
+				break;
+			case 'v':
+				log_set_level(LOG_DEBUG);
+				if (!log_enabled(LOG_DEBUG)) {
+					log_printf(LOG_WARNING, "Debug messages were left out of "
+						"this build, so -v has no effect");
+				}
+				break;
 			case 'y':
 				opts.accept_all = true;
 				break;
@@ -138,6 +288,24 @@ int main(int argc, char **argv) {
 			argv[optind++]);
 	}
 
+	/* Receive everything into the output directory. */
+	if (!dir_set_base(opts.outdir)) {
+		log_syserr(LOG_ERROR, "Failed to open output directory \"%s\"",
+			opts.outdir);
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* Load the index of the contents we already have. */
+	if (!dedup_open(&dedup, GL_DEDUP_INDEX)) {
+		ret = 1;
+		goto cleanup;
+	}
+	if (!names_open(&names, opts.outdir)) {
+		ret = 1;
+		goto cleanup;
+	}
+
 	/* Run the server. */
 	if (!server_start(opts.addr, opts.port)) {
 		ret = 2;
@@ -148,6 +316,11 @@ int main(int argc, char **argv) {
 cleanup:
 	/* Stop our server. */
 	server_stop();
+	stripe_xfer_reap(true);
+	dedup_close(&dedup);
+	names_close(&names);
+	if (chunks_opened)
+		chunkstore_close(&chunks);
 
 #ifdef _WIN32
 	/* Clean up Winsock stuff. */
@@ -220,6 +393,16 @@ void server_stop(void) {
 	}
 }
 
+/**
+ * Checks if the server should keep going, which it shouldn't once it was
+ * stopped or asked to stop by a signal.
+ *
+ * @return TRUE if the server is still running, FALSE otherwise.
+ */
+bool server_running(void) {
+	return (server_status & SERVER_RUNNING) && !stop_signaled;
+}
+
 /**
  * Server listening loop.
  *
@@ -227,23 +410,27 @@ void server_stop(void) {
  * @param server Socket in which the server is listening on.
  */
 void server_loop(int af, sockfd_t server) {
-	while (server_status & SERVER_RUNNING) {
+	while (server_running()) {
 		struct sockaddr_storage csa;
 		sockfd_t *sock;
 		socklen_t socklen;
 		char addrstr[IPADDR_STRLEN];
 
+		/* Give up on striped transfers that the client abandoned. */
+		stripe_xfer_reap(false);
+
 		/* Accept the client connection. */
 		sock = &sockfd_client;
 		socklen = sizeof(csa);
 		*sock = accept(server, (struct sockaddr*)&csa, &socklen);
 		if (*sock == SOCKERR) {
-			if ((server_status & SERVER_RUNNING) && (sockerrno != EWOULDBLOCK))
+			if (server_running() && (sockerrno != EWOULDBLOCK))
 				log_sockerr(LOG_ERROR, "Server failed to accept a connection");
 			server_status &= ~CLIENT_CONNECTED;
 			continue;
 		}
 		server_status |= CLIENT_CONNECTED;
+		socket_nodelay(*sock);
 
 		/* Get client address string and announce connection. */
 		if (inet_addr_str(af, &csa, addrstr) == NULL) {
@@ -255,6 +442,10 @@ void server_loop(int af, sockfd_t server) {
 		/* Process the client's request. */
 		server_process_request(sock);
 	}
+
+	/* Signal handlers can't log, so we do it for them. */
+	if (stop_signaled)
+		log_printf(LOG_DEBUG, "Received a SIGINT");
 }
 
 /**
@@ -263,63 +454,88 @@ void server_loop(int af, sockfd_t server) {
  * @param sock Pointer to a client connection socket descriptor.
  */
 void server_process_request(sockfd_t *sock) {
-	char line[GL_REQLINE_MAX + 1];
+	char line[GL_BINHDR_MAX + 1];
+	const uint8_t *peek;
+	reqline_t parsed;
 	reqline_t *reqline;
+	conn_t conn;
+	size_t hlen;
 	ssize_t len;
-	int i;
-
-	/* Initialize some defaults. */
-	reqline = NULL;
 
-	/* Read the line from client's request. */
-	if ((len = recv(*sock, line, GL_REQLINE_MAX, 0)) < 0) {
-		if (server_status & SERVER_RUNNING) {
+	/* Wait for the client's request. */
+	conn_init(&conn, *sock);
+	if ((peek = conn_peek(&conn, &hlen)) == NULL) {
+		if (server_running()) {
 			log_sockerr(LOG_ERROR, "Server failed to receive request line");
 			send_error(*sock, ERR_CODE_INTERNAL);
 		}
 		goto close_conn;
 	}
-	line[len] = '\0';
 
-	/* Ensure the request wasn't too long. */
-	if (len >= GL_REQLINE_MAX) {
-		log_printf(LOG_WARNING, "Request line unusually long, closing "
-			"connection.");
-		send_error(*sock, ERR_CODE_REQ_LONG);
-		goto close_conn;
-	}
+	/* Handle both binary request headers and text request lines. */
+	if (reqline_is_bin(peek, hlen)) {
+		/* Get the entire binary request header. */
+		hlen = recv_bin_header(&conn, (uint8_t *)line);
+		if (hlen == 0)
+			goto close_conn;
+
+		/* Parse the binary request header. */
+		if (!reqline_parse_bin((uint8_t *)line, hlen, &parsed)) {
+			log_printf(LOG_NOTICE, "Invalid request header. Ignored.");
+			send_error(*sock, ERR_CODE_REQ_BAD);
+			goto close_conn;
+		}
+	} else {
+		/* Get the request line, leaving whatever follows it in the buffer. */
+		if ((len = conn_recv_line(&conn, line, GL_REQLINE_MAX)) < 0) {
+			if (server_running()) {
+				log_sockerr(LOG_ERROR, "Server failed to receive request "
+					"line");
+				send_error(*sock, ERR_CODE_INTERNAL);
+			}
+			goto close_conn;
+		}
 
-	/* Terminate the request line before CRLF. */
-	for (i = 0; i < len; i++) {
-		if ((line[i] == '\r') || (line[i] == '\n')) {
-			line[i] = '\0';
-			break;
+		/* Ensure the request wasn't too long. */
+		if (len >= GL_REQLINE_MAX) {
+			log_printf(LOG_WARNING, "Request line unusually long, closing "
+				"connection.");
+			send_error(*sock, ERR_CODE_REQ_LONG);
+			goto close_conn;
 		}
-	}
 
-	/* Parse the request line. */
-	reqline = reqline_parse(line);
-	if (reqline == NULL) {
-		log_printf(LOG_NOTICE, "Invalid request line. Ignored.");
-		send_error(*sock, ERR_CODE_REQ_BAD);
-		goto close_conn;
+		/* Parse the request line. */
+		if (!reqline_parse(line, (size_t)len, &parsed)) {
+			log_printf(LOG_NOTICE, "Invalid request line. Ignored.");
+			send_error(*sock, ERR_CODE_REQ_BAD);
+			goto close_conn;
+		}
 	}
+	reqline = &parsed;
 
-#ifdef _DEBUG
-	log_printf(LOG_INFO, "Parsed request line:");
-	reqline_dump(reqline);
-#endif /* _DEBUG */
+	/* Show what the client asked for when debugging. */
+	if (log_enabled(LOG_DEBUG)) {
+		log_printf(LOG_DEBUG, "Parsed request line:");
+		log_flush();
+		reqline_dump(reqline);
+	}
 
 	/* Reply to the client and accept the contents if the type requires. */
 	switch (reqline->type) {
 		case REQ_TYPE_FILE:
-			process_file_req(sock, reqline);
+			process_file_req(&conn, reqline);
 			break;
 		case REQ_TYPE_URL:
 			process_url_req(sock, reqline);
 			break;
 		case REQ_TYPE_TEXT:
-			process_text_req(sock, reqline);
+			process_text_req(&conn, reqline);
+			break;
+		case REQ_TYPE_STRIPE:
+			stripe_conn_start(&conn, reqline);
+			break;
+		case REQ_TYPE_SYNC:
+			process_sync_req(&conn, reqline);
 			break;
 		default:
 			log_printf(LOG_ERROR, "Unknown transfer type '%c' %s",
@@ -328,279 +544,2525 @@ void server_process_request(sockfd_t *sock) {
 			break;
 	}
 
-close_conn:
-	/* Free our request line object. */
-	reqline_free(reqline);
+	/* Striped transfers take the connection over. */
+	if (conn.sockfd == SOCKERR)
+		*sock = SOCKERR;
 
+close_conn:
 	/* Close the client connection and signal that we are finished here. */
 	if (*sock != SOCKERR) {
 		socket_close(*sock, false);
 		log_printf(LOG_INFO, "Closed client connection");
 	}
+	arena_free(&conn.arena);
 	*sock = SOCKERR;
 	server_status &= ~CLIENT_CONNECTED;
 }
 
 /**
- * Processes and replies to the client that sent a file transfer request.
+ * Receives an entire binary request header.
  *
- * @param sockfd  Client's socket handle used to reply.
+ * @param conn Client's connection.
+ * @param buf  Buffer of at least GL_BINHDR_MAX bytes to store the header.
+ *
+ * @return Length of the entire header or 0 if the client closed the connection
+ *         or sent a header that is too long.
+ */
+size_t recv_bin_header(conn_t *conn, uint8_t *buf) {
+	size_t hlen;
+	size_t len;
+
+	/* Read until we know the length of the header and have all of it. */
+	len = 0;
+	while (((hlen = reqline_bin_len(buf, len)) == 0) ||
+			((hlen <= GL_BINHDR_MAX) && (len < hlen))) {
+		ssize_t rlen;
+
+		rlen = conn_recv(conn, buf + len, ((hlen == 0) ? REQ_BIN_PREFIX_LEN :
+			hlen) - len);
+		if (rlen <= 0) {
+			if (len > 0) {
+				log_sockerr(LOG_ERROR, "Client closed the connection before "
+					"sending the entire request header");
+			}
+
+			return 0;
+		}
+		len += rlen;
+	}
+
+	/* Ensure the request wasn't too long. */
+	if (hlen > GL_BINHDR_MAX) {
+		log_printf(LOG_WARNING, "Request header has an unexpected length, "
+			"closing connection.");
+		send_error(conn->sockfd, ERR_CODE_REQ_LONG);
+		return 0;
+	}
+
+	return hlen;
+}
+
+/**
+ * Picks a name for a file being received, asks the user if they want to accept
+ * it, and opens it for writing. Replies to the client in case of a failure.
+ *
+ * When the client only wants to send what changed in a file that we already
+ * have, the existing file is opened as the basis for rebuilding it and the
+ * returned handle is of a temporary file that will later replace it.
+ *
+ * @param conn    Client's connection used to reply.
  * @param reqline Request line object.
+ * @param fname   Returns the name of the file that was opened, allocated from
+ *                the connection's arena.
+ * @param basis   Optional. Returns the handle of the existing file that will be
+ *                updated or NULL if the file is being received in full.
  *
- * @return TRUE if the operation was successful, FALSE otherwise.
+ * @return File handle opened for writing or NULL if the transfer was refused.
  */
-bool process_file_req(const sockfd_t *sockfd, const reqline_t *reqline) {
-	uint8_t buf[RECV_BUF_LEN];
-	char *fname;
-	size_t acclen;
-	ssize_t len;
+FILE *accept_file(conn_t *conn, const reqline_t *reqline, char **fname,
+                  FILE **basis) {
+	char *tmpname;
 	FILE *fh;
-	bool ret;
 
-	/* Initialize some variables. */
-	fh = NULL;
-	ret = true;
+	/* Ensure we have a name to work with. */
+	if ((reqline->name == NULL) || (*reqline->name == '\0')) {
+		log_printf(LOG_ERROR, "File transfer request without a file name");
+		send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+		return NULL;
+	}
 
 	/* Sanitize filename. */
-	fname = strdup(reqline->name);
-	if (fname_sanitize(fname)) {
+	*fname = arena_strdup(&conn->arena, reqline->name);
+	if (*fname == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate string for filename");
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		return NULL;
+	}
+	if (fname_sanitize(*fname)) {
 		log_printf(LOG_INFO, "Filename \"%s\" contained malicious characters "
-			"and was sanitized to \"%s\"", reqline->name, fname);
+			"and was sanitized to \"%s\"", reqline->name, *fname);
 	}
 
-	/* Ensure we are not overwriting any existing files. */
-	while (file_exists(fname)) {
-		char *nf;
-		size_t slen;
+	/* Keep clients away from the files that we use ourselves. */
+	if (fname_reserved(*fname)) {
+		log_printf(LOG_NOTICE, "Refused a transfer to \"%s\", which is a "
+			"name reserved for the server", *fname);
+		goto refuse;
+	}
 
-		/* Check if we are just incrementing an existing prefix. */
-		nf = fname;
-		slen = strlen(fname);
-		if ((slen > 1) && (*nf >= '0') && (*nf < '9') && (nf[1] == '_')) {
-			*nf = (char)(*nf + 1);
-			continue;
+	/* Update the file we already have if the client only sends what changed. */
+	if (basis != NULL)
+		*basis = NULL;
+	if ((basis != NULL) &&
+			(file_req_flags(reqline) & reqline->flags & REQ_FLAG_DELTA) &&
+			file_exists(*fname)) {
+		if (!opts.accept_all &&
+		    !ask_yn("Do you want to update the file \"%s\"?", *fname)) {
+			goto refuse;
 		}
 
-		/* Allocate the new filename string. */
-		nf = (char *)malloc((slen + 4) * sizeof(char));
-		if (nf == NULL) {
-			log_syserr(LOG_CRIT, "Failed to allocate new string for filename");
-			send_error(*sockfd, ERR_CODE_INTERNAL);
-			return false;
+		/* Open the older copy and a temporary file to rebuild it in. */
+		*basis = file_open(*fname, "rb");
+		if (*basis == NULL) {
+			log_printf(LOG_ERROR, "Failed to open file \"%s\" for reading",
+				*fname);
+			goto refuse;
+		}
+		tmpname = delta_temp_fname(&conn->arena, *fname);
+		fh = (tmpname != NULL) ? file_open(tmpname, "w+b") : NULL;
+		if (fh == NULL) {
+			log_printf(LOG_ERROR, "Failed to open temporary file for updating "
+				"\"%s\"", *fname);
+			fclose(*basis);
+			*basis = NULL;
+			goto refuse;
 		}
 
-		/* Build up the new filename and switch them. */
-		sprintf(nf, "1_%s", fname);
-		free(fname);
-		fname = nf;
+		return fh;
+	}
+
+	/* Pick a name that doesn't overwrite any existing files. */
+	if (!names_reserve(&names, &conn->arena, fname)) {
+		log_printf(LOG_ERROR, "Failed to pick a name for file \"%s\"",
+			reqline->name);
+		goto refuse;
 	}
 
 	/* Ask the user if they want to accept the transfer. */
 	if (!opts.accept_all &&
-	    !ask_yn("Do you want to receive the file \"%s\"?", fname)) {
+	    !ask_yn("Do you want to receive the file \"%s\"?", *fname)) {
+		names_release(&names, *fname);
 		goto refuse;
 	}
 
-	/* Open the file for writing. */
-	fh = fopen(fname, "wb");
+	/* Only now put the file in the directory. */
+	fh = names_create(&names, &conn->arena, fname);
 	if (fh == NULL) {
-		log_printf(LOG_ERROR, "Failed to open file \"%s\" for writing", fname);
+		log_printf(LOG_ERROR, "Failed to open file \"%s\" for writing",
+			*fname);
 		goto refuse;
 	}
-	send_continue(*sockfd);
 
-	/* Pipe the contents of the file from the network. */
-	acclen = 0;
-	while ((len = recv(*sockfd, buf, RECV_BUF_LEN, 0)) > 0) {
-		/* Deal with the transfer size. */
-		acclen += len;
-		if (acclen > reqline->size) {
-			fprintf(stderr, "\n");
-			log_printf(LOG_ERROR, "Received file is bigger than expected");
-			goto refuse;
-		}
+	return fh;
 
-		/* Show transfer progress and write to the file. */
-		buffered_progress(fname, acclen, reqline->size);
-		fwrite(buf, sizeof(uint8_t), len, fh);
+refuse:
+	*fname = NULL;
+	send_refused(conn->sockfd);
+	return NULL;
+}
 
-		/* Detect if we have finished transferring the file. */
-		if (acclen == reqline->size) {
-			send_ok(*sockfd);
-			break;
-		}
-	}
+/**
+ * Checks if a file name is reserved for the files that the server keeps for
+ * itself, which a client must never be allowed to write to.
+ *
+ * @param fname Sanitized name of the file.
+ *
+ * @return TRUE if the name is reserved, FALSE otherwise.
+ */
+bool fname_reserved(const char *fname) {
+	size_t len;
 
-	/* Check if the connection ended before the file finished transferring. */
-	if (len <= 0) {
-		fprintf(stderr, "\n");
-		log_sockerr(LOG_ERROR, "The client has closed the connection before "
-			"the file \"%s\" finished transferring", fname);
-		ret = false;
-	} else {
-		fprintf(stderr, "\n");
+	/* File where we keep track of the contents that we have received. */
+	if (strcmp(fname, GL_DEDUP_INDEX) == 0)
+		return true;
+
+	/* Files where we keep the chunks that we have received. */
+	if ((strncmp(fname, GL_CHUNK_INDEX, strlen(GL_CHUNK_INDEX)) == 0) ||
+			(strncmp(fname, GL_CHUNK_DATA, strlen(GL_CHUNK_DATA)) == 0)) {
+		return true;
 	}
 
-	/* Free up resources. */
-	free(fname);
-	fname = NULL;
-	fclose(fh);
-	fh = NULL;
+	/* Temporary files where newer versions of files are rebuilt. */
+	len = strlen(fname);
+	return (len >= (sizeof(DELTA_TEMP_SUFFIX) - 1)) &&
+		(strcmp(fname + len - (sizeof(DELTA_TEMP_SUFFIX) - 1),
+		DELTA_TEMP_SUFFIX) == 0);
+}
 
-	return ret;
+/**
+ * Gets the name of the temporary file where a newer version of a file is
+ * rebuilt before replacing it.
+ *
+ * @param arena Arena to allocate the name from.
+ * @param fname Name of the file that's being updated.
+ *
+ * @return Name of the temporary file or NULL if an error occurred.
+ */
+char *delta_temp_fname(arena_t *arena, const char *fname) {
+	char *tmpname;
+
+	tmpname = (char *)arena_alloc(arena, strlen(fname) +
+		sizeof(DELTA_TEMP_SUFFIX));
+	if (tmpname == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate temporary filename");
+		return NULL;
+	}
+	sprintf(tmpname, "%s%s", fname, DELTA_TEMP_SUFFIX);
 
-refuse:
-	if (fname)
-		free(fname);
-	if (fh)
-		fclose(fh);
-	send_refused(*sockfd);
-	return false;
+	return tmpname;
 }
 
 /**
- * Processes and replies to the client that sent an URL request.
+ * Completes a transfer by reusing the contents of a file that we already have,
+ * either by cloning it or by linking to it.
  *
- * @param sockfd  Client's socket handle used to reply.
- * @param reqline Request line object.
+ * @param fh      Empty file opened for the transfer. May be closed and
+ *                replaced by us, or set to NULL if it couldn't be reopened.
+ * @param fname   Name of the file being received.
+ * @param reqline Request line object with the digest of the contents.
  *
- * @return TRUE if the operation was successful, FALSE otherwise.
+ * @return TRUE if the file already has the requested contents, FALSE if they
+ *         must be transferred.
  */
-bool process_url_req(const sockfd_t *sockfd, const reqline_t *reqline) {
-	const char *url;
-	char *cmd;
+bool dedup_recv(FILE **fh, const char *fname, const reqline_t *reqline) {
+	char *src;
 
-	/* Check if the URL may be malicious and refuse instantly. */
-	url = reqline->name;
-	if (strncmp(url, "file://", 7) == 0) {
-		send_refused(*sockfd);
-		log_printf(LOG_NOTICE, "Blocked malicious URL request for \"%s\"", url);
+	/* Check if we have these contents anywhere. */
+	src = dedup_lookup(&dedup, reqline->digest, reqline->size);
+	if (src == NULL)
 		return false;
-	}
 
-	/* Print out the URL for piping. */
-	printf("%s\n", url);
+	/* Share the contents of the file if the file system allows it. */
+	if (file_clone(*fh, src)) {
+		log_printf(LOG_INFO, "Completed \"%s\" instantly by cloning \"%s\"",
+			fname, src);
+		free(src);
+		return true;
+	}
 
-	/* Open in the OS's default browser. */
-	if (ask_yn("Do you want to open the above URL?")) {
-#ifdef _WIN32
-		/* Windows */
-		LPTSTR szUrl;
-		UnicodeMultiByteToWideChar(url, &szUrl);
-		ShellExecute(NULL, _T("open"), szUrl, NULL, NULL, SW_SHOWNORMAL);
-		free(szUrl);
-		szUrl = NULL;
-		cmd = NULL;
-#else
-		/* UNIX */
-		size_t len;
-#if defined(__APPLE__) || defined(__MACH__)
-		/* Mac OS X */
-		len = 8 + strlen(url);
-		cmd = (char *)malloc(len * sizeof(char));
-		snprintf(cmd, len, "open '%s'", url);
-		cmd[len - 1] = '\0';
-#else
-		/* UNIX / XDG */
-		len = 12 + strlen(url);
-		cmd = (char *)malloc(len * sizeof(char));
-		snprintf(cmd, len, "xdg-open '%s'", url);
-		cmd[len - 1] = '\0';
-#endif /* __APPLE__ || __MACH__ */
+	/* Fall back to having both names point to the same file. */
+	fclose(*fh);
+	*fh = NULL;
+	file_remove(fname);
+	if (file_link(src, fname)) {
+		log_printf(LOG_INFO, "Completed \"%s\" instantly by linking to \"%s\"",
+			fname, src);
+		free(src);
+		return true;
+	}
+	free(src);
 
-		/* Execute open command and free the command line string. */
-		system(cmd);
-		free(cmd);
-#endif /* _WIN32 */
-	} else {
-		/* Reply with refused. */
-		send_refused(*sockfd);
-		return false;
+	/* Go back to receiving the contents. */
+	*fh = file_open(fname, "w+b");
+	if (*fh == NULL) {
+		log_printf(LOG_ERROR, "Failed to open file \"%s\" for writing",
+			fname);
 	}
 
-	/* Send OK and stop processing the request. */
-	send_ok(*sockfd);
-	return true;
+	return false;
 }
 
 /**
- * Processes and replies to the client that sent a text transfer request.
- *
- * @param sockfd  Client's socket handle used to reply.
- * @param reqline Request line object.
+ * Adds a file that has just been received to the index of contents we already
+ * have, as long as its digest matches the one the client sent.
  *
- * @return TRUE if the operation was successful, FALSE otherwise.
+ * @param fname  Name of the file that was received.
+ * @param size   Size of the file.
+ * @param digest Digest of the contents sent by the client.
  */
-bool process_text_req(const sockfd_t *sockfd, const reqline_t *reqline) {
-	uint8_t buf[RECV_BUF_LEN];
-	size_t acclen;
-	ssize_t len;
-	bool ret;
+void dedup_remember(const char *fname, uint64_t size, const uint8_t *digest) {
+	uint8_t actual[REQ_DIGEST_LEN];
+	FILE *fh;
 
-	/* Ask the user if they want to accept the transfer. */
-	if ((reqline->size > RECV_TEXT_THRESHOLD) && !opts.accept_all &&
-	    !ask_yn("Do you want to receive %u bytes of text?", reqline->size)) {
-		send_refused(*sockfd);
-		return false;
+	/* Never trust the client's digest to avoid poisoning the index. */
+	fh = file_open(fname, "rb");
+	if (fh == NULL)
+		return;
+	if (!dedup_digest(fh, size, actual)) {
+		fclose(fh);
+		return;
 	}
+	fclose(fh);
 
-	/* Begin the transfer. */
-	fputs("----------BEGIN TEXT BLOCK----------\n", stderr);
-	fflush(stderr);
-	send_continue(*sockfd);
-	ret = true;
-
-	/* Pipe the text content to stdout. */
-	acclen = 0;
-	while ((len = recv(*sockfd, buf, RECV_BUF_LEN, 0)) > 0) {
-		/* Deal with the transfer size. */
-		acclen += len;
-		if (acclen > reqline->size) {
-			fprintf(stderr, "\n");
-			log_printf(LOG_ERROR, "Received text is bigger than expected");
-			send_refused(*sockfd);
-			return false;
-		}
-
-		/* Show transfer progress and write to the file. */
-		fwrite(buf, sizeof(uint8_t), len, stdout);
-		fflush(stdout);
+	if (memcmp(actual, digest, REQ_DIGEST_LEN) != 0) {
+		log_printf(LOG_WARNING, "Digest of \"%s\" doesn't match the one sent "
+			"by the client", fname);
+		return;
+	}
+	dedup_add(&dedup, actual, fname);
+}
 
-		/* Detect if we have finished transferring the file. */
-		if (acclen == reqline->size) {
-			send_ok(*sockfd);
-			break;
-		}
+/**
+ * Replies to a client with a CONTINUE, letting it know which of the flags it
+ * requested are supported by us.
+ *
+ * @param sockfd    Client's socket handle used to reply.
+ * @param reqline   Request line object.
+ * @param supported Flags that are supported for this request.
+ *
+ * @return Flags that were accepted and must be honored during the transfer.
+ */
+uint16_t reply_continue(const sockfd_t *sockfd, const reqline_t *reqline,
+                        uint16_t supported) {
+	/* Keep the reply compatible with clients that don't know about flags. */
+	if (reqline->flags == 0) {
+		send_continue(*sockfd);
+		return 0;
 	}
 
-	/* End the text block. */
-	if ((acclen > 0) && (buf[acclen - 1] != '\n'))
-		fputc('\n', stderr);
-	fflush(stderr);
-	fputs("-----------END TEXT BLOCK-----------\n", stderr);
+	send_continue_flags(*sockfd, reqline->flags & supported);
+	return reqline->flags & supported;
+}
 
-	/* Check if the connection ended before the file finished transferring. */
-	if (len <= 0) {
+/**
+ * Receives a checksum sent by the client.
+ *
+ * @param conn   Client's connection.
+ * @param crc    Where to store the received checksum.
+ *
+ * @return TRUE if the checksum was received, FALSE otherwise.
+ */
+bool recv_crc(conn_t *conn, uint32_t *crc) {
+	uint8_t buf[CRC32C_LEN];
+
+	if (!conn_recv_all(conn, buf, CRC32C_LEN)) {
 		log_sockerr(LOG_ERROR, "The client has closed the connection before "
-			"the text contents finished transferring");
-		ret = false;
+			"sending the content's checksum");
+		return false;
 	}
+	*crc = crc32c_unpack(buf);
 
-	return ret;
+	return true;
 }
 
 /**
- * Handles the SIGINT interrupt event.
+ * Gets the flags that are supported for a file transfer request.
  *
- * @param sig Signal handle that generated this interrupt.
+ * @param reqline Request line object.
+ *
+ * @return Flags that may be accepted for this request.
+ */
+uint16_t file_req_flags(const reqline_t *reqline) {
+	uint16_t flags;
+
+	/* Only verify files of a known size with reasonably sized leaves. */
+	flags = SUPPORTED_FLAGS;
+	if ((reqline->flags & REQ_FLAG_CHUNKED) ||
+			(reqline->leaf < GL_MERKLE_LEAF_MIN) ||
+			(reqline->leaf > GL_MERKLE_LEAF_MAX)) {
+		flags &= ~REQ_FLAG_MERKLE;
+	}
+
+	/* Stripes are always sent as they are. */
+	if (reqline->flags & REQ_FLAG_STRIPED)
+		flags &= ~COMPRESS_FLAGS;
+
+	/* Only whole files of a known size can be rebuilt from an older copy. */
+	if (reqline->flags & (REQ_FLAG_CHUNKED | REQ_FLAG_STRIPED)) {
+		flags &= ~(REQ_FLAG_DELTA | REQ_FLAG_CDC);
+	} else if (reqline->flags & REQ_FLAG_CDC) {
+		/* Chunks are assembled and verified as they are. */
+		flags &= REQ_FLAG_CDC | REQ_FLAG_DIGEST;
+	}
+
+	return flags;
+}
+
+/**
+ * Verifies a file that has just been received by comparing its Merkle tree with
+ * the client's, walking down from the root to find exactly which pieces are
+ * damaged and asking the client to send only those again. Replies to the
+ * client with the outcome of the verification.
+ *
+ * @param conn   Client's connection.
+ * @param fh     Handle of the file that was received.
+ * @param fname  Name of the file that was received.
+ * @param size   Size of the file.
+ * @param leaf   Size of the leaves of the tree.
+ *
+ * @return TRUE if the file matches the client's, FALSE otherwise.
+ */
+bool merkle_verify_recv(conn_t *conn, FILE *fh, const char *fname,
+                        uint64_t size, uint32_t leaf) {
+	uint8_t root[MERKLE_HASH_LEN];
+	uint8_t *hashes;
+	uint8_t *buf;
+	uint64_t *cur;
+	uint64_t *next;
+	uint64_t ncur;
+	uint64_t nnext;
+	uint64_t i;
+	merkle_t tree;
+	uint8_t level;
+	int attempt;
+	bool ret;
+
+	/* Build our tree while the client sends us the root of theirs. */
+	ret = false;
+	hashes = NULL;
+	buf = NULL;
+	cur = NULL;
+	next = NULL;
+	fflush(fh);
+	if (!merkle_build(&tree, fh, size, leaf, cpu_count())) {
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		return false;
+	}
+	if (!conn_recv_all(conn, root, MERKLE_HASH_LEN)) {
+		log_sockerr(LOG_ERROR, "The client has closed the connection before "
+			"sending the Merkle tree root of \"%s\"", fname);
+		goto cleanup;
+	}
+
+	for (attempt = 0; ; attempt++) {
+		/* Check if we got everything right. */
+		if (memcmp(merkle_root(&tree), root, MERKLE_HASH_LEN) == 0) {
+			send_ok(conn->sockfd);
+			ret = true;
+			break;
+		}
+
+		/* Give up if the damage keeps on coming back. */
+		if (attempt >= GL_MERKLE_RETRIES) {
+			log_printf(LOG_ERROR, "File \"%s\" is still damaged after "
+				"%d attempts to repair it", fname, attempt);
+			send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+			break;
+		}
+
+		/* Allocate the buffers used to walk down the tree. */
+		if (cur == NULL) {
+			cur = (uint64_t *)malloc((size_t)tree.counts[0] * sizeof(uint64_t));
+			next = (uint64_t *)malloc((size_t)tree.counts[0] *
+				sizeof(uint64_t));
+			hashes = (uint8_t *)malloc((size_t)tree.counts[0] *
+				MERKLE_HASH_LEN);
+			buf = (uint8_t *)malloc(leaf);
+			if ((cur == NULL) || (next == NULL) || (hashes == NULL) ||
+					(buf == NULL)) {
+				log_syserr(LOG_CRIT, "Failed to allocate Merkle tree "
+					"verification buffers");
+				send_error(conn->sockfd, ERR_CODE_INTERNAL);
+				break;
+			}
+		}
+
+		/* Walk down the tree following the nodes that don't match. */
+		cur[0] = 0;
+		ncur = 1;
+		for (level = tree.nlevels - 1; level > 0; level--) {
+			/* Ask for the children of the damaged nodes. */
+			nnext = 0;
+			for (i = 0; i < ncur; i++) {
+				next[nnext++] = cur[i] * 2;
+				if (((cur[i] * 2) + 1) < tree.counts[level - 1])
+					next[nnext++] = (cur[i] * 2) + 1;
+			}
+			if (!verify_send(conn->sockfd, VERIFY_OP_HASHES, level - 1, next,
+					(uint32_t)nnext) || !conn_recv_all(conn, hashes,
+					(size_t)nnext * MERKLE_HASH_LEN)) {
+				log_sockerr(LOG_ERROR, "Failed to get the Merkle tree of "
+					"\"%s\" from the client", fname);
+				goto cleanup;
+			}
+
+			/* Keep only the ones that are different from ours. */
+			ncur = 0;
+			for (i = 0; i < nnext; i++) {
+				if (memcmp(merkle_node(&tree, level - 1, next[i]),
+						hashes + (i * MERKLE_HASH_LEN), MERKLE_HASH_LEN) != 0) {
+					cur[ncur++] = next[i];
+				}
+			}
+		}
+		if (ncur == 0) {
+			log_printf(LOG_ERROR, "Merkle tree of \"%s\" doesn't match but "
+				"none of its leaves are damaged", fname);
+			send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+			break;
+		}
+
+		/* Get the damaged pieces again. */
+		log_printf(LOG_WARNING, "Asking for %lu damaged pieces of \"%s\" "
+			"again", (unsigned long)ncur, fname);
+		if (!verify_send(conn->sockfd, VERIFY_OP_RESEND, 0, cur,
+				(uint32_t)ncur)) {
+			goto cleanup;
+		}
+		for (i = 0; i < ncur; i++) {
+			uint32_t len = merkle_leaf_len(&tree, cur[i]);
+
+			if (!conn_recv_all(conn, buf, len)) {
+				log_sockerr(LOG_ERROR, "The client has closed the connection "
+					"before sending the damaged pieces of \"%s\"", fname);
+				goto cleanup;
+			}
+			if (!file_pwrite(fh, buf, len, cur[i] * leaf)) {
+				log_syserr(LOG_ERROR, "Failed to repair file \"%s\"", fname);
+				send_error(conn->sockfd, ERR_CODE_INTERNAL);
+				goto cleanup;
+			}
+		}
+
+		/* Update our tree with the repaired pieces. */
+		if (!merkle_rehash(&tree, fh, cur, ncur)) {
+			send_error(conn->sockfd, ERR_CODE_INTERNAL);
+			break;
+		}
+	}
+
+cleanup:
+	/* Free up resources. */
+	merkle_free(&tree);
+	free(cur);
+	free(next);
+	free(hashes);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * Processes and replies to the client that sent a file transfer request.
+ *
+ * @param conn    Client's connection. Its socket will be set to SOCKERR if
+ *                it was handed over to a striped transfer.
+ * @param reqline Request line object.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+bool process_file_req(conn_t *conn, const reqline_t *reqline) {
+	uint16_t flags;
+	uint32_t crc;
+	uint32_t expected;
+	char *tmpname;
+	char *fname;
+	uint8_t *buf;
+	size_t acclen;
+	ssize_t len;
+	FILE *basis;
+	FILE *fh;
+	bool remember;
+	bool ret;
+
+	/* Refuse stripes that would be too many to keep track of. */
+	if ((reqline->flags & REQ_FLAG_STRIPED) &&
+			((reqline->chunk < GL_STRIPE_CHUNK_MIN) || (reqline->size >
+			((uint64_t)GL_STRIPE_CHUNKS_MAX * reqline->chunk)))) {
+		log_printf(LOG_NOTICE, "Invalid striped transfer request. Ignored.");
+		send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+		return false;
+	}
+
+	/* Get a file to write the contents to. */
+	fh = accept_file(conn, reqline, &fname, &basis);
+	if (fh == NULL)
+		return false;
+	buf = NULL;
+	remember = false;
+	ret = true;
+
+	/* Rebuild the file from the copy we already have. */
+	if (basis != NULL) {
+		reply_continue(&conn->sockfd, reqline, REQ_FLAG_DELTA);
+		ret = recv_delta(conn, fh, basis, fname, reqline);
+		fclose(basis);
+		fclose(fh);
+		fh = NULL;
+
+		/* Replace the older copy with the newer one. */
+		tmpname = delta_temp_fname(&conn->arena, fname);
+		if (ret && ((tmpname == NULL) || !file_replace(tmpname, fname))) {
+			log_syserr(LOG_ERROR, "Failed to replace \"%s\" with its newer "
+				"version", fname);
+			send_error(conn->sockfd, ERR_CODE_INTERNAL);
+			ret = false;
+		}
+		if (ret) {
+			send_ok(conn->sockfd);
+		} else if (tmpname != NULL) {
+			file_remove(tmpname);
+		}
+
+		goto cleanup;
+	}
+
+	/* Reuse the contents if we already have them. */
+	if ((reqline->flags & REQ_FLAG_DIGEST) && !(reqline->flags &
+			REQ_FLAG_CHUNKED)) {
+		if (dedup_recv(&fh, fname, reqline)) {
+			send_ok(conn->sockfd);
+			goto cleanup;
+		} else if (fh == NULL) {
+			send_error(conn->sockfd, ERR_CODE_INTERNAL);
+			ret = false;
+			goto cleanup;
+		}
+
+		remember = true;
+	}
+
+	/* Spread the contents over multiple connections if requested. */
+	if ((reqline->flags & REQ_FLAG_STRIPED) && (reqline->chunk > 0) &&
+			(reqline->size > 0)) {
+		return stripe_xfer_start(conn, reqline, fh, fname);
+	}
+	flags = reply_continue(&conn->sockfd, reqline,
+		file_req_flags(reqline) & ~REQ_FLAG_DELTA);
+
+	/* Assemble the file out of chunks, some of which we may already have. */
+	if (flags & REQ_FLAG_CDC) {
+		ret = recv_cdc(conn, fh, fname, reqline);
+		if (ret)
+			send_ok(conn->sockfd);
+
+		goto cleanup;
+	}
+
+	/* Stream content of unknown length straight to the file. */
+	if ((flags & REQ_FLAG_CHUNKED) && !(flags & COMPRESS_FLAGS)) {
+		ret = recv_chunked(conn, fh, fname, NULL,
+			(flags & REQ_FLAG_CHECKSUM) != 0);
+		if (ret)
+			send_ok(conn->sockfd);
+
+		goto cleanup;
+	}
+
+	/* Decompress the contents as they arrive. */
+	if (flags & COMPRESS_FLAGS) {
+		ret = recv_compressed(conn, fh, fname, reqline, flags, NULL);
+		if (ret && (flags & REQ_FLAG_MERKLE)) {
+			ret = merkle_verify_recv(conn, fh, fname, reqline->size,
+				reqline->leaf);
+		} else if (ret) {
+			send_ok(conn->sockfd);
+		}
+
+		goto cleanup;
+	}
+
+	/* Borrow a buffer only for as long as we are moving the contents. */
+	buf = bufpool_get();
+	if (buf == NULL) {
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		ret = false;
+		goto cleanup;
+	}
+
+	/* Pipe the contents of the file from the network. */
+	acclen = 0;
+	crc = 0;
+	len = 0;
+	while (acclen < reqline->size) {
+		/* Never read past the contents, there might be a checksum after it. */
+		len = conn_recv(conn, buf, ((reqline->size - acclen) > GL_IOBUF_LEN) ?
+			GL_IOBUF_LEN : (reqline->size - acclen));
+		if (len <= 0)
+			break;
+		acclen += len;
+
+		/* Show transfer progress and write to the file. */
+		buffered_progress(fname, acclen, reqline->size);
+		fwrite(buf, sizeof(uint8_t), len, fh);
+		if (flags & REQ_FLAG_CHECKSUM)
+			crc = crc32c(crc, buf, len);
+	}
+	fprintf(stderr, "\n");
+	bufpool_put(buf);
+	buf = NULL;
+
+	/* Check if the connection ended before the file finished transferring. */
+	if (acclen < reqline->size) {
+		log_sockerr(LOG_ERROR, "The client has closed the connection before "
+			"the file \"%s\" finished transferring", fname);
+		ret = false;
+		goto cleanup;
+	}
+
+	/* Find and repair any damaged pieces of the file. */
+	if (flags & REQ_FLAG_MERKLE) {
+		ret = merkle_verify_recv(conn, fh, fname, reqline->size,
+			reqline->leaf);
+		goto cleanup;
+	}
+
+	/* Ensure the contents are exactly what the client sent. */
+	if (flags & REQ_FLAG_CHECKSUM) {
+		if (!recv_crc(conn, &expected)) {
+			ret = false;
+			goto cleanup;
+		}
+
+		if (crc != expected) {
+			log_printf(LOG_ERROR, "Checksum mismatch for file \"%s\" "
+				"(expected %08X, got %08X)", fname, expected, crc);
+			send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+			ret = false;
+			goto cleanup;
+		}
+	}
+	send_ok(conn->sockfd);
+
+cleanup:
+	/* Free up resources. */
+	bufpool_put(buf);
+	if (fh != NULL) {
+		fclose(fh);
+		fh = NULL;
+	}
+	if (ret && remember)
+		dedup_remember(fname, reqline->size, reqline->digest);
+
+	return ret;
+}
+
+/**
+ * Processes and replies to the client that sent an URL request.
+ *
+ * @param sockfd  Client's socket handle used to reply.
+ * @param reqline Request line object.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+bool process_url_req(const sockfd_t *sockfd, const reqline_t *reqline) {
+	const char *url;
+	char *cmd;
+
+	/* Check if the URL may be malicious and refuse instantly. */
+	url = reqline->name;
+	if (strncmp(url, "file://", 7) == 0) {
+		send_refused(*sockfd);
+		log_printf(LOG_NOTICE, "Blocked malicious URL request for \"%s\"", url);
+		return false;
+	}
+
+	/* Print out the URL for piping. */
+	printf("%s\n", url);
+
+	/* Open in the OS's default browser. */
+	if (ask_yn("Do you want to open the above URL?")) {
+#ifdef _WIN32
+		/* Windows */
+		LPTSTR szUrl;
+		UnicodeMultiByteToWideChar(url, &szUrl);
+		ShellExecute(NULL, _T("open"), szUrl, NULL, NULL, SW_SHOWNORMAL);
+		free(szUrl);
+		szUrl = NULL;
+		cmd = NULL;
+#else
+		/* UNIX */
+		size_t len;
+#if defined(__APPLE__) || defined(__MACH__)
+		/* Mac OS X */
+		len = 8 + strlen(url);
+		cmd = (char *)malloc(len * sizeof(char));
+		snprintf(cmd, len, "open '%s'", url);
+		cmd[len - 1] = '\0';
+#else
+		/* UNIX / XDG */
+		len = 12 + strlen(url);
+		cmd = (char *)malloc(len * sizeof(char));
+		snprintf(cmd, len, "xdg-open '%s'", url);
+		cmd[len - 1] = '\0';
+#endif /* __APPLE__ || __MACH__ */
+
+		/* Execute open command and free the command line string. */
+		system(cmd);
+		free(cmd);
+#endif /* _WIN32 */
+	} else {
+		/* Reply with refused. */
+		send_refused(*sockfd);
+		return false;
+	}
+
+	/* Send OK and stop processing the request. */
+	send_ok(*sockfd);
+	return true;
+}
+
+/**
+ * Processes and replies to the client that sent a text transfer request.
+ *
+ * @param conn    Client's connection used to reply.
+ * @param reqline Request line object.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+bool process_text_req(conn_t *conn, const reqline_t *reqline) {
+	uint8_t buf[RECV_BUF_LEN];
+	uint16_t flags;
+	size_t acclen;
+	ssize_t len;
+	bool ret;
+
+	/* Ask the user if they want to accept the transfer. */
+	if (reqline->flags & REQ_FLAG_CHUNKED) {
+		if (!opts.accept_all &&
+		    !ask_yn("Do you want to receive a text stream?")) {
+			send_refused(conn->sockfd);
+			return false;
+		}
+	} else if ((reqline->size > RECV_TEXT_THRESHOLD) && !opts.accept_all &&
+	    !ask_yn("Do you want to receive %u bytes of text?", reqline->size)) {
+		send_refused(conn->sockfd);
+		return false;
+	}
+
+	/* Begin the transfer. */
+	fputs("----------BEGIN TEXT BLOCK----------\n", stderr);
+	fflush(stderr);
+	ret = true;
+
+	/* Stream text of unknown length straight to stdout. */
+	if (reqline->flags & REQ_FLAG_CHUNKED) {
+		int last;
+
+		flags = reply_continue(&conn->sockfd, reqline,
+			SUPPORTED_FLAGS & ~REQ_FLAG_MERKLE);
+		if (flags & COMPRESS_FLAGS) {
+			ret = recv_compressed(conn, stdout, NULL, reqline, flags, &last);
+		} else {
+			ret = recv_chunked(conn, stdout, NULL, &last,
+				(flags & REQ_FLAG_CHECKSUM) != 0);
+		}
+		if (ret)
+			send_ok(conn->sockfd);
+
+		/* End the text block. */
+		if ((last != EOF) && (last != '\n'))
+			fputc('\n', stderr);
+		fflush(stderr);
+		fputs("-----------END TEXT BLOCK-----------\n", stderr);
+
+		return ret;
+	}
+
+	/* Pipe the text content to stdout. */
+	reply_continue(&conn->sockfd, reqline, SUPPORTED_FLAGS &
+		~(REQ_FLAG_CHECKSUM | REQ_FLAG_MERKLE | COMPRESS_FLAGS));
+	acclen = 0;
+	while ((len = conn_recv(conn, buf, RECV_BUF_LEN)) > 0) {
+		/* Deal with the transfer size. */
+		acclen += len;
+		if (acclen > reqline->size) {
+			fprintf(stderr, "\n");
+			log_printf(LOG_ERROR, "Received text is bigger than expected");
+			send_refused(conn->sockfd);
+			return false;
+		}
+
+		/* Show transfer progress and write to the file. */
+		fwrite(buf, sizeof(uint8_t), len, stdout);
+		fflush(stdout);
+
+		/* Detect if we have finished transferring the file. */
+		if (acclen == reqline->size) {
+			send_ok(conn->sockfd);
+			break;
+		}
+	}
+
+	/* End the text block. */
+	if ((acclen > 0) && (buf[acclen - 1] != '\n'))
+		fputc('\n', stderr);
+	fflush(stderr);
+	fputs("-----------END TEXT BLOCK-----------\n", stderr);
+
+	/* Check if the connection ended before the file finished transferring. */
+	if (len <= 0) {
+		log_sockerr(LOG_ERROR, "The client has closed the connection before "
+			"the text contents finished transferring");
+		ret = false;
+	}
+
+	return ret;
+}
+
+/**
+ * Processes and replies to the client that wants to synchronize a directory
+ * with us. The client's manifest is compared with our copy of the directory as
+ * it arrives, the client is told which of its files we want, and those are
+ * then received in a single stream.
+ *
+ * @param conn    Client's connection used to reply.
+ * @param reqline Request line object.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+bool process_sync_req(conn_t *conn, const reqline_t *reqline) {
+	uint8_t hdr[REQ_SYNC_HDR_LEN];
+	char lastdir[GL_SYNC_PATH_MAX];
+	char path[GL_SYNC_PATH_MAX];
+	uint8_t *want;
+	uint8_t *pack;
+	uint64_t count;
+	uint64_t nwant;
+	uint64_t nrecv;
+	uint64_t nfail;
+	uint64_t size;
+	uint64_t mtime;
+	uint16_t flags;
+	uint32_t len;
+	syncop_t op;
+	bool stored;
+	bool dir;
+	bool ret;
+
+	/* The directory must be created right where we are. */
+	want = NULL;
+	pack = NULL;
+	ret = false;
+	if ((reqline->name == NULL) || !manifest_path_valid(reqline->name) ||
+			(strchr(reqline->name, '/') != NULL)) {
+		log_printf(LOG_ERROR, "Directory synchronization request without a "
+			"valid directory name");
+		send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+		return false;
+	}
+	if (path_stat(reqline->name, &dir, &size, &mtime) && !dir) {
+		log_printf(LOG_ERROR, "Can't synchronize \"%s\" since it isn't a "
+			"directory", reqline->name);
+		send_refused(conn->sockfd);
+		return false;
+	}
+
+	/* Ask the user if they want to accept the transfer. */
+	if (!opts.accept_all &&
+	    !ask_yn("Do you want to synchronize the directory \"%s\"?",
+	    reqline->name)) {
+		send_refused(conn->sockfd);
+		return false;
+	}
+	if (!dir_create(reqline->name)) {
+		log_syserr(LOG_ERROR, "Failed to create directory \"%s\"",
+			reqline->name);
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		return false;
+	}
+	flags = reply_continue(&conn->sockfd, reqline, REQ_FLAG_CHECKSUM);
+
+	/* Find out which files we're missing and let the client know. */
+	want = sync_diff(conn, reqline->name, &count, &nwant);
+	if (want == NULL)
+		return false;
+	if (!sync_send(conn->sockfd, SYNC_OP_WANT, (uint32_t)nwant, count, 0, want,
+			(size_t)((count + 7) / 8))) {
+		log_sockerr(LOG_ERROR, "Failed to send the list of wanted files");
+		goto cleanup;
+	}
+	log_printf(LOG_INFO, "Client has %lu files of which %lu are new or changed",
+		(unsigned long)count, (unsigned long)nwant);
+
+	/* Receive the files. */
+	lastdir[0] = '\0';
+	nrecv = 0;
+	nfail = 0;
+	while (true) {
+		if (!conn_recv_all(conn, hdr, REQ_SYNC_HDR_LEN))
+			goto closed;
+		if (!sync_parse(hdr, &op, &len, &size, &mtime))
+			goto invalid;
+		if (op == SYNC_OP_END)
+			break;
+
+		/* Unpack small files that were sent together. */
+		if (op == SYNC_OP_PACK) {
+			if ((size > GL_SYNC_PACK_SIZE) || (len == 0))
+				goto invalid;
+			if (pack == NULL) {
+				pack = (uint8_t *)malloc(GL_SYNC_PACK_SIZE);
+				if (pack == NULL) {
+					log_syserr(LOG_CRIT, "Failed to allocate pack buffer");
+					send_error(conn->sockfd, ERR_CODE_INTERNAL);
+					goto cleanup;
+				}
+			}
+			if (!sync_recv_pack(conn, reqline->name, len, size,
+					(flags & REQ_FLAG_CHECKSUM) != 0, pack, lastdir, &nrecv,
+					&nfail)) {
+				goto closed;
+			}
+
+			continue;
+		}
+
+		/* Get the path of the file. */
+		if ((op != SYNC_OP_FILE) || (len == 0) || (len >= GL_SYNC_PATH_MAX))
+			goto invalid;
+		if (!conn_recv_all(conn, path, len))
+			goto closed;
+		path[len] = '\0';
+		if ((strlen(path) != len) || !manifest_path_valid(path))
+			goto invalid;
+
+		/* Store its contents. */
+		if (!sync_recv_file(conn, reqline->name, path, size, mtime,
+				(flags & REQ_FLAG_CHECKSUM) != 0, lastdir, &stored)) {
+			goto closed;
+		}
+		if (stored) {
+			nrecv++;
+		} else {
+			nfail++;
+		}
+	}
+
+	/* Let the client know how it went. */
+	log_printf(LOG_INFO, "Synchronized %lu files in \"%s\"",
+		(unsigned long)nrecv, reqline->name);
+	if (nfail > 0) {
+		log_printf(LOG_ERROR, "Failed to receive %lu files",
+			(unsigned long)nfail);
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		goto cleanup;
+	}
+	send_ok(conn->sockfd);
+	ret = true;
+	goto cleanup;
+
+invalid:
+	log_printf(LOG_ERROR, "Received an invalid directory synchronization "
+		"frame");
+	send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+	goto cleanup;
+
+closed:
+	log_sockerr(LOG_ERROR, "The client has closed the connection before the "
+		"directory \"%s\" finished synchronizing", reqline->name);
+
+cleanup:
+	free(want);
+	free(pack);
+
+	return ret;
+}
+
+/**
+ * Compares the manifest sent by the client with our copy of a directory as it
+ * arrives, only ever holding the current entry of each side in memory.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param conn   Client's connection.
+ * @param dname  Directory being synchronized.
+ * @param count  Returns the number of files listed by the client.
+ * @param nwant  Returns the number of files that we want.
+ *
+ * @return Bitmap with a bit set for each file of the manifest that's new or
+ *         changed, or NULL if an error occurred.
+ */
+uint8_t *sync_diff(conn_t *conn, const char *dname, uint64_t *count,
+                   uint64_t *nwant) {
+	uint8_t digest[REQ_DIGEST_LEN];
+	manifest_codec_t codec;
+	manifest_walk_t walk;
+	manifest_entry_t remote;
+	manifest_entry_t local;
+	uint8_t *want;
+	uint8_t *tmp;
+	size_t wantlen;
+	size_t newlen;
+	bool changed;
+	bool have;
+	bool end;
+	FILE *fh;
+	int cmp;
+
+	/* Start walking through our copy of the directory. */
+	if (!manifest_walk_open(&walk, dname)) {
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		return NULL;
+	}
+	have = manifest_walk_next(&walk, &local);
+	manifest_codec_init(&codec);
+	*count = 0;
+	*nwant = 0;
+	wantlen = 0;
+	want = NULL;
+
+	while (true) {
+		/* Get the next file listed by the client. */
+		if (!manifest_decode(&codec, sync_read, conn, &remote, &end)) {
+			log_sockerr(LOG_ERROR, "Failed to receive the manifest of the "
+				"client");
+			send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+			goto failed;
+		}
+		if (end)
+			break;
+
+		/* Make room for its bit. */
+		if ((*count / 8) >= wantlen) {
+			newlen = (wantlen == 0) ? 1024 : (wantlen * 2);
+			tmp = (uint8_t *)realloc(want, newlen);
+			if (tmp == NULL) {
+				log_syserr(LOG_CRIT, "Failed to allocate list of wanted files");
+				send_error(conn->sockfd, ERR_CODE_INTERNAL);
+				goto failed;
+			}
+			memset(tmp + wantlen, 0, newlen - wantlen);
+			want = tmp;
+			wantlen = newlen;
+		}
+
+		/* Catch up with the client in our copy. */
+		cmp = -1;
+		while (have && ((cmp = manifest_cmp(local.path, remote.path)) < 0))
+			have = manifest_walk_next(&walk, &local);
+
+		/* Check if our copy is any different. */
+		changed = !have || (cmp != 0) || (local.size != remote.size);
+		if (!changed && remote.hashed) {
+			fh = file_open(walk.path, "rb");
+			changed = (fh == NULL) || !dedup_digest(fh, local.size, digest) ||
+				(memcmp(digest, remote.digest, REQ_DIGEST_LEN) != 0);
+			if (fh != NULL)
+				fclose(fh);
+		} else if (!changed) {
+			changed = local.mtime != remote.mtime;
+		}
+		if (changed) {
+			want[*count / 8] |= (uint8_t)(1 << (*count % 8));
+			(*nwant)++;
+		}
+		(*count)++;
+	}
+
+	/* Always give back something even if the client has no files. */
+	if (want == NULL)
+		want = (uint8_t *)calloc(1, 1);
+	manifest_walk_close(&walk);
+
+	return want;
+
+failed:
+	manifest_walk_close(&walk);
+	free(want);
+
+	return NULL;
+}
+
+/**
+ * Receives a file that's part of a directory synchronization, replacing our
+ * copy of it only once it has been entirely received and verified.
+ *
+ * @param conn      Client's connection.
+ * @param dname     Directory being synchronized.
+ * @param path      Path of the file inside the directory.
+ * @param size      Size of the file.
+ * @param mtime     Modification time of the file in nanoseconds since the Unix
+ *                  epoch.
+ * @param checksums Is the file followed by a checksum?
+ * @param lastdir   Last directory that was created inside the directory.
+ * @param stored    Returns TRUE if the file was stored, FALSE if it had to be
+ *                  discarded.
+ *
+ * @return TRUE if the file was received, FALSE if the connection was closed.
+ */
+bool sync_recv_file(conn_t *conn, const char *dname, const char *path,
+                    uint64_t size, uint64_t mtime, bool checksums,
+                    char *lastdir, bool *stored) {
+	arena_mark_t mark;
+	uint8_t *buf;
+	char *fname;
+	char *tmpname;
+	uint64_t acclen;
+	uint32_t expected;
+	uint32_t crc;
+	size_t len;
+	FILE *fh;
+
+	/* Receive the contents even if we can't store them. */
+	buf = bufpool_get();
+	if (buf == NULL)
+		return false;
+	mark = arena_mark(&conn->arena);
+	fh = sync_open(&conn->arena, dname, path, lastdir, &fname, &tmpname);
+	acclen = 0;
+	crc = 0;
+	buffered_progress(path, 0, (size_t)size);
+	while (acclen < size) {
+		len = ((size - acclen) > GL_IOBUF_LEN) ? GL_IOBUF_LEN :
+			(size_t)(size - acclen);
+		if (!conn_recv_all(conn, buf, len))
+			goto closed;
+		if (checksums)
+			crc = crc32c(crc, buf, len);
+		if ((fh != NULL) && (fwrite(buf, sizeof(uint8_t), len, fh) != len)) {
+			log_syserr(LOG_ERROR, "Failed to write to file \"%s\"", tmpname);
+			fclose(fh);
+			fh = NULL;
+		}
+
+		acclen += len;
+		buffered_progress(path, (size_t)acclen, (size_t)size);
+	}
+	fprintf(stderr, "\n");
+	bufpool_put(buf);
+	buf = NULL;
+	if (checksums && !recv_crc(conn, &expected))
+		goto closed;
+
+	/* Only replace our copy with the one that's been verified. */
+	if (checksums && (crc != expected))
+		log_printf(LOG_ERROR, "Checksum mismatch for \"%s\"", path);
+	*stored = sync_finish(fh, fname, tmpname, mtime,
+		!checksums || (crc == expected));
+	arena_rewind(&conn->arena, mark);
+
+	return true;
+
+closed:
+	fprintf(stderr, "\n");
+	bufpool_put(buf);
+	sync_finish(fh, fname, tmpname, mtime, false);
+	arena_rewind(&conn->arena, mark);
+	*stored = false;
+
+	return false;
+}
+
+/**
+ * Receives a pack of small files that's part of a directory synchronization,
+ * verifying all of them at once before creating them.
+ *
+ * @param conn      Client's connection.
+ * @param dname     Directory being synchronized.
+ * @param count     Number of files in the pack.
+ * @param size      Length of the pack.
+ * @param checksums Is the pack followed by a checksum?
+ * @param pack      Buffer of GL_SYNC_PACK_SIZE bytes to receive the pack into.
+ * @param lastdir   Last directory that was created inside the directory.
+ * @param nrecv     Incremented for each file that was stored.
+ * @param nfail     Incremented for each file that had to be discarded.
+ *
+ * @return TRUE if the pack was received, FALSE if the connection was closed.
+ */
+bool sync_recv_pack(conn_t *conn, const char *dname, uint32_t count,
+                    uint64_t size, bool checksums, uint8_t *pack,
+                    char *lastdir, uint64_t *nrecv, uint64_t *nfail) {
+	char path[GL_SYNC_PATH_MAX];
+	const uint8_t *buf;
+	const uint8_t *end;
+	arena_mark_t mark;
+	uint32_t expected;
+	uint32_t fsize;
+	uint64_t mtime;
+	uint16_t len;
+	char *fname;
+	char *tmpname;
+	FILE *fh;
+	bool ok;
+
+	/* Get the entire pack and make sure it's intact. */
+	if (!conn_recv_all(conn, pack, (size_t)size))
+		return false;
+	if (checksums) {
+		if (!recv_crc(conn, &expected))
+			return false;
+		if (crc32c(0, pack, (size_t)size) != expected) {
+			log_printf(LOG_ERROR, "Checksum mismatch for a pack of %u files",
+				count);
+			*nfail += count;
+			return true;
+		}
+	}
+
+	/* Create each of the files. */
+	buf = pack;
+	end = pack + size;
+	for (; count > 0; count--) {
+		/* Get the path of the file and make sure the contents are there. */
+		if (((size_t)(end - buf) < REQ_SYNC_ENTRY_LEN) ||
+				!sync_entry_parse(buf, &len, &fsize, &mtime) ||
+				(len >= GL_SYNC_PATH_MAX) ||
+				((size_t)(end - buf) < (REQ_SYNC_ENTRY_LEN + (size_t)len +
+				fsize))) {
+			log_printf(LOG_ERROR, "Received an invalid pack of files");
+			*nfail += count;
+			return true;
+		}
+		memcpy(path, buf + REQ_SYNC_ENTRY_LEN, len);
+		path[len] = '\0';
+		buf += REQ_SYNC_ENTRY_LEN + len;
+		if ((strlen(path) != len) || !manifest_path_valid(path)) {
+			log_printf(LOG_ERROR, "Received an invalid path in a pack of "
+				"files");
+			*nfail += count;
+			return true;
+		}
+
+		/* Write its contents in one go. */
+		mark = arena_mark(&conn->arena);
+		fh = sync_open(&conn->arena, dname, path, lastdir, &fname, &tmpname);
+		ok = (fh != NULL) && (fwrite(buf, sizeof(uint8_t), fsize, fh) ==
+			fsize);
+		if ((fh != NULL) && !ok)
+			log_syserr(LOG_ERROR, "Failed to write to file \"%s\"", tmpname);
+		if (sync_finish(fh, fname, tmpname, mtime, ok)) {
+			(*nrecv)++;
+		} else {
+			(*nfail)++;
+		}
+		arena_rewind(&conn->arena, mark);
+		buf += fsize;
+	}
+
+	return true;
+}
+
+/**
+ * Opens the temporary file where a file that's part of a directory
+ * synchronization is received, creating the directories leading up to it.
+ *
+ * @param arena   Arena to allocate the names of the files from.
+ * @param dname   Directory being synchronized.
+ * @param path    Path of the file inside the directory.
+ * @param lastdir Last directory that was created inside the directory. Files
+ *                usually arrive in batches that share it, so it's only
+ *                created once.
+ * @param fname   Returns the name of the file, or NULL if it couldn't be
+ *                allocated.
+ * @param tmpname Returns the name of the temporary file, or NULL if it
+ *                couldn't be allocated.
+ *
+ * @return Temporary file opened for writing or NULL if an error occurred.
+ *
+ * @see sync_finish
+ */
+FILE *sync_open(arena_t *arena, const char *dname, const char *path,
+                char *lastdir, char **fname, char **tmpname) {
+	const char *last;
+	char *sep;
+	size_t dlen;
+	size_t plen;
+	FILE *fh;
+
+	/* Build up the paths of the file and where it's received. */
+	dlen = strlen(dname);
+	*fname = (char *)arena_alloc(arena, dlen + strlen(path) + 2);
+	*tmpname = (char *)arena_alloc(arena, dlen + strlen(path) +
+		sizeof(SYNC_TEMP_SUFFIX) + 1);
+	if ((*fname == NULL) || (*tmpname == NULL)) {
+		log_syserr(LOG_CRIT, "Failed to allocate synchronized file name");
+		return NULL;
+	}
+	sprintf(*fname, "%s/%s", dname, path);
+	sprintf(*tmpname, "%s%s", *fname, SYNC_TEMP_SUFFIX);
+
+	/* Create the directories leading up to the file if we haven't yet. */
+	last = strrchr(path, '/');
+	plen = (last != NULL) ? (size_t)(last - path) : 0;
+	if ((plen > 0) && ((strlen(lastdir) != plen) ||
+			(memcmp(lastdir, path, plen) != 0))) {
+		lastdir[0] = '\0';
+		for (sep = strchr(*fname + dlen + 1, '/'); sep != NULL;
+				sep = strchr(sep + 1, '/')) {
+			*sep = '\0';
+			if (!dir_create(*fname)) {
+				log_syserr(LOG_ERROR, "Failed to create directory \"%s\"",
+					*fname);
+				*sep = '/';
+				return NULL;
+			}
+			*sep = '/';
+		}
+
+		memcpy(lastdir, path, plen);
+		lastdir[plen] = '\0';
+	}
+
+	/* Open the temporary file. */
+	fh = file_open(*tmpname, "wb");
+	if (fh == NULL) {
+		log_syserr(LOG_ERROR, "Failed to open file \"%s\" for writing",
+			*tmpname);
+	}
+
+	return fh;
+}
+
+/**
+ * Finishes receiving a file that's part of a directory synchronization,
+ * replacing our copy of it with the temporary file if it was received.
+ *
+ * @param fh      Temporary file opened by sync_open. May be NULL. Will be
+ *                closed by us.
+ * @param fname   Name of the file.
+ * @param tmpname Name of the temporary file.
+ * @param mtime   Modification time of the file in nanoseconds since the Unix
+ *                epoch.
+ * @param ok      Was the file entirely received and verified?
+ *
+ * @return TRUE if the file was stored, FALSE otherwise.
+ *
+ * @see sync_open
+ */
+bool sync_finish(FILE *fh, const char *fname, const char *tmpname,
+                 uint64_t mtime, bool ok) {
+	bool stored;
+
+	/* Close the temporary file. */
+	stored = false;
+	if (fh != NULL) {
+		if (fclose(fh) != 0) {
+			log_syserr(LOG_ERROR, "Failed to write to file \"%s\"", tmpname);
+			ok = false;
+		}
+
+		/* Replace our copy of the file. */
+		if (ok && !file_replace(tmpname, fname)) {
+			log_syserr(LOG_ERROR, "Failed to replace \"%s\"", fname);
+			ok = false;
+		}
+		if (!ok)
+			file_remove(tmpname);
+		stored = ok;
+	}
+
+	/* Keep the modification time so that the file isn't sent again. */
+	if (stored && !file_set_mtime(fname, mtime)) {
+		log_syserr(LOG_WARNING, "Failed to set the modification time of "
+			"\"%s\"", fname);
+	}
+
+	return stored;
+}
+
+/**
+ * Reads a part of a manifest sent by the client.
+ *
+ * @param arg Client's connection.
+ * @param buf Buffer where the bytes will be stored.
+ * @param len Number of bytes to read.
+ *
+ * @return TRUE if all the bytes were read, FALSE otherwise.
+ */
+bool sync_read(void *arg, void *buf, size_t len) {
+	return conn_recv_all((conn_t *)arg, buf, len);
+}
+
+/**
+ * Receives content sent using the chunked transfer encoding and writes it to a
+ * file as it arrives.
+ *
+ * @param conn      Client's connection.
+ * @param fh        File handle where the content will be written to.
+ * @param name      Name to display in the transfer progress. Set to NULL to
+ *                  disable the progress display and flush every write instead.
+ * @param last      Optional. Returns the last byte received or EOF if nothing
+ *                  was received.
+ * @param checksums Are the chunks followed by checksums?
+ *
+ * @return TRUE if the content was entirely received, FALSE otherwise.
+ */
+bool recv_chunked(conn_t *conn, FILE *fh, const char *name,
+                  int *last, bool checksums) {
+	chunkdec_t dec;
+	uint8_t *buf;
+	size_t acclen;
+	ssize_t len;
+	bool ret;
+
+	/* Initialize some variables. */
+	buf = bufpool_get();
+	if (buf == NULL) {
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		return false;
+	}
+	chunkdec_init(&dec, checksums);
+	acclen = 0;
+	if (last != NULL)
+		*last = EOF;
+
+	/* Decode the chunks as they come from the network. */
+	while (!dec.done && ((len = conn_recv(conn, buf, GL_IOBUF_LEN)) > 0)) {
+		const uint8_t *cur;
+		size_t left;
+
+		cur = buf;
+		left = len;
+		while ((left > 0) && !dec.done) {
+			const uint8_t *data;
+			size_t dlen;
+
+			/* Get the next slice of content. */
+			if (!chunkdec_feed(&dec, &cur, &left, &data, &dlen)) {
+				if (name != NULL)
+					fprintf(stderr, "\n");
+				send_error(conn->sockfd, (dec.mismatch) ? ERR_CODE_CHECKSUM :
+					ERR_CODE_REQ_BAD);
+				ret = false;
+				goto cleanup;
+			}
+			if (dlen == 0)
+				continue;
+
+			/* Write the content out. */
+			fwrite(data, sizeof(uint8_t), dlen, fh);
+			acclen += dlen;
+			if (last != NULL)
+				*last = data[dlen - 1];
+			if (name != NULL) {
+				buffered_progress(name, acclen, SIZE_UNKNOWN);
+			} else {
+				fflush(fh);
+			}
+		}
+
+		/* Ensure the client didn't send anything after the terminator. */
+		if (left > 0) {
+			if (name != NULL)
+				fprintf(stderr, "\n");
+			log_printf(LOG_ERROR, "Client sent data after the end of the "
+				"chunked content");
+			send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+			ret = false;
+			goto cleanup;
+		}
+	}
+
+	/* Check if the connection ended before the content finished. */
+	if (name != NULL) {
+		buffered_progress(name, acclen, acclen);
+		fprintf(stderr, "\n");
+	}
+	ret = true;
+	if (!dec.done) {
+		log_sockerr(LOG_ERROR, "The client has closed the connection before "
+			"the chunked content finished transferring");
+		ret = false;
+	}
+
+cleanup:
+	bufpool_put(buf);
+	return ret;
+}
+
+/**
+ * Receives content that was compressed in blocks, decompressing them in
+ * parallel and writing each of them to a file in order as they're done.
+ *
+ * @param conn    Client's connection.
+ * @param fh      File handle where the content will be written to.
+ * @param name    Name to display in the transfer progress. Set to NULL to
+ *                disable the progress display and flush every write instead.
+ * @param reqline Request line object.
+ * @param flags   Request flags that were accepted for this transfer.
+ * @param last    Optional. Returns the last byte received or EOF if nothing
+ *                was received.
+ *
+ * @return TRUE if the content was entirely received, FALSE otherwise.
  */
-void sigint_handler(int sig) {
-#ifdef _DEBUG
-	log_printf(LOG_INFO, "Received a SIGINT");
-#endif /* _DEBUG */
+bool recv_compressed(conn_t *conn, FILE *fh, const char *name,
+                     const reqline_t *reqline, uint16_t flags, int *last) {
+	uint8_t hdr[COMPRESS_HDR_LEN];
+	compblock_t *block;
+	compmethod_t method;
+	comppool_t pool;
+	uint32_t rawlen;
+	uint32_t len;
+	uint32_t expected;
+	uint32_t crc;
+	size_t fsize;
+	size_t acclen;
+	size_t pending;
+	size_t inlen;
+	bool checksums;
+	bool end;
+	bool ret;
 
-	/* Stop our server. */
-	server_stop();
+	/* Initialize some variables. */
+	fsize = (reqline->flags & REQ_FLAG_CHUNKED) ? SIZE_UNKNOWN : reqline->size;
+	checksums = (flags & REQ_FLAG_CHECKSUM) && !(flags & REQ_FLAG_MERKLE);
+	acclen = 0;
+	pending = 0;
+	inlen = 0;
+	crc = 0;
+	end = false;
+	ret = false;
+	if (last != NULL)
+		*last = EOF;
+
+	/* Get the workers ready. */
+	if (!comppool_init(&pool, true, COMPRESS_NONE, GL_COMPRESS_BLOCK,
+			opts.threads)) {
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		return false;
+	}
+
+	while (true) {
+		/* Write out the oldest block if it's done or if we can't do more. Text
+		 * is written out as soon as possible since it may be interactive. */
+		block = comppool_next(&pool, end || (name == NULL) ||
+			(comppool_get(&pool) == NULL));
+		if (block != NULL) {
+			if (!block->ok) {
+				log_printf(LOG_ERROR, "Received a damaged compressed block");
+				send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+				goto cleanup;
+			}
+
+			/* Write the content out. */
+			log_printf(LOG_DEBUG, "Block of %lu bytes decompressed from %lu",
+				(unsigned long)block->outlen, (unsigned long)block->inlen);
+			fwrite(block->out, sizeof(uint8_t), block->outlen, fh);
+			if (checksums)
+				crc = crc32c(crc, block->out, block->outlen);
+			acclen += block->outlen;
+			if (last != NULL)
+				*last = block->out[block->outlen - 1];
+			if (name != NULL) {
+				buffered_progress(name, acclen, fsize);
+			} else {
+				fflush(fh);
+			}
+
+			comppool_release(&pool);
+			continue;
+		} else if (end) {
+			break;
+		}
+
+		/* Get the next block. */
+		if (!conn_recv_all(conn, hdr, COMPRESS_HDR_LEN))
+			goto closed;
+		if (!compress_frame_parse(hdr, &method, &rawlen, &len)) {
+			log_printf(LOG_ERROR, "Received an invalid compressed block");
+			send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+			goto cleanup;
+		}
+		inlen += COMPRESS_HDR_LEN + len;
+		if (rawlen == 0) {
+			end = true;
+			continue;
+		}
+		if ((fsize != SIZE_UNKNOWN) && (rawlen > (fsize - pending))) {
+			log_printf(LOG_ERROR, "Received content is bigger than expected");
+			send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+			goto cleanup;
+		}
+		pending += rawlen;
+
+		/* Hand it over to the workers, making room if it's unusually large. */
+		block = comppool_get(&pool);
+		if (!comppool_reserve(block, rawlen)) {
+			log_syserr(LOG_CRIT, "Failed to allocate decompression buffers");
+			send_error(conn->sockfd, ERR_CODE_INTERNAL);
+			goto cleanup;
+		}
+		if (!conn_recv_all(conn, block->in, len))
+			goto closed;
+		block->method = method;
+		block->inlen = len;
+		block->outlen = rawlen;
+		comppool_submit(&pool);
+	}
+	if (name != NULL) {
+		buffered_progress(name, acclen, acclen);
+		fprintf(stderr, "\n");
+		log_printf(LOG_INFO, "Received %lu bytes compressed into %lu using "
+			"%u threads", (unsigned long)acclen, (unsigned long)inlen,
+			(pool.nthreads > 0) ? pool.nthreads : 1);
+	}
+
+	/* Ensure we got everything we were promised. */
+	if ((fsize != SIZE_UNKNOWN) && (acclen != fsize)) {
+		log_printf(LOG_ERROR, "Received content is smaller than expected");
+		send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+		goto cleanup;
+	}
+
+	/* Ensure the contents are exactly what the client sent. */
+	if (checksums) {
+		if (!recv_crc(conn, &expected))
+			goto cleanup;
+
+		if (crc != expected) {
+			log_printf(LOG_ERROR, "Checksum mismatch for compressed content "
+				"(expected %08X, got %08X)", expected, crc);
+			send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+			goto cleanup;
+		}
+	}
+	ret = true;
+	goto cleanup;
+
+closed:
+	if (name != NULL)
+		fprintf(stderr, "\n");
+	log_sockerr(LOG_ERROR, "The client has closed the connection before the "
+		"compressed content finished transferring");
+
+cleanup:
+	/* Stop the workers and free up resources. */
+	comppool_free(&pool);
+
+	return ret;
+}
+
+/**
+ * Rebuilds a file from the copy we already have. The client is sent the
+ * signature of our copy and replies with the parts of the file that changed,
+ * interleaved with references to the blocks of our copy that are unchanged.
+ *
+ * @param conn    Client's connection.
+ * @param fh      File handle where the newer version will be written to.
+ * @param basis   File handle of the copy we already have.
+ * @param fname   Name of the file being updated.
+ * @param reqline Request line object.
+ *
+ * @return TRUE if the file was entirely rebuilt, FALSE otherwise.
+ */
+bool recv_delta(conn_t *conn, FILE *fh, FILE *basis,
+                const char *fname, const reqline_t *reqline) {
+	uint8_t hdr[REQ_DELTA_HDR_LEN];
+	uint8_t expected[SHA256_LEN];
+	uint8_t digest[SHA256_LEN];
+	deltasig_t sig;
+	deltaop_t op;
+	sha256_t ctx;
+	uint8_t *buf;
+	uint64_t acclen;
+	uint64_t literal;
+	uint64_t bsize;
+	uint64_t val;
+	uint64_t n;
+	uint64_t i;
+	uint32_t len;
+	size_t bufsize;
+	bool ret;
+
+	/* Build the signature of the copy we already have. */
+	buf = NULL;
+	ret = false;
+	bsize = file_size(fname);
+	if (!delta_sig_build(&sig, basis, bsize, delta_block_size(bsize),
+			cpu_count())) {
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		return false;
+	}
+
+	/* Allocate a buffer big enough for a block or a literal. */
+	bufsize = (sig.block > GL_DELTA_LITERAL_MAX) ? sig.block :
+		GL_DELTA_LITERAL_MAX;
+	buf = (uint8_t *)malloc(bufsize);
+	if (buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate delta transfer buffer");
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		goto cleanup;
+	}
+
+	/* Wait for the client to be ready for the signature. */
+	if (!conn_recv_all(conn, hdr, REQ_DELTA_HDR_LEN))
+		goto closed;
+	if (!delta_parse(hdr, &op, &len, &val) || (op != DELTA_OP_SIGNATURE)) {
+		log_printf(LOG_ERROR, "Client didn't ask for the delta signature");
+		send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+		goto cleanup;
+	}
+
+	/* Send the signature over in as few segments as possible. */
+	socket_cork(conn->sockfd, true);
+	if (!delta_send(conn->sockfd, DELTA_OP_SIGNATURE, sig.block, sig.size,
+			NULL, 0)) {
+		goto closed;
+	}
+	for (i = 0; i < sig.count; i += n) {
+		n = bufsize / DELTA_SIG_ENTRY_LEN;
+		if (n > (sig.count - i))
+			n = sig.count - i;
+
+		delta_sig_pack(&sig, i, n, buf);
+		if (!socket_send_all(conn->sockfd, buf,
+				(size_t)n * DELTA_SIG_ENTRY_LEN)) {
+			goto closed;
+		}
+	}
+	socket_cork(conn->sockfd, false);
+
+	/* Rebuild the file following the client's instructions. */
+	sha256_init(&ctx);
+	acclen = 0;
+	literal = 0;
+	buffered_progress(fname, acclen, reqline->size);
+	while (true) {
+		if (!conn_recv_all(conn, hdr, REQ_DELTA_HDR_LEN))
+			goto closed;
+		if (!delta_parse(hdr, &op, &len, &val))
+			goto invalid;
+		if (op == DELTA_OP_END)
+			break;
+
+		if (op == DELTA_OP_LITERAL) {
+			/* Content that we don't have. */
+			if ((len == 0) || (len > GL_DELTA_LITERAL_MAX) ||
+					(len > (reqline->size - acclen))) {
+				goto invalid;
+			}
+			if (!conn_recv_all(conn, buf, len))
+				goto closed;
+
+			fwrite(buf, sizeof(uint8_t), len, fh);
+			sha256_update(&ctx, buf, len);
+			acclen += len;
+			literal += len;
+		} else if (op == DELTA_OP_COPY) {
+			/* Blocks of our copy that haven't changed. */
+			n = delta_copy_len(&sig, val, len);
+			if ((n == 0) || (n > (reqline->size - acclen)))
+				goto invalid;
+
+			for (i = val; i < (val + len); i++) {
+				n = delta_copy_len(&sig, i, 1);
+				if (!file_pread(basis, buf, (size_t)n, i * sig.block)) {
+					log_syserr(LOG_ERROR, "Failed to read the older copy of "
+						"\"%s\"", fname);
+					send_error(conn->sockfd, ERR_CODE_INTERNAL);
+					goto cleanup;
+				}
+
+				fwrite(buf, sizeof(uint8_t), (size_t)n, fh);
+				sha256_update(&ctx, buf, (size_t)n);
+				acclen += n;
+			}
+		} else {
+			goto invalid;
+		}
+
+		buffered_progress(fname, acclen, reqline->size);
+	}
+	fprintf(stderr, "\n");
+
+	/* Ensure we got everything we were promised. */
+	if (acclen != reqline->size) {
+		log_printf(LOG_ERROR, "Rebuilt file is smaller than expected");
+		send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+		goto cleanup;
+	}
+
+	/* Ensure the rebuilt file is exactly what the client has. */
+	if (!conn_recv_all(conn, expected, SHA256_LEN))
+		goto closed;
+	sha256_final(&ctx, digest);
+	if (memcmp(expected, digest, SHA256_LEN) != 0) {
+		log_printf(LOG_ERROR, "Rebuilt file \"%s\" doesn't match the client's",
+			fname);
+		send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+		goto cleanup;
+	}
+	log_printf(LOG_INFO, "Rebuilt %lu bytes from %lu bytes of new content",
+		(unsigned long)acclen, (unsigned long)literal);
+	ret = true;
+	goto cleanup;
+
+invalid:
+	fprintf(stderr, "\n");
+	log_printf(LOG_ERROR, "Received an invalid delta transfer instruction");
+	send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+	goto cleanup;
+
+closed:
+	fprintf(stderr, "\n");
+	log_sockerr(LOG_ERROR, "The client has closed the connection before the "
+		"file \"%s\" finished updating", fname);
+
+cleanup:
+	/* Free up resources. */
+	delta_sig_free(&sig);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * Assembles a file out of content-defined chunks. The client sends the hashes
+ * of a batch of chunks, we reply with the ones that we don't have in the chunk
+ * store nor earlier in the same batch, and then only those are sent over.
+ * Every chunk is checked against its hash as it's written, so the file as a
+ * whole is verified by hashing the list of hashes of its chunks.
+ *
+ * @param conn    Client's connection.
+ * @param fh      File handle where the contents will be written to.
+ * @param fname   Name of the file being received.
+ * @param reqline Request line object.
+ *
+ * @return TRUE if the file was entirely assembled, FALSE otherwise.
+ */
+bool recv_cdc(conn_t *conn, FILE *fh, const char *fname,
+              const reqline_t *reqline) {
+	uint8_t hdr[REQ_CDC_HDR_LEN];
+	uint8_t expected[SHA256_LEN];
+	uint8_t digest[SHA256_LEN];
+	cdc_chunk_t *batch;
+	uint32_t *src;
+	uint8_t *entries;
+	uint8_t *want;
+	uint8_t *buf;
+	sha256_t ctx;
+	cdcop_t op;
+	uint64_t acclen;
+	uint64_t offset;
+	uint64_t fresh;
+	uint64_t val;
+	uint32_t count;
+	uint32_t nwant;
+	uint32_t i;
+	uint32_t j;
+	bool ret;
+
+	/* Allocate the buffers for a batch of chunks. */
+	ret = false;
+	batch = (cdc_chunk_t *)malloc(GL_CDC_BATCH * sizeof(cdc_chunk_t));
+	src = (uint32_t *)malloc(GL_CDC_BATCH * sizeof(uint32_t));
+	entries = (uint8_t *)malloc(GL_CDC_BATCH * CDC_ENTRY_LEN);
+	want = (uint8_t *)malloc((GL_CDC_BATCH + 7) / 8);
+	buf = (uint8_t *)malloc(GL_CDC_MAX);
+	if ((batch == NULL) || (src == NULL) || (entries == NULL) ||
+			(want == NULL) || (buf == NULL)) {
+		log_syserr(LOG_CRIT, "Failed to allocate chunk transfer buffers");
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		goto cleanup;
+	}
+
+	/* Only start keeping chunks around once a client sends them. */
+	if (!chunks_opened) {
+		chunks_opened = true;
+		if (!chunkstore_open(&chunks, GL_CHUNK_INDEX, GL_CHUNK_DATA)) {
+			log_printf(LOG_WARNING, "Chunks of received files won't be kept "
+				"for later transfers");
+		}
+	}
+
+	sha256_init(&ctx);
+	acclen = 0;
+	fresh = 0;
+	buffered_progress(fname, acclen, reqline->size);
+	while (true) {
+		/* Get the hashes of the next batch of chunks. */
+		if (!conn_recv_all(conn, hdr, REQ_CDC_HDR_LEN))
+			goto closed;
+		if (!cdc_frame_parse(hdr, &op, &count, &val))
+			goto invalid;
+		if (op == CDC_OP_END)
+			break;
+		if ((op != CDC_OP_HASHES) || (count == 0) || (count > GL_CDC_BATCH))
+			goto invalid;
+		if (!conn_recv_all(conn, entries, (size_t)count * CDC_ENTRY_LEN))
+			goto closed;
+
+		/* Figure out where each chunk will come from. */
+		memset(want, 0, (count + 7) / 8);
+		nwant = 0;
+		offset = acclen;
+		for (i = 0; i < count; i++) {
+			cdc_chunk_unpack(entries + ((size_t)i * CDC_ENTRY_LEN), &batch[i]);
+			if ((batch[i].len == 0) || (batch[i].len > GL_CDC_MAX) ||
+					(batch[i].len > (reqline->size - offset))) {
+				goto invalid;
+			}
+			batch[i].offset = offset;
+			offset += batch[i].len;
+
+			/* Chunks that we already have or that are repeated in the batch. */
+			src[i] = i;
+			if (chunkstore_has(&chunks, &batch[i]))
+				continue;
+			for (j = 0; j < i; j++) {
+				if ((batch[j].len == batch[i].len) && (memcmp(batch[j].hash,
+						batch[i].hash, CDC_HASH_LEN) == 0)) {
+					src[i] = j;
+					break;
+				}
+			}
+			if (src[i] != i)
+				continue;
+
+			want[i / 8] |= (uint8_t)(1 << (i % 8));
+			nwant++;
+		}
+
+		/* Ask for the chunks that we don't have. */
+		if (!cdc_frame_send(conn->sockfd, CDC_OP_WANT, nwant, 0, want,
+				(count + 7) / 8)) {
+			goto closed;
+		}
+
+		/* Assemble the batch in order. */
+		for (i = 0; i < count; i++) {
+			if (want[i / 8] & (1 << (i % 8))) {
+				/* Chunk sent by the client. */
+				if (!conn_recv_all(conn, buf, batch[i].len))
+					goto closed;
+				fresh += batch[i].len;
+			} else if (src[i] != i) {
+				/* Chunk repeated earlier in the file. */
+				fflush(fh);
+				if (!file_pread(fh, buf, batch[i].len,
+						batch[src[i]].offset)) {
+					goto failed;
+				}
+			} else if (!chunkstore_read(&chunks, &batch[i], buf)) {
+				/* Chunk that we already have. */
+				goto failed;
+			}
+
+			/* Ensure every chunk is exactly the one the client has. */
+			sha256(buf, batch[i].len, digest);
+			if (memcmp(digest, batch[i].hash, CDC_HASH_LEN) != 0) {
+				fprintf(stderr, "\n");
+				log_printf(LOG_ERROR, "Chunk of \"%s\" at %lu doesn't match "
+					"its hash", fname, (unsigned long)batch[i].offset);
+				send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+				goto cleanup;
+			}
+			if (want[i / 8] & (1 << (i % 8)))
+				chunkstore_add(&chunks, &batch[i], buf);
+			log_printf(LOG_DEBUG, "Chunk of \"%s\" at %lu (%u bytes) %s",
+				fname, (unsigned long)batch[i].offset, batch[i].len,
+				(want[i / 8] & (1 << (i % 8))) ? "was sent" :
+				((src[i] != i) ? "was repeated" : "was in the store"));
+
+			fwrite(buf, sizeof(uint8_t), batch[i].len, fh);
+			sha256_update(&ctx, digest, CDC_HASH_LEN);
+			acclen += batch[i].len;
+			buffered_progress(fname, acclen, reqline->size);
+		}
+	}
+	fprintf(stderr, "\n");
+
+	/* Ensure we got everything we were promised. */
+	if ((val != reqline->size) || (acclen != reqline->size)) {
+		log_printf(LOG_ERROR, "Assembled file is smaller than expected");
+		send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+		goto cleanup;
+	}
+
+	/* Ensure the assembled file is exactly what the client has. */
+	if (!conn_recv_all(conn, expected, SHA256_LEN))
+		goto closed;
+	sha256_final(&ctx, digest);
+	if (memcmp(expected, digest, SHA256_LEN) != 0) {
+		log_printf(LOG_ERROR, "Assembled file \"%s\" doesn't match the "
+			"client's", fname);
+		send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+		goto cleanup;
+	}
+	log_printf(LOG_INFO, "Assembled %lu bytes from %lu bytes of new content",
+		(unsigned long)acclen, (unsigned long)fresh);
+	ret = true;
+	goto cleanup;
+
+invalid:
+	fprintf(stderr, "\n");
+	log_printf(LOG_ERROR, "Received an invalid chunk transfer instruction");
+	send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+	goto cleanup;
+
+failed:
+	fprintf(stderr, "\n");
+	log_syserr(LOG_ERROR, "Failed to read a chunk of \"%s\" that we already "
+		"have", fname);
+	send_error(conn->sockfd, ERR_CODE_INTERNAL);
+	goto cleanup;
+
+closed:
+	fprintf(stderr, "\n");
+	log_sockerr(LOG_ERROR, "The client has closed the connection before the "
+		"file \"%s\" finished transferring", fname);
+
+cleanup:
+	/* Free up resources. */
+	free(batch);
+	free(src);
+	free(entries);
+	free(want);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * Sets up a file transfer whose contents will be striped across multiple
+ * connections. The connection that requested it is kept open until all of the
+ * stripes have been received, only then being replied to.
+ *
+ * @param conn    Client's connection. Its socket will be set to SOCKERR and
+ *                its arena emptied since both are handed over to the
+ *                transfer.
+ * @param reqline Request line object.
+ * @param fh      File handle opened for writing. Will be closed by us.
+ * @param fname   Name of the file being written, allocated from the
+ *                connection's arena.
+ *
+ * @return TRUE if the transfer was set up, FALSE otherwise.
+ */
+bool stripe_xfer_start(conn_t *conn, const reqline_t *reqline, FILE *fh,
+                       char *fname) {
+	stripe_xfer_t *xfer;
+	stripe_xfer_t *cur;
+
+	/* Allocate the transfer object. */
+	xfer = (stripe_xfer_t *)malloc(sizeof(stripe_xfer_t));
+	if (xfer == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate striped transfer object");
+		goto failed;
+	}
+	memcpy(xfer->xid, reqline->xid, REQ_XID_LEN);
+	xfer->conn = *conn;
+	xfer->fh = fh;
+	xfer->fname = fname;
+	xfer->size = reqline->size;
+	xfer->acclen = 0;
+	xfer->chunk = reqline->chunk;
+	xfer->nchunks = (reqline->size + reqline->chunk - 1) / reqline->chunk;
+	xfer->ndone = 0;
+	xfer->touched = clock_ms();
+	xfer->refs = 0;
+	xfer->checksums = (reqline->flags & REQ_FLAG_CHECKSUM) != 0;
+	xfer->merkle = (reqline->flags & file_req_flags(reqline) &
+		REQ_FLAG_MERKLE) != 0;
+	xfer->leaf = reqline->leaf;
+	memcpy(xfer->digest, reqline->digest, REQ_DIGEST_LEN);
+	xfer->dedup = (reqline->flags & REQ_FLAG_DIGEST) != 0;
+	xfer->mismatch = false;
+	xfer->failed = false;
+	xfer->finished = false;
+
+	/* Keep track of which chunks have already been received. */
+	xfer->done = (uint8_t *)calloc((xfer->nchunks + 7) / 8, sizeof(uint8_t));
+	xfer->crcs = (uint32_t *)calloc(xfer->nchunks, sizeof(uint32_t));
+	if ((xfer->done == NULL) || (xfer->crcs == NULL)) {
+		log_syserr(LOG_CRIT, "Failed to allocate striped transfer chunk map");
+		free(xfer->done);
+		free(xfer->crcs);
+		free(xfer);
+		goto failed;
+	}
+
+	/* Reserve the space for the file since it'll be written out of order. */
+	if (!file_prealloc(fh, reqline->size)) {
+		log_syserr(LOG_ERROR, "Failed to allocate space for file \"%s\"",
+			fname);
+		free(xfer->done);
+		free(xfer->crcs);
+		free(xfer);
+		goto failed;
+	}
+
+	/* Register the transfer, ensuring the identifier is unique. */
+	mutex_lock(&stripe_lock);
+	for (cur = stripe_xfers; cur != NULL; cur = cur->next) {
+		if (memcmp(cur->xid, xfer->xid, REQ_XID_LEN) == 0) {
+			mutex_unlock(&stripe_lock);
+			log_printf(LOG_ERROR, "Striped transfer identifier already in use");
+			free(xfer->done);
+			free(xfer->crcs);
+			free(xfer);
+			goto failed;
+		}
+	}
+	xfer->next = stripe_xfers;
+	stripe_xfers = xfer;
+	mutex_unlock(&stripe_lock);
+
+	/* Hand the connection over to the transfer and let the client continue. */
+	log_printf(LOG_INFO, "Receiving \"%s\" in %lu stripes", fname,
+		(unsigned long)xfer->nchunks);
+	reply_continue(&conn->sockfd, reqline, file_req_flags(reqline));
+	conn->sockfd = SOCKERR;
+	arena_init(&conn->arena);
+
+	return true;
+
+failed:
+	fclose(fh);
+	send_error(conn->sockfd, ERR_CODE_INTERNAL);
+	return false;
+}
+
+/**
+ * Finishes a striped transfer, replying to the connection that requested it
+ * and freeing up its resources. Must only be called once the transfer has been
+ * removed from the list of active transfers. A file whose transfer failed is
+ * removed, since it was preallocated and can't be told apart from a complete
+ * one.
+ *
+ * @param xfer Striped transfer object to be finished.
+ */
+void stripe_xfer_finish(stripe_xfer_t *xfer) {
+	uint32_t expected;
+	uint32_t crc;
+	size_t i;
+
+	/* Find and repair any damaged pieces of the file. */
+	if (!xfer->failed && xfer->merkle) {
+		if (merkle_verify_recv(&xfer->conn, xfer->fh, xfer->fname, xfer->size,
+				xfer->leaf)) {
+			log_printf(LOG_INFO, "Finished receiving \"%s\"", xfer->fname);
+		} else {
+			xfer->failed = true;
+		}
+
+		fclose(xfer->fh);
+		goto close_conn;
+	}
+
+	/* Verify the checksum of the entire file against the client's. */
+	if (!xfer->failed && xfer->checksums) {
+		crc = 0;
+		for (i = 0; i < xfer->nchunks; i++) {
+			crc = crc32c_combine(crc, xfer->crcs[i],
+				(i == (xfer->nchunks - 1)) ? (xfer->size - (i * xfer->chunk)) :
+				xfer->chunk);
+		}
+
+		if (!recv_crc(&xfer->conn, &expected)) {
+			xfer->failed = true;
+		} else if (crc != expected) {
+			log_printf(LOG_ERROR, "Checksum mismatch for file \"%s\" "
+				"(expected %08X, got %08X)", xfer->fname, expected, crc);
+			xfer->failed = true;
+			xfer->mismatch = true;
+		}
+	}
+
+	/* Close the file and let the client know how it went. */
+	fclose(xfer->fh);
+	if (xfer->failed) {
+		log_printf(LOG_ERROR, "Striped transfer of \"%s\" failed",
+			xfer->fname);
+		send_error(xfer->conn.sockfd, (xfer->mismatch) ? ERR_CODE_CHECKSUM :
+			ERR_CODE_INTERNAL);
+		file_remove(xfer->fname);
+		names_release(&names, xfer->fname);
+	} else {
+		log_printf(LOG_INFO, "Finished receiving \"%s\"", xfer->fname);
+		send_ok(xfer->conn.sockfd);
+	}
+
+close_conn:
+	socket_close(xfer->conn.sockfd, false);
+	if (!xfer->failed && xfer->dedup)
+		dedup_remember(xfer->fname, xfer->size, xfer->digest);
+
+	/* Free up resources. */
+	arena_free(&xfer->conn.arena);
+	free(xfer->done);
+	free(xfer->crcs);
+	free(xfer);
+}
+
+/**
+ * Fails the striped transfers that haven't had any stripes arriving for a
+ * while, which is what's left of them when the client goes away before
+ * sending every stripe.
+ *
+ * @param all Should every transfer that's not receiving a stripe right now be
+ *            failed, regardless of how long it's been waiting?
+ */
+void stripe_xfer_reap(bool all) {
+	stripe_xfer_t *expired;
+	stripe_xfer_t *xfer;
+	stripe_xfer_t **prev;
+	uint64_t now;
+
+	/* Take the transfers that expired out of the list. */
+	expired = NULL;
+	now = clock_ms();
+	mutex_lock(&stripe_lock);
+	prev = &stripe_xfers;
+	while ((xfer = *prev) != NULL) {
+		if ((xfer->refs > 0) || (!all &&
+				((now - xfer->touched) < GL_STRIPE_TIMEOUT_MS))) {
+			prev = &xfer->next;
+			continue;
+		}
+
+		*prev = xfer->next;
+		xfer->failed = true;
+		xfer->finished = true;
+		xfer->next = expired;
+		expired = xfer;
+	}
+	mutex_unlock(&stripe_lock);
+
+	/* Let the clients know that we gave up on them. */
+	while (expired != NULL) {
+		xfer = expired;
+		expired = xfer->next;
+		log_printf(LOG_WARNING, "Gave up on receiving the rest of \"%s\"",
+			xfer->fname);
+		stripe_xfer_finish(xfer);
+	}
+}
+
+/**
+ * Hands a connection that's sending stripes of a transfer over to its own
+ * thread so that we can continue accepting connections in parallel.
+ *
+ * @param conn    Client's connection. Its socket will be set to SOCKERR and
+ *                its arena emptied since both are handed over to the thread.
+ * @param reqline Request line object of the first stripe.
+ *
+ * @return TRUE if the thread was started, FALSE otherwise.
+ */
+bool stripe_conn_start(conn_t *conn, const reqline_t *reqline) {
+	stripe_conn_t *sconn;
+	thread_t thread;
+
+	/* Allocate the connection object. */
+	sconn = (stripe_conn_t *)malloc(sizeof(stripe_conn_t));
+	if (sconn == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate stripe connection object");
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		return false;
+	}
+	sconn->conn = *conn;
+	sconn->reqline = *reqline;
+	sconn->reqline.name = NULL;
+
+	/* Start the thread and hand the connection over to it. */
+	if (!thread_create(&thread, stripe_conn_thread, sconn)) {
+		send_error(conn->sockfd, ERR_CODE_INTERNAL);
+		free(sconn);
+		return false;
+	}
+	thread_detach(thread);
+	conn->sockfd = SOCKERR;
+	arena_init(&conn->arena);
+
+	return true;
+}
+
+/**
+ * Thread that receives stripes from a single connection until it's closed.
+ *
+ * @param arg Stripe connection object.
+ *
+ * @return Nothing.
+ */
+thread_ret_t THREAD_CALL stripe_conn_thread(void *arg) {
+	uint8_t buf[GL_BINHDR_MAX + 1];
+	stripe_conn_t *sconn;
+	reqline_t reqline;
+	size_t hlen;
+
+	/* Process stripes until the client is done with this connection. */
+	sconn = (stripe_conn_t *)arg;
+	reqline = sconn->reqline;
+	while (process_stripe_req(&sconn->conn, &reqline)) {
+		/* Wait for the next stripe. */
+		arena_reset(&sconn->conn.arena);
+		hlen = recv_bin_header(&sconn->conn, buf);
+		if (hlen == 0)
+			break;
+
+		/* Ensure we are still dealing with stripes. */
+		if (!reqline_parse_bin(buf, hlen, &reqline) ||
+				(reqline.type != REQ_TYPE_STRIPE)) {
+			send_error(sconn->conn.sockfd, ERR_CODE_REQ_BAD);
+			break;
+		}
+	}
+
+	/* Close the connection and free up resources. */
+	socket_close(sconn->conn.sockfd, false);
+	arena_free(&sconn->conn.arena);
+	free(sconn);
+	bufpool_thread_exit();
+
+	return 0;
+}
+
+/**
+ * Receives a single stripe of a transfer and writes it to its place in the
+ * file.
+ *
+ * @param conn    Client's connection.
+ * @param reqline Request line object of the stripe.
+ *
+ * @return TRUE if the stripe was received, FALSE otherwise.
+ */
+bool process_stripe_req(conn_t *conn, const reqline_t *reqline) {
+	stripe_xfer_t *xfer;
+	stripe_xfer_t **prev;
+	uint32_t expected;
+	uint32_t crc;
+	uint8_t *buf;
+	size_t idx;
+	size_t acclen;
+	ssize_t len;
+	bool mismatch;
+	bool finish;
+
+	/* Find the transfer this stripe belongs to and validate the stripe. */
+	mutex_lock(&stripe_lock);
+	for (xfer = stripe_xfers; xfer != NULL; xfer = xfer->next) {
+		if (memcmp(xfer->xid, reqline->xid, REQ_XID_LEN) == 0)
+			break;
+	}
+	idx = (xfer != NULL) ? (size_t)(reqline->offset / xfer->chunk) : 0;
+	if ((xfer == NULL) || xfer->failed || xfer->finished ||
+			(reqline->offset % xfer->chunk) || (idx >= xfer->nchunks) ||
+			(xfer->done[idx / 8] & (1 << (idx % 8))) ||
+			(reqline->size != ((idx == (xfer->nchunks - 1)) ?
+				(xfer->size - (size_t)reqline->offset) : xfer->chunk))) {
+		mutex_unlock(&stripe_lock);
+		log_printf(LOG_ERROR, "Received a stripe that doesn't belong to any "
+			"transfer in progress");
+		send_error(conn->sockfd, ERR_CODE_REQ_BAD);
+		return false;
+	}
+	xfer->refs++;
+	xfer->touched = clock_ms();
+	mutex_unlock(&stripe_lock);
+	send_continue(conn->sockfd);
+
+	/* Pipe the stripe from the network to its place in the file. */
+	buf = bufpool_get();
+	acclen = 0;
+	crc = 0;
+	mismatch = false;
+	while ((buf != NULL) && (acclen < reqline->size)) {
+		len = conn_recv(conn, buf, ((reqline->size - acclen) > GL_IOBUF_LEN) ?
+			GL_IOBUF_LEN : (reqline->size - acclen));
+		if (len <= 0) {
+			log_sockerr(LOG_ERROR, "The client has closed the connection "
+				"before the stripe finished transferring");
+			break;
+		}
+
+		if (!file_pwrite(xfer->fh, buf, len, reqline->offset + acclen)) {
+			log_syserr(LOG_ERROR, "Failed to write stripe to file");
+			break;
+		}
+		if (xfer->checksums)
+			crc = crc32c(crc, buf, len);
+		acclen += len;
+	}
+	bufpool_put(buf);
+
+	/* Ensure the stripe is exactly what the client sent. */
+	if ((acclen == reqline->size) && xfer->checksums) {
+		if (!recv_crc(conn, &expected)) {
+			acclen = 0;
+		} else if ((crc != expected) && xfer->merkle) {
+			log_printf(LOG_WARNING, "Checksum mismatch for stripe at offset "
+				"%lu of \"%s\", will repair it later",
+				(unsigned long)reqline->offset, xfer->fname);
+		} else if (crc != expected) {
+			log_printf(LOG_ERROR, "Checksum mismatch for stripe at offset "
+				"%lu of \"%s\"", (unsigned long)reqline->offset, xfer->fname);
+			mismatch = true;
+			acclen = 0;
+		}
+	}
+
+	/* Account for the stripe and check if the transfer is finished. */
+	mutex_lock(&stripe_lock);
+	xfer->refs--;
+	xfer->touched = clock_ms();
+	if (acclen == reqline->size) {
+		xfer->done[idx / 8] |= (uint8_t)(1 << (idx % 8));
+		xfer->crcs[idx] = crc;
+		xfer->ndone++;
+		xfer->acclen += acclen;
+		log_printf(LOG_DEBUG, "Stripe %lu of \"%s\" received (%lu bytes)",
+			(unsigned long)idx, xfer->fname, (unsigned long)acclen);
+		buffered_progress(xfer->fname, xfer->acclen, xfer->size);
+		if (xfer->ndone == xfer->nchunks)
+			fprintf(stderr, "\n");
+	} else {
+		xfer->failed = true;
+		if (mismatch)
+			xfer->mismatch = true;
+	}
+	finish = (xfer->refs == 0) && !xfer->finished &&
+		(xfer->failed || (xfer->ndone == xfer->nchunks));
+	if (finish) {
+		/* Remove the transfer from the list. */
+		xfer->finished = true;
+		for (prev = &stripe_xfers; *prev != xfer; prev = &(*prev)->next)
+			;
+		*prev = xfer->next;
+	}
+	mutex_unlock(&stripe_lock);
+
+	/* Acknowledge the stripe and finish the transfer if needed. */
+	if (acclen == reqline->size) {
+		send_ok(conn->sockfd);
+	} else if (mismatch) {
+		send_error(conn->sockfd, ERR_CODE_CHECKSUM);
+	}
+	if (finish)
+		stripe_xfer_finish(xfer);
+
+	return acclen == reqline->size;
+}
+
+/**
+ * Handles the SIGINT interrupt event.
+ *
+ * @param sig Signal handle that generated this interrupt.
+ */
+void sigint_handler(int sig) {
+	/* Only wake up the main loop, which stops the server for us. */
+	stop_signaled = 1;
+	socket_interrupt(sockfd_server);
+	socket_interrupt(sockfd_client);
 
 	/* Don't let the signal propagate. */
 	signal(sig, SIG_IGN);
@@ -634,11 +3096,18 @@ BOOL WINAPI ConsoleSignalHandler(DWORD dwCtrlType) {
  * @param prog Program's name from argv[0].
  */
 void usage(const char *prog) {
-	printf("usage: %s [-l addr] [-p port] [-y]\n\n", prog);
+	printf("usage: %s [-l addr] [-p port] [-o dir] [-T threads] [-q] [-v] "
+		"[-y]\n\n", prog);
 	puts("options:");
 	puts("    -h         Displays this message");
 	puts("    -l addr    Server should listen on the specified address");
 	puts("    -p port    Port the server should listen on");
+	puts("    -o dir     Directory to receive files into (current by default)");
+	puts("    -q         Only log warnings and errors");
+	puts("    -T threads Number of decompression threads (all processors by "
+	     "default)");
+	puts("    -v         Log every chunk that's transferred (only in debug "
+	     "builds)");
 	puts("    -y         Automatically accept all requests without asking");
 	puts("");
 	puts(GL_COPYRIGHT);
@@ -9,6 +9,8 @@
 	#define WIN32_LEAN_AND_MEAN
 	#include <windows.h>
 	#include <tchar.h>
+	#include <io.h>
+	#include <fcntl.h>
 	#ifdef _DEBUG
 		#include <crtdbg.h>
 	#endif /* _DEBUG */
@@ -18,6 +20,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <getopt.h>
@@ -26,8 +29,21 @@
 #include "logging.h"
 #include "sockets.h"
 #include "request.h"
+#include "bufpool.h"
+#include "cdc.h"
+#include "compress.h"
+#include "dedup.h"
+#include "delta.h"
+#include "hashcache.h"
+#include "manifest.h"
+#include "merkle.h"
+#include "scan.h"
+#include "thread.h"
 #include "utils.h"
 
+/* Contents read at a time while splitting a file into chunks. */
+#define CDC_WINDOW_LEN (4 * GL_CDC_MAX)
+
 /**
  * Configuration options passed as command line arguments.
  */
@@ -35,21 +51,105 @@ typedef struct {
 	const char *addr;
 	const char *port;
 	const char *fpath;
+	const char *name;
 	size_t len;
+	size_t block;
+	unsigned int streams;
+	unsigned int threads;
 	char type;
+	bool binary;
+	bool stream;
+	bool checksums;
+	bool compress;
+	bool delta;
+	bool dedup;
+	bool compare;
+	bool cdc;
 } opts_t;
 
+/**
+ * File transfer being striped across multiple parallel connections.
+ */
+typedef struct {
+	const char *addr;
+	const char *port;
+	const char *fpath;
+	FILE *fh;
+	const reqline_t *reqline;
+
+	mutex_t lock;
+	uint32_t *crcs;
+	size_t nchunks;
+	size_t next;
+	size_t acclen;
+	unsigned int active;
+	bool failed;
+} stripe_job_t;
+
+/**
+ * File being sent as only the parts that changed since the server's copy.
+ */
+typedef struct {
+	const sockfd_t *sockfd;
+	const reqline_t *reqline;
+	const deltasig_t *sig;
+	size_t acclen;
+	size_t literal;
+} delta_xfer_t;
+
+/**
+ * Small files of a directory synchronization that are sent together.
+ */
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+	uint32_t count;
+} sync_pack_t;
+
 /* Private functions. */
 void cancel_request(void);
 bool send_url(const char *addr, const char *port, const char *url);
 bool send_file(const char *addr, const char *port, const char *fpath);
 bool send_text(const char *addr, const char *port, const char *text,
                size_t len);
-reply_t *process_server_reply(const sockfd_t *sockfd);
+bool send_stream(const char *addr, const char *port, reqtype_t type,
+                 const char *name);
+bool send_sync(const char *addr, const char *port, const char *path);
+FILE *sync_send_manifest(sockfd_t sockfd, const char *path);
+bool sync_send_file(sockfd_t sockfd, const reqline_t *reqline,
+                    const char *root, const char *path, uint64_t *sent);
+bool sync_pack_add(sockfd_t sockfd, const reqline_t *reqline,
+                   sync_pack_t *pack, const char *root, const char *path,
+                   uint64_t *sent);
+bool sync_pack_flush(sockfd_t sockfd, const reqline_t *reqline,
+                     sync_pack_t *pack);
+bool sync_list_read(void *arg, void *buf, size_t len);
+reply_t *process_server_reply(conn_t *conn);
 size_t client_file_transfer(const sockfd_t *sockfd, const reqline_t *reqline,
-                            const char *fpath);
+                            FILE *fh);
+bool send_crc(sockfd_t sockfd, uint32_t crc);
+bool process_final_reply(conn_t *conn);
+bool merkle_verify_send(conn_t *conn, const reqline_t *reqline,
+                        const char *fpath, FILE *fh);
 size_t client_text_transfer(const sockfd_t *sockfd, const char *text,
                             size_t len);
+bool client_stream_transfer(const sockfd_t *sockfd, const reqline_t *reqline,
+                            FILE *fh);
+bool client_delta_transfer(conn_t *conn, const reqline_t *reqline,
+                           FILE *fh);
+bool client_delta_emit(void *arg, deltaop_t op, const uint8_t *buf,
+                       uint32_t len, uint64_t idx);
+bool client_cdc_transfer(conn_t *conn, const reqline_t *reqline,
+                         const char *fpath, FILE *fh);
+bool client_cdc_batch(conn_t *conn, FILE *fh,
+                      const cdc_chunk_t *batch, uint32_t count, uint8_t *buf,
+                      uint64_t *sent);
+bool client_compressed_transfer(const sockfd_t *sockfd,
+                                const reqline_t *reqline, FILE *fh);
+bool client_striped_transfer(const char *addr, const char *port,
+                             const reqline_t *reqline, const char *fpath,
+                             FILE *fh, uint32_t *digest);
+thread_ret_t THREAD_CALL stripe_worker(void *arg);
 bool perform_request(const char *addr, const char *port, reqline_t *reqline,
                      reply_t **reply);
 void print_reply_error(const reply_t *reply);
@@ -61,9 +161,11 @@ BOOL WINAPI ConsoleSignalHandler(DWORD dwCtrlType);
 #endif /* _WIN32 */
 
 /* State variables. */
-static sockfd_t sockfd_client;
-static bool running;
+static conn_t conn_client;
+static volatile bool running;
+static volatile sig_atomic_t interrupted;
 static opts_t opts;
+static hashcache_t hashcache;
 
 /**
  * Program's main entry point.
@@ -87,9 +189,14 @@ int main(int argc, char **argv) {
 #endif /* _WIN32 & _DEBUG */
 
 	/* Initialize defaults and subsystems. */
+	log_init();
 	ret = 0;
 	text = NULL;
 	running = false;
+	crc32c_init();
+	scan_init();
+	bufpool_init();
+	cdc_init();
 	if (!socket_init()) {
 		ret = 1;
 		goto cleanup;
@@ -113,18 +220,95 @@ int main(int argc, char **argv) {
 	opts.addr = NULL;
 	opts.port = GL_SERVER_PORT;
 	opts.fpath = NULL;
+	opts.name = "stdin";
 	opts.len = 0;
+	opts.streams = GL_STRIPES_MAX;
+	opts.block = GL_COMPRESS_BLOCK;
+	opts.threads = 0;
 	opts.type = REQ_TYPE_FILE;
+	opts.binary = true;
+	opts.stream = false;
+	opts.checksums = true;
+	opts.compress = true;
+	opts.delta = false;
+	opts.dedup = true;
+	opts.compare = false;
+	opts.cdc = false;
 
 	/* Handle command line arguments. */
-	while ((opt = getopt(argc, argv, "p:uth")) != -1) {
+	while ((opt = getopt(argc, argv, "p:n:j:B:T:cdDkqstuvLCZh")) != -1) {
 		switch (opt) {
 			case 'p':
 				opts.port = optarg;
 				break;
+			case 'j':
+				opts.streams = (unsigned int)atoi(optarg);
+				if ((opts.streams < 1) || (opts.streams > GL_STRIPES_MAX)) {
+					log_printf(LOG_ERROR, "Number of streams must be between 1 "
+						"and %u", GL_STRIPES_MAX);
+					ret = 1;
+					goto cleanup;
+				}
+				break;
+			case 'B':
+				if (!parse_size(optarg, &opts.block) || (opts.block < 4) ||
+						(opts.block > (GL_COMPRESS_BLOCK_MAX / 1024))) {
+					log_printf(LOG_ERROR, "Compression block size must be "
+						"between 4 and %ld KiB", GL_COMPRESS_BLOCK_MAX / 1024);
+					ret = 1;
+					goto cleanup;
+				}
+				opts.block *= 1024;
+				break;
+			case 'T':
+				opts.threads = (unsigned int)atoi(optarg);
+				if (opts.threads > GL_COMPRESS_THREADS_MAX) {
+					log_printf(LOG_ERROR, "Number of compression threads must "
+						"be at most %u", GL_COMPRESS_THREADS_MAX);
+					ret = 1;
+					goto cleanup;
+				}
+				break;
+			case 'n':
+				opts.name = optarg;
+				break;
+			case 'L':
+				opts.binary = false;
+				break;
+			case 'C':
+				opts.checksums = false;
+				break;
+			case 'Z':
+				opts.compress = false;
+				break;
+			case 'd':
+				opts.delta = true;
+				break;
+			case 'c':
+				opts.compare = true;
+				break;
+			case 'D':
+				opts.dedup = false;
+				break;
+			case 'k':
+				opts.cdc = true;
+				break;
+			case 's':
+				opts.type = REQ_TYPE_SYNC;
+				break;
 			case 'u':
 				opts.type = REQ_TYPE_URL;
 				break;
+			case 'q':
+				log_set_level(LOG_WARNING);
+				break;
+			case 'v':
+				log_set_level(LOG_DEBUG);
+				if (!log_enabled(LOG_DEBUG)) {
+					log_printf(LOG_WARNING, "Debug messages were left out of "
+						"this build, so -v has no effect");
+				}
+				break;
 			case 't':
 				opts.type = REQ_TYPE_TEXT;
 				break;
@@ -169,15 +353,34 @@ int main(int argc, char **argv) {
 		goto cleanup;
 	}
 
+	/* Directories can only be synchronized using binary headers. */
+	if ((opts.type == REQ_TYPE_SYNC) && !opts.binary) {
+		log_printf(LOG_ERROR, "Directories can't be synchronized using legacy "
+			"text request lines");
+		ret = 1;
+		goto cleanup;
+	}
+
 	/* Check if the user wants us to read from STDIN. */
-	if ((opts.len == 1) && (*opts.fpath == '-')) {
-		opts.len = read_stdin(&text, opts.type != REQ_TYPE_TEXT);
-		opts.fpath = text;
+	if ((opts.len == 1) && (*opts.fpath == '-') &&
+			(opts.type != REQ_TYPE_SYNC)) {
+		if ((opts.type != REQ_TYPE_URL) && opts.binary) {
+			/* Stream files and text as they are read. */
+			opts.stream = true;
+		} else {
+			opts.len = read_stdin(&text, opts.type != REQ_TYPE_TEXT);
+			opts.fpath = text;
+		}
 	}
 
 	/* Send request to the server. */
+	if (opts.stream) {
+		send_stream(opts.addr, opts.port, (reqtype_t)opts.type, opts.name);
+		goto cleanup;
+	}
 	switch (opts.type) {
 		case REQ_TYPE_FILE:
+			hashcache_open(&hashcache);
 			send_file(opts.addr, opts.port, opts.fpath);
 			break;
 		case REQ_TYPE_URL:
@@ -186,6 +389,11 @@ int main(int argc, char **argv) {
 		case REQ_TYPE_TEXT:
 			send_text(opts.addr, opts.port, opts.fpath, opts.len);
 			break;
+		case REQ_TYPE_SYNC:
+			if (opts.compare)
+				hashcache_open(&hashcache);
+			send_sync(opts.addr, opts.port, opts.fpath);
+			break;
 		default:
 			log_printf(LOG_ERROR, "Unknown request type to send to server");
 			ret = 1;
@@ -193,12 +401,17 @@ int main(int argc, char **argv) {
 	}
 
 cleanup:
+	/* Signal handlers can't log, so we do it for them. */
+	if (interrupted)
+		log_printf(LOG_DEBUG, "Received a SIGINT");
+
 	/* Clean up temporary stuff. */
 	running = false;
 	if (text) {
 		free(text);
 		text = NULL;
 	}
+	hashcache_close(&hashcache);
 
 #ifdef _WIN32
 	/* Clean up Winsock stuff. */
@@ -233,8 +446,8 @@ void cancel_request(void) {
 		return;
 
 	/* Close the socket forcefully. */
-	socket_close(sockfd_client, true);
-	sockfd_client = SOCKERR;
+	socket_close(conn_client.sockfd, true);
+	conn_client.sockfd = SOCKERR;
 	running = false;
 }
 
@@ -279,9 +492,9 @@ cleanup:
 	/* Free request line object and close the socket. */
 	reqline_free(reqline);
 	reply_free(reply);
-	if (sockfd_client != SOCKERR) {
-		socket_close(sockfd_client, true);
-		sockfd_client = SOCKERR;
+	if (conn_client.sockfd != SOCKERR) {
+		socket_close(conn_client.sockfd, true);
+		conn_client.sockfd = SOCKERR;
 	}
 	running = false;
 
@@ -300,30 +513,88 @@ cleanup:
 bool send_file(const char *addr, const char *port, const char *fpath) {
 	reqline_t *reqline;
 	reply_t *reply;
+	merkle_t tree;
+	uint64_t size;
+	uint64_t mtime;
+	bool compressible;
+	FILE *fh;
 	bool ret;
 
 	/* Initialize variables. */
 	reply = NULL;
+	compressible = false;
 
-	/* Check if the file actually exists. */
-	if (!file_exists(fpath)) {
-		log_printf(LOG_ERROR, "File \"%s\" does not exist", fpath);
+	/* Open the file once for everything we need from it. */
+	fh = file_open_stat(fpath, &size, &mtime);
+	if (fh == NULL) {
+		log_syserr(LOG_ERROR, "Failed to open file \"%s\" for sending", fpath);
 		return false;
 	}
 
 	/* Build request line object. */
 	reqline = reqline_new();
-	if (reqline == NULL)
+	if (reqline == NULL) {
+		fclose(fh);
 		return false;
+	}
 	reqline_type_set(reqline, REQ_TYPE_FILE);
-	reqline->size = file_size(fpath);
+	reqline->size = (size_t)size;
 	reqline->name = path_basename(fpath);
 
+	/* Send the file as chunks that the server may already have. */
+	if (opts.binary && opts.cdc)
+		reqline->flags |= REQ_FLAG_CDC;
+
+	/* Offer to compress files that look like they'd benefit from it. */
+	if (opts.binary && opts.compress && !opts.cdc &&
+			(reqline->size >= GL_COMPRESS_MIN)) {
+		compressible = compress_file_worthwhile(fh, reqline->size);
+		if (compressible)
+			reqline->flags |= COMPRESS_FLAGS;
+	}
+
+	/* Only send what changed if the server already has an older copy. */
+	if (opts.binary && opts.delta && !opts.cdc)
+		reqline->flags |= REQ_FLAG_DELTA;
+
+	/* Let the server reuse the contents if it already has them. */
+	if (opts.binary && opts.dedup && (reqline->size >= GL_DEDUP_MIN) &&
+			hashcache_tree(&hashcache, &tree, fh, reqline->size,
+			REQ_DIGEST_LEAF)) {
+		memcpy(reqline->digest, merkle_root(&tree), REQ_DIGEST_LEN);
+		reqline->flags |= REQ_FLAG_DIGEST;
+		merkle_free(&tree);
+	}
+
+	/* Offer to stripe large files across multiple connections. */
+	if (opts.binary && (opts.streams > 1) && !compressible && !opts.delta &&
+			!opts.cdc && (reqline->size >= (2 * GL_STRIPE_CHUNK))) {
+		reqline->flags |= REQ_FLAG_STRIPED;
+		reqline->chunk = GL_STRIPE_CHUNK;
+		random_bytes(reqline->xid, REQ_XID_LEN);
+	}
+	if (opts.binary && opts.checksums && !opts.cdc) {
+		reqline->flags |= REQ_FLAG_CHECKSUM;
+
+		/* Large files are better off having only their damaged parts sent. */
+		if (reqline->size >= GL_MERKLE_MIN) {
+			reqline->flags |= REQ_FLAG_MERKLE;
+			reqline->leaf = GL_MERKLE_LEAF;
+		}
+	}
+
 	/* Connect to the server. */
 	ret = perform_request(addr, port, reqline, &reply);
 	if (!ret)
 		goto cleanup;
 
+	/* Check if the server already had the contents of the file. */
+	if ((reqline->flags & REQ_FLAG_DIGEST) && opts.binary &&
+			(reply->code == 200)) {
+		log_printf(LOG_INFO, "Server already had the contents of the file");
+		goto cleanup;
+	}
+
 	/* Check if the server replied with an error. */
 	if (reply->code != 100) {
 		print_reply_error(reply);
@@ -331,21 +602,89 @@ bool send_file(const char *addr, const char *port, const char *fpath) {
 		goto cleanup;
 	}
 
+	/* Only honor the flags that the server has accepted. */
+	reqline->flags &= (opts.binary) ? reply->flags : 0;
+
+	/* Rebuild the file from the server's copy if it agreed to it. */
+	if (reqline->flags & REQ_FLAG_DELTA) {
+		if (!client_delta_transfer(&conn_client, reqline, fh)) {
+			log_printf(LOG_NOTICE, "File transfer %s", (running) ? "failed" :
+				"canceled");
+			ret = false;
+			goto cleanup;
+		}
+
+		ret = process_final_reply(&conn_client);
+		goto cleanup;
+	}
+
+	/* Only send the chunks the server doesn't have if it agreed to it. */
+	if (reqline->flags & REQ_FLAG_CDC) {
+		if (!client_cdc_transfer(&conn_client, reqline, fpath, fh)) {
+			log_printf(LOG_NOTICE, "File transfer %s", (running) ? "failed" :
+				"canceled");
+			ret = false;
+			goto cleanup;
+		}
+
+		ret = process_final_reply(&conn_client);
+		goto cleanup;
+	}
+
+	/* Stripe the file contents if the server agreed to it. */
+	if (reqline->flags & REQ_FLAG_STRIPED) {
+		uint32_t digest;
+
+		if (!client_striped_transfer(addr, port, reqline, fpath, fh,
+				(reqline->flags & REQ_FLAG_CHECKSUM) ? &digest : NULL)) {
+			log_printf(LOG_NOTICE, "File transfer %s", (running) ? "failed" :
+				"canceled");
+			ret = false;
+			goto cleanup;
+		}
+
+		/* Help the server find and repair any damaged pieces. */
+		if (reqline->flags & REQ_FLAG_MERKLE) {
+			ret = merkle_verify_send(&conn_client, reqline, fpath, fh);
+			goto cleanup;
+		}
+
+		/* Let the server verify the file as a whole. */
+		if (reqline->flags & REQ_FLAG_CHECKSUM) {
+			if (!send_crc(conn_client.sockfd, digest)) {
+				ret = false;
+				goto cleanup;
+			}
+		}
+
+		/* Wait for the server to confirm it received everything. */
+		ret = process_final_reply(&conn_client);
+		goto cleanup;
+	}
+
 	/* Send the file contents. */
-	if (!client_file_transfer(&sockfd_client, reqline, fpath)) {
+	if (!client_file_transfer(&conn_client.sockfd, reqline, fh)) {
 		log_printf(LOG_NOTICE, "File transfer %s", (running) ? "failed" :
 			"canceled");
 		ret = false;
 		goto cleanup;
 	}
 
+	/* Wait for the server to confirm it received everything. */
+	if (reqline->flags & REQ_FLAG_MERKLE) {
+		ret = merkle_verify_send(&conn_client, reqline, fpath, fh);
+	} else {
+		ret = process_final_reply(&conn_client);
+	}
+
 cleanup:
-	/* Free request line object and close the socket. */
+	/* Free request line object and close the file and socket. */
 	reqline_free(reqline);
 	reply_free(reply);
-	if (sockfd_client != SOCKERR) {
-		socket_close(sockfd_client, true);
-		sockfd_client = SOCKERR;
+	fclose(fh);
+	if (conn_client.sockfd != SOCKERR) {
+		socket_close(conn_client.sockfd, true);
+		conn_client.sockfd = SOCKERR;
 	}
 	running = false;
 
@@ -393,7 +732,7 @@ bool send_text(const char *addr, const char *port, const char *text,
 	}
 
 	/* Send text contents to server. */
-	if (!client_text_transfer(&sockfd_client, text, len)) {
+	if (!client_text_transfer(&conn_client.sockfd, text, len)) {
 		log_printf(LOG_NOTICE, "Text transfer %s", (running) ? "failed" :
 			"canceled");
 		ret = false;
@@ -404,9 +743,9 @@ cleanup:
 	/* Free request line object and close the socket. */
 	reqline_free(reqline);
 	reply_free(reply);
-	if (sockfd_client != SOCKERR) {
-		socket_close(sockfd_client, true);
-		sockfd_client = SOCKERR;
+	if (conn_client.sockfd != SOCKERR) {
+		socket_close(conn_client.sockfd, true);
+		conn_client.sockfd = SOCKERR;
 	}
 	running = false;
 
@@ -414,162 +753,1194 @@ cleanup:
 }
 
 /**
- * Processes the server's reply to a request.
+ * Handles the entire process of streaming content of unknown length from STDIN
+ * to a server.
  *
- * @param sockfd Socket connected to a server.
+ * @param addr Address of the server to send the content to.
+ * @param port Port used to communicate with the server.
+ * @param type Type of the content being streamed (file or text).
+ * @param name Name of the file on the server. Ignored for text.
  *
- * @return Server reply object if the operation was successful, or NULL if any
- *         errors occurred during the transfer.
+ * @return TRUE if the operation was successful, FALSE otherwise.
  */
-reply_t *process_server_reply(const sockfd_t *sockfd) {
-	char line[GL_REPLYLINE_MAX + 1];
-	ssize_t len;
-	int i;
+bool send_stream(const char *addr, const char *port, reqtype_t type,
+                 const char *name) {
+	reqline_t *reqline;
+	reply_t *reply;
+	bool ret;
 
-	/* Read the reply from the server. */
-	if ((len = recv(*sockfd, line, GL_REPLYLINE_MAX, 0)) < 0)
-		return NULL;
-	line[len] = '\0';
+	/* Initialize variables. */
+	reply = NULL;
 
-	/* Ensure the reply wasn't too long. */
-	if (len >= GL_REPLYLINE_MAX) {
-		log_printf(LOG_WARNING, "Reply from server unusually long. Aborting");
-		return NULL;
-	}
+	/* Build request line object. */
+	reqline = reqline_new();
+	if (reqline == NULL)
+		return false;
+	reqline_type_set(reqline, type);
+	reqline->flags = REQ_FLAG_CHUNKED;
+	if (opts.checksums)
+		reqline->flags |= REQ_FLAG_CHECKSUM;
+	if (opts.compress && !stdin_is_tty())
+		reqline->flags |= COMPRESS_FLAGS;
+	reqline->size = 0;
+	reqline->name = (type == REQ_TYPE_FILE) ? strdup(name) : NULL;
 
-	/* Terminate the reply before the CRLF. */
-	for (i = 0; i < len; i++) {
-		if ((line[i] == '\r') || (line[i] == '\n')) {
-			line[i] = '\0';
-			break;
+	/* Connect to the server. */
+	ret = perform_request(addr, port, reqline, &reply);
+	if (!ret) {
+		/* Older servers can still receive text if we buffer it beforehand. */
+		if (!opts.binary && (type == REQ_TYPE_TEXT)) {
+			char *text;
+			size_t len;
+
+			reqline_free(reqline);
+			len = read_stdin(&text, false);
+			if (len == 0)
+				return false;
+
+			ret = send_text(addr, port, text, len);
+			free(text);
+			return ret;
 		}
+
+		goto cleanup;
 	}
 
-#ifdef _DEBUG
-	/* Print reply for debugging. */
-	log_printf(LOG_INFO, "Server reply: %s", line);
-#endif /* _DEBUG */
+	/* Check if the server replied with an error. */
+	if (reply->code != 100) {
+		print_reply_error(reply);
+		ret = false;
+		goto cleanup;
+	}
 
-	/* Parse reply from server and return it. */
-	return reply_parse(line);
+	/* Only honor the flags that the server has accepted. */
+	reqline->flags &= reply->flags | REQ_FLAG_CHUNKED;
+
+	/* Stream the contents. */
+#ifdef _WIN32
+	if (type == REQ_TYPE_FILE)
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif /* _WIN32 */
+	if (!client_stream_transfer(&conn_client.sockfd, reqline, stdin)) {
+		log_printf(LOG_NOTICE, "Stream transfer %s", (running) ? "failed" :
+			"canceled");
+		ret = false;
+		goto cleanup;
+	}
+
+	/* Wait for the server to confirm it received everything. */
+	ret = process_final_reply(&conn_client);
+
+cleanup:
+	/* Free request line object and close the socket. */
+	reqline_free(reqline);
+	reply_free(reply);
+	if (conn_client.sockfd != SOCKERR) {
+		socket_close(conn_client.sockfd, true);
+		conn_client.sockfd = SOCKERR;
+	}
+	running = false;
+
+	return ret;
 }
 
 /**
- * Connects to the server, sends the request line, waits, and processes the
- * server's reply.
+ * Handles the entire process of synchronizing a directory with a server. Our
+ * manifest of the directory is sent over, the server replies with the files
+ * that it's missing or that have changed, and only those are then sent.
  *
- * @param addr    Address of the server to connect to.
- * @param port    Port to connect to the server on.
- * @param reqline Request line object to be sent over to the server.
- * @param reply   Where to store the parsed reply from the server. May be NULL
- *                if an error occurred during parsing.
+ * @param addr Address of the server to synchronize the directory with.
+ * @param port Port used to communicate with the server.
+ * @param path Path of the directory to be synchronized.
  *
- * @return TRUE if the entire operation was successful, FALSE otherwise.
+ * @return TRUE if the operation was successful, FALSE otherwise.
  */
-bool perform_request(const char *addr, const char *port, reqline_t *reqline,
-                     reply_t **reply) {
-	bool ret = true;
+bool send_sync(const char *addr, const char *port, const char *path) {
+	uint8_t hdr[REQ_SYNC_HDR_LEN];
+	manifest_codec_t codec;
+	manifest_entry_t entry;
+	sync_pack_t pack;
+	reqline_t *reqline;
+	reply_t *reply;
+	uint8_t *want;
+	uint64_t count;
+	uint64_t mtime;
+	uint64_t size;
+	uint64_t sent;
+	uint64_t i;
+	uint32_t nwant;
+	syncop_t op;
+	FILE *list;
+	bool end;
+	bool dir;
+	bool ok;
+	bool ret;
 
-	/* Check if we have a valid reply object pointer. */
-	if (reply == NULL) {
-		log_printf(LOG_CRIT, "Reply object pointer cannot be NULL");
+	/* Initialize variables. */
+	reply = NULL;
+	want = NULL;
+	list = NULL;
+	pack.buf = NULL;
+
+	/* Check if the directory actually exists. */
+	if (!path_stat(path, &dir, &size, &mtime) || !dir) {
+		log_printf(LOG_ERROR, "Directory \"%s\" does not exist", path);
 		return false;
 	}
 
-	/* Connect to the server. */
-	running = true;
-	sockfd_client = socket_new_client(addr, port);
-	if (sockfd_client == SOCKERR)
+	/* Build request line object. */
+	reqline = reqline_new();
+	if (reqline == NULL)
 		return false;
-	log_printf(LOG_INFO, "Connected to the server on %s:%s", addr, port);
+	reqline_type_set(reqline, REQ_TYPE_SYNC);
+	reqline->size = 0;
+	reqline->name = path_basename(path);
+	if (opts.checksums)
+		reqline->flags |= REQ_FLAG_CHECKSUM;
 
-	/* Send request line. */
-	if (reqline_send(sockfd_client, reqline) == 0)
-		return false;
-	log_printf(LOG_INFO, "Sent %s request", reqline->stype);
+	/* Connect to the server. */
+	ret = perform_request(addr, port, reqline, &reply);
+	if (!ret)
+		goto cleanup;
 
-	/* Wait and process the server reply. */
-	*reply = process_server_reply(&sockfd_client);
-	if (*reply == NULL)
-		return false;
+	/* Check if the server replied with an error. */
+	if (reply->code != 100) {
+		print_reply_error(reply);
+		ret = false;
+		goto cleanup;
+	}
+	ret = false;
+	reqline->flags &= reply->flags;
 
-#ifdef _DEBUG
-	/* Print parsed reply for debugging. */
-	log_printf(LOG_INFO, "Parsed server reply: (%u) [%s] \"%s\"",
-		(*reply)->code, (*reply)->type, (*reply)->msg);
-#endif /* _DEBUG */
+	/* Let the server know what we have and find out what it wants. */
+	list = sync_send_manifest(conn_client.sockfd, path);
+	if (list == NULL)
+		goto cleanup;
+	if (!conn_recv_all(&conn_client, hdr, REQ_SYNC_HDR_LEN) ||
+			!sync_parse(hdr, &op, &nwant, &count, &mtime) ||
+			(op != SYNC_OP_WANT)) {
+		log_printf(LOG_ERROR, "Server didn't reply with the files it wants");
+		goto cleanup;
+	}
+	want = (uint8_t *)malloc((size_t)((count + 7) / 8) + 1);
+	if (want == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate list of wanted files");
+		goto cleanup;
+	}
+	if (!conn_recv_all(&conn_client, want, (size_t)((count + 7) / 8))) {
+		print_transfer_error("list of wanted files");
+		goto cleanup;
+	}
+	log_printf(LOG_INFO, "Server wants %lu of our %lu files",
+		(unsigned long)nwant, (unsigned long)count);
+	pack.buf = (uint8_t *)malloc(GL_SYNC_PACK_SIZE);
+	pack.len = 0;
+	pack.count = 0;
+	if (pack.buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate pack buffer");
+		goto cleanup;
+	}
+
+	/* Send the files that the server wants, packing their headers together
+	 * with their contents. */
+	manifest_codec_init(&codec);
+	socket_cork(conn_client.sockfd, true);
+	sent = 0;
+	for (i = 0; i < count; i++) {
+		if (!manifest_decode(&codec, sync_list_read, list, &entry, &end) ||
+				end) {
+			log_printf(LOG_ERROR, "Failed to read back our manifest");
+			goto cleanup;
+		}
+		if (!(want[i / 8] & (1 << (i % 8))))
+			continue;
+
+		/* Small files are sent together with others. */
+		if (entry.size < GL_SYNC_PACK_FILE_MAX) {
+			ok = sync_pack_add(conn_client.sockfd, reqline, &pack, path,
+				entry.path, &sent);
+		} else {
+			ok = sync_pack_flush(conn_client.sockfd, reqline, &pack) &&
+				sync_send_file(conn_client.sockfd, reqline, path, entry.path,
+				&sent);
+		}
+		if (!ok) {
+			log_printf(LOG_NOTICE, "Directory synchronization %s",
+				(running) ? "failed" : "canceled");
+			goto cleanup;
+		}
+	}
+	if (!sync_pack_flush(conn_client.sockfd, reqline, &pack)) {
+		log_printf(LOG_NOTICE, "Directory synchronization %s",
+			(running) ? "failed" : "canceled");
+		goto cleanup;
+	}
+	if (!sync_send(conn_client.sockfd, SYNC_OP_END, 0, 0, 0, NULL, 0)) {
+		print_transfer_error("end of the synchronization");
+		goto cleanup;
+	}
+	socket_cork(conn_client.sockfd, false);
+	log_printf(LOG_INFO, "Sent %lu files", (unsigned long)sent);
+
+	/* Wait for the server to confirm it received everything. */
+	ret = process_final_reply(&conn_client);
+
+cleanup:
+	/* Free request line object and close the socket. */
+	if (list != NULL)
+		fclose(list);
+	free(want);
+	free(pack.buf);
+	reqline_free(reqline);
+	reply_free(reply);
+	if (conn_client.sockfd != SOCKERR) {
+		socket_close(conn_client.sockfd, true);
+		conn_client.sockfd = SOCKERR;
+	}
+	running = false;
 
 	return ret;
 }
 
 /**
- * Prints out error messages based on a server's reply.
+ * Walks through a directory sending its manifest to the server, while also
+ * keeping a copy of it to be read back later.
  *
- * @param reply Server reply object.
+ * @param sockfd Connection to a server.
+ * @param path   Path of the directory being synchronized.
+ *
+ * @return Temporary file with the manifest that was sent or NULL if an error
+ *         occurred.
  */
-void print_reply_error(const reply_t *reply) {
-	switch (reply->code) {
-		case ERR_CODE_REQ_REFUSED:
-			log_printf(LOG_NOTICE, "User refused the request");
-			break;
-		default:
-			log_printf(LOG_ERROR, "Server replied with error: [%u %s] %s",
-				reply->code, reply->type, reply->msg);
-			break;
+FILE *sync_send_manifest(sockfd_t sockfd, const char *path) {
+	manifest_codec_t codec;
+	manifest_entry_t entry;
+	manifest_walk_t walk;
+	merkle_t tree;
+	uint8_t *buf;
+	size_t len;
+	FILE *list;
+	FILE *fh;
+	bool ok;
+
+	/* Get ourselves somewhere to keep the manifest. */
+	list = tmpfile();
+	buf = (uint8_t *)malloc(GL_SYNC_BUF + MANIFEST_ENTRY_MAX);
+	if ((list == NULL) || (buf == NULL)) {
+		log_syserr(LOG_CRIT, "Failed to allocate manifest buffers");
+		goto failed;
 	}
+	if (!manifest_walk_open(&walk, path))
+		goto failed;
+
+	/* List the files in batches. */
+	manifest_codec_init(&codec);
+	len = 0;
+	do {
+		ok = manifest_walk_next(&walk, &entry);
+		if (ok && opts.compare) {
+			/* Let the server compare the contents themselves. */
+			fh = fopen(walk.path, "rb");
+			if ((fh != NULL) && hashcache_tree(&hashcache, &tree, fh,
+					entry.size, REQ_DIGEST_LEAF)) {
+				memcpy(entry.digest, merkle_root(&tree), REQ_DIGEST_LEN);
+				entry.hashed = true;
+				merkle_free(&tree);
+			}
+			if (fh != NULL)
+				fclose(fh);
+		}
+		len += manifest_encode(&codec, (ok) ? &entry : NULL, buf + len);
+
+		/* Flush the batch when it's full or we're done. */
+		if ((len >= GL_SYNC_BUF) || !ok) {
+			if (!socket_send_all(sockfd, buf, len)) {
+				print_transfer_error("manifest");
+				manifest_walk_close(&walk);
+				goto failed;
+			}
+			if (fwrite(buf, sizeof(uint8_t), len, list) != len) {
+				log_syserr(LOG_ERROR, "Failed to keep a copy of the manifest");
+				manifest_walk_close(&walk);
+				goto failed;
+			}
+			len = 0;
+		}
+	} while (ok);
+	manifest_walk_close(&walk);
+	free(buf);
+	rewind(list);
+
+	return list;
+
+failed:
+	if (list != NULL)
+		fclose(list);
+	free(buf);
+
+	return NULL;
 }
 
 /**
- * Dumps the contents of a file through a TCP socket connection.
+ * Sends a file that's part of a directory synchronization.
  *
- * @param sockfd  Socket connection to a server that's ready to receive this.
- * @param reqline Request line object sent to the server.
- * @param fpath   Path to the file to be dumped over a socket.
+ * @param sockfd  Connection to a server.
+ * @param reqline Request line object of the synchronization.
+ * @param root    Path of the directory being synchronized.
+ * @param path    Path of the file inside the directory.
+ * @param sent    Incremented if the file was sent.
  *
- * @return Number of bytes transferred or 0 in case of an error.
+ * @return TRUE if the synchronization may go on, FALSE if it was interrupted.
  */
-size_t client_file_transfer(const sockfd_t *sockfd, const reqline_t *reqline,
-                            const char *fpath) {
-	FILE *fh;
+bool sync_send_file(sockfd_t sockfd, const reqline_t *reqline,
+                    const char *root, const char *path, uint64_t *sent) {
+	uint8_t *buf;
+	char *fname;
+	uint64_t acclen;
+	uint64_t mtime;
+	uint64_t size;
+	uint32_t crc;
 	size_t len;
-	size_t acclen;
-	uint8_t buf[SEND_BUF_LEN];
+	FILE *fh;
+	bool ret;
 
-	/* Open file for reading. */
-	fh = fopen(fpath, "rb");
+	/* Open the file as it is right now. */
+	fname = (char *)malloc(strlen(root) + strlen(path) + 2);
+	if (fname == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate synchronized file name");
+		return false;
+	}
+	sprintf(fname, "%s/%s", root, path);
+	fh = file_open_stat(fname, &size, &mtime);
 	if (fh == NULL) {
-		log_printf(LOG_ERROR, "Failed to open file \"%s\" for sending", fpath);
-		return 0;
+		log_printf(LOG_WARNING, "Skipping \"%s\" since it's gone", fname);
+		free(fname);
+		return true;
 	}
 
-	/* Pipe file contents straight to socket. */
+	/* Send its header and contents. */
+	ret = false;
+	buf = NULL;
+	if (!sync_send(sockfd, SYNC_OP_FILE, (uint32_t)strlen(path), size,
+			mtime, path, strlen(path))) {
+		print_transfer_error("file");
+		goto cleanup;
+	}
+	buf = bufpool_get();
+	if (buf == NULL)
+		goto cleanup;
 	acclen = 0;
-	buffered_progress(reqline->name, acclen, reqline->size);
-	while ((len = fread(buf, sizeof(uint8_t), SEND_BUF_LEN, fh)) > 0) {
-		if (send(*sockfd, buf, len, 0) < 0) {
+	crc = 0;
+	buffered_progress(path, 0, (size_t)size);
+	while (acclen < size) {
+		len = ((size - acclen) > GL_IOBUF_LEN) ? GL_IOBUF_LEN :
+			(size_t)(size - acclen);
+		if (fread(buf, sizeof(uint8_t), len, fh) != len) {
+			fprintf(stderr, "\n");
+			log_printf(LOG_ERROR, "File \"%s\" shrank while being sent", fname);
+			goto cleanup;
+		}
+		if (!socket_send_all(sockfd, buf, len)) {
+			fprintf(stderr, "\n");
 			print_transfer_error("file");
-			acclen = 0;
-			break;
+			goto cleanup;
 		}
+		if (reqline->flags & REQ_FLAG_CHECKSUM)
+			crc = crc32c(crc, buf, len);
 
-		/* Increment the accumulated length and display the progress. */
 		acclen += len;
-		buffered_progress(reqline->name, acclen, reqline->size);
+		buffered_progress(path, (size_t)acclen, (size_t)size);
 	}
+	fprintf(stderr, "\n");
 
-	/* Ensure we go to a new line before continuing to preserve the progress. */
+	/* Let the server verify what it has received. */
+	if ((reqline->flags & REQ_FLAG_CHECKSUM) && !send_crc(sockfd, crc))
+		goto cleanup;
+	(*sent)++;
+	ret = true;
+
+cleanup:
+	bufpool_put(buf);
+	fclose(fh);
+	free(fname);
+
+	return ret;
+}
+
+/**
+ * Adds a small file that's part of a directory synchronization to the pack of
+ * files that are sent together, sending the pack once it's full. Files that
+ * have grown too large since they were listed are sent on their own.
+ *
+ * @param sockfd  Connection to a server.
+ * @param reqline Request line object of the synchronization.
+ * @param pack    Pack of files that are waiting to be sent.
+ * @param root    Path of the directory being synchronized.
+ * @param path    Path of the file inside the directory.
+ * @param sent    Incremented if the file was added or sent.
+ *
+ * @return TRUE if the synchronization may go on, FALSE if it was interrupted.
+ */
+bool sync_pack_add(sockfd_t sockfd, const reqline_t *reqline,
+                   sync_pack_t *pack, const char *root, const char *path,
+                   uint64_t *sent) {
+	char *fname;
+	uint64_t mtime;
+	uint64_t size;
+	size_t len;
+	FILE *fh;
+	bool ret;
+
+	/* Open the file as it is right now. */
+	fname = (char *)malloc(strlen(root) + strlen(path) + 2);
+	if (fname == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate synchronized file name");
+		return false;
+	}
+	sprintf(fname, "%s/%s", root, path);
+	fh = file_open_stat(fname, &size, &mtime);
+	if (fh == NULL) {
+		log_printf(LOG_WARNING, "Skipping \"%s\" since it's gone", fname);
+		free(fname);
+		return true;
+	}
+
+	/* Send files that aren't small anymore on their own. */
+	ret = false;
+	len = REQ_SYNC_ENTRY_LEN + strlen(path);
+	if (size >= GL_SYNC_PACK_FILE_MAX) {
+		fclose(fh);
+		free(fname);
+		return sync_pack_flush(sockfd, reqline, pack) &&
+			sync_send_file(sockfd, reqline, root, path, sent);
+	}
+
+	/* Make room for it in the pack. */
+	if (((pack->len + len + size) > GL_SYNC_PACK_SIZE) &&
+			!sync_pack_flush(sockfd, reqline, pack)) {
+		goto cleanup;
+	}
+
+	/* Append it to the pack. */
+	sync_entry_pack(pack->buf + pack->len, path, (uint32_t)size, mtime);
+	if (fread(pack->buf + pack->len + len, sizeof(uint8_t), (size_t)size,
+			fh) != size) {
+		log_printf(LOG_ERROR, "File \"%s\" shrank while being sent", fname);
+		goto cleanup;
+	}
+	pack->len += len + (size_t)size;
+	pack->count++;
+	(*sent)++;
+	ret = true;
+
+cleanup:
+	fclose(fh);
+	free(fname);
+
+	return ret;
+}
+
+/**
+ * Sends the pack of small files that are waiting to be sent, if there are any.
+ *
+ * @param sockfd  Connection to a server.
+ * @param reqline Request line object of the synchronization.
+ * @param pack    Pack of files that are waiting to be sent. Will be emptied.
+ *
+ * @return TRUE if the pack was sent, FALSE otherwise.
+ */
+bool sync_pack_flush(sockfd_t sockfd, const reqline_t *reqline,
+                     sync_pack_t *pack) {
+	/* Do we even have anything to do? */
+	if (pack->count == 0)
+		return true;
+
+	/* Send the pack in one go. */
+	if (!sync_send(sockfd, SYNC_OP_PACK, pack->count, pack->len, 0,
+			pack->buf, pack->len)) {
+		print_transfer_error("pack of files");
+		return false;
+	}
+	if ((reqline->flags & REQ_FLAG_CHECKSUM) &&
+			!send_crc(sockfd, crc32c(0, pack->buf, pack->len))) {
+		return false;
+	}
+	log_printf(LOG_INFO, "Sent a pack of %u files (%lu bytes)", pack->count,
+		(unsigned long)pack->len);
+
+	pack->len = 0;
+	pack->count = 0;
+
+	return true;
+}
+
+/**
+ * Reads back a part of the manifest we've sent.
+ *
+ * @param arg File handle of the manifest.
+ * @param buf Buffer where the bytes will be stored.
+ * @param len Number of bytes to read.
+ *
+ * @return TRUE if all the bytes were read, FALSE otherwise.
+ */
+bool sync_list_read(void *arg, void *buf, size_t len) {
+	return fread(buf, sizeof(uint8_t), len, (FILE *)arg) == len;
+}
+
+/**
+ * Processes the server's reply to a request.
+ *
+ * @param conn   Connection to a server.
+ *
+ * @return Server reply object if the operation was successful, or NULL if any
+ *         errors occurred during the transfer.
+ */
+reply_t *process_server_reply(conn_t *conn) {
+	reply_t *reply;
+	ssize_t len;
+
+	/* Receive the reply straight into the object that'll point to it. */
+	reply = reply_new();
+	if (reply == NULL)
+		return NULL;
+	if ((len = conn_recv_line(conn, reply->line, GL_REPLYLINE_MAX)) < 0)
+		goto failed;
+
+	/* Ensure the reply wasn't too long. */
+	if (len >= GL_REPLYLINE_MAX) {
+		log_printf(LOG_WARNING, "Reply from server unusually long. Aborting");
+		goto failed;
+	}
+
+	/* Print reply for debugging. */
+	log_printf(LOG_DEBUG, "Server reply: %s", reply->line);
+
+	/* Parse reply from server and return it. */
+	if (!reply_parse(reply->line, (size_t)len, reply))
+		goto failed;
+
+	return reply;
+
+failed:
+	reply_free(reply);
+	return NULL;
+}
+
+/**
+ * Connects to the server, sends the request line, waits, and processes the
+ * server's reply.
+ *
+ * @param addr    Address of the server to connect to.
+ * @param port    Port to connect to the server on.
+ * @param reqline Request line object to be sent over to the server.
+ * @param reply   Where to store the parsed reply from the server. May be NULL
+ *                if an error occurred during parsing.
+ *
+ * @return TRUE if the entire operation was successful, FALSE otherwise.
+ */
+bool perform_request(const char *addr, const char *port, reqline_t *reqline,
+                     reply_t **reply) {
+	char buf[GL_REPLYLINE_MAX];
+	bool ret = true;
+
+	/* Check if we have a valid reply object pointer. */
+	if (reply == NULL) {
+		log_printf(LOG_CRIT, "Reply object pointer cannot be NULL");
+		return false;
+	}
+
+	/* Connect to the server. */
+	running = true;
+	conn_init(&conn_client, socket_new_client(addr, port));
+	if (conn_client.sockfd == SOCKERR)
+		return false;
+	log_printf(LOG_INFO, "Connected to the server on %s:%s", addr, port);
+
+	/* Send request header. */
+	if (opts.binary) {
+		if (reqline_send_bin(conn_client.sockfd, reqline) == 0)
+			return false;
+	} else {
+		if (reqline_send(conn_client.sockfd, reqline) == 0)
+			return false;
+	}
+	log_printf(LOG_INFO, "Sent %s request", reqline->stype);
+
+	/* Wait and process the server reply. */
+	*reply = process_server_reply(&conn_client);
+	if (*reply == NULL)
+		return false;
+
+	/* Fall back to a text request line if the server doesn't understand us. */
+	if (opts.binary && (((*reply)->code == ERR_CODE_REQ_BAD) ||
+			((*reply)->code == ERR_CODE_UNKNOWN))) {
+		log_printf(LOG_NOTICE, "Server doesn't support binary request "
+			"headers, falling back to a text request line");
+		reply_free(*reply);
+		*reply = NULL;
+
+		/* Let older servers finish replying before hanging up on them. */
+		while (conn_recv(&conn_client, buf, GL_REPLYLINE_MAX) > 0)
+			;
+		socket_close(conn_client.sockfd, true);
+		conn_client.sockfd = SOCKERR;
+		opts.binary = false;
+
+		/* Text request lines can't express content of unknown length. */
+		if (reqline->flags & REQ_FLAG_CHUNKED) {
+			log_printf(LOG_NOTICE, "Server doesn't support streaming content "
+				"of unknown length");
+			return false;
+		}
+
+		return perform_request(addr, port, reqline, reply);
+	}
+
+	/* Print parsed reply for debugging. */
+	log_printf(LOG_DEBUG, "Parsed server reply: (%u) [%s] \"%s\"",
+		(*reply)->code, (*reply)->type, (*reply)->msg);
+
+	return ret;
+}
+
+/**
+ * Prints out error messages based on a server's reply.
+ *
+ * @param reply Server reply object.
+ */
+void print_reply_error(const reply_t *reply) {
+	switch (reply->code) {
+		case ERR_CODE_REQ_REFUSED:
+			log_printf(LOG_NOTICE, "User refused the request");
+			break;
+		case ERR_CODE_CHECKSUM:
+			log_printf(LOG_ERROR, "Server received corrupted contents "
+				"(checksum mismatch)");
+			break;
+		default:
+			log_printf(LOG_ERROR, "Server replied with error: [%u %s] %s",
+				reply->code, reply->type, reply->msg);
+			break;
+	}
+}
+
+/**
+ * Dumps the contents of a file through a TCP socket connection.
+ *
+ * @param sockfd  Connection to a server that's ready to receive this.
+ * @param reqline Request line object sent to the server.
+ * @param fh      Handle of the file to be dumped over a socket, positioned at
+ *                its beginning.
+ *
+ * @return Number of bytes transferred or 0 in case of an error.
+ */
+size_t client_file_transfer(const sockfd_t *sockfd, const reqline_t *reqline,
+                            FILE *fh) {
+	size_t len;
+	size_t acclen;
+	uint32_t crc;
+	uint8_t *buf;
+
+	/* Compress the file contents if the server agreed to it. */
+	if (compress_method(reqline->flags) != COMPRESS_NONE) {
+		return (client_compressed_transfer(sockfd, reqline, fh)) ?
+			reqline->size : 0;
+	}
+
+	/* Borrow a buffer only for as long as we are moving the contents. */
+	buf = bufpool_get();
+	if (buf == NULL)
+		return 0;
+
+	/* Pipe file contents straight to socket. */
+	acclen = 0;
+	crc = 0;
+	buffered_progress(reqline->name, acclen, reqline->size);
+	while ((len = fread(buf, sizeof(uint8_t), GL_IOBUF_LEN, fh)) > 0) {
+		if (!socket_send_all(*sockfd, buf, len)) {
+			print_transfer_error("file");
+			acclen = 0;
+			break;
+		}
+		if (reqline->flags & REQ_FLAG_CHECKSUM)
+			crc = crc32c(crc, buf, len);
+
+		/* Increment the accumulated length and display the progress. */
+		acclen += len;
+		buffered_progress(reqline->name, acclen, reqline->size);
+	}
+	bufpool_put(buf);
+
+	/* Ensure we go to a new line before continuing to preserve the progress. */
 	if (acclen > 0)
 		fprintf(stderr, "\n");
 
-	/* Close the file handle and return. */
-	fclose(fh);
+	/* Let the server verify what it has received. */
+	if ((acclen > 0) && (reqline->flags & REQ_FLAG_CHECKSUM) &&
+			!(reqline->flags & REQ_FLAG_MERKLE)) {
+		if (!send_crc(*sockfd, crc))
+			acclen = 0;
+	}
+
 	return acclen;
 }
 
+/**
+ * Sends the checksum of the contents that were just transferred.
+ *
+ * @param sockfd Connection to a server.
+ * @param crc    Checksum to be sent.
+ *
+ * @return TRUE if the checksum was sent, FALSE otherwise.
+ */
+bool send_crc(sockfd_t sockfd, uint32_t crc) {
+	uint8_t buf[CRC32C_LEN];
+
+	crc32c_pack(buf, crc);
+	if (send(sockfd, buf, CRC32C_LEN, 0) != CRC32C_LEN) {
+		print_transfer_error("checksum");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Waits for the server to confirm that it has received all of the contents.
+ *
+ * @param conn   Connection to a server.
+ *
+ * @return TRUE if the server received everything, FALSE otherwise.
+ */
+bool process_final_reply(conn_t *conn) {
+	reply_t *reply;
+	bool ret;
+
+	/* Get the reply from the server. */
+	reply = process_server_reply(conn);
+	if (reply == NULL) {
+		log_printf(LOG_ERROR, "Server didn't confirm the transfer");
+		return false;
+	}
+
+	/* Check if everything went fine. */
+	ret = reply->code == 200;
+	if (!ret)
+		print_reply_error(reply);
+	reply_free(reply);
+
+	return ret;
+}
+
+/**
+ * Answers the questions the server asks while comparing its Merkle tree of the
+ * file with ours, sending it again only the pieces that got damaged, until it
+ * replies with the outcome of the transfer.
+ *
+ * @param conn    Connection to a server.
+ * @param reqline Request line object of the transfer.
+ * @param fpath   Path to the file that was sent.
+ * @param fh      Handle of the file that was sent.
+ *
+ * @return TRUE if the server received everything, FALSE otherwise.
+ */
+bool merkle_verify_send(conn_t *conn, const reqline_t *reqline,
+                        const char *fpath, FILE *fh) {
+	uint8_t hdr[GL_REPLYLINE_MAX + 1];
+	uint8_t *buf;
+	uint8_t *idxbuf;
+	uint64_t idx;
+	uint32_t count;
+	uint32_t len;
+	uint32_t i;
+	verifyop_t op;
+	uint8_t level;
+	merkle_t tree;
+	reply_t reply;
+	ssize_t rlen;
+	size_t hlen;
+	bool ret;
+	int j;
+
+	/* Build our tree and let the server compare its root with its own. */
+	ret = false;
+	buf = NULL;
+	idxbuf = NULL;
+	if (!hashcache_tree(&hashcache, &tree, fh, reqline->size, reqline->leaf))
+		return false;
+	buf = (uint8_t *)malloc(reqline->leaf);
+	if (buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate Merkle tree leaf buffer");
+		goto cleanup;
+	}
+	if (!socket_send_all(conn->sockfd, merkle_root(&tree), MERKLE_HASH_LEN)) {
+		print_transfer_error("Merkle tree root");
+		goto cleanup;
+	}
+
+	while (true) {
+		/* Get the next request from the server. */
+		if (!conn_recv_all(conn, hdr, REQ_VERIFY_HDR_LEN)) {
+			log_printf(LOG_ERROR, "Server didn't confirm the transfer");
+			goto cleanup;
+		}
+
+		/* Anything that isn't a request must be the final reply. */
+		if (!verify_parse(hdr, &op, &level, &count)) {
+			/* Read the rest of the reply line. */
+			hlen = REQ_VERIFY_HDR_LEN;
+			hdr[hlen] = '\0';
+			if (hdr[hlen - 1] != '\n') {
+				rlen = conn_recv_line(conn, (char *)hdr + hlen,
+					GL_REPLYLINE_MAX - hlen);
+				if (rlen > 0)
+					hlen += (size_t)rlen;
+			}
+
+			/* Check if everything went fine. */
+			if (!reply_parse((char *)hdr, hlen, &reply)) {
+				log_printf(LOG_ERROR, "Server didn't confirm the transfer");
+				goto cleanup;
+			}
+			ret = reply.code == 200;
+			if (!ret)
+				print_reply_error(&reply);
+
+			goto cleanup;
+		}
+
+		/* Ensure the request makes sense for our tree. */
+		if ((level >= tree.nlevels) || (count == 0) ||
+				(count > tree.counts[level]) ||
+				((op == VERIFY_OP_RESEND) && (level != 0))) {
+			log_printf(LOG_ERROR, "Server sent an invalid verification "
+				"request");
+			goto cleanup;
+		}
+
+		/* Get the indexes the request refers to. */
+		idxbuf = (uint8_t *)malloc((size_t)count * sizeof(uint64_t));
+		if (idxbuf == NULL) {
+			log_syserr(LOG_CRIT, "Failed to allocate verification indexes");
+			goto cleanup;
+		}
+		if (!conn_recv_all(conn, idxbuf, (size_t)count *
+				sizeof(uint64_t))) {
+			print_transfer_error("verification");
+			goto cleanup;
+		}
+
+		/* Answer the server. */
+		if (op == VERIFY_OP_RESEND)
+			log_printf(LOG_WARNING, "Sending %u damaged pieces again", count);
+		for (i = 0; i < count; i++) {
+			idx = 0;
+			for (j = 0; j < 8; j++)
+				idx = (idx << 8) | idxbuf[(i * sizeof(uint64_t)) + j];
+			if (idx >= tree.counts[level]) {
+				log_printf(LOG_ERROR, "Server sent an invalid verification "
+					"request");
+				goto cleanup;
+			}
+
+			if (op == VERIFY_OP_HASHES) {
+				if (!socket_send_all(conn->sockfd,
+						merkle_node(&tree, level, idx), MERKLE_HASH_LEN)) {
+					print_transfer_error("Merkle tree");
+					goto cleanup;
+				}
+			} else {
+				len = merkle_leaf_len(&tree, idx);
+				if (!file_pread(fh, buf, len, idx * reqline->leaf)) {
+					log_syserr(LOG_ERROR, "Failed to read file \"%s\"",
+						fpath);
+					goto cleanup;
+				}
+				if (!socket_send_all(conn->sockfd, buf, len)) {
+					print_transfer_error("file");
+					goto cleanup;
+				}
+			}
+		}
+
+		free(idxbuf);
+		idxbuf = NULL;
+	}
+
+cleanup:
+	/* Free up resources. */
+	merkle_free(&tree);
+	free(idxbuf);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * Sends a file striped across multiple parallel connections. Starts with a
+ * single connection and keeps adding more for as long as the aggregate
+ * throughput keeps improving.
+ *
+ * @param addr    Address of the server to connect to.
+ * @param port    Port to connect to the server on.
+ * @param reqline Request line object that the server agreed to stripe.
+ * @param fpath   Path to the file to be sent.
+ * @param fh      Handle of the file, which is shared by the workers.
+ * @param digest  Where to store the checksum of the entire file. Set to NULL
+ *                if checksums aren't in use.
+ *
+ * @return TRUE if all of the stripes were transferred, FALSE otherwise.
+ */
+bool client_striped_transfer(const char *addr, const char *port,
+                             const reqline_t *reqline, const char *fpath,
+                             FILE *fh, uint32_t *digest) {
+	thread_t threads[GL_STRIPES_MAX];
+	unsigned int nthreads;
+	stripe_job_t job;
+	uint64_t tune_ts;
+	size_t tune_acclen;
+	size_t last_rate;
+	size_t rate;
+	size_t acclen;
+	size_t i;
+	bool pending;
+	bool tuning;
+	bool busy;
+	bool ret;
+
+	/* Set up the job shared between the worker threads. */
+	job.addr = addr;
+	job.port = port;
+	job.fpath = fpath;
+	job.fh = fh;
+	job.reqline = reqline;
+	job.nchunks = (reqline->size + reqline->chunk - 1) / reqline->chunk;
+	job.next = 0;
+	job.acclen = 0;
+	job.active = 0;
+	job.failed = false;
+	job.crcs = NULL;
+	if (digest != NULL) {
+		job.crcs = (uint32_t *)calloc(job.nchunks, sizeof(uint32_t));
+		if (job.crcs == NULL) {
+			log_syserr(LOG_CRIT, "Failed to allocate stripe checksums");
+			return false;
+		}
+	}
+	mutex_init(&job.lock);
+
+	/* Start off with a single connection. */
+	nthreads = 0;
+	tuning = true;
+	last_rate = 0;
+	tune_acclen = 0;
+	tune_ts = clock_ms();
+	busy = true;
+	buffered_progress(reqline->name, 0, reqline->size);
+	while (busy) {
+		/* Check how the transfer is going. */
+		mutex_lock(&job.lock);
+		acclen = job.acclen;
+		pending = job.next < job.nchunks;
+		if (job.failed || !running)
+			tuning = false;
+		if ((nthreads > 0) && (job.active == 0))
+			busy = false;
+		mutex_unlock(&job.lock);
+
+		/* Open another connection if the last one improved the throughput. */
+		if (tuning && ((nthreads == 0) ||
+				((clock_ms() - tune_ts) >= GL_STRIPE_TUNE_MS))) {
+			rate = (size_t)(((acclen - tune_acclen) * 1000) /
+				((clock_ms() - tune_ts) + 1));
+			if ((nthreads > 0) && ((rate < (last_rate + (last_rate / 10))) ||
+					(nthreads >= opts.streams) || !pending)) {
+				/* Throughput has settled. */
+				log_printf(LOG_INFO, "Settled on %u streams (%lu bytes/s each)",
+					nthreads, (unsigned long)(rate / nthreads));
+				tuning = false;
+			} else {
+				mutex_lock(&job.lock);
+				job.active++;
+				mutex_unlock(&job.lock);
+				if (thread_create(&threads[nthreads], stripe_worker, &job)) {
+					nthreads++;
+				} else {
+					mutex_lock(&job.lock);
+					job.active--;
+					mutex_unlock(&job.lock);
+					tuning = false;
+					if (nthreads == 0)
+						busy = false;
+				}
+			}
+
+			last_rate = rate;
+			tune_acclen = acclen;
+			tune_ts = clock_ms();
+		}
+
+		/* Display the progress and wait a bit. */
+		buffered_progress(reqline->name, acclen, reqline->size);
+		if (busy)
+			thread_sleep(100);
+	}
+
+	/* Wait for the workers to finish. */
+	while (nthreads > 0)
+		thread_join(threads[--nthreads]);
+	buffered_progress(reqline->name, job.acclen, reqline->size);
+	fprintf(stderr, "\n");
+	mutex_free(&job.lock);
+	ret = !job.failed && running && (job.acclen == reqline->size);
+
+	/* Combine the checksums of each stripe into the one of the entire file. */
+	if (digest != NULL) {
+		*digest = 0;
+		for (i = 0; i < job.nchunks; i++) {
+			*digest = crc32c_combine(*digest, job.crcs[i],
+				(i == (job.nchunks - 1)) ?
+				(reqline->size - (i * reqline->chunk)) : reqline->chunk);
+		}
+		free(job.crcs);
+	}
+
+	return ret;
+}
+
+/**
+ * Worker thread that sends stripes of a file over its own connection until
+ * there are none left.
+ *
+ * @param arg Striped transfer job object.
+ *
+ * @return Nothing.
+ */
+thread_ret_t THREAD_CALL stripe_worker(void *arg) {
+	stripe_job_t *job;
+	reqline_t stripe;
+	reply_t *reply;
+	conn_t conn;
+	uint32_t crc;
+	uint8_t *buf;
+	size_t acclen;
+	size_t len;
+	size_t idx;
+
+	/* Initialize variables. */
+	job = (stripe_job_t *)arg;
+	conn_init(&conn, SOCKERR);
+	buf = NULL;
+	reply = NULL;
+	stripe = *job->reqline;
+	stripe.name = NULL;
+	stripe.flags = 0;
+	reqline_type_set(&stripe, REQ_TYPE_STRIPE);
+
+	/* Open our own connection to the server. */
+	conn_init(&conn, socket_new_client(job->addr, job->port));
+	if (conn.sockfd == SOCKERR)
+		goto failed;
+
+	for (;;) {
+		/* Grab the next chunk to be sent. */
+		mutex_lock(&job->lock);
+		if (job->failed || !running || (job->next >= job->nchunks)) {
+			mutex_unlock(&job->lock);
+			break;
+		}
+		idx = job->next++;
+		mutex_unlock(&job->lock);
+
+		/* Request the server to accept the stripe. */
+		stripe.offset = (uint64_t)idx * job->reqline->chunk;
+		stripe.size = job->reqline->size - (size_t)stripe.offset;
+		if (stripe.size > job->reqline->chunk)
+			stripe.size = job->reqline->chunk;
+		if (reqline_send_bin(conn.sockfd, &stripe) == 0)
+			goto failed;
+		reply = process_server_reply(&conn);
+		if ((reply == NULL) || (reply->code != 100))
+			goto refused;
+		reply_free(reply);
+		reply = NULL;
+
+		/* Pipe the stripe from the shared file handle to the socket. */
+		buf = bufpool_get();
+		if (buf == NULL)
+			goto failed;
+		acclen = 0;
+		crc = 0;
+		while (running && (acclen < stripe.size)) {
+			len = ((stripe.size - acclen) > GL_IOBUF_LEN) ? GL_IOBUF_LEN :
+				(stripe.size - acclen);
+			if (!file_pread(job->fh, buf, len, stripe.offset + acclen)) {
+				log_printf(LOG_ERROR, "File \"%s\" ended unexpectedly",
+					job->fpath);
+				goto failed;
+			}
+			if (!socket_send_all(conn.sockfd, buf, len)) {
+				print_transfer_error("file");
+				goto failed;
+			}
+			if (job->crcs != NULL)
+				crc = crc32c(crc, buf, len);
+
+			/* Account for the transferred bytes. */
+			acclen += len;
+			mutex_lock(&job->lock);
+			job->acclen += len;
+			mutex_unlock(&job->lock);
+		}
+		bufpool_put(buf);
+		buf = NULL;
+		if (!running)
+			goto failed;
+
+		/* Let the server verify the stripe. */
+		if (job->crcs != NULL) {
+			if (!send_crc(conn.sockfd, crc))
+				goto failed;
+			job->crcs[idx] = crc;
+		}
+
+		/* Wait for the server to acknowledge the stripe. */
+		reply = process_server_reply(&conn);
+		if ((reply == NULL) || (reply->code != 200))
+			goto refused;
+		reply_free(reply);
+		reply = NULL;
+		log_printf(LOG_DEBUG, "Stripe %lu of \"%s\" sent (%lu bytes)",
+			(unsigned long)idx, job->fpath, (unsigned long)stripe.size);
+	}
+
+	goto cleanup;
+
+refused:
+	if (reply != NULL)
+		print_reply_error(reply);
+failed:
+	mutex_lock(&job->lock);
+	job->failed = true;
+	mutex_unlock(&job->lock);
+cleanup:
+	/* Free up resources and let the controller know we are done. */
+	reply_free(reply);
+	bufpool_put(buf);
+	bufpool_thread_exit();
+	if (conn.sockfd != SOCKERR)
+		socket_close(conn.sockfd, false);
+	mutex_lock(&job->lock);
+	job->active--;
+	mutex_unlock(&job->lock);
+
+	return 0;
+}
+
 /**
  * Dumps text through a TCP socket connection.
  *
- * @param sockfd Socket connection to a server that's ready to receive this.
+ * @param sockfd Connection to a server that's ready to receive this.
  * @param text   Text content to be dumped over a socket.
  * @param len    Length of the text to be sent over, not including the NUL
  *               terminator.
@@ -612,6 +1983,497 @@ size_t client_text_transfer(const sockfd_t *sockfd, const char *text,
 	return acclen;
 }
 
+/**
+ * Streams the contents of a file handle through a TCP socket connection using
+ * the chunked transfer encoding, until EOF is reached.
+ *
+ * @param sockfd  Connection to a server that's ready to receive this.
+ * @param reqline Request line object sent to the server.
+ * @param fh      File handle to read the contents from.
+ *
+ * @return TRUE if the entire content was transferred, FALSE otherwise.
+ */
+bool client_stream_transfer(const sockfd_t *sockfd, const reqline_t *reqline,
+                            FILE *fh) {
+	uint8_t buf[REQ_CHUNK_HDR_LEN + SEND_BUF_LEN + CRC32C_LEN];
+	uint32_t crc;
+	uint32_t *digest;
+	uint8_t *data;
+	const char *name;
+	size_t len;
+	size_t acclen;
+
+	/* Compress the contents if the server agreed to it. */
+	if (compress_method(reqline->flags) != COMPRESS_NONE)
+		return client_compressed_transfer(sockfd, reqline, fh);
+
+	/* Initialize some variables. */
+	data = buf + REQ_CHUNK_HDR_LEN;
+	crc = 0;
+	digest = (reqline->flags & REQ_FLAG_CHECKSUM) ? &crc : NULL;
+	name = (reqline->type == REQ_TYPE_TEXT) ? "Text" : reqline->name;
+	acclen = 0;
+	buffered_progress(name, acclen, SIZE_UNKNOWN);
+
+	/* Send each read as a chunk. Text is sent line by line as it's typed. */
+	while (true) {
+		if (reqline->type == REQ_TYPE_TEXT) {
+			if (fgets((char *)data, SEND_BUF_LEN, fh) == NULL)
+				break;
+			len = strlen((char *)data);
+		} else {
+			len = fread(data, sizeof(uint8_t), SEND_BUF_LEN, fh);
+			if (len == 0)
+				break;
+		}
+
+		/* Send the chunk over. */
+		if (!chunk_send(*sockfd, buf, len, digest)) {
+			print_transfer_error("stream");
+			return false;
+		}
+
+		/* Increment the accumulated length and display the progress. */
+		acclen += len;
+		buffered_progress(name, acclen, SIZE_UNKNOWN);
+	}
+	buffered_progress(name, acclen, acclen);
+	fprintf(stderr, "\n");
+
+	/* Check if we stopped because of an error. */
+	if (ferror(fh)) {
+		log_syserr(LOG_ERROR, "Failed to read the contents to be streamed");
+		return false;
+	}
+
+	/* Terminate the content with an empty chunk. */
+	if (!chunk_send(*sockfd, buf, 0, digest)) {
+		print_transfer_error("stream");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Sends only the parts of a file that changed since the copy the server has,
+ * letting it rebuild the file from the blocks of its copy that are unchanged.
+ *
+ * @param conn    Connection to a server that has agreed to this.
+ * @param reqline Request line object of the transfer.
+ * @param fh      Handle of the file to be sent, positioned at its beginning.
+ *
+ * @return TRUE if the file was entirely sent, FALSE otherwise.
+ */
+bool client_delta_transfer(conn_t *conn, const reqline_t *reqline,
+                           FILE *fh) {
+	uint8_t hdr[REQ_DELTA_HDR_LEN];
+	uint8_t digest[SHA256_LEN];
+	uint8_t *buf;
+	delta_xfer_t xfer;
+	deltasig_t sig;
+	deltaop_t op;
+	uint64_t size;
+	uint64_t n;
+	uint64_t i;
+	uint32_t block;
+	bool ret;
+
+	buf = NULL;
+	ret = false;
+	memset(&sig, 0, sizeof(deltasig_t));
+
+	/* Get the signature of the server's copy. */
+	if (!delta_send(conn->sockfd, DELTA_OP_SIGNATURE, 0, 0, NULL, 0) ||
+			!conn_recv_all(conn, hdr, REQ_DELTA_HDR_LEN)) {
+		print_transfer_error("delta signature");
+		goto cleanup;
+	}
+	if (!delta_parse(hdr, &op, &block, &size) || (op != DELTA_OP_SIGNATURE) ||
+			(block < GL_DELTA_BLOCK_MIN) || (block > GL_DELTA_BLOCK_MAX)) {
+		log_printf(LOG_ERROR, "Server sent an invalid delta signature");
+		goto cleanup;
+	}
+	if (!delta_sig_alloc(&sig, size, block))
+		goto cleanup;
+	buf = (uint8_t *)malloc(GL_DELTA_LITERAL_MAX);
+	if (buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate delta signature buffer");
+		goto cleanup;
+	}
+	for (i = 0; i < sig.count; i += n) {
+		n = GL_DELTA_LITERAL_MAX / DELTA_SIG_ENTRY_LEN;
+		if (n > (sig.count - i))
+			n = sig.count - i;
+
+		if (!conn_recv_all(conn, buf, (size_t)n * DELTA_SIG_ENTRY_LEN)) {
+			print_transfer_error("delta signature");
+			goto cleanup;
+		}
+		delta_sig_unpack(&sig, i, n, buf);
+	}
+	if (!delta_sig_index(&sig))
+		goto cleanup;
+
+	/* Send only what the server doesn't have, packing the small copy
+	 * instructions together instead of sending each on its own. */
+	xfer.sockfd = &conn->sockfd;
+	xfer.reqline = reqline;
+	xfer.sig = &sig;
+	xfer.acclen = 0;
+	xfer.literal = 0;
+	buffered_progress(reqline->name, xfer.acclen, reqline->size);
+	socket_cork(conn->sockfd, true);
+	if (!delta_generate(&sig, fh, client_delta_emit, &xfer, digest))
+		goto cleanup;
+	fprintf(stderr, "\n");
+
+	/* Let the server verify the file it has rebuilt. */
+	if (!delta_send(conn->sockfd, DELTA_OP_END, 0, 0, digest, SHA256_LEN)) {
+		print_transfer_error("file changes");
+		goto cleanup;
+	}
+	socket_cork(conn->sockfd, false);
+	log_printf(LOG_INFO, "Sent %lu bytes of new content out of %lu",
+		(unsigned long)xfer.literal, (unsigned long)xfer.acclen);
+	ret = true;
+
+cleanup:
+	delta_sig_free(&sig);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * Sends an instruction to rebuild a file to the server.
+ *
+ * @param arg Delta transfer object.
+ * @param op  Operation to be sent.
+ * @param buf New content for literals.
+ * @param len Length of the literal or number of blocks to be copied.
+ * @param idx Index of the first block to be copied.
+ *
+ * @return TRUE if the instruction was sent, FALSE otherwise.
+ */
+bool client_delta_emit(void *arg, deltaop_t op, const uint8_t *buf,
+                       uint32_t len, uint64_t idx) {
+	delta_xfer_t *xfer;
+
+	/* Send the instruction over. */
+	xfer = (delta_xfer_t *)arg;
+	if (!delta_send(*xfer->sockfd, op, len, idx, (op == DELTA_OP_LITERAL) ?
+			buf : NULL, len)) {
+		print_transfer_error("file changes");
+		return false;
+	}
+
+	/* Display the progress. */
+	if (op == DELTA_OP_LITERAL) {
+		xfer->acclen += len;
+		xfer->literal += len;
+	} else {
+		xfer->acclen += (size_t)delta_copy_len(xfer->sig, idx, len);
+	}
+	buffered_progress(xfer->reqline->name, xfer->acclen, xfer->reqline->size);
+
+	return true;
+}
+
+/**
+ * Sends a file split into content-defined chunks, letting the server tell us
+ * which ones it doesn't have yet so that only those are sent over.
+ *
+ * @param conn    Connection to a server that has agreed to this.
+ * @param reqline Request line object of the transfer.
+ * @param fpath   Path to the file to be sent.
+ * @param fh      Handle of the file, positioned at its beginning.
+ *
+ * @return TRUE if the file was entirely sent, FALSE otherwise.
+ */
+bool client_cdc_transfer(conn_t *conn, const reqline_t *reqline,
+                         const char *fpath, FILE *fh) {
+	uint8_t digest[SHA256_LEN];
+	cdc_chunk_t *batch;
+	uint8_t *window;
+	uint8_t *buf;
+	sha256_t ctx;
+	uint64_t acclen;
+	uint64_t sent;
+	uint32_t count;
+	size_t wlen;
+	size_t pos;
+	size_t len;
+	bool eof;
+	bool ret;
+
+	ret = false;
+
+	/* Allocate the buffers used to split the file. */
+	batch = (cdc_chunk_t *)malloc(GL_CDC_BATCH * sizeof(cdc_chunk_t));
+	window = (uint8_t *)malloc(CDC_WINDOW_LEN);
+	buf = (uint8_t *)malloc(GL_CDC_MAX);
+	if ((batch == NULL) || (window == NULL) || (buf == NULL)) {
+		log_syserr(LOG_CRIT, "Failed to allocate chunk transfer buffers");
+		goto cleanup;
+	}
+
+	sha256_init(&ctx);
+	acclen = 0;
+	sent = 0;
+	count = 0;
+	wlen = 0;
+	pos = 0;
+	eof = false;
+	buffered_progress(reqline->name, acclen, reqline->size);
+	while (running) {
+		/* Always have a whole chunk worth of contents to look at. */
+		if (!eof && ((wlen - pos) < GL_CDC_MAX)) {
+			memmove(window, window + pos, wlen - pos);
+			wlen -= pos;
+			pos = 0;
+			len = fread(window + wlen, sizeof(uint8_t), CDC_WINDOW_LEN - wlen,
+				fh);
+			wlen += len;
+			if (len < (CDC_WINDOW_LEN - (wlen - len))) {
+				if (ferror(fh)) {
+					log_syserr(LOG_ERROR, "Failed to read file \"%s\"",
+						fpath);
+					goto cleanup;
+				}
+				eof = true;
+			}
+		}
+
+		/* Split off the next chunk. */
+		if (pos < wlen) {
+			len = cdc_cut(window + pos, wlen - pos);
+			batch[count].offset = acclen;
+			batch[count].len = (uint32_t)len;
+			sha256(window + pos, len, batch[count].hash);
+			sha256_update(&ctx, batch[count].hash, CDC_HASH_LEN);
+			acclen += len;
+			pos += len;
+			count++;
+		}
+
+		/* Offer the batch to the server once it's full or we are done. */
+		if ((count == GL_CDC_BATCH) || ((pos == wlen) && eof && (count > 0))) {
+			if (!client_cdc_batch(conn, fh, batch, count, buf, &sent))
+				goto cleanup;
+			count = 0;
+			buffered_progress(reqline->name, acclen, reqline->size);
+		}
+		if ((pos == wlen) && eof)
+			break;
+	}
+	if (!running)
+		goto cleanup;
+	fprintf(stderr, "\n");
+
+	/* Let the server verify the file it has assembled. */
+	sha256_final(&ctx, digest);
+	if (!cdc_frame_send(conn->sockfd, CDC_OP_END, 0, acclen, digest,
+			SHA256_LEN)) {
+		print_transfer_error("file chunks");
+		goto cleanup;
+	}
+	log_printf(LOG_INFO, "Sent %lu bytes of new content out of %lu",
+		(unsigned long)sent, (unsigned long)acclen);
+	ret = true;
+
+cleanup:
+	free(batch);
+	free(window);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * Offers a batch of chunks to the server and sends the ones it asks for.
+ *
+ * @param conn   Connection to the server.
+ * @param fh     Handle of the file being sent.
+ * @param batch  Chunks of the batch.
+ * @param count  Number of chunks in the batch.
+ * @param buf    Buffer with room for the largest chunk, which is also
+ *               enough for the hashes of an entire batch.
+ * @param sent   Incremented by the number of bytes sent over.
+ *
+ * @return TRUE if the batch was sent, FALSE otherwise.
+ */
+bool client_cdc_batch(conn_t *conn, FILE *fh,
+                      const cdc_chunk_t *batch, uint32_t count, uint8_t *buf,
+                      uint64_t *sent) {
+	uint8_t hdr[REQ_CDC_HDR_LEN];
+	uint8_t want[(GL_CDC_BATCH + 7) / 8];
+	uint64_t val;
+	uint32_t nwant;
+	uint32_t i;
+	cdcop_t op;
+
+	/* Send the hashes of the chunks over. */
+	for (i = 0; i < count; i++)
+		cdc_chunk_pack(buf + ((size_t)i * CDC_ENTRY_LEN), &batch[i]);
+	if (!cdc_frame_send(conn->sockfd, CDC_OP_HASHES, count, 0, buf,
+			(size_t)count * CDC_ENTRY_LEN)) {
+		goto closed;
+	}
+
+	/* Find out which ones the server wants. */
+	if (!conn_recv_all(conn, hdr, REQ_CDC_HDR_LEN))
+		goto closed;
+	if (!cdc_frame_parse(hdr, &op, &nwant, &val) || (op != CDC_OP_WANT) ||
+			(nwant > count)) {
+		log_printf(LOG_ERROR, "Server sent an invalid chunk request");
+		return false;
+	}
+	if (!conn_recv_all(conn, want, (count + 7) / 8))
+		goto closed;
+
+	/* Send the chunks the server doesn't have in as few segments as we can. */
+	socket_cork(conn->sockfd, true);
+	for (i = 0; i < count; i++) {
+		if (!(want[i / 8] & (1 << (i % 8))))
+			continue;
+
+		if (!file_pread(fh, buf, batch[i].len, batch[i].offset)) {
+			log_syserr(LOG_ERROR, "Failed to read a chunk of the file");
+			return false;
+		}
+		if (!socket_send_all(conn->sockfd, buf, batch[i].len))
+			goto closed;
+		*sent += batch[i].len;
+		log_printf(LOG_DEBUG, "Chunk at %lu (%u bytes) sent",
+			(unsigned long)batch[i].offset, batch[i].len);
+	}
+	socket_cork(conn->sockfd, false);
+
+	return true;
+
+closed:
+	print_transfer_error("file chunks");
+	return false;
+}
+
+/**
+ * Sends the contents of a file handle compressed in blocks through a TCP socket
+ * connection, until EOF is reached. Blocks are compressed in parallel and sent
+ * in order as soon as they are ready, with how hard each one is compressed
+ * adapting to how fast the connection takes them.
+ *
+ * @param sockfd  Connection to a server that's ready to receive this.
+ * @param reqline Request line object of the transfer.
+ * @param fh      File handle to read the contents from.
+ *
+ * @return TRUE if the contents were entirely sent, FALSE otherwise.
+ */
+bool client_compressed_transfer(const sockfd_t *sockfd,
+                                const reqline_t *reqline, FILE *fh) {
+	char summary[COMPRESS_SUMMARY_LEN];
+	compblock_t *block;
+	compmethod_t method;
+	comptune_t tune;
+	comppool_t pool;
+	const char *name;
+	uint64_t start;
+	uint32_t crc;
+	size_t fsize;
+	size_t acclen;
+	size_t outlen;
+	bool eof;
+	bool ret;
+
+	/* Initialize some variables. */
+	method = compress_method(reqline->flags);
+	name = (reqline->type == REQ_TYPE_TEXT) ? "Text" : reqline->name;
+	fsize = (reqline->flags & REQ_FLAG_CHUNKED) ? SIZE_UNKNOWN : reqline->size;
+	acclen = 0;
+	outlen = 0;
+	crc = 0;
+	eof = false;
+	ret = false;
+
+	/* Get the workers ready. */
+	if (!comppool_init(&pool, false, method, opts.block, opts.threads))
+		return false;
+	comptune_init(&tune, reqline->flags & COMPRESS_FLAGS, pool.nthreads);
+
+	/* Keep the workers busy and send the blocks out as they are done. */
+	buffered_progress(name, acclen, fsize);
+	while (true) {
+		/* Send out the oldest block if it's done or if we can't do more. */
+		block = comppool_next(&pool, eof || (comppool_get(&pool) == NULL));
+		if (block != NULL) {
+			start = clock_us();
+			if (!socket_send_all(*sockfd, block->out, block->outlen)) {
+				print_transfer_error("compressed content");
+				goto cleanup;
+			}
+			comptune_update(&tune, block, clock_us() - start);
+			log_printf(LOG_DEBUG, "Block of %lu bytes compressed into %lu "
+				"at level %d", (unsigned long)block->inlen,
+				(unsigned long)block->outlen, block->level);
+
+			/* Increment the accumulated length and display the progress. */
+			acclen += block->inlen;
+			outlen += block->outlen;
+			buffered_progress(name, acclen, fsize);
+			comppool_release(&pool);
+			continue;
+		} else if (eof) {
+			break;
+		}
+
+		/* Read the next block and hand it over to the workers. */
+		block = comppool_get(&pool);
+		block->inlen = fread(block->in, sizeof(uint8_t), opts.block, fh);
+		if (block->inlen == 0) {
+			eof = true;
+			continue;
+		}
+		if (reqline->flags & REQ_FLAG_CHECKSUM)
+			crc = crc32c(crc, block->in, block->inlen);
+		comptune_apply(&tune, block);
+		comppool_submit(&pool);
+	}
+	buffered_progress(name, acclen, (fsize == SIZE_UNKNOWN) ? acclen : fsize);
+	fprintf(stderr, "\n");
+
+	/* Check if we stopped because of an error. */
+	if (ferror(fh)) {
+		log_syserr(LOG_ERROR, "Failed to read the contents to be compressed");
+		goto cleanup;
+	}
+
+	/* Terminate the content with an empty block. */
+	block = comppool_get(&pool);
+	block->outlen = compress_block(method, block->level, block->in, 0,
+		block->out);
+	if (!socket_send_all(*sockfd, block->out, block->outlen)) {
+		print_transfer_error("compressed content");
+		goto cleanup;
+	}
+	outlen += block->outlen;
+
+	/* Let the server verify what it has received. */
+	if ((reqline->flags & REQ_FLAG_CHECKSUM) &&
+			!(reqline->flags & REQ_FLAG_MERKLE)) {
+		if (!send_crc(*sockfd, crc))
+			goto cleanup;
+	}
+	comptune_summary(&tune, summary);
+	log_printf(LOG_INFO, "Sent %lu bytes compressed into %lu on %u threads "
+		"(%s)", (unsigned long)acclen, (unsigned long)outlen,
+		(pool.nthreads > 0) ? pool.nthreads : 1, summary);
+	ret = true;
+
+cleanup:
+	comppool_free(&pool);
+	return ret;
+}
+
 /**
  * Prints out transfer error messages.
  *
@@ -622,9 +2484,7 @@ void print_transfer_error(const char *type) {
 
 	/* Check if the transfer has been canceled. */
 	if (!running) {
-#ifdef _DEBUG
-		log_sockerr(LOG_ERROR, "Transfer canceled. Suppressed error");
-#endif /* _DEBUG */
+		log_sockerr(LOG_DEBUG, "Transfer canceled. Suppressed error");
 		return;
 	}
 
@@ -647,12 +2507,10 @@ void print_transfer_error(const char *type) {
  * @param sig Signal handle that generated this interrupt.
  */
 void sigint_handler(int sig) {
-#ifdef _DEBUG
-	log_printf(LOG_INFO, "Received a SIGINT");
-#endif /* _DEBUG */
-
-	/* Cancel the request. */
-	cancel_request();
+	/* Only wake up the transfer, which cleans up after itself. */
+	interrupted = 1;
+	running = false;
+	socket_interrupt(conn_client.sockfd);
 
 	/* Don't let the signal propagate. */
 	signal(sig, SIG_IGN);
@@ -686,18 +2544,49 @@ BOOL WINAPI ConsoleSignalHandler(DWORD dwCtrlType) {
  * @param prog Program's name from argv[0].
  */
 void usage(const char *prog) {
-	printf("usage: %s [-p port] [-u] [-t] addr attach\n\n", prog);
+	printf("usage: %s [-p port] [-n name] [-j streams] [-B kbytes] "
+		"[-T threads] [-c] [-d] [-D] [-k] [-s] [-u] [-t] [-L] [-C] [-Z] [-q] "
+		"[-v] addr "
+		"attach\n\n", prog);
 	puts("arguments:");
 	puts("    addr       Address where the server is listening on");
-	puts("    attach     File, URL or text to send to the server. If a '-' "
-	     "(dash) is ");
-	puts("               supplied, the content is read from STDIN until EOF");
+	puts("    attach     File, URL, text or directory to send to the server. "
+	     "If a '-'");
+	puts("               (dash) is supplied, the content is streamed from "
+	     "STDIN until EOF");
 	puts("");
 	puts("options:");
+	puts("    -B kbytes  Size of the blocks of content compressed in parallel");
+	puts("    -C         Don't verify the transferred contents with checksums");
+	puts("    -c         Compare the contents of files instead of their "
+	     "modification");
+	puts("               times when synchronizing a directory");
+	puts("    -d         Only send what changed if the server has an older "
+	     "copy of the");
+	puts("               file, replacing it with the newer one");
+	puts("    -D         Always send the contents even if the server already "
+	     "has them");
 	puts("    -h         Displays this message");
+	puts("    -k         Split files into chunks and only send the ones the "
+	     "server");
+	puts("               doesn't have from any earlier transfer");
+	puts("    -j streams Maximum number of parallel connections used for large "
+	     "files");
+	puts("    -L         Use legacy text request lines instead of binary "
+	     "headers");
+	puts("    -n name    Name of the file when streaming from STDIN");
 	puts("    -p port    Port the server is listening on");
+	puts("    -q         Only log warnings and errors");
+	puts("    -s         Synchronize a directory, only sending the files "
+	     "that are new");
+	puts("               or have changed since the server's copy");
 	puts("    -t         Send text instead of a file");
+	puts("    -T threads Number of compression threads (all processors by "
+	     "default)");
 	puts("    -u         Send a URL instead of a file");
+	puts("    -v         Log every chunk that's transferred (only in debug "
+	     "builds)");
+	puts("    -Z         Don't compress the transferred contents");
 	puts("");
 	puts(GL_COPYRIGHT);
 }
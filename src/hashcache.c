@@ -0,0 +1,640 @@
+/**
+ * hashcache.c
+ * Persistent cache of the hashes of the files that were sent, so that files
+ * that haven't changed since don't have to be read and hashed again.
+ *
+ * The cache is a single file laid out exactly as it's used in memory: a header,
+ * a fixed-size record for each file, and then the hashes of the leaves of the
+ * Merkle trees of every file. It's mapped straight into memory and indexed by
+ * device and inode for lookups. Files that are hashed and records that are used
+ * are only kept track of in memory, and the cache file is rewritten once, when
+ * the cache is closed, keeping every file that was used since it was opened
+ * and as many of the most recently used other ones as its bounds allow. Files
+ * are identified by their device, inode, size and modification time, so any
+ * change to a file makes its record go stale.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "hashcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defaults.h"
+#include "logging.h"
+#include "utils.h"
+
+/* Identification of the cache file. */
+#define HASHCACHE_MAGIC   0x43484C47UL
+#define HASHCACHE_VERSION 1
+
+/* Smallest number of slots in the index. */
+#define HASHCACHE_SLOTS_MIN 64
+
+/* Record that isn't in the cache. */
+#define HASHCACHE_NONE 0xFFFFFFFFUL
+
+/**
+ * Header of the cache file.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t tick;
+	uint64_t unused;
+} hashcache_hdr_t;
+
+/* Private functions. */
+static char *hashcache_path(void);
+static void hashcache_map(hashcache_t *cache);
+static bool hashcache_index(hashcache_t *cache);
+static bool hashcache_grow(hashcache_t *cache, uint32_t count);
+static void hashcache_insert(hashcache_t *cache, uint32_t id);
+static const hashcache_rec_t *hashcache_get(const hashcache_t *cache,
+                                            uint32_t id);
+static uint64_t *hashcache_used(hashcache_t *cache, uint32_t id);
+static uint8_t *hashcache_leaves(const hashcache_t *cache, uint32_t id);
+static uint32_t hashcache_find(hashcache_t *cache, const hashcache_rec_t *key,
+                               bool evict);
+static bool hashcache_load(const hashcache_t *cache, uint32_t id,
+                           merkle_t *tree);
+static void hashcache_add(hashcache_t *cache, hashcache_rec_t *rec,
+                          const merkle_t *tree);
+static void hashcache_write(hashcache_t *cache);
+static void hashcache_free(hashcache_t *cache);
+static size_t hashcache_hash(const hashcache_rec_t *rec);
+static int hashcache_cmp(const void *a, const void *b);
+
+/**
+ * Opens the cache of the current user.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param cache Cache object to be populated.
+ *
+ * @return TRUE if the cache can be used, FALSE if the files will always have to
+ *         be hashed.
+ *
+ * @see hashcache_close
+ */
+bool hashcache_open(hashcache_t *cache) {
+	memset(cache, 0, sizeof(hashcache_t));
+	cache->path = hashcache_path();
+	if (cache->path == NULL)
+		return false;
+
+	hashcache_map(cache);
+	if (!hashcache_index(cache)) {
+		hashcache_free(cache);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Writes out what changed in the cache and frees up the resources allocated by
+ * it.
+ *
+ * @param cache Cache object to be freed.
+ */
+void hashcache_close(hashcache_t *cache) {
+	if (cache->dirty && (cache->path != NULL))
+		hashcache_write(cache);
+	hashcache_free(cache);
+}
+
+/**
+ * Gets the Merkle tree of a file, either straight from the cache if the file
+ * hasn't changed since it was last hashed, or by hashing it in parallel and
+ * adding it to the cache.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param cache Cache object.
+ * @param tree  Tree object to be populated.
+ * @param fh    File to get the tree of. Must not have pending writes.
+ * @param size  Size of the file.
+ * @param leaf  Size of each of the leaves.
+ *
+ * @return TRUE if the tree was built, FALSE otherwise.
+ *
+ * @see merkle_free
+ */
+bool hashcache_tree(hashcache_t *cache, merkle_t *tree, FILE *fh,
+                    uint64_t size, uint32_t leaf) {
+	hashcache_rec_t rec;
+	hashcache_rec_t after;
+	uint32_t id;
+
+	/* Check if we've already hashed this exact file. */
+	memset(&rec, 0, sizeof(hashcache_rec_t));
+	rec.leaf = leaf;
+	if ((cache->path == NULL) ||
+			!file_ident(fh, &rec.dev, &rec.ino, &rec.size, &rec.mtime) ||
+			(rec.size != size)) {
+		return merkle_build(tree, fh, size, leaf, cpu_count());
+	}
+	id = hashcache_find(cache, &rec, false);
+	if ((id != HASHCACHE_NONE) && hashcache_load(cache, id, tree)) {
+		*hashcache_used(cache, id) = ++cache->tick;
+		cache->dirty = true;
+		return true;
+	}
+
+	/* Hash the file and only remember it if it didn't change meanwhile. */
+	if (!merkle_build(tree, fh, size, leaf, cpu_count()))
+		return false;
+	memcpy(&after, &rec, sizeof(hashcache_rec_t));
+	if (file_ident(fh, &after.dev, &after.ino, &after.size, &after.mtime) &&
+			(memcmp(&after, &rec, sizeof(hashcache_rec_t)) == 0)) {
+		memcpy(rec.root, merkle_root(tree), MERKLE_HASH_LEN);
+		hashcache_add(cache, &rec, tree);
+	}
+
+	return true;
+}
+
+/**
+ * Gets the path to the cache file of the current user.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @return Path to the cache file or NULL if the user has no home directory.
+ */
+static char *hashcache_path(void) {
+	const char *home;
+	char *path;
+
+	/* Find the user's home directory. */
+#ifdef _WIN32
+	home = getenv("LOCALAPPDATA");
+	if (home == NULL)
+		home = getenv("USERPROFILE");
+#else
+	home = getenv("HOME");
+#endif /* _WIN32 */
+	if ((home == NULL) || (*home == '\0'))
+		return NULL;
+
+	/* Build up the path. */
+	path = (char *)malloc(strlen(home) + sizeof(GL_HASHCACHE_FILE) + 1);
+	if (path == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate hash cache path");
+		return NULL;
+	}
+#ifdef _WIN32
+	sprintf(path, "%s\\%s", home, GL_HASHCACHE_FILE);
+#else
+	sprintf(path, "%s/%s", home, GL_HASHCACHE_FILE);
+#endif /* _WIN32 */
+
+	return path;
+}
+
+/**
+ * Maps the cache file into memory, leaving the cache empty if the file doesn't
+ * exist or isn't valid.
+ *
+ * @param cache Cache object.
+ */
+static void hashcache_map(hashcache_t *cache) {
+	const hashcache_hdr_t *hdr;
+
+	cache->map = (uint8_t *)file_map(cache->path, &cache->len, false);
+	if (cache->map == NULL)
+		return;
+
+	/* Ensure the records fit in the file and were written by us. */
+	hdr = (const hashcache_hdr_t *)cache->map;
+	if ((cache->len < sizeof(hashcache_hdr_t)) ||
+			(hdr->magic != HASHCACHE_MAGIC) ||
+			(hdr->version != HASHCACHE_VERSION) ||
+			(((cache->len - sizeof(hashcache_hdr_t)) /
+			sizeof(hashcache_rec_t)) < hdr->count)) {
+		file_unmap(cache->map, cache->len);
+		cache->map = NULL;
+		cache->len = 0;
+	}
+}
+
+/**
+ * Indexes the records of the cache file, leaving out the ones whose leaves
+ * aren't all in the file.
+ *
+ * @param cache Cache object.
+ *
+ * @return TRUE if the index was built, FALSE otherwise.
+ */
+static bool hashcache_index(hashcache_t *cache) {
+	const hashcache_hdr_t *hdr;
+	const hashcache_rec_t *rec;
+	uint32_t i;
+
+	/* Start the clock from where the last run left it. */
+	if (cache->map != NULL) {
+		hdr = (const hashcache_hdr_t *)cache->map;
+		cache->nmapped = hdr->count;
+		cache->tick = hdr->tick;
+	}
+	cache->opened = cache->tick;
+
+	/* Keep track of when each record was used without touching the file. */
+	if (cache->nmapped > 0) {
+		cache->used = (uint64_t *)malloc(cache->nmapped * sizeof(uint64_t));
+		if (cache->used == NULL) {
+			log_syserr(LOG_CRIT, "Failed to allocate hash cache index");
+			return false;
+		}
+	}
+	for (i = 0; i < cache->nmapped; i++) {
+		rec = hashcache_get(cache, i);
+		cache->used[i] = rec->used;
+		if ((rec->leaf == 0) || (rec->used == 0) ||
+				(rec->offset > cache->len) ||
+				(merkle_leaf_count(rec->size, rec->leaf) >
+				((cache->len - rec->offset) / MERKLE_HASH_LEN))) {
+			cache->used[i] = 0;
+		}
+	}
+
+	return hashcache_grow(cache, cache->nmapped);
+}
+
+/**
+ * Ensures the index has room for a number of records, keeping it at most half
+ * full.
+ *
+ * @param cache Cache object.
+ * @param count Number of records the index must have room for.
+ *
+ * @return TRUE if the index has room for them, FALSE otherwise.
+ */
+static bool hashcache_grow(hashcache_t *cache, uint32_t count) {
+	uint32_t nslots;
+	uint32_t *slots;
+	uint32_t i;
+
+	if ((cache->slots != NULL) && (((uint64_t)count * 2) <= cache->nslots))
+		return true;
+
+	/* Build a bigger index from scratch. */
+	nslots = (cache->nslots > 0) ? cache->nslots : HASHCACHE_SLOTS_MIN;
+	while (((uint64_t)count * 2) > nslots)
+		nslots *= 2;
+	slots = (uint32_t *)calloc(nslots, sizeof(uint32_t));
+	if (slots == NULL) {
+		log_syserr(LOG_CRIT, "Failed to grow hash cache index");
+		return false;
+	}
+	free(cache->slots);
+	cache->slots = slots;
+	cache->nslots = nslots;
+	for (i = 0; i < (cache->nmapped + cache->nadded); i++)
+		hashcache_insert(cache, i);
+
+	return true;
+}
+
+/**
+ * Puts a record in the index.
+ *
+ * @param cache Cache object.
+ * @param id    Record to be put in the index.
+ */
+static void hashcache_insert(hashcache_t *cache, uint32_t id) {
+	size_t slot;
+
+	slot = hashcache_hash(hashcache_get(cache, id)) & (cache->nslots - 1);
+	while (cache->slots[slot] != 0)
+		slot = (slot + 1) & (cache->nslots - 1);
+	cache->slots[slot] = id + 1;
+}
+
+/**
+ * Gets a record of the cache, either from the cache file or from the ones that
+ * were added since it was opened.
+ *
+ * @param cache Cache object.
+ * @param id    Record to get.
+ *
+ * @return The requested record.
+ */
+static const hashcache_rec_t *hashcache_get(const hashcache_t *cache,
+                                            uint32_t id) {
+	if (id < cache->nmapped) {
+		return (const hashcache_rec_t *)(cache->map +
+			sizeof(hashcache_hdr_t)) + id;
+	}
+
+	return &cache->added[id - cache->nmapped].rec;
+}
+
+/**
+ * Gets when a record was last used, which is zero if it's gone stale.
+ *
+ * @param cache Cache object.
+ * @param id    Record to get it from.
+ *
+ * @return Where the time the record was last used is kept.
+ */
+static uint64_t *hashcache_used(hashcache_t *cache, uint32_t id) {
+	if (id < cache->nmapped)
+		return &cache->used[id];
+
+	return &cache->added[id - cache->nmapped].rec.used;
+}
+
+/**
+ * Gets the hashes of the leaves of a record.
+ *
+ * @param cache Cache object.
+ * @param id    Record to get them from.
+ *
+ * @return Hashes of the leaves of the file.
+ */
+static uint8_t *hashcache_leaves(const hashcache_t *cache, uint32_t id) {
+	if (id < cache->nmapped)
+		return cache->map + hashcache_get(cache, id)->offset;
+
+	return cache->added[id - cache->nmapped].leaves;
+}
+
+/**
+ * Finds the record of a file in the cache, or gets rid of every record of an
+ * earlier version of it.
+ *
+ * @param cache Cache object.
+ * @param key   Record with the identity of the file and the size of its leaves.
+ * @param evict Should every record of the file be marked as stale instead?
+ *
+ * @return Record of the file or HASHCACHE_NONE if it's not in the cache.
+ */
+static uint32_t hashcache_find(hashcache_t *cache, const hashcache_rec_t *key,
+                               bool evict) {
+	const hashcache_rec_t *rec;
+	uint64_t *used;
+	uint32_t id;
+	size_t slot;
+
+	slot = hashcache_hash(key) & (cache->nslots - 1);
+	for (; cache->slots[slot] != 0; slot = (slot + 1) & (cache->nslots - 1)) {
+		id = cache->slots[slot] - 1;
+		rec = hashcache_get(cache, id);
+		used = hashcache_used(cache, id);
+		if ((*used == 0) || (rec->dev != key->dev) ||
+				(rec->ino != key->ino) || (rec->leaf != key->leaf)) {
+			continue;
+		}
+
+		if (evict) {
+			*used = 0;
+			cache->dirty = true;
+		} else if ((rec->size == key->size) && (rec->mtime == key->mtime)) {
+			return id;
+		}
+	}
+
+	return HASHCACHE_NONE;
+}
+
+/**
+ * Builds the Merkle tree of a file from its record in the cache.
+ *
+ * @param cache Cache object.
+ * @param id    Record of the file.
+ * @param tree  Tree object to be populated.
+ *
+ * @return TRUE if the tree was built and matches the record, FALSE otherwise.
+ */
+static bool hashcache_load(const hashcache_t *cache, uint32_t id,
+                           merkle_t *tree) {
+	const hashcache_rec_t *rec;
+
+	/* Rebuild the tree and check that nothing got corrupted. */
+	rec = hashcache_get(cache, id);
+	if (!merkle_load(tree, rec->size, rec->leaf, hashcache_leaves(cache, id)))
+		return false;
+	if (memcmp(merkle_root(tree), rec->root, MERKLE_HASH_LEN) != 0) {
+		merkle_free(tree);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Adds a file to the cache in memory, replacing any earlier version of it.
+ *
+ * @param cache Cache object.
+ * @param rec   Record of the file to be added.
+ * @param tree  Merkle tree of the file.
+ */
+static void hashcache_add(hashcache_t *cache, hashcache_rec_t *rec,
+                          const merkle_t *tree) {
+	hashcache_new_t *added;
+	uint8_t *leaves;
+	uint64_t bytes;
+	uint32_t count;
+
+	/* Don't bother with files whose hashes wouldn't fit. */
+	bytes = tree->counts[0] * MERKLE_HASH_LEN;
+	if (bytes > GL_HASHCACHE_SIZE)
+		return;
+
+	/* Make room for the new record. */
+	hashcache_find(cache, rec, true);
+	if (!hashcache_grow(cache, cache->nmapped + cache->nadded + 1))
+		return;
+	if (cache->nadded == cache->cadded) {
+		count = (cache->cadded > 0) ? (cache->cadded * 2) : 16;
+		added = (hashcache_new_t *)realloc(cache->added,
+			count * sizeof(hashcache_new_t));
+		if (added == NULL) {
+			log_syserr(LOG_CRIT, "Failed to grow hash cache records");
+			return;
+		}
+		cache->added = added;
+		cache->cadded = count;
+	}
+	leaves = (uint8_t *)malloc((size_t)bytes);
+	if (leaves == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate hash cache leaves");
+		return;
+	}
+	memcpy(leaves, tree->levels[0], (size_t)bytes);
+
+	/* Index it as the most recently used one. */
+	rec->used = ++cache->tick;
+	rec->offset = 0;
+	added = &cache->added[cache->nadded];
+	memcpy(&added->rec, rec, sizeof(hashcache_rec_t));
+	added->leaves = leaves;
+	hashcache_insert(cache, cache->nmapped + cache->nadded);
+	cache->nadded++;
+	cache->dirty = true;
+}
+
+/**
+ * Replaces the cache file with one that has every file that was used since the
+ * cache was opened, followed by the most recently used ones that still fit
+ * within its bounds.
+ *
+ * @param cache Cache object.
+ */
+static void hashcache_write(hashcache_t *cache) {
+	hashcache_new_t *recs;
+	hashcache_hdr_t hdr;
+	uint8_t rnd[4];
+	uint64_t offset;
+	uint64_t total;
+	uint64_t bytes;
+	uint32_t count;
+	uint32_t i;
+	char *tmpname;
+	FILE *fh;
+	bool ok;
+
+	/* Gather the records that are still usable, most recently used first. */
+	recs = (hashcache_new_t *)malloc(((size_t)cache->nmapped +
+		cache->nadded + 1) * sizeof(hashcache_new_t));
+	if (recs == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate hash cache records");
+		return;
+	}
+	count = 0;
+	for (i = 0; i < (cache->nmapped + cache->nadded); i++) {
+		if (*hashcache_used(cache, i) == 0)
+			continue;
+
+		memcpy(&recs[count].rec, hashcache_get(cache, i),
+			sizeof(hashcache_rec_t));
+		recs[count].rec.used = *hashcache_used(cache, i);
+		recs[count].leaves = hashcache_leaves(cache, i);
+		count++;
+	}
+	qsort(recs, count, sizeof(hashcache_new_t), hashcache_cmp);
+
+	/* Evict the least recently used records that weren't used this time. */
+	total = 0;
+	for (i = 0; i < count; i++) {
+		bytes = merkle_leaf_count(recs[i].rec.size, recs[i].rec.leaf) *
+			MERKLE_HASH_LEN;
+		if ((recs[i].rec.used <= cache->opened) &&
+				((i >= GL_HASHCACHE_ENTRIES) ||
+				((total + bytes) > GL_HASHCACHE_SIZE))) {
+			break;
+		}
+
+		total += bytes;
+	}
+	count = i;
+
+	/* Lay out where every leaf will go. */
+	memset(&hdr, 0, sizeof(hashcache_hdr_t));
+	hdr.magic = HASHCACHE_MAGIC;
+	hdr.version = HASHCACHE_VERSION;
+	hdr.count = count;
+	hdr.tick = cache->tick;
+	offset = sizeof(hashcache_hdr_t) + (count * sizeof(hashcache_rec_t));
+
+	/* Write the new cache to a temporary file. */
+	random_bytes(rnd, sizeof(rnd));
+	tmpname = (char *)malloc(strlen(cache->path) + 10);
+	if (tmpname == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate hash cache temporary path");
+		free(recs);
+		return;
+	}
+	sprintf(tmpname, "%s.%02x%02x%02x%02x", cache->path, rnd[0], rnd[1],
+		rnd[2], rnd[3]);
+	fh = fopen(tmpname, "wb");
+	if (fh == NULL) {
+		free(tmpname);
+		free(recs);
+		return;
+	}
+	ok = fwrite(&hdr, sizeof(hashcache_hdr_t), 1, fh) == 1;
+	for (i = 0; ok && (i < count); i++) {
+		recs[i].rec.offset = offset;
+		ok = fwrite(&recs[i].rec, sizeof(hashcache_rec_t), 1, fh) == 1;
+		offset += merkle_leaf_count(recs[i].rec.size, recs[i].rec.leaf) *
+			MERKLE_HASH_LEN;
+	}
+	for (i = 0; ok && (i < count); i++) {
+		bytes = merkle_leaf_count(recs[i].rec.size, recs[i].rec.leaf) *
+			MERKLE_HASH_LEN;
+		ok = fwrite(recs[i].leaves, 1, (size_t)bytes, fh) == bytes;
+	}
+	ok = (fclose(fh) == 0) && ok;
+	free(recs);
+
+	/* Swap the old cache for the new one. */
+	file_unmap(cache->map, cache->len);
+	cache->map = NULL;
+	cache->len = 0;
+	if (!ok || !file_replace(tmpname, cache->path)) {
+		log_printf(LOG_WARNING, "Failed to update the hash cache \"%s\"",
+			cache->path);
+		remove(tmpname);
+	}
+	free(tmpname);
+	cache->dirty = false;
+}
+
+/**
+ * Frees up the resources allocated by the cache without writing anything out.
+ *
+ * @param cache Cache object to be freed.
+ */
+static void hashcache_free(hashcache_t *cache) {
+	uint32_t i;
+
+	for (i = 0; i < cache->nadded; i++)
+		free(cache->added[i].leaves);
+	free(cache->added);
+	free(cache->slots);
+	free(cache->used);
+	file_unmap(cache->map, cache->len);
+	free(cache->path);
+	memset(cache, 0, sizeof(hashcache_t));
+}
+
+/**
+ * Hashes the identity of a file for the index. Only the device and inode are
+ * used, so that every version of a file ends up in the same place.
+ *
+ * @param rec Record of the file.
+ *
+ * @return Hash of the file's identity.
+ */
+static size_t hashcache_hash(const hashcache_rec_t *rec) {
+	uint64_t hash;
+
+	hash = (rec->dev * 0x9E3779B97F4A7C15ULL) ^ rec->ino;
+	hash = (hash ^ (hash >> 33)) * 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+
+	return (size_t)hash;
+}
+
+/**
+ * Orders records from the most to the least recently used.
+ *
+ * @param a First record.
+ * @param b Second record.
+ *
+ * @return Negative if the first record was used more recently, positive if the
+ *         second one was, zero if they were used at the same time.
+ */
+static int hashcache_cmp(const void *a, const void *b) {
+	const hashcache_new_t *ra = (const hashcache_new_t *)a;
+	const hashcache_new_t *rb = (const hashcache_new_t *)b;
+
+	if (ra->rec.used == rb->rec.used)
+		return 0;
+	return (ra->rec.used > rb->rec.used) ? -1 : 1;
+}
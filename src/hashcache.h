@@ -0,0 +1,81 @@
+/**
+ * hashcache.h
+ * Persistent cache of the hashes of the files that were sent, so that files
+ * that haven't changed since don't have to be read and hashed again.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_HASHCACHE_H
+#define _GL_HASHCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "merkle.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Record of a file in the cache, laid out exactly as it is in the cache file.
+ */
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t used;
+	uint64_t offset;
+	uint32_t leaf;
+	uint32_t reserved;
+	uint8_t root[MERKLE_HASH_LEN];
+} hashcache_rec_t;
+
+/**
+ * File that was hashed since the cache was opened, along with the hashes of
+ * its leaves.
+ */
+typedef struct {
+	hashcache_rec_t rec;
+	uint8_t *leaves;
+} hashcache_new_t;
+
+/**
+ * Hash cache object, backed by a file that's mapped into memory. Changes are
+ * kept in memory and written out all at once when the cache is closed.
+ */
+typedef struct {
+	char *path;
+	uint8_t *map;
+	size_t len;
+
+	uint32_t nmapped;
+	uint64_t *used;
+	uint64_t opened;
+	uint64_t tick;
+
+	hashcache_new_t *added;
+	uint32_t nadded;
+	uint32_t cadded;
+
+	uint32_t *slots;
+	uint32_t nslots;
+	bool dirty;
+} hashcache_t;
+
+/* Opening the cache. */
+bool hashcache_open(hashcache_t *cache);
+void hashcache_close(hashcache_t *cache);
+
+/* Getting the hashes of files. */
+bool hashcache_tree(hashcache_t *cache, merkle_t *tree, FILE *fh,
+                    uint64_t size, uint32_t leaf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_HASHCACHE_H */
@@ -2,6 +2,14 @@
  * logging.c
  * Logging and log reporting utility.
  *
+ * Once the logger is initialized, messages are formatted by the thread that
+ * logs them and put in a ring that any number of threads may write to without
+ * taking a lock, while a background thread writes them out in batches. This
+ * keeps threads that are moving data from waiting on the terminal. Errors and
+ * messages that don't fit in the ring are written out right away, after the
+ * ones that were waiting, so that nothing gets out of order. Whatever is left
+ * in the ring is written out when the program exits or crashes.
+ *
  * @author Nathan Campos <nathan@innoveworkshop.com>
  */
 
@@ -13,22 +21,35 @@
 	#include <winsock2.h>
 	#include <ws2tcpip.h>
 	#include <tchar.h>
+	#include <io.h>
 #endif /* _WIN32 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #ifdef WITH_LOG_TIME
 	#include <time.h>
 #endif /* WITH_LOG_TIME */
 #ifndef _WIN32
 	#include <errno.h>
+	#include <unistd.h>
 #endif /* !_WIN32 */
 
+#include "defaults.h"
+#include "thread.h"
+
 /* Defines the standard stream to use for logging. */
 #ifndef LOG_STREAM
 	#define LOG_STREAM stderr
 #endif /* !LOG_STREAM */
 
+/* Length of the buffer where messages are gathered before being written. */
+#define LOG_BATCH_LEN (16 * 1024)
+
+/* Length of the system error message appended to a log message. */
+#define LOG_SUFFIX_LEN 256
+
 #ifdef _WIN32
 	/* Standard values for Win32's FormatMessage function. */
 	#ifndef FORMAT_MESSAGE_FLAGS
@@ -42,53 +63,140 @@
 #endif /* _WIN32 */
 
 /**
- * Prints out logging information with an associated log level tag using the
- * printf function style.
- *
- * @param level  Severity of the logged information.
- * @param format Format of the desired output without the tag.
- * @param ap     Additional variables to be populated.
+ * Slot of the ring of messages waiting to be written out. Its sequence number
+ * tells whose turn it is: a writer may fill it in when it matches the position
+ * being written to, and the background thread may write it out once it's one
+ * past that position.
  */
-void log_vprintf(log_level_t level, const char *format, va_list ap) {
-#ifdef WITH_LOG_TIME
-	char ts[23];
+typedef struct {
+	atomic32_t seq;
+	uint32_t len;
+	char text[GL_LOG_RECORD_LEN];
+} log_record_t;
 
-	/* Time and date. */
-	time_t tm = time(NULL);
-	struct tm* gmt = gmtime(&tm);
-	if (strftime(ts, 22, "%Y-%m-%dT%H:%M:%SZ", gmt) == 0)
-		ts[20] = '?';
-	ts[21] = ' ';
-	ts[22] = '\0';
+/* Most verbose level that's currently being logged. */
+log_level_t log_level = LOG_INFO;
+
+/* Ring of messages waiting to be written out. */
+static log_record_t ring[GL_LOG_RING_LEN];
+static atomic32_t ring_tail;
+static uint32_t ring_head;
+static bool ring_active = false;
+
+/* Background thread that writes out the ring. */
+static mutex_t flush_lock;
+static char flush_batch[LOG_BATCH_LEN];
+static thread_t flusher;
+static volatile bool flusher_running;
+
+/* Descriptor of the log stream, for when stdio can't be trusted. */
+static int crash_fd;
+
+/* Private functions. */
+static void log_vwrite(log_level_t level, const char *suffix,
+                       const char *format, va_list ap);
+static void log_put(log_level_t level, const char *text, size_t len);
+static bool log_enqueue(const char *text, size_t len);
+static void log_drain(void);
+static thread_ret_t THREAD_CALL log_flusher(void *arg);
+static void log_exit(void);
+static void log_crash(int sig);
+
+/**
+ * Starts writing out log messages in the background. Until this is called, or
+ * if the background thread can't be started, messages are written out right
+ * away. Must be called before any other threads are started.
+ */
+void log_init(void) {
+#ifndef _WIN32
+	sigset_t mask;
+	sigset_t prev;
+#endif /* !_WIN32 */
+	bool started;
+	uint32_t i;
+
+	/* Every slot starts out waiting for its first turn. */
+	for (i = 0; i < GL_LOG_RING_LEN; i++)
+		ring[i].seq = i;
+	ring_tail = 0;
+	ring_head = 0;
+	mutex_init(&flush_lock);
+#ifdef _WIN32
+	crash_fd = _fileno(LOG_STREAM);
 #else
-	char ts[1];
-	*ts = '\0';
-#endif /* WITH_LOG_TIME */
+	crash_fd = fileno(LOG_STREAM);
+#endif /* _WIN32 */
 
-	/* Print the log level tag. */
-	switch (level) {
-		case LOG_CRIT:
-			fprintf(LOG_STREAM, "%s[CRITICAL] ", ts);
-			break;
-		case LOG_ERROR:
-			fprintf(LOG_STREAM, "%s[ERROR]    ", ts);
-			break;
-		case LOG_WARNING:
-			fprintf(LOG_STREAM, "%s[WARNING]  ", ts);
-			break;
-		case LOG_NOTICE:
-			fprintf(LOG_STREAM, "%s[NOTICE]   ", ts);
-			break;
-		case LOG_INFO:
-			fprintf(LOG_STREAM, "%s[INFO]     ", ts);
-			break;
-		default:
-			fprintf(LOG_STREAM, "%s[UNKNOWN]  ", ts);
-			break;
+	/* Start the thread that writes out the ring, keeping signals away from it
+	 * so that they're handled by the threads doing the actual work. */
+	flusher_running = true;
+#ifndef _WIN32
+	sigfillset(&mask);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGILL);
+	sigdelset(&mask, SIGFPE);
+#ifdef SIGBUS
+	sigdelset(&mask, SIGBUS);
+#endif /* SIGBUS */
+	pthread_sigmask(SIG_BLOCK, &mask, &prev);
+#endif /* !_WIN32 */
+	started = thread_create(&flusher, log_flusher, NULL);
+#ifndef _WIN32
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+#endif /* !_WIN32 */
+	if (!started) {
+		mutex_free(&flush_lock);
+		return;
+	}
+	ring_active = true;
+
+	/* Make sure nothing is left behind when we go away. */
+	atexit(log_exit);
+	signal(SIGSEGV, log_crash);
+	signal(SIGILL, log_crash);
+	signal(SIGFPE, log_crash);
+	signal(SIGABRT, log_crash);
+#ifdef SIGBUS
+	signal(SIGBUS, log_crash);
+#endif /* SIGBUS */
+}
+
+/**
+ * Writes out every log message that's waiting to be written.
+ */
+void log_flush(void) {
+	if (!ring_active) {
+		fflush(LOG_STREAM);
+		return;
 	}
 
-	/* Print the actual message. */
-	vfprintf(LOG_STREAM, format, ap);
+	mutex_lock(&flush_lock);
+	log_drain();
+	mutex_unlock(&flush_lock);
+}
+
+/**
+ * Sets the most verbose level that's going to be logged. Levels that weren't
+ * compiled in stay disabled.
+ *
+ * @param level Most verbose level to be logged.
+ *
+ * @see GL_LOG_MIN_LEVEL
+ */
+void log_set_level(log_level_t level) {
+	log_level = level;
+}
+
+/**
+ * Prints out a line of logging information with an associated log level tag
+ * using the printf function style.
+ *
+ * @param level  Severity of the logged information.
+ * @param format Format of the desired output without the tag.
+ * @param ap     Additional variables to be populated.
+ */
+void log_vprintf(log_level_t level, const char *format, va_list ap) {
+	log_vwrite(level, "", format, ap);
 }
 
 /**
@@ -100,16 +208,13 @@ void log_vprintf(log_level_t level, const char *format, va_list ap) {
  * @param format Format of the desired output without the tag.
  * @param ...    Additional variables to be populated.
  */
-void log_printf(log_level_t level, const char *format, ...) {
+void (log_printf)(log_level_t level, const char *format, ...) {
 	va_list args;
 
 	/* Print the log message. */
 	va_start(args, format);
-	log_vprintf(level, format, args);
+	log_vwrite(level, "", format, args);
 	va_end(args);
-
-	/* Ensure we finish with a newline. */
-	fprintf(LOG_STREAM, "\n");
 }
 
 /**
@@ -120,7 +225,8 @@ void log_printf(log_level_t level, const char *format, ...) {
  * @param format Format of the desired output without the tag or system message.
  * @param ...    Additional variables to be populated.
  */
-void log_syserr(log_level_t level, const char *format, ...) {
+void (log_syserr)(log_level_t level, const char *format, ...) {
+	char suffix[LOG_SUFFIX_LEN];
 	va_list args;
 	int err;
 
@@ -133,27 +239,19 @@ void log_syserr(log_level_t level, const char *format, ...) {
 					   (LPTSTR)&szErrorMessage, 0, NULL)) {
 		szErrorMessage = _tcsdup(_T("FormatMessage failed"));
 	}
-
-	/* Print the application's error message. */
-	va_start(args, format);
-	log_vprintf(level, format, args);
-	va_end(args);
-
-	/* Print the system error message. */
-	_ftprintf(LOG_STREAM, _T(": System Error (%d) %ls\n"), err, szErrorMessage);
-
-	/* Free up any resources. */
+	_snprintf(suffix, LOG_SUFFIX_LEN, ": System Error (%d) %ls", err,
+		szErrorMessage);
+	suffix[LOG_SUFFIX_LEN - 1] = '\0';
 	LocalFree(szErrorMessage);
 #else
-	/* Print the application's error message. */
 	err = errno;
+	snprintf(suffix, LOG_SUFFIX_LEN, ": (%d) %s", err, strerror(err));
+#endif /* _WIN32 */
+
+	/* Print the application's error message followed by the system's. */
 	va_start(args, format);
-	log_vprintf(level, format, args);
+	log_vwrite(level, suffix, format, args);
 	va_end(args);
-
-	/* Print the system error message. */
-	fprintf(LOG_STREAM, ": (%d) %s\n", err, strerror(err));
-#endif /* _WIN32 */
 }
 
 /**
@@ -165,7 +263,8 @@ void log_syserr(log_level_t level, const char *format, ...) {
  * @param format Format of the desired output without the tag or system message.
  * @param ...    Additional variables to be populated.
  */
-void log_sockerr(log_level_t level, const char *format, ...) {
+void (log_sockerr)(log_level_t level, const char *format, ...) {
+	char suffix[LOG_SUFFIX_LEN];
 	va_list args;
 	int err;
 
@@ -178,25 +277,270 @@ void log_sockerr(log_level_t level, const char *format, ...) {
 					   (LPTSTR)&szErrorMessage, 0, NULL)) {
 		szErrorMessage = _tcsdup(_T("FormatMessage failed"));
 	}
+	_snprintf(suffix, LOG_SUFFIX_LEN, ": WSAError (%d) %ls", err,
+		szErrorMessage);
+	suffix[LOG_SUFFIX_LEN - 1] = '\0';
+	LocalFree(szErrorMessage);
+#else
+	err = errno;
+	snprintf(suffix, LOG_SUFFIX_LEN, ": (%d) %s", err, strerror(err));
+#endif /* _WIN32 */
 
-	/* Print the application's error message. */
+	/* Print the application's error message followed by the system's. */
 	va_start(args, format);
-	log_vprintf(level, format, args);
+	log_vwrite(level, suffix, format, args);
 	va_end(args);
+}
 
-	/* Print the system error message. */
-	_ftprintf(LOG_STREAM, _T(": WSAError (%d) %ls\n"), err, szErrorMessage);
+/**
+ * Formats a line of logging information and hands it over to be written out.
+ *
+ * @param level  Severity of the logged information.
+ * @param suffix Text that goes after the message.
+ * @param format Format of the message without the tag.
+ * @param ap     Additional variables to be populated.
+ */
+static void log_vwrite(log_level_t level, const char *suffix,
+                       const char *format, va_list ap) {
+	char buf[GL_LOG_RECORD_LEN];
+	const char *tag;
+	va_list aq;
+	size_t hlen;
+	size_t slen;
+	size_t len;
+	char *line;
+	int mlen;
+#ifdef WITH_LOG_TIME
+	char ts[23];
 
-	/* Free up any resources. */
-	LocalFree(szErrorMessage);
+	/* Time and date. */
+	time_t tm = time(NULL);
+	struct tm* gmt = gmtime(&tm);
+	if (strftime(ts, 22, "%Y-%m-%dT%H:%M:%SZ", gmt) == 0)
+		ts[20] = '?';
+	ts[21] = ' ';
+	ts[22] = '\0';
 #else
-	/* Print the application's error message. */
-	err = errno;
-	va_start(args, format);
-	log_vprintf(level, format, args);
-	va_end(args);
+	char ts[1];
+	*ts = '\0';
+#endif /* WITH_LOG_TIME */
 
-	/* Print the system error message. */
-	fprintf(LOG_STREAM, ": (%d) %s\n", err, strerror(err));
+	/* Get the log level tag. */
+	switch (level) {
+		case LOG_CRIT:
+			tag = "[CRITICAL] ";
+			break;
+		case LOG_ERROR:
+			tag = "[ERROR]    ";
+			break;
+		case LOG_WARNING:
+			tag = "[WARNING]  ";
+			break;
+		case LOG_NOTICE:
+			tag = "[NOTICE]   ";
+			break;
+		case LOG_INFO:
+			tag = "[INFO]     ";
+			break;
+		case LOG_DEBUG:
+			tag = "[DEBUG]    ";
+			break;
+		default:
+			tag = "[UNKNOWN]  ";
+			break;
+	}
+
+	/* Try to fit the whole line in a single record. */
+	hlen = (size_t)snprintf(buf, GL_LOG_RECORD_LEN, "%s%s", ts, tag);
+	va_copy(aq, ap);
+	mlen = vsnprintf(buf + hlen, GL_LOG_RECORD_LEN - hlen, format, aq);
+	va_end(aq);
+	if (mlen < 0)
+		mlen = 0;
+	slen = strlen(suffix);
+	len = hlen + (size_t)mlen + slen + 1;
+	line = buf;
+
+	/* Longer lines get a buffer of their own or are cut short. */
+	if (len >= GL_LOG_RECORD_LEN) {
+		line = (char *)malloc(len + 1);
+		if (line != NULL) {
+			memcpy(line, buf, hlen);
+			vsnprintf(line + hlen, (size_t)mlen + 1, format, ap);
+		} else {
+			line = buf;
+			mlen = (int)(GL_LOG_RECORD_LEN - hlen - 1);
+			slen = 0;
+			len = GL_LOG_RECORD_LEN;
+		}
+	}
+	memcpy(line + hlen + mlen, suffix, slen);
+	line[len - 1] = '\n';
+
+	log_put(level, line, len);
+	if (line != buf)
+		free(line);
+}
+
+/**
+ * Writes out a line of logging information, either in the background or right
+ * away if it's important or there's no room for it in the ring.
+ *
+ * @param level Severity of the logged information.
+ * @param text  Line to be written out, including its newline.
+ * @param len   Length of the line.
+ */
+static void log_put(log_level_t level, const char *text, size_t len) {
+	/* Nobody is writing out the ring yet. */
+	if (!ring_active) {
+		fwrite(text, sizeof(char), len, LOG_STREAM);
+		return;
+	}
+
+	/* Errors might be followed by the end of the program. */
+	if (log_enqueue(text, len)) {
+		if (level <= LOG_ERROR)
+			log_flush();
+		return;
+	}
+
+	/* Write it out after the ones that are already waiting. */
+	mutex_lock(&flush_lock);
+	log_drain();
+	fwrite(text, sizeof(char), len, LOG_STREAM);
+	fflush(LOG_STREAM);
+	mutex_unlock(&flush_lock);
+}
+
+/**
+ * Puts a line in the ring to be written out in the background.
+ *
+ * @param text Line to be written out.
+ * @param len  Length of the line.
+ *
+ * @return TRUE if the line was put in the ring, FALSE if it doesn't fit in a
+ *         record or the ring is full.
+ */
+static bool log_enqueue(const char *text, size_t len) {
+	log_record_t *rec;
+	uint32_t pos;
+	int32_t diff;
+
+	if (len > GL_LOG_RECORD_LEN)
+		return false;
+
+	/* Claim the next slot that's free. */
+	pos = atomic32_load(&ring_tail);
+	for (;;) {
+		rec = &ring[pos & (GL_LOG_RING_LEN - 1)];
+		diff = (int32_t)(atomic32_load(&rec->seq) - pos);
+		if (diff == 0) {
+			if (atomic32_cas(&ring_tail, pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return false;
+		}
+
+		pos = atomic32_load(&ring_tail);
+	}
+
+	/* Fill it in and let the background thread have it. */
+	memcpy(rec->text, text, len);
+	rec->len = (uint32_t)len;
+	atomic32_store(&rec->seq, pos + 1);
+
+	return true;
+}
+
+/**
+ * Writes out the lines that are ready in the ring, in batches. Must only be
+ * called by one thread at a time.
+ */
+static void log_drain(void) {
+	log_record_t *rec;
+	size_t len;
+
+	len = 0;
+	for (;;) {
+		rec = &ring[ring_head & (GL_LOG_RING_LEN - 1)];
+		if (atomic32_load(&rec->seq) != (ring_head + 1))
+			break;
+
+		/* Gather lines until the batch is full. */
+		if ((len + rec->len) > LOG_BATCH_LEN) {
+			fwrite(flush_batch, sizeof(char), len, LOG_STREAM);
+			len = 0;
+		}
+		memcpy(flush_batch + len, rec->text, rec->len);
+		len += rec->len;
+
+		/* Give the slot back for its next turn. */
+		atomic32_store(&rec->seq, ring_head + GL_LOG_RING_LEN);
+		ring_head++;
+	}
+
+	if (len > 0) {
+		fwrite(flush_batch, sizeof(char), len, LOG_STREAM);
+		fflush(LOG_STREAM);
+	}
+}
+
+/**
+ * Background thread that keeps writing out the ring.
+ *
+ * @param arg Nothing.
+ *
+ * @return Nothing.
+ */
+static thread_ret_t THREAD_CALL log_flusher(void *arg) {
+	(void)arg;
+
+	while (flusher_running) {
+		log_flush();
+		thread_sleep(GL_LOG_FLUSH_MS);
+	}
+
+	return 0;
+}
+
+/**
+ * Stops the background thread and writes out what's left in the ring when the
+ * program exits.
+ */
+static void log_exit(void) {
+	flusher_running = false;
+	thread_join(flusher);
+	log_flush();
+	ring_active = false;
+}
+
+/**
+ * Writes out what's left in the ring when the program crashes, and then lets
+ * it crash as it would have. Neither the lock nor stdio are used, since the
+ * thread that crashed may be holding them, so each line is written straight to
+ * the stream's descriptor and a line that's being written out in the
+ * background at the same time may show up twice.
+ *
+ * @param sig Signal that was raised.
+ */
+static void log_crash(int sig) {
+	log_record_t *rec;
+	uint32_t pos;
+
+	for (pos = ring_head; ; pos++) {
+		rec = &ring[pos & (GL_LOG_RING_LEN - 1)];
+		if (atomic32_load(&rec->seq) != (pos + 1))
+			break;
+
+#ifdef _WIN32
+		if (_write(crash_fd, rec->text, rec->len) < 0)
+			break;
+#else
+		if (write(crash_fd, rec->text, rec->len) < 0)
+			break;
 #endif /* _WIN32 */
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
 }
@@ -10,6 +10,8 @@
 
 #include <stdarg.h>
 
+#include "defaults.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,14 +22,55 @@ typedef enum {
 	LOG_ERROR,
 	LOG_WARNING,
 	LOG_NOTICE,
-	LOG_INFO
+	LOG_INFO,
+	LOG_DEBUG
 } log_level_t;
 
+/* Most verbose level that's currently being logged. */
+extern log_level_t log_level;
+
+/**
+ * Checks if messages of a log level are going to be logged, both by being
+ * compiled in and by being enabled at runtime. Levels that aren't compiled in
+ * are known to be disabled at compile time, so whatever depends on them gets
+ * optimized away.
+ *
+ * @param level Severity of the logged information.
+ *
+ * @return TRUE if the messages are going to be logged, FALSE otherwise.
+ */
+#define log_enabled(level) \
+	(((int)(level) <= (int)(GL_LOG_MIN_LEVEL)) && \
+	 ((int)(level) <= (int)log_level))
+
+/* Skip the formatting and the evaluation of the arguments of messages that
+ * aren't going to be logged. */
+#define log_printf(level, ...) \
+	do { \
+		if (log_enabled(level)) \
+			(log_printf)((level), __VA_ARGS__); \
+	} while (0)
+#define log_syserr(level, ...) \
+	do { \
+		if (log_enabled(level)) \
+			(log_syserr)((level), __VA_ARGS__); \
+	} while (0)
+#define log_sockerr(level, ...) \
+	do { \
+		if (log_enabled(level)) \
+			(log_sockerr)((level), __VA_ARGS__); \
+	} while (0)
+
+/* Background writing. */
+void log_init(void);
+void log_flush(void);
+void log_set_level(log_level_t level);
+
 /* Logging and debugging. */
 void log_vprintf(log_level_t level, const char *format, va_list ap);
-void log_printf(log_level_t level, const char *format, ...);
-void log_syserr(log_level_t level, const char *format, ...);
-void log_sockerr(log_level_t level, const char *format, ...);
+void (log_printf)(log_level_t level, const char *format, ...);
+void (log_syserr)(log_level_t level, const char *format, ...);
+void (log_sockerr)(log_level_t level, const char *format, ...);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,319 @@
+/**
+ * lz.c
+ * Small and fast LZ77 compressor that doesn't depend on any external library.
+ *
+ * Blocks are encoded as a sequence of literal runs, each followed by a back
+ * reference into the data that was already decoded. Every sequence starts with
+ * a token byte, whose high nibble holds the length of the literal run and the
+ * low nibble the length of the match, either of which are continued in extra
+ * bytes when they don't fit. The last sequence of a block only has literals.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "lz.h"
+
+#include <string.h>
+
+/* Shortest match worth encoding. */
+#define LZ_MIN_MATCH 4
+
+/* Farthest back a match may reference. */
+#define LZ_MAX_OFFSET 65535
+
+/* Number of bits used to index the match finder's hash table. */
+#define LZ_HASH_BITS 14
+
+/* Bytes at the end of a block that are always encoded as literals. */
+#define LZ_END_LITERALS 5
+
+/* Blocks smaller than this are always stored as literals. */
+#define LZ_MIN_INPUT (LZ_END_LITERALS + LZ_MIN_MATCH + 4)
+
+/* How quickly we start skipping over data that doesn't seem to have matches. */
+#define LZ_SKIP_SHIFT 6
+
+/* Private functions. */
+static uint32_t lz_read32(const uint8_t *buf);
+static uint32_t lz_hash(uint32_t seq);
+static size_t lz_match_len(const uint8_t *cur, const uint8_t *ref,
+                           const uint8_t *end);
+static uint8_t *lz_emit(uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+                        size_t litlen, size_t offset, size_t mlen);
+
+/**
+ * Compresses a block of data.
+ *
+ * @param src Data to be compressed.
+ * @param len Length of the data.
+ * @param dst Buffer where the compressed data will be stored.
+ * @param cap Capacity of the destination buffer.
+ *
+ * @return Length of the compressed data or 0 if it didn't fit in the
+ *         destination buffer.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *oend;
+	uint8_t *op;
+	uint32_t seq;
+	uint32_t h;
+	size_t anchor;
+	size_t limit;
+	size_t mlen;
+	size_t ref;
+	size_t ip;
+
+	/* Positions in the hash table are only 32-bit wide. */
+	if (len > 0xFFFFFFFFUL)
+		return 0;
+
+	/* Initialize some variables. */
+	op = dst;
+	oend = dst + cap;
+	anchor = 0;
+
+	/* Look for matches in everything but the very end of the block. */
+	if (len >= LZ_MIN_INPUT) {
+		memset(table, 0, sizeof(table));
+		limit = len - LZ_END_LITERALS - LZ_MIN_MATCH;
+		ip = 0;
+		while (ip <= limit) {
+			/* Check if we've seen these bytes recently. */
+			seq = lz_read32(src + ip);
+			h = lz_hash(seq);
+			ref = table[h];
+			table[h] = (uint32_t)ip;
+			if ((ref >= ip) || ((ip - ref) > LZ_MAX_OFFSET) ||
+					(lz_read32(src + ref) != seq)) {
+				ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+				continue;
+			}
+
+			/* Extend the match backwards over the pending literals. */
+			while ((ip > anchor) && (ref > 0) &&
+					(src[ip - 1] == src[ref - 1])) {
+				ip--;
+				ref--;
+			}
+
+			/* Extend it forwards as much as we can and emit it. */
+			mlen = LZ_MIN_MATCH + lz_match_len(src + ip + LZ_MIN_MATCH,
+				src + ref + LZ_MIN_MATCH, src + len - LZ_END_LITERALS);
+			op = lz_emit(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+			if (op == NULL)
+				return 0;
+			ip += mlen;
+			anchor = ip;
+
+			/* Help finding matches that start right before this one ends. */
+			if ((ip - 2) <= limit)
+				table[lz_hash(lz_read32(src + ip - 2))] = (uint32_t)(ip - 2);
+		}
+	}
+
+	/* Finish the block with whatever literals are left. */
+	op = lz_emit(op, oend, src + anchor, len - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+
+	return op - dst;
+}
+
+/**
+ * Decompresses a block of data.
+ *
+ * @param src    Compressed data.
+ * @param len    Length of the compressed data.
+ * @param dst    Buffer where the decompressed data will be stored.
+ * @param rawlen Exact length of the decompressed data.
+ *
+ * @return TRUE if the block was decompressed to exactly the expected length,
+ *         FALSE if it was malformed.
+ */
+bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                   size_t rawlen) {
+	const uint8_t *iend;
+	const uint8_t *ip;
+	uint8_t token;
+	uint8_t b;
+	size_t offset;
+	size_t litlen;
+	size_t mlen;
+	size_t op;
+	size_t i;
+
+	ip = src;
+	iend = src + len;
+	op = 0;
+	while (ip < iend) {
+		/* Get the length of the literal run. */
+		token = *ip++;
+		litlen = token >> 4;
+		if (litlen == 15) {
+			do {
+				if (ip >= iend)
+					return false;
+				b = *ip++;
+				litlen += b;
+			} while (b == 255);
+		}
+
+		/* Copy the literals over. */
+		if ((litlen > (size_t)(iend - ip)) || (litlen > (rawlen - op)))
+			return false;
+		memcpy(dst + op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+
+		/* The last sequence doesn't have a match. */
+		if (ip == iend)
+			break;
+
+		/* Get the match. */
+		if ((iend - ip) < 2)
+			return false;
+		offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > op))
+			return false;
+		mlen = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15) {
+			do {
+				if (ip >= iend)
+					return false;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		if (mlen > (rawlen - op))
+			return false;
+
+		/* Copy the match, which may overlap with itself. */
+		if (offset >= mlen) {
+			memcpy(dst + op, dst + op - offset, mlen);
+		} else {
+			for (i = 0; i < mlen; i++)
+				dst[op + i] = dst[op - offset + i];
+		}
+		op += mlen;
+	}
+
+	return op == rawlen;
+}
+
+/**
+ * Reads 4 bytes from a buffer that might not be aligned.
+ *
+ * @param buf Buffer to read from.
+ *
+ * @return Bytes that were read in native byte order.
+ */
+static uint32_t lz_read32(const uint8_t *buf) {
+	uint32_t val;
+
+	memcpy(&val, buf, sizeof(uint32_t));
+	return val;
+}
+
+/**
+ * Hashes 4 bytes into an index of the match finder's hash table.
+ *
+ * @param seq Bytes to be hashed.
+ *
+ * @return Index into the hash table.
+ */
+static uint32_t lz_hash(uint32_t seq) {
+	return (uint32_t)(seq * 2654435761UL) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Counts how many bytes two sequences have in common.
+ *
+ * @param cur Current position in the data.
+ * @param ref Earlier position in the data being compared against.
+ * @param end Where to stop comparing.
+ *
+ * @return Number of bytes that are the same in both sequences.
+ */
+static size_t lz_match_len(const uint8_t *cur, const uint8_t *ref,
+                           const uint8_t *end) {
+	const uint8_t *start;
+	uint64_t a;
+	uint64_t b;
+
+	/* Compare whole words while we can. */
+	start = cur;
+	while ((end - cur) >= 8) {
+		memcpy(&a, cur, sizeof(uint64_t));
+		memcpy(&b, ref, sizeof(uint64_t));
+		if (a != b)
+			break;
+		cur += 8;
+		ref += 8;
+	}
+
+	/* Find exactly where they differ. */
+	while ((cur < end) && (*cur == *ref)) {
+		cur++;
+		ref++;
+	}
+
+	return cur - start;
+}
+
+/**
+ * Emits a sequence of literals followed by a match.
+ *
+ * @param op     Where to write the sequence.
+ * @param oend   End of the destination buffer.
+ * @param lit    Literals to be emitted.
+ * @param litlen Number of literals.
+ * @param offset How far back the match is.
+ * @param mlen   Length of the match or 0 for the last sequence of the block.
+ *
+ * @return Position right after the sequence or NULL if it didn't fit.
+ */
+static uint8_t *lz_emit(uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+                        size_t litlen, size_t offset, size_t mlen) {
+	uint8_t *token;
+	size_t need;
+	size_t n;
+
+	/* Check if the worst case fits. */
+	need = 1 + litlen + (litlen / 255) + 1;
+	if (mlen > 0)
+		need += 2 + (mlen / 255) + 1;
+	if (need > (size_t)(oend - op))
+		return NULL;
+
+	/* Literal run. */
+	token = op++;
+	if (litlen >= 15) {
+		*token = 15 << 4;
+		for (n = litlen - 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = (uint8_t)n;
+	} else {
+		*token = (uint8_t)(litlen << 4);
+	}
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	/* Match. */
+	if (mlen == 0)
+		return op;
+	*op++ = (uint8_t)(offset & 0xFF);
+	*op++ = (uint8_t)((offset >> 8) & 0xFF);
+	n = mlen - LZ_MIN_MATCH;
+	if (n >= 15) {
+		*token |= 15;
+		for (n -= 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = (uint8_t)n;
+	} else {
+		*token |= (uint8_t)n;
+	}
+
+	return op;
+}
@@ -0,0 +1,28 @@
+/**
+ * lz.h
+ * Small and fast LZ77 compressor that doesn't depend on any external library.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_LZ_H
+#define _GL_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Compression and decompression of independent blocks. */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                   size_t rawlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_LZ_H */
@@ -0,0 +1,485 @@
+/**
+ * manifest.c
+ * Sorted listings of every file inside a directory tree, used to find out
+ * which files changed between two copies of a directory.
+ *
+ * Both ends walk their copy of the directory in the same order, visiting the
+ * entries of each directory sorted by name, so that their manifests can be
+ * compared side by side in a single pass without holding either of them in
+ * memory. Paths always use forward slashes as their separator.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "manifest.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "thread.h"
+#include "utils.h"
+
+/**
+ * Share of the entries of a directory that's looked up by a single thread.
+ */
+typedef struct {
+	manifest_level_t *level;
+	const char *dir;
+	size_t dlen;
+	size_t first;
+	size_t step;
+} manifest_stat_job_t;
+
+/* Private functions. */
+static bool manifest_level_stat(manifest_level_t *level, const char *dir,
+                                size_t dlen);
+static thread_ret_t THREAD_CALL manifest_stat_worker(void *arg);
+static void manifest_level_free(manifest_level_t *level);
+static int manifest_name_cmp(const void *a, const void *b);
+
+/**
+ * Starts walking through a directory tree.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param walk Walk object to be populated.
+ * @param root Path to the directory to walk through.
+ *
+ * @return TRUE if the walk has started, FALSE if the directory couldn't be
+ *         read.
+ *
+ * @see manifest_walk_close
+ */
+bool manifest_walk_open(manifest_walk_t *walk, const char *root) {
+	manifest_level_t *level;
+
+	/* Keep the root as the prefix of every path, without trailing slashes. */
+	walk->depth = 0;
+	walk->rootlen = strlen(root);
+	while ((walk->rootlen > 1) && ((root[walk->rootlen - 1] == '/') ||
+			(root[walk->rootlen - 1] == '\\'))) {
+		walk->rootlen--;
+	}
+	if ((walk->rootlen + 2) > GL_SYNC_PATH_MAX) {
+		log_printf(LOG_ERROR, "Path of directory \"%s\" is too long", root);
+		return false;
+	}
+	memcpy(walk->path, root, walk->rootlen);
+	walk->path[walk->rootlen] = '\0';
+
+	/* List the root directory. */
+	level = &walk->levels[0];
+	level->names = dir_list(walk->path, &level->count);
+	if (level->names == NULL) {
+		log_syserr(LOG_ERROR, "Failed to read directory \"%s\"", walk->path);
+		return false;
+	}
+	qsort(level->names, level->count, sizeof(char *), manifest_name_cmp);
+	level->next = 0;
+	walk->path[walk->rootlen++] = '/';
+	level->len = walk->rootlen;
+	if (!manifest_level_stat(level, walk->path, level->len)) {
+		manifest_level_free(level);
+		return false;
+	}
+	walk->depth = 1;
+
+	return true;
+}
+
+/**
+ * Gets the next file of the directory tree.
+ *
+ * @param walk  Walk object.
+ * @param entry Returns the next file. Its path is relative to the root of the
+ *              walk and only valid until the next call.
+ *
+ * @return TRUE if there was another file, FALSE if the walk is over.
+ */
+bool manifest_walk_next(manifest_walk_t *walk, manifest_entry_t *entry) {
+	manifest_level_t *level;
+	manifest_level_t *sub;
+	const manifest_stat_t *st;
+	const char *name;
+	size_t len;
+
+	while (walk->depth > 0) {
+		/* Go back up once we're done with a directory. */
+		level = &walk->levels[walk->depth - 1];
+		if (level->next == level->count) {
+			manifest_level_free(level);
+			walk->depth--;
+			continue;
+		}
+
+		/* Build up the path of the next entry. */
+		st = &level->stats[level->next];
+		name = level->names[level->next++];
+		len = strlen(name);
+		if ((level->len + len + 2) > GL_SYNC_PATH_MAX) {
+			log_printf(LOG_WARNING, "Skipping \"%s\" since its path is too "
+				"long", name);
+			continue;
+		}
+		memcpy(walk->path + level->len, name, len + 1);
+		if (!st->found)
+			continue;
+
+		/* Descend into directories. */
+		if (st->dir) {
+			if (walk->depth == GL_SYNC_DEPTH_MAX) {
+				log_printf(LOG_WARNING, "Skipping \"%s\" since it's nested too "
+					"deep", walk->path);
+				continue;
+			}
+
+			sub = &walk->levels[walk->depth];
+			sub->names = dir_list(walk->path, &sub->count);
+			if (sub->names == NULL) {
+				log_syserr(LOG_WARNING, "Skipping unreadable directory \"%s\"",
+					walk->path);
+				continue;
+			}
+			qsort(sub->names, sub->count, sizeof(char *), manifest_name_cmp);
+			sub->next = 0;
+			sub->len = level->len + len + 1;
+			walk->path[sub->len - 1] = '/';
+			if (!manifest_level_stat(sub, walk->path, sub->len)) {
+				manifest_level_free(sub);
+				continue;
+			}
+			walk->depth++;
+
+			continue;
+		}
+
+		/* Got ourselves a file. */
+		entry->path = walk->path + walk->rootlen;
+		entry->size = st->size;
+		entry->mtime = st->mtime;
+		entry->hashed = false;
+
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Frees up the resources allocated by a walk, even if it didn't finish.
+ *
+ * @param walk Walk object to be freed.
+ */
+void manifest_walk_close(manifest_walk_t *walk) {
+	while (walk->depth > 0)
+		manifest_level_free(&walk->levels[--walk->depth]);
+}
+
+/**
+ * Initializes the state of the encoding or decoding of a manifest.
+ *
+ * @param codec Codec object to be initialized.
+ */
+void manifest_codec_init(manifest_codec_t *codec) {
+	codec->path[0] = '\0';
+	codec->len = 0;
+}
+
+/**
+ * Encodes an entry of a manifest to be sent over the network.
+ *
+ * @param codec Codec object.
+ * @param entry Entry to be encoded or NULL to mark the end of the manifest.
+ * @param buf   Buffer with room for at least MANIFEST_ENTRY_MAX bytes.
+ *
+ * @return Length of the encoded entry.
+ */
+size_t manifest_encode(manifest_codec_t *codec, const manifest_entry_t *entry,
+                       uint8_t *buf) {
+	size_t shared;
+	size_t suffix;
+	size_t len;
+	int i;
+
+	/* Mark the end of the manifest. */
+	memset(buf, 0, MANIFEST_HDR_LEN);
+	if (entry == NULL) {
+		buf[0] = MANIFEST_FLAG_END;
+		return MANIFEST_HDR_LEN;
+	}
+
+	/* Only send the part of the path that differs from the previous one. */
+	len = strlen(entry->path);
+	shared = 0;
+	while ((shared < codec->len) && (shared < len) &&
+			(codec->path[shared] == entry->path[shared])) {
+		shared++;
+	}
+	suffix = len - shared;
+	memcpy(codec->path + shared, entry->path + shared, suffix + 1);
+	codec->len = len;
+
+	/* Build up the fixed-width part. */
+	buf[0] = (entry->hashed) ? MANIFEST_FLAG_DIGEST : 0;
+	buf[1] = (uint8_t)(shared >> 8);
+	buf[2] = (uint8_t)(shared & 0xFF);
+	buf[3] = (uint8_t)(suffix >> 8);
+	buf[4] = (uint8_t)(suffix & 0xFF);
+	for (i = 0; i < 8; i++) {
+		buf[5 + i] = (uint8_t)((entry->size >> ((7 - i) * 8)) & 0xFF);
+		buf[13 + i] = (uint8_t)((entry->mtime >> ((7 - i) * 8)) & 0xFF);
+	}
+	len = MANIFEST_HDR_LEN;
+
+	/* Append the digest and the path. */
+	if (entry->hashed) {
+		memcpy(buf + len, entry->digest, REQ_DIGEST_LEN);
+		len += REQ_DIGEST_LEN;
+	}
+	memcpy(buf + len, entry->path + shared, suffix);
+
+	return len + suffix;
+}
+
+/**
+ * Decodes the next entry of a manifest.
+ *
+ * @param codec Codec object.
+ * @param read  Function used to read the manifest.
+ * @param arg   Opaque argument passed to the read function.
+ * @param entry Returns the entry. Its path is only valid until the next call.
+ * @param end   Returns TRUE if the end of the manifest was reached.
+ *
+ * @return TRUE if the entry was decoded, FALSE if it couldn't be read or isn't
+ *         valid.
+ */
+bool manifest_decode(manifest_codec_t *codec, manifest_read_t read, void *arg,
+                     manifest_entry_t *entry, bool *end) {
+	uint8_t hdr[MANIFEST_HDR_LEN];
+	size_t shared;
+	size_t suffix;
+	int i;
+
+	/* Get the fixed-width part. */
+	if (!read(arg, hdr, MANIFEST_HDR_LEN))
+		return false;
+	*end = (hdr[0] & MANIFEST_FLAG_END) != 0;
+	if (*end)
+		return true;
+	shared = ((size_t)hdr[1] << 8) | hdr[2];
+	suffix = ((size_t)hdr[3] << 8) | hdr[4];
+	entry->size = 0;
+	entry->mtime = 0;
+	for (i = 0; i < 8; i++) {
+		entry->size = (entry->size << 8) | hdr[5 + i];
+		entry->mtime = (entry->mtime << 8) | hdr[13 + i];
+	}
+
+	/* Get the digest if there's one. */
+	entry->hashed = (hdr[0] & MANIFEST_FLAG_DIGEST) != 0;
+	if (entry->hashed && !read(arg, entry->digest, REQ_DIGEST_LEN))
+		return false;
+
+	/* Rebuild the path from the previous one. */
+	if ((suffix == 0) || (shared > codec->len) ||
+			((shared + suffix) >= GL_SYNC_PATH_MAX)) {
+		log_printf(LOG_ERROR, "Invalid manifest entry");
+		return false;
+	}
+	if (!read(arg, codec->path + shared, suffix))
+		return false;
+	codec->len = shared + suffix;
+	codec->path[codec->len] = '\0';
+	if (strlen(codec->path) != codec->len) {
+		log_printf(LOG_ERROR, "Invalid manifest entry path");
+		return false;
+	}
+	entry->path = codec->path;
+
+	return true;
+}
+
+/**
+ * Compares two paths in the order they're listed in a manifest, which is the
+ * same as comparing them component by component.
+ *
+ * @param a First path.
+ * @param b Second path.
+ *
+ * @return Negative if the first path comes first, positive if the second one
+ *         does, zero if they're the same.
+ */
+int manifest_cmp(const char *a, const char *b) {
+	const uint8_t *ua = (const uint8_t *)a;
+	const uint8_t *ub = (const uint8_t *)b;
+	int ca;
+	int cb;
+
+	/* Separators go before anything else so that subdirectories come first. */
+	do {
+		ca = (*ua == '\0') ? 0 : ((*ua == '/') ? 1 : (*ua + 1));
+		cb = (*ub == '\0') ? 0 : ((*ub == '/') ? 1 : (*ub + 1));
+		ua++;
+		ub++;
+	} while ((ca == cb) && (ca != 0));
+
+	return ca - cb;
+}
+
+/**
+ * Checks if a path received from the other end is safe to be used inside the
+ * directory being synchronized.
+ *
+ * @param path Relative path to be checked.
+ *
+ * @return TRUE if the path stays inside the directory, FALSE otherwise.
+ */
+bool manifest_path_valid(const char *path) {
+	const char *comp;
+	const char *cur;
+	size_t len;
+
+	/* Paths must be relative. */
+	if ((*path == '\0') || (*path == '/'))
+		return false;
+
+	/* Check each of the components. */
+	comp = path;
+	for (cur = path; ; cur++) {
+		if ((*cur == '/') || (*cur == '\0')) {
+			len = (size_t)(cur - comp);
+			if ((len == 0) || ((len == 1) && (comp[0] == '.')) ||
+					((len == 2) && (comp[0] == '.') && (comp[1] == '.'))) {
+				return false;
+			}
+			if (*cur == '\0')
+				break;
+			comp = cur + 1;
+			continue;
+		}
+
+		/* Characters that could escape the directory or confuse a terminal. */
+		if ((*cur == '\\') || ((uint8_t)*cur < 0x20))
+			return false;
+#ifdef _WIN32
+		if (*cur == ':')
+			return false;
+#endif /* _WIN32 */
+	}
+
+	return true;
+}
+
+/**
+ * Looks up every entry of a directory that was just listed, spreading the work
+ * across multiple threads when there are enough entries for it to pay off.
+ *
+ * @param level Directory whose entries will be looked up.
+ * @param dir   Path of the directory, ending with a slash.
+ * @param dlen  Length of the path of the directory.
+ *
+ * @return TRUE if the entries were looked up, FALSE if we ran out of memory.
+ */
+static bool manifest_level_stat(manifest_level_t *level, const char *dir,
+                                size_t dlen) {
+	manifest_stat_job_t jobs[GL_SYNC_STAT_THREADS];
+	thread_t threads[GL_SYNC_STAT_THREADS];
+	bool started[GL_SYNC_STAT_THREADS];
+	unsigned int nthreads;
+	unsigned int i;
+
+	/* Empty directories have nothing to look up. */
+	level->stats = NULL;
+	if (level->count == 0)
+		return true;
+	level->stats = (manifest_stat_t *)calloc(level->count,
+		sizeof(manifest_stat_t));
+	if (level->stats == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate directory entry details");
+		return false;
+	}
+
+	/* Split the entries between the threads. */
+	nthreads = (level->count >= GL_SYNC_STAT_MIN) ? GL_SYNC_STAT_THREADS : 1;
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].level = level;
+		jobs[i].dir = dir;
+		jobs[i].dlen = dlen;
+		jobs[i].first = i;
+		jobs[i].step = nthreads;
+	}
+
+	/* Do our share while the others do theirs. */
+	for (i = 1; i < nthreads; i++)
+		started[i] = thread_create(&threads[i], manifest_stat_worker, &jobs[i]);
+	manifest_stat_worker(&jobs[0]);
+	for (i = 1; i < nthreads; i++) {
+		if (started[i]) {
+			thread_join(threads[i]);
+		} else {
+			manifest_stat_worker(&jobs[i]);
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Looks up a share of the entries of a directory.
+ *
+ * @param arg Share of the entries to be looked up.
+ *
+ * @return Nothing.
+ */
+static thread_ret_t THREAD_CALL manifest_stat_worker(void *arg) {
+	manifest_stat_job_t *job;
+	manifest_stat_t *st;
+	char path[GL_SYNC_PATH_MAX];
+	size_t len;
+	size_t i;
+
+	job = (manifest_stat_job_t *)arg;
+	memcpy(path, job->dir, job->dlen);
+	for (i = job->first; i < job->level->count; i += job->step) {
+		/* Paths that are too long are skipped by the walk. */
+		st = &job->level->stats[i];
+		len = strlen(job->level->names[i]);
+		if ((job->dlen + len + 2) > GL_SYNC_PATH_MAX)
+			continue;
+
+		memcpy(path + job->dlen, job->level->names[i], len + 1);
+		st->found = path_stat(path, &st->dir, &st->size, &st->mtime);
+	}
+
+	return 0;
+}
+
+/**
+ * Frees up the names listed in a directory.
+ *
+ * @param level Directory to be freed.
+ */
+static void manifest_level_free(manifest_level_t *level) {
+	size_t i;
+
+	for (i = 0; i < level->count; i++)
+		free(level->names[i]);
+	free(level->names);
+	free(level->stats);
+	level->names = NULL;
+	level->stats = NULL;
+	level->count = 0;
+}
+
+/**
+ * Orders names of directory entries.
+ *
+ * @param a Pointer to the first name.
+ * @param b Pointer to the second name.
+ *
+ * @return Same as strcmp.
+ */
+static int manifest_name_cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
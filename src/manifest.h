@@ -0,0 +1,123 @@
+/**
+ * manifest.h
+ * Sorted listings of every file inside a directory tree, used to find out
+ * which files changed between two copies of a directory.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_MANIFEST_H
+#define _GL_MANIFEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "defaults.h"
+#include "request.h"
+
+/**
+ * Length of the fixed-width part of an entry when sent over the network.
+ */
+#define MANIFEST_HDR_LEN 21
+
+/**
+ * Maximum length of an entry when sent over the network.
+ */
+#define MANIFEST_ENTRY_MAX \
+	(MANIFEST_HDR_LEN + REQ_DIGEST_LEN + GL_SYNC_PATH_MAX)
+
+/* Flags of the entries sent over the network. */
+#define MANIFEST_FLAG_DIGEST 0x01
+#define MANIFEST_FLAG_END    0x80
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * File listed in a manifest.
+ */
+typedef struct {
+	const char *path;
+	uint64_t size;
+	uint64_t mtime;
+
+	bool hashed;
+	uint8_t digest[REQ_DIGEST_LEN];
+} manifest_entry_t;
+
+/**
+ * What was found out about an entry of a directory.
+ */
+typedef struct {
+	uint64_t size;
+	uint64_t mtime;
+	bool dir;
+	bool found;
+} manifest_stat_t;
+
+/**
+ * Directory whose entries are being walked through.
+ */
+typedef struct {
+	char **names;
+	manifest_stat_t *stats;
+	size_t count;
+	size_t next;
+	size_t len;
+} manifest_level_t;
+
+/**
+ * Walk through a directory tree, listing its files in the order of their paths
+ * while only keeping the directories along the current path in memory.
+ */
+typedef struct {
+	char path[GL_SYNC_PATH_MAX];
+	size_t rootlen;
+
+	manifest_level_t levels[GL_SYNC_DEPTH_MAX];
+	unsigned int depth;
+} manifest_walk_t;
+
+/**
+ * State of the encoding of entries, whose paths are sent as the part that
+ * differs from the path of the previous entry.
+ */
+typedef struct {
+	char path[GL_SYNC_PATH_MAX];
+	size_t len;
+} manifest_codec_t;
+
+/**
+ * Function that reads exactly the requested number of bytes of a manifest.
+ *
+ * @param arg Opaque argument passed to manifest_decode.
+ * @param buf Buffer where the bytes will be stored.
+ * @param len Number of bytes to read.
+ *
+ * @return TRUE if all the bytes were read, FALSE otherwise.
+ */
+typedef bool (*manifest_read_t)(void *arg, void *buf, size_t len);
+
+/* Walking directories. */
+bool manifest_walk_open(manifest_walk_t *walk, const char *root);
+bool manifest_walk_next(manifest_walk_t *walk, manifest_entry_t *entry);
+void manifest_walk_close(manifest_walk_t *walk);
+
+/* Exchanging manifests. */
+void manifest_codec_init(manifest_codec_t *codec);
+size_t manifest_encode(manifest_codec_t *codec, const manifest_entry_t *entry,
+                       uint8_t *buf);
+bool manifest_decode(manifest_codec_t *codec, manifest_read_t read, void *arg,
+                     manifest_entry_t *entry, bool *end);
+
+/* Paths. */
+int manifest_cmp(const char *a, const char *b);
+bool manifest_path_valid(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_MANIFEST_H */
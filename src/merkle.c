@@ -0,0 +1,399 @@
+/**
+ * merkle.c
+ * Merkle trees over fixed-size pieces of a file, used to find out exactly which
+ * parts of it are damaged.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "merkle.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defaults.h"
+#include "logging.h"
+#include "thread.h"
+#include "utils.h"
+
+/* Domain separation prefixes, so that leaves can't be mistaken for nodes. */
+#define MERKLE_PREFIX_LEAF 0x00
+#define MERKLE_PREFIX_NODE 0x01
+
+/**
+ * Range of leaves to be hashed by a single thread.
+ */
+typedef struct {
+	merkle_t *tree;
+	FILE *fh;
+	uint64_t first;
+	uint64_t last;
+	bool ok;
+} merkle_job_t;
+
+/* Private functions. */
+static bool merkle_alloc(merkle_t *tree, uint64_t size, uint32_t leaf);
+static void merkle_hash_nodes(merkle_t *tree);
+static bool merkle_hash_leaf(merkle_t *tree, FILE *fh, uint64_t idx,
+                             uint8_t *buf);
+static void merkle_hash_node(merkle_t *tree, uint8_t level, uint64_t idx);
+static thread_ret_t THREAD_CALL merkle_worker(void *arg);
+
+/**
+ * Builds the Merkle tree of a file, hashing its leaves in parallel.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param tree    Tree object to be populated.
+ * @param fh      File to build the tree of. Must not have pending writes.
+ * @param size    Size of the file.
+ * @param leaf    Size of each of the leaves.
+ * @param threads Number of threads used to hash the leaves.
+ *
+ * @return TRUE if the tree was built, FALSE otherwise.
+ *
+ * @see merkle_free
+ */
+bool merkle_build(merkle_t *tree, FILE *fh, uint64_t size, uint32_t leaf,
+                  unsigned int threads) {
+	thread_t handles[GL_HASH_THREADS_MAX];
+	merkle_job_t jobs[GL_HASH_THREADS_MAX];
+	unsigned int started;
+	unsigned int i;
+	bool ok;
+
+	/* Work out the shape of the tree. */
+	if (!merkle_alloc(tree, size, leaf))
+		return false;
+
+	/* Spread the leaves between the threads. */
+	if (threads > GL_HASH_THREADS_MAX)
+		threads = GL_HASH_THREADS_MAX;
+	if ((uint64_t)threads > tree->counts[0])
+		threads = (unsigned int)tree->counts[0];
+	if (threads == 0)
+		threads = 1;
+	started = 0;
+	for (i = 0; i < threads; i++) {
+		jobs[i].tree = tree;
+		jobs[i].fh = fh;
+		jobs[i].first = (tree->counts[0] * i) / threads;
+		jobs[i].last = (tree->counts[0] * (i + 1)) / threads;
+		jobs[i].ok = false;
+
+		/* The first range is hashed by ourselves. */
+		if (i == 0)
+			continue;
+		if (!thread_create(&handles[started], merkle_worker, &jobs[i]))
+			break;
+		started++;
+	}
+
+	/* Hash our own range, then whatever couldn't get a thread of its own. */
+	merkle_worker(&jobs[0]);
+	for (i = started + 1; i < threads; i++)
+		merkle_worker(&jobs[i]);
+	for (i = 0; i < started; i++)
+		thread_join(handles[i]);
+
+	/* Check if all of the leaves were hashed. */
+	ok = true;
+	for (i = 0; i < threads; i++)
+		ok = ok && jobs[i].ok;
+	if (!ok) {
+		merkle_free(tree);
+		return false;
+	}
+
+	/* Build up the rest of the tree. */
+	merkle_hash_nodes(tree);
+
+	return true;
+}
+
+/**
+ * Builds the Merkle tree of a file from the already known hashes of its leaves,
+ * without having to read the file.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param tree   Tree object to be populated.
+ * @param size   Size of the file.
+ * @param leaf   Size of each of the leaves.
+ * @param leaves Hashes of all of the leaves of the tree, one after the other.
+ *
+ * @return TRUE if the tree was built, FALSE otherwise.
+ *
+ * @see merkle_free
+ */
+bool merkle_load(merkle_t *tree, uint64_t size, uint32_t leaf,
+                 const uint8_t *leaves) {
+	if (!merkle_alloc(tree, size, leaf))
+		return false;
+
+	memcpy(tree->levels[0], leaves, (size_t)tree->counts[0] * MERKLE_HASH_LEN);
+	merkle_hash_nodes(tree);
+
+	return true;
+}
+
+/**
+ * Hashes some leaves of the tree again after they've been rewritten and updates
+ * the nodes that depend on them.
+ *
+ * @param tree  Tree object.
+ * @param fh    File the tree was built from. Must not have pending writes.
+ * @param idx   Indexes of the leaves that have changed.
+ * @param count Number of leaves that have changed.
+ *
+ * @return TRUE if the tree was updated, FALSE otherwise.
+ */
+bool merkle_rehash(merkle_t *tree, FILE *fh, const uint64_t *idx,
+                   uint64_t count) {
+	uint8_t *buf;
+	uint64_t i;
+	uint8_t level;
+
+	/* Allocate a buffer for reading the leaves. */
+	buf = (uint8_t *)malloc(tree->leaf);
+	if (buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate Merkle tree leaf buffer");
+		return false;
+	}
+
+	/* Hash the leaves again and walk their way up to the root. */
+	for (i = 0; i < count; i++) {
+		if (!merkle_hash_leaf(tree, fh, idx[i], buf)) {
+			free(buf);
+			return false;
+		}
+
+		for (level = 1; level < tree->nlevels; level++)
+			merkle_hash_node(tree, level, idx[i] >> level);
+	}
+
+	free(buf);
+	return true;
+}
+
+/**
+ * Frees up the resources allocated by a tree.
+ *
+ * @param tree Tree object to be freed.
+ */
+void merkle_free(merkle_t *tree) {
+	uint8_t i;
+
+	for (i = 0; i < tree->nlevels; i++) {
+		free(tree->levels[i]);
+		tree->levels[i] = NULL;
+	}
+	tree->nlevels = 0;
+}
+
+/**
+ * Gets the number of leaves of the tree of a file.
+ *
+ * @param size Size of the file.
+ * @param leaf Size of each of the leaves.
+ *
+ * @return Number of leaves, which is never zero.
+ */
+uint64_t merkle_leaf_count(uint64_t size, uint32_t leaf) {
+	uint64_t count;
+
+	count = (size + leaf - 1) / leaf;
+	return (count == 0) ? 1 : count;
+}
+
+/**
+ * Gets the hash of a node in the tree.
+ *
+ * @param tree  Tree object.
+ * @param level Level of the node, where 0 is the level of the leaves.
+ * @param idx   Index of the node in its level.
+ *
+ * @return Hash of the node or NULL if it doesn't exist.
+ */
+const uint8_t *merkle_node(const merkle_t *tree, uint8_t level, uint64_t idx) {
+	if ((level >= tree->nlevels) || (idx >= tree->counts[level]))
+		return NULL;
+
+	return tree->levels[level] + (idx * MERKLE_HASH_LEN);
+}
+
+/**
+ * Gets the root hash of the tree, which covers the entire file.
+ *
+ * @param tree Tree object.
+ *
+ * @return Root hash of the tree.
+ */
+const uint8_t *merkle_root(const merkle_t *tree) {
+	return tree->levels[tree->nlevels - 1];
+}
+
+/**
+ * Gets the length of the piece of the file covered by a leaf.
+ *
+ * @param tree Tree object.
+ * @param idx  Index of the leaf.
+ *
+ * @return Length of the leaf, which is only shorter for the last one.
+ */
+uint32_t merkle_leaf_len(const merkle_t *tree, uint64_t idx) {
+	uint64_t offset;
+
+	offset = idx * tree->leaf;
+	if (offset >= tree->size)
+		return 0;
+
+	return ((tree->size - offset) < tree->leaf) ?
+		(uint32_t)(tree->size - offset) : tree->leaf;
+}
+
+/**
+ * Works out the shape of a tree and allocates its levels.
+ *
+ * @param tree Tree object to be populated.
+ * @param size Size of the file.
+ * @param leaf Size of each of the leaves.
+ *
+ * @return TRUE if the tree was allocated, FALSE otherwise.
+ */
+static bool merkle_alloc(merkle_t *tree, uint64_t size, uint32_t leaf) {
+	uint64_t count;
+
+	memset(tree, 0, sizeof(merkle_t));
+	tree->size = size;
+	tree->leaf = leaf;
+	count = merkle_leaf_count(size, leaf);
+	do {
+		tree->counts[tree->nlevels] = count;
+		tree->levels[tree->nlevels] = (uint8_t *)malloc(
+			(size_t)count * MERKLE_HASH_LEN);
+		if (tree->levels[tree->nlevels] == NULL) {
+			log_syserr(LOG_CRIT, "Failed to allocate Merkle tree level");
+			merkle_free(tree);
+			return false;
+		}
+
+		tree->nlevels++;
+		count = (count + 1) / 2;
+	} while (tree->counts[tree->nlevels - 1] > 1);
+
+	return true;
+}
+
+/**
+ * Hashes all of the nodes of a tree whose leaves have already been hashed.
+ *
+ * @param tree Tree object.
+ */
+static void merkle_hash_nodes(merkle_t *tree) {
+	uint64_t j;
+	uint8_t i;
+
+	for (i = 1; i < tree->nlevels; i++) {
+		for (j = 0; j < tree->counts[i]; j++)
+			merkle_hash_node(tree, i, j);
+	}
+}
+
+/**
+ * Reads a leaf from the file and stores its hash in the tree.
+ *
+ * @param tree Tree object.
+ * @param fh   File the tree is being built from.
+ * @param idx  Index of the leaf.
+ * @param buf  Buffer large enough to hold an entire leaf.
+ *
+ * @return TRUE if the leaf was hashed, FALSE if the file couldn't be read.
+ */
+static bool merkle_hash_leaf(merkle_t *tree, FILE *fh, uint64_t idx,
+                             uint8_t *buf) {
+	uint8_t prefix;
+	sha256_t ctx;
+	uint32_t len;
+
+	/* Read the leaf. */
+	len = merkle_leaf_len(tree, idx);
+	if ((len > 0) && !file_pread(fh, buf, len, idx * tree->leaf)) {
+		log_syserr(LOG_ERROR, "Failed to read file while building its Merkle "
+			"tree");
+		return false;
+	}
+
+	/* Hash it. */
+	prefix = MERKLE_PREFIX_LEAF;
+	sha256_init(&ctx);
+	sha256_update(&ctx, &prefix, 1);
+	sha256_update(&ctx, buf, len);
+	sha256_final(&ctx, tree->levels[0] + (idx * MERKLE_HASH_LEN));
+
+	return true;
+}
+
+/**
+ * Calculates the hash of a node from the hashes of its children. A node
+ * without a right child takes the hash of its left child.
+ *
+ * @param tree  Tree object.
+ * @param level Level of the node, greater than 0.
+ * @param idx   Index of the node in its level.
+ */
+static void merkle_hash_node(merkle_t *tree, uint8_t level, uint64_t idx) {
+	const uint8_t *left;
+	uint8_t prefix;
+	sha256_t ctx;
+	uint8_t *node;
+
+	node = tree->levels[level] + (idx * MERKLE_HASH_LEN);
+	left = tree->levels[level - 1] + (idx * 2 * MERKLE_HASH_LEN);
+
+	/* Promote lonely children. */
+	if (((idx * 2) + 1) >= tree->counts[level - 1]) {
+		memcpy(node, left, MERKLE_HASH_LEN);
+		return;
+	}
+
+	/* Hash both children together. */
+	prefix = MERKLE_PREFIX_NODE;
+	sha256_init(&ctx);
+	sha256_update(&ctx, &prefix, 1);
+	sha256_update(&ctx, left, MERKLE_HASH_LEN * 2);
+	sha256_final(&ctx, node);
+}
+
+/**
+ * Thread that hashes a range of leaves.
+ *
+ * @param arg Merkle job object.
+ *
+ * @return Nothing.
+ */
+static thread_ret_t THREAD_CALL merkle_worker(void *arg) {
+	merkle_job_t *job;
+	uint8_t *buf;
+	uint64_t i;
+
+	/* Allocate a buffer for reading the leaves. */
+	job = (merkle_job_t *)arg;
+	buf = (uint8_t *)malloc(job->tree->leaf);
+	if (buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate Merkle tree leaf buffer");
+		return 0;
+	}
+
+	/* Hash our range of leaves. */
+	for (i = job->first; i < job->last; i++) {
+		if (!merkle_hash_leaf(job->tree, job->fh, i, buf)) {
+			free(buf);
+			return 0;
+		}
+	}
+	job->ok = true;
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * merkle.h
+ * Merkle trees over fixed-size pieces of a file, used to find out exactly which
+ * parts of it are damaged.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_MERKLE_H
+#define _GL_MERKLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sha256.h"
+
+/**
+ * Length of the hash of each node in the tree.
+ */
+#define MERKLE_HASH_LEN SHA256_LEN
+
+/**
+ * Maximum number of levels a tree may have. Enough for any 64-bit file size.
+ */
+#define MERKLE_LEVELS_MAX 65
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Merkle tree object. Level 0 holds the hashes of the leaves and the last level
+ * holds the root of the tree.
+ */
+typedef struct {
+	uint64_t size;
+	uint32_t leaf;
+	uint8_t nlevels;
+
+	uint64_t counts[MERKLE_LEVELS_MAX];
+	uint8_t *levels[MERKLE_LEVELS_MAX];
+} merkle_t;
+
+/* Building the tree. */
+bool merkle_build(merkle_t *tree, FILE *fh, uint64_t size, uint32_t leaf,
+                  unsigned int threads);
+bool merkle_load(merkle_t *tree, uint64_t size, uint32_t leaf,
+                 const uint8_t *leaves);
+bool merkle_rehash(merkle_t *tree, FILE *fh, const uint64_t *idx,
+                   uint64_t count);
+void merkle_free(merkle_t *tree);
+
+/* Accessing the tree. */
+uint64_t merkle_leaf_count(uint64_t size, uint32_t leaf);
+const uint8_t *merkle_node(const merkle_t *tree, uint8_t level, uint64_t idx);
+const uint8_t *merkle_root(const merkle_t *tree);
+uint32_t merkle_leaf_len(const merkle_t *tree, uint64_t idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_MERKLE_H */
@@ -0,0 +1,425 @@
+/**
+ * names.c
+ * Index of the names taken in the directory where files are received, used to
+ * pick a name for a new file without asking the file system about every
+ * candidate.
+ *
+ * Names that clash with existing ones get a numeric prefix, going from "1_" to
+ * "9_" and then starting over on top of the last one ("1_9_"). Each requested
+ * name remembers the last one picked for it, so the next clash continues from
+ * there instead of going through every candidate again. That hint is only
+ * trusted while no names were freed up since, which keeps the lowest free name
+ * being picked. A name is only reserved in the index while the user is asked
+ * about the file, and the file is created once it's accepted, so nothing is
+ * left behind in the directory if we never get that far. The index only avoids
+ * trying names that we know are taken, the file is always created exclusively,
+ * so a name taken behind our back is just skipped.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "names.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/inotify.h>
+#endif /* __linux__ */
+
+#include "logging.h"
+#include "utils.h"
+
+/* Smallest number of slots in the hash table. */
+#define NAMES_SLOTS_MIN 64
+
+#ifdef __linux__
+/* Changes to the directory that we keep track of. */
+#define NAMES_WATCH_MASK \
+	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#endif /* __linux__ */
+
+/* Private functions. */
+static names_entry_t *names_slot(const names_t *names, const char *name);
+static names_entry_t *names_put(names_t *names, const char *name, bool taken);
+static bool names_scan(names_t *names);
+static void names_sync(names_t *names);
+static char *names_next(arena_t *arena, const char *name);
+
+/**
+ * Indexes the names in the base directory and starts watching it for changes.
+ *
+ * @warning This function allocates memory that must be freed later.
+ *
+ * @param names Index object to be populated.
+ * @param path  Path to the base directory, relative to the working directory,
+ *              which is needed to watch it.
+ *
+ * @return TRUE if the index is ready to be used, FALSE otherwise.
+ *
+ * @see names_close
+ */
+bool names_open(names_t *names, const char *path) {
+	/* Start with an empty table. */
+	memset(names, 0, sizeof(names_t));
+	mutex_init(&names->lock);
+	names->watch = -1;
+	names->nslots = NAMES_SLOTS_MIN;
+	names->slots = (names_entry_t *)calloc(names->nslots,
+		sizeof(names_entry_t));
+	if (names->slots == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate name index");
+		mutex_free(&names->lock);
+		return false;
+	}
+
+#ifdef __linux__
+	/* Watch before listing so that nothing slips through in between. */
+	names->watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ((names->watch != -1) &&
+			(inotify_add_watch(names->watch, path, NAMES_WATCH_MASK) == -1)) {
+		close(names->watch);
+		names->watch = -1;
+	}
+	if (names->watch == -1) {
+		log_syserr(LOG_WARNING, "Failed to watch the directory for changes, "
+			"names freed up by others won't be reused");
+	}
+#endif /* __linux__ */
+
+	/* Take every name that's already in the directory. */
+	if (!names_scan(names)) {
+		names_close(names);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Frees up the resources allocated by the index.
+ *
+ * @param names Index object to be freed.
+ */
+void names_close(names_t *names) {
+	size_t i;
+
+	/* Index was never opened. */
+	if (names->slots == NULL)
+		return;
+
+	for (i = 0; i < names->nslots; i++) {
+		free(names->slots[i].name);
+		free(names->slots[i].hint);
+	}
+	free(names->slots);
+	names->slots = NULL;
+#ifdef __linux__
+	if (names->watch != -1) {
+		close(names->watch);
+		names->watch = -1;
+	}
+#endif /* __linux__ */
+	mutex_free(&names->lock);
+}
+
+/**
+ * Reserves the requested name or, if it's already taken, the first one that's
+ * free after adding a numeric prefix to it. Nothing is created in the directory
+ * until the file is actually created.
+ *
+ * @param names Index object.
+ * @param arena Arena where the name that was picked is allocated from.
+ * @param fname Name that was requested. Returns the name that was reserved.
+ *
+ * @return TRUE if a name was reserved, FALSE otherwise.
+ *
+ * @see names_create
+ * @see names_release
+ */
+bool names_reserve(names_t *names, arena_t *arena, char **fname) {
+	names_entry_t *entry;
+	const char *req;
+	char *name;
+	bool ret;
+
+	mutex_lock(&names->lock);
+	names_sync(names);
+
+	/* Continue from the last name picked if none were freed up since. */
+	ret = false;
+	req = *fname;
+	name = *fname;
+	entry = names_slot(names, req);
+	if ((entry->name != NULL) && (entry->hint != NULL) &&
+			(entry->hgen == names->gen)) {
+		name = names_next(arena, entry->hint);
+	}
+
+	/* Go through the candidates until one of them is free. */
+	while (name != NULL) {
+		entry = names_slot(names, name);
+		if ((entry->name == NULL) || !entry->taken)
+			break;
+		name = names_next(arena, name);
+	}
+	if (name == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate new string for filename");
+		goto cleanup;
+	}
+
+	/* Take the name and let the next clash continue from it. */
+	if ((names_put(names, name, true) == NULL) ||
+			((entry = names_put(names, req, true)) == NULL)) {
+		goto cleanup;
+	}
+	free(entry->hint);
+	entry->hint = strdup(name);
+	entry->hgen = names->gen;
+	*fname = name;
+	ret = true;
+
+cleanup:
+	mutex_unlock(&names->lock);
+	return ret;
+}
+
+/**
+ * Creates a new file with a name that was reserved. If something else took the
+ * name behind our back, the next free name is reserved and used instead.
+ *
+ * @param names Index object.
+ * @param arena Arena where any other name that's picked is allocated from.
+ * @param fname Name that was reserved. Returns the name of the file that was
+ *              created.
+ *
+ * @return File handle opened for reading and writing or NULL if the file
+ *         couldn't be created, in which case the reservation is released.
+ *
+ * @see names_reserve
+ */
+FILE *names_create(names_t *names, arena_t *arena, char **fname) {
+	FILE *fh;
+
+	for (;;) {
+		fh = file_create(*fname);
+		if (fh != NULL)
+			return fh;
+		if (errno != EEXIST) {
+			log_syserr(LOG_ERROR, "Failed to create file \"%s\"", *fname);
+			names_release(names, *fname);
+			return NULL;
+		}
+
+		/* Name stays taken, since something is really there. */
+		if (!names_reserve(names, arena, fname))
+			return NULL;
+	}
+}
+
+/**
+ * Frees up a name that was reserved but not used.
+ *
+ * @param names Index object.
+ * @param fname Name that was reserved.
+ */
+void names_release(names_t *names, const char *fname) {
+	mutex_lock(&names->lock);
+	if (names_put(names, fname, false) != NULL)
+		names->gen++;
+	mutex_unlock(&names->lock);
+}
+
+/**
+ * Finds the slot of the hash table where a name is or should be.
+ *
+ * @param names Index object.
+ * @param name  Name to look for.
+ *
+ * @return Slot with the name or the empty slot where it should go.
+ */
+static names_entry_t *names_slot(const names_t *names, const char *name) {
+	names_entry_t *entry;
+	const unsigned char *p;
+	uint64_t hash;
+	size_t slot;
+
+	/* FNV-1a. */
+	hash = 0xCBF29CE484222325ULL;
+	for (p = (const unsigned char *)name; *p != '\0'; p++)
+		hash = (hash ^ *p) * 0x100000001B3ULL;
+
+	slot = (size_t)hash & (names->nslots - 1);
+	for (; ; slot = (slot + 1) & (names->nslots - 1)) {
+		entry = &names->slots[slot];
+		if ((entry->name == NULL) || (strcmp(entry->name, name) == 0))
+			return entry;
+	}
+}
+
+/**
+ * Puts a name in the hash table or updates the one that's already there,
+ * growing the table if needed. Names are never taken out, only marked as free,
+ * so that they can keep their hints.
+ *
+ * @param names Index object.
+ * @param name  Name to be put in the table.
+ * @param taken Is there anything in the directory with this name?
+ *
+ * @return Entry of the name or NULL if it couldn't be put in the table.
+ */
+static names_entry_t *names_put(names_t *names, const char *name, bool taken) {
+	names_entry_t *slots;
+	names_entry_t *entry;
+	size_t nslots;
+	size_t i;
+
+	/* Update the name we already have. */
+	entry = names_slot(names, name);
+	if (entry->name != NULL) {
+		entry->taken = taken;
+		return entry;
+	}
+
+	/* Keep the table at most half full. */
+	if (((names->count + 1) * 2) > names->nslots) {
+		slots = names->slots;
+		nslots = names->nslots;
+		names->slots = (names_entry_t *)calloc(nslots * 2,
+			sizeof(names_entry_t));
+		if (names->slots == NULL) {
+			log_syserr(LOG_CRIT, "Failed to grow name index");
+			names->slots = slots;
+			return NULL;
+		}
+		names->nslots = nslots * 2;
+
+		for (i = 0; i < nslots; i++) {
+			if (slots[i].name != NULL)
+				*names_slot(names, slots[i].name) = slots[i];
+		}
+		free(slots);
+		entry = names_slot(names, name);
+	}
+
+	/* Fill in the entry. */
+	entry->name = strdup(name);
+	if (entry->name == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate name index entry");
+		return NULL;
+	}
+	entry->taken = taken;
+	entry->hint = NULL;
+	names->count++;
+
+	return entry;
+}
+
+/**
+ * Takes every name that's in the directory, freeing up the ones that aren't
+ * there anymore.
+ *
+ * @param names Index object.
+ *
+ * @return TRUE if the directory was listed, FALSE otherwise.
+ */
+static bool names_scan(names_t *names) {
+	char **list;
+	size_t count;
+	size_t i;
+	bool ret;
+
+	list = dir_list(".", &count);
+	if (list == NULL) {
+		log_syserr(LOG_ERROR, "Failed to list the names in the directory");
+		return false;
+	}
+
+	/* Start over from what's actually there. */
+	for (i = 0; i < names->nslots; i++)
+		names->slots[i].taken = false;
+	names->gen++;
+
+	ret = true;
+	for (i = 0; i < count; i++) {
+		if (ret && (names_put(names, list[i], true) == NULL))
+			ret = false;
+		free(list[i]);
+	}
+	free(list);
+
+	return ret;
+}
+
+/**
+ * Brings the index up to date with the changes that were made to the directory
+ * since it was last looked at.
+ *
+ * @param names Index object.
+ */
+static void names_sync(names_t *names) {
+#ifdef __linux__
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	if (names->watch == -1)
+		return;
+
+	while ((len = read(names->watch, u.buf, sizeof(u.buf))) > 0) {
+		for (p = u.buf; p < (u.buf + len);
+				p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			/* Too many changes to keep up with them one by one. */
+			if (ev->mask & IN_Q_OVERFLOW) {
+				names_scan(names);
+				continue;
+			}
+			if (ev->len == 0)
+				continue;
+
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				names_put(names, ev->name, true);
+			} else if (names_put(names, ev->name, false) != NULL) {
+				names->gen++;
+			}
+		}
+	}
+#endif /* __linux__ */
+}
+
+/**
+ * Builds the candidate that comes after a name, either by incrementing the
+ * prefix it already has or by adding a new one.
+ *
+ * @param arena Arena where the candidate is allocated from.
+ * @param name  Name that was taken.
+ *
+ * @return Next candidate or NULL if it couldn't be allocated.
+ */
+static char *names_next(arena_t *arena, const char *name) {
+	char *next;
+
+	/* Check if we are just incrementing an existing prefix. */
+	if ((name[0] >= '0') && (name[0] < '9') && (name[1] == '_')) {
+		next = arena_strdup(arena, name);
+		if (next != NULL)
+			next[0] = (char)(next[0] + 1);
+
+		return next;
+	}
+
+	/* Add a new prefix to it. */
+	next = (char *)arena_alloc(arena, strlen(name) + 3);
+	if (next != NULL)
+		sprintf(next, "1_%s", name);
+
+	return next;
+}
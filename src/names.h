@@ -0,0 +1,63 @@
+/**
+ * names.h
+ * Index of the names taken in the directory where files are received, used to
+ * pick a name for a new file without asking the file system about every
+ * candidate.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_NAMES_H
+#define _GL_NAMES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "arena.h"
+#include "thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Name that was seen in the directory.
+ */
+typedef struct {
+	char *name;
+	bool taken;
+
+	char *hint;
+	uint32_t hgen;
+} names_entry_t;
+
+/**
+ * Index of the names in the base directory, kept up to date with the changes
+ * made to it by others whenever the operating system is able to tell us about
+ * them.
+ */
+typedef struct {
+	names_entry_t *slots;
+	size_t nslots;
+	size_t count;
+	uint32_t gen;
+
+	int watch;
+	mutex_t lock;
+} names_t;
+
+/* Opening the index. */
+bool names_open(names_t *names, const char *path);
+void names_close(names_t *names);
+
+/* Picking names and creating files. */
+bool names_reserve(names_t *names, arena_t *arena, char **fname);
+FILE *names_create(names_t *names, arena_t *arena, char **fname);
+void names_release(names_t *names, const char *fname);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_NAMES_H */
@@ -13,15 +13,48 @@
 
 #include "defaults.h"
 #include "logging.h"
+#include "scan.h"
 #include "utils.h"
 
+/* Fixed reply lines. */
+#define REPLY_OK       "200\tOK\r\n"
+#define REPLY_REFUSED  "403\tREFUSED\tUser refused the transfer\r\n"
+#define REPLY_CONTINUE "100\tCONTINUE\tReady to accept content\r\n"
+#define REPLY_ERROR(num, msg) num "\tERROR\t" msg "\r\n"
+
+/**
+ * Reply line of an error, built once so that it's sent with a single call.
+ */
+typedef struct {
+	error_code_t code;
+	const char *line;
+	size_t len;
+} error_reply_t;
+
+/* Reply lines of the errors that have a message of their own. */
+#define ERROR_REPLY(code, num, msg) \
+	{ (code), REPLY_ERROR(num, msg), sizeof(REPLY_ERROR(num, msg)) - 1 }
+static const error_reply_t error_replies[] = {
+	ERROR_REPLY(ERR_CODE_REQ_BAD, "400", "Failed to parse request line"),
+	ERROR_REPLY(ERR_CODE_REQ_LONG, "417", "Request line too long"),
+	ERROR_REPLY(ERR_CODE_CHECKSUM, "422", "Content checksum mismatch"),
+	ERROR_REPLY(ERR_CODE_INTERNAL, "500", "Internal server error")
+};
+
+/* Private functions. */
+static char *line_end(char *line, size_t len);
+static char *field_next(char **cur, char *end, size_t *len);
+static bool field_to_uint(const char *field, size_t len, unsigned int base,
+                          uint64_t max, uint64_t *num);
+static reqtype_t reqtype_parse(const char *str, size_t len);
+
 /**
  * Sends a OK reply to a client, terminating the exchange.
  *
  * @param sockfd Socket handle used to reply.
  */
 void send_ok(sockfd_t sockfd) {
-	send(sockfd, "200\tOK\r\n", 8, 0);
+	socket_send_all(sockfd, REPLY_OK, sizeof(REPLY_OK) - 1);
 }
 
 /**
@@ -30,7 +63,7 @@ void send_ok(sockfd_t sockfd) {
  * @param sockfd Socket handle used to reply.
  */
 void send_refused(sockfd_t sockfd) {
-	send(sockfd, "403\tREFUSED\tUser refused the transfer\r\n", 39, 0);
+	socket_send_all(sockfd, REPLY_REFUSED, sizeof(REPLY_REFUSED) - 1);
 }
 
 /**
@@ -40,7 +73,23 @@ void send_refused(sockfd_t sockfd) {
  * @param sockfd Socket handle used to reply.
  */
 void send_continue(sockfd_t sockfd) {
-	send(sockfd, "100\tCONTINUE\tReady to accept content\r\n", 38, 0);
+	socket_send_all(sockfd, REPLY_CONTINUE, sizeof(REPLY_CONTINUE) - 1);
+}
+
+/**
+ * Sends a CONTINUE reply to a client, letting it know which of the flags it
+ * requested are going to be honored for this transaction.
+ *
+ * @param sockfd Socket handle used to reply.
+ * @param flags  Request flags accepted by the server.
+ */
+void send_continue_flags(sockfd_t sockfd, uint16_t flags) {
+	char buf[48];
+	int len;
+
+	len = sprintf(buf, "100\tCONTINUE\tReady to accept content\t%04X\r\n",
+		flags);
+	socket_send_all(sockfd, buf, (size_t)len);
 }
 
 /**
@@ -50,34 +99,23 @@ void send_continue(sockfd_t sockfd) {
  * @param code   Error code to notify.
  */
 void send_error(sockfd_t sockfd, error_code_t code) {
-	char strcode[4];
-
-	/* Convert error code to string. */
-	snprintf(strcode, 4, "%u", code);
-	strcode[3] = '\0';
+	char buf[48];
+	size_t i;
+	int len;
 
-	/* Send the error header and code. */
-	send(sockfd, strcode, 3, 0);
-	send(sockfd, "\tERROR\t", 7, 0);
-
-	/* Send the error message. */
-	switch (code) {
-		case ERR_CODE_REQ_BAD:
-			send(sockfd, "Failed to parse request line", 28, 0);
-			break;
-		case ERR_CODE_REQ_LONG:
-			send(sockfd, "Request line too long", 21, 0);
-			break;
-		case ERR_CODE_INTERNAL:
-			send(sockfd, "Internal server error", 21, 0);
-			break;
-		default:
-			send(sockfd, "Unknown error", 13, 0);
-			break;
+	/* Send the reply line of the error if it has one. */
+	for (i = 0; i < (sizeof(error_replies) / sizeof(error_reply_t)); i++) {
+		if (error_replies[i].code == code) {
+			socket_send_all(sockfd, error_replies[i].line,
+				error_replies[i].len);
+			return;
+		}
 	}
 
-	/* End with a CRLF. */
-	send(sockfd, "\r\n", 2, 0);
+	/* Build up a generic one otherwise. */
+	len = snprintf(buf, sizeof(buf), "%03u\tERROR\tUnknown error\r\n",
+		(unsigned int)code % 1000);
+	socket_send_all(sockfd, buf, (size_t)len);
 }
 
 /**
@@ -101,12 +139,27 @@ reqline_t *reqline_new(void) {
 	}
 
 	/* Initialize the object with some sane defaults. */
+	reqline_init(reqline);
+
+	return reqline;
+}
+
+/**
+ * Initializes a request line object with some sane defaults.
+ *
+ * @param reqline Request line object to be initialized.
+ */
+void reqline_init(reqline_t *reqline) {
 	reqline->type = REQ_TYPE_UNKNOWN;
 	reqline->stype = NULL;
 	reqline->name = NULL;
 	reqline->size = 0;
-
-	return reqline;
+	reqline->flags = 0;
+	memset(reqline->xid, 0, REQ_XID_LEN);
+	reqline->offset = 0;
+	reqline->chunk = 0;
+	reqline->leaf = 0;
+	memset(reqline->digest, 0, REQ_DIGEST_LEN);
 }
 
 /**
@@ -119,13 +172,9 @@ void reqline_free(reqline_t *reqline) {
 		return;
 
 	reqline->type = REQ_TYPE_UNKNOWN;
+	reqline->stype = NULL;
 	reqline->size = 0;
 
-	if (reqline->stype) {
-		free(reqline->stype);
-		reqline->stype = NULL;
-	}
-
 	if (reqline->name) {
 		free(reqline->name);
 		reqline->name = NULL;
@@ -135,77 +184,66 @@ void reqline_free(reqline_t *reqline) {
 }
 
 /**
- * Parses a request line and populates new request line object.
+ * Parses a request line in place and populates a request line object.
  *
- * @warning This function allocates memory that must later be freed.
+ * @warning The request line object will point to data inside the line buffer,
+ *          so it must not be freed with reqline_free and the buffer must
+ *          outlive it.
  *
- * @return A new, fully populated, request line object, or NULL if an error
- *         occurred.
+ * @param line    Buffer with the request line, which gets sliced into its
+ *                fields. Must have room for a NUL terminator after it.
+ * @param len     Number of bytes in the buffer.
+ * @param reqline Request line object to be populated.
  *
- * @see reqline_free
+ * @return TRUE if the request line was valid, FALSE otherwise.
  */
-reqline_t *reqline_parse(const char *line) {
-	reqline_t *reqline;
-	const char *cur;
-	char *buf;
+bool reqline_parse(char *line, size_t len, reqline_t *reqline) {
+	uint64_t size;
+	size_t flen;
+	char *field;
+	char *cur;
+	char *end;
 	uint8_t step;
 
-	/* Allocate a brand new request line object. */
-	reqline = reqline_new();
-	if (reqline == NULL)
-		return NULL;
+	/* Initialize the object with some sane defaults. */
+	reqline_init(reqline);
 
 	/* Parse each field of the request line and assign it to the object. */
-	step = 0;
 	cur = line;
-	while ((buf = struntil(cur, '\t', &cur)) != NULL) {
+	end = line_end(line, len);
+	for (step = 0; (field = field_next(&cur, end, &flen)) != NULL; step++) {
 		switch (step) {
 			case 0:
 				/* Request type. */
-				reqline->stype = buf;
-				if (strcmp(buf, "FILE") == 0) {
-					reqline->type = REQ_TYPE_FILE;
-				} else if (strcmp(buf, "URL") == 0) {
-					reqline->type = REQ_TYPE_URL;
-				} else if (strcmp(buf, "TEXT") == 0) {
-					reqline->type = REQ_TYPE_TEXT;
-				} else {
-					log_printf(LOG_ERROR, "Unknown request type '%s' from "
-						"request line \"%s\"", buf, line);
-					goto parse_failed;
+				reqline->type = reqtype_parse(field, flen);
+				reqline->stype = reqtype_str(reqline->type);
+				if (reqline->stype == NULL) {
+					log_printf(LOG_ERROR, "Unknown request type '%s' in "
+						"request line", field);
+					return false;
 				}
 				break;
 			case 1:
 				/* File name or URL. */
-				reqline->name = buf;
+				reqline->name = field;
 				break;
 			case 2:
 				/* Content size. */
-				if (!parse_size(buf, &reqline->size)) {
-					log_syserr(LOG_NOTICE, "Failed to convert content size "
-						"'%s' to number from request line \"%s\"", buf, line);
-					free(buf);
-					goto skip_parsing;
+				if (!field_to_uint(field, flen, 10, SIZE_MAX, &size)) {
+					log_printf(LOG_NOTICE, "Invalid content size '%s' in "
+						"request line", field);
+					return true;
 				}
+				reqline->size = (size_t)size;
 				break;
 			default:
 				log_printf(LOG_NOTICE, "Client sent more information than "
-					"needed in request line \"%s\"", line);
-				free(buf);
-				goto skip_parsing;
+					"needed in request line");
+				return true;
 		}
-
-		step++;
 	}
 
-skip_parsing:
-	return reqline;
-
-parse_failed:
-	/* In case of an error... */
-	reqline_free(reqline);
-	reqline = NULL;
-	return NULL;
+	return true;
 }
 
 /**
@@ -219,7 +257,6 @@ parse_failed:
 size_t reqline_send(sockfd_t sockfd, reqline_t *reqline) {
 	char buf[GL_REQLINE_MAX + 1];
 	size_t llen;
-	ssize_t tlen;
 
 	/* Build up the request line. */
 	snprintf(buf, GL_REQLINE_MAX, "%s\t%s\t%lu\r\n", reqline->stype,
@@ -228,13 +265,12 @@ size_t reqline_send(sockfd_t sockfd, reqline_t *reqline) {
 	llen = strlen(buf);
 
 	/* Send the request line over. */
-	tlen = send(sockfd, buf, llen, 0);
-	if (tlen != llen) {
+	if (!socket_send_all(sockfd, buf, llen)) {
 		log_sockerr(LOG_ERROR, "Failed to send the request line to the server");
 		return 0;
 	}
 
-	return tlen;
+	return llen;
 }
 
 /**
@@ -245,24 +281,828 @@ size_t reqline_send(sockfd_t sockfd, reqline_t *reqline) {
  */
 void reqline_type_set(reqline_t *reqline, reqtype_t type) {
 	reqline->type = type;
-	if (reqline->stype)
-		free(reqline->stype);
+	reqline->stype = reqtype_str(type);
+
+	if (reqline->stype == NULL)
+		log_printf(LOG_ERROR, "Setting request line type to unknown value");
+}
 
+/**
+ * Gets the string representation of a request type as used in request lines.
+ *
+ * @param type Request type.
+ *
+ * @return Statically allocated type string or NULL if the type is unknown.
+ */
+const char *reqtype_str(reqtype_t type) {
 	switch (type) {
 		case REQ_TYPE_FILE:
-			reqline->stype = strdup("FILE");
-			break;
+			return "FILE";
 		case REQ_TYPE_URL:
-			reqline->stype = strdup("URL");
-			break;
+			return "URL";
 		case REQ_TYPE_TEXT:
-			reqline->stype = strdup("TEXT");
-			break;
+			return "TEXT";
+		case REQ_TYPE_STRIPE:
+			return "STRIPE";
+		case REQ_TYPE_SYNC:
+			return "SYNC";
 		default:
-			reqline->stype = NULL;
-			log_printf(LOG_ERROR, "Setting request line type to unknown value");
-			break;
+			return NULL;
+	}
+}
+
+/**
+ * Encodes an unsigned integer as a variable-length (LEB128) integer.
+ *
+ * @param buf Destination buffer with at least 10 bytes available.
+ * @param num Number to be encoded.
+ *
+ * @return Number of bytes written to the buffer.
+ */
+static size_t varint_encode(uint8_t *buf, uint64_t num) {
+	size_t len;
+
+	len = 0;
+	do {
+		buf[len] = (uint8_t)(num & 0x7F);
+		num >>= 7;
+		if (num > 0)
+			buf[len] |= 0x80;
+		len++;
+	} while (num > 0);
+
+	return len;
+}
+
+/**
+ * Decodes a variable-length (LEB128) integer.
+ *
+ * @param buf Buffer where the encoded integer begins.
+ * @param len Number of bytes available in the buffer.
+ * @param num Where to store the decoded number.
+ *
+ * @return Number of bytes consumed or 0 if the integer is truncated or too big.
+ */
+static size_t varint_decode(const uint8_t *buf, size_t len, uint64_t *num) {
+	size_t i;
+
+	*num = 0;
+	for (i = 0; (i < len) && (i < 10); i++) {
+		*num |= (uint64_t)(buf[i] & 0x7F) << (7 * i);
+		if (!(buf[i] & 0x80))
+			return i + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Appends an extension TLV to a binary request header being built.
+ *
+ * @param buf  Binary request header buffer of GL_BINHDR_MAX bytes.
+ * @param len  Current length of the header. Updated if the extension fits.
+ * @param type Type of the extension.
+ * @param val  Value of the extension.
+ * @param vlen Length of the value.
+ *
+ * @return TRUE if the extension was appended, FALSE if it didn't fit.
+ */
+static bool ext_append(uint8_t *buf, size_t *len, uint8_t type,
+                       const void *val, size_t vlen) {
+	/* Ensure we have enough space for the type, length and value. */
+	if ((*len + 11 + vlen) > GL_BINHDR_MAX)
+		return false;
+
+	buf[(*len)++] = type;
+	*len += varint_encode(buf + *len, vlen);
+	memcpy(buf + *len, val, vlen);
+	*len += vlen;
+
+	return true;
+}
+
+/**
+ * Appends an extension TLV with a varint value to a binary request header.
+ *
+ * @param buf  Binary request header buffer of GL_BINHDR_MAX bytes.
+ * @param len  Current length of the header. Updated if the extension fits.
+ * @param type Type of the extension.
+ * @param num  Value of the extension.
+ *
+ * @return TRUE if the extension was appended, FALSE if it didn't fit.
+ */
+static bool ext_append_varint(uint8_t *buf, size_t *len, uint8_t type,
+                              uint64_t num) {
+	uint8_t val[10];
+
+	return ext_append(buf, len, type, val, varint_encode(val, num));
+}
+
+/**
+ * Checks if the beginning of a buffer contains a binary request header.
+ *
+ * @param buf Buffer with the data received from the client.
+ * @param len Number of bytes available in the buffer.
+ *
+ * @return TRUE if the buffer starts with a binary request header.
+ */
+bool reqline_is_bin(const uint8_t *buf, size_t len) {
+	return (len > 0) && (buf[0] == REQ_BIN_MAGIC);
+}
+
+/**
+ * Gets the total length of a binary request header from its fixed prefix.
+ *
+ * @param buf Buffer where the binary request header begins.
+ * @param len Number of bytes available in the buffer.
+ *
+ * @return Length of the entire header or 0 if not enough bytes are available
+ *         to determine it.
+ */
+size_t reqline_bin_len(const uint8_t *buf, size_t len) {
+	if (len < REQ_BIN_PREFIX_LEN)
+		return 0;
+
+	return ((size_t)buf[6] << 8) | buf[7];
+}
+
+/**
+ * Parses a binary request header and populates a request line object.
+ *
+ * @warning The request line object will point to data inside the header
+ *          buffer, so it must not be freed with reqline_free and the buffer
+ *          must outlive it.
+ *
+ * @param buf     Buffer containing the entire binary request header.
+ * @param len     Length of the header as reported by reqline_bin_len.
+ * @param reqline Request line object to be populated.
+ *
+ * @return TRUE if the header was valid, FALSE otherwise.
+ */
+bool reqline_parse_bin(const uint8_t *buf, size_t len, reqline_t *reqline) {
+	const uint8_t *cur;
+	const uint8_t *end;
+	uint64_t size;
+	uint8_t type;
+	int i;
+
+	/* Initialize the object with some sane defaults. */
+	reqline_init(reqline);
+
+	/* Check the fixed-width prefix. */
+	if ((len < REQ_BIN_PREFIX_LEN) || (buf[0] != REQ_BIN_MAGIC) ||
+			(reqline_bin_len(buf, len) != len)) {
+		log_printf(LOG_ERROR, "Malformed binary request header");
+		return false;
+	}
+	if (buf[1] != REQ_BIN_VERSION) {
+		log_printf(LOG_ERROR, "Unsupported binary request header version %u",
+			buf[1]);
+		return false;
+	}
+
+	/* Request type. */
+	reqline->type = (reqtype_t)buf[2];
+	reqline->stype = reqtype_str(reqline->type);
+	if (reqline->stype == NULL) {
+		log_printf(LOG_ERROR, "Unknown request type '%c' in binary request "
+			"header", buf[2]);
+		reqline->type = REQ_TYPE_UNKNOWN;
+		return false;
+	}
+
+	/* Flags and content size. */
+	reqline->flags = (uint16_t)((buf[4] << 8) | buf[5]);
+	size = 0;
+	for (i = 8; i < 16; i++)
+		size = (size << 8) | buf[i];
+	reqline->size = (size_t)size;
+	if ((uint64_t)reqline->size != size) {
+		log_printf(LOG_ERROR, "Content size in binary request header is too "
+			"big for this platform");
+		return false;
+	}
+
+	/* Go through the extensions. */
+	cur = buf + REQ_BIN_PREFIX_LEN;
+	end = buf + len;
+	while (cur < end) {
+		uint64_t elen;
+		size_t vlen;
+
+		/* Get the type and length of the extension. */
+		type = *cur++;
+		vlen = varint_decode(cur, end - cur, &elen);
+		if ((vlen == 0) || (elen > (uint64_t)(end - cur - vlen))) {
+			log_printf(LOG_ERROR, "Truncated extension 0x%02X in binary "
+				"request header", type);
+			return false;
+		}
+		cur += vlen;
+
+		/* Handle the extension. */
+		switch (type) {
+			case REQ_EXT_NAME:
+				/* Name must be a single NUL terminated string. */
+				if ((elen == 0) || (memchr(cur, '\0', elen) !=
+						cur + elen - 1)) {
+					log_printf(LOG_ERROR, "Invalid name in binary request "
+						"header");
+					return false;
+				}
+				reqline->name = (char *)cur;
+				break;
+			case REQ_EXT_XID:
+				if (elen != REQ_XID_LEN)
+					goto invalid_ext;
+				memcpy(reqline->xid, cur, REQ_XID_LEN);
+				break;
+			case REQ_EXT_OFFSET:
+				if (varint_decode(cur, (size_t)elen, &reqline->offset) != elen)
+					goto invalid_ext;
+				break;
+			case REQ_EXT_CHUNK:
+				if ((varint_decode(cur, (size_t)elen, &size) != elen) ||
+						(size == 0) || (size > 0xFFFFFFFFUL))
+					goto invalid_ext;
+				reqline->chunk = (uint32_t)size;
+				break;
+			case REQ_EXT_LEAF:
+				if ((varint_decode(cur, (size_t)elen, &size) != elen) ||
+						(size == 0) || (size > 0xFFFFFFFFUL))
+					goto invalid_ext;
+				reqline->leaf = (uint32_t)size;
+				break;
+			case REQ_EXT_DIGEST:
+				if (elen != REQ_DIGEST_LEN)
+					goto invalid_ext;
+				memcpy(reqline->digest, cur, REQ_DIGEST_LEN);
+				break;
+			default:
+				/* Skip over unknown extensions for forward compatibility. */
+				log_printf(LOG_DEBUG, "Skipped unknown binary request header "
+					"extension 0x%02X", type);
+				break;
+		}
+
+		cur += elen;
+	}
+
+	return true;
+
+invalid_ext:
+	log_printf(LOG_ERROR, "Invalid extension 0x%02X in binary request header",
+		type);
+	return false;
+}
+
+/**
+ * Sends a request line object to a server using a binary request header.
+ *
+ * @param sockfd  Socket handle already connected to the server.
+ * @param reqline Request line object to be sent.
+ *
+ * @return Number of bytes sent to the server or 0 in case of an error.
+ */
+size_t reqline_send_bin(sockfd_t sockfd, reqline_t *reqline) {
+	uint8_t buf[GL_BINHDR_MAX];
+	uint64_t size;
+	size_t len;
+	bool ok;
+	int i;
+
+	/* Build up the fixed-width prefix. */
+	buf[0] = REQ_BIN_MAGIC;
+	buf[1] = REQ_BIN_VERSION;
+	buf[2] = (uint8_t)reqline->type;
+	buf[3] = 0;
+	buf[4] = (uint8_t)(reqline->flags >> 8);
+	buf[5] = (uint8_t)(reqline->flags & 0xFF);
+	size = reqline->size;
+	for (i = 15; i >= 8; i--) {
+		buf[i] = (uint8_t)(size & 0xFF);
+		size >>= 8;
+	}
+	len = REQ_BIN_PREFIX_LEN;
+
+	/* Append the extensions. */
+	ok = true;
+	if (reqline->name != NULL) {
+		ok = ok && ext_append(buf, &len, REQ_EXT_NAME, reqline->name,
+			strlen(reqline->name) + 1);
+	}
+	if ((reqline->type == REQ_TYPE_STRIPE) ||
+			(reqline->flags & REQ_FLAG_STRIPED)) {
+		ok = ok && ext_append(buf, &len, REQ_EXT_XID, reqline->xid,
+			REQ_XID_LEN);
+	}
+	if (reqline->type == REQ_TYPE_STRIPE) {
+		ok = ok && ext_append_varint(buf, &len, REQ_EXT_OFFSET,
+			reqline->offset);
+	}
+	if (reqline->flags & REQ_FLAG_STRIPED) {
+		ok = ok && ext_append_varint(buf, &len, REQ_EXT_CHUNK,
+			reqline->chunk);
+	}
+	if (reqline->flags & REQ_FLAG_MERKLE) {
+		ok = ok && ext_append_varint(buf, &len, REQ_EXT_LEAF,
+			reqline->leaf);
+	}
+	if (reqline->flags & REQ_FLAG_DIGEST) {
+		ok = ok && ext_append(buf, &len, REQ_EXT_DIGEST, reqline->digest,
+			REQ_DIGEST_LEN);
+	}
+	if (!ok) {
+		log_printf(LOG_ERROR, "Request too long for a binary request header");
+		return 0;
+	}
+
+	/* Set the total header length. */
+	buf[6] = (uint8_t)(len >> 8);
+	buf[7] = (uint8_t)(len & 0xFF);
+
+	/* Send the header over. */
+	if (!socket_send_all(sockfd, buf, len)) {
+		log_sockerr(LOG_ERROR, "Failed to send the request header to the "
+			"server");
+		return 0;
+	}
+
+	return len;
+}
+
+/**
+ * Sends a single chunk of content using the chunked transfer encoding. A chunk
+ * with a length of 0 signals the end of the content.
+ *
+ * When checksums are in use each chunk is followed by the CRC-32C of all of the
+ * content sent up until the end of it, which makes the checksum following the
+ * terminating chunk the one of the entire content.
+ *
+ * @param sockfd Socket handle already connected to the server.
+ * @param chunk  Buffer with REQ_CHUNK_HDR_LEN bytes reserved for the chunk
+ *               header followed by the chunk's contents and CRC32C_LEN bytes
+ *               reserved for its checksum.
+ * @param len    Length of the chunk's contents.
+ * @param digest Running checksum of the content, which gets updated with this
+ *               chunk. Set to NULL if checksums aren't in use.
+ *
+ * @return TRUE if the chunk was sent, FALSE otherwise.
+ */
+bool chunk_send(sockfd_t sockfd, uint8_t *chunk, size_t len,
+                uint32_t *digest) {
+	/* Build up the chunk header. */
+	chunk[0] = (uint8_t)((len >> 24) & 0xFF);
+	chunk[1] = (uint8_t)((len >> 16) & 0xFF);
+	chunk[2] = (uint8_t)((len >> 8) & 0xFF);
+	chunk[3] = (uint8_t)(len & 0xFF);
+
+	/* Append the running checksum to the chunk. */
+	if (digest != NULL) {
+		*digest = crc32c(*digest, chunk + REQ_CHUNK_HDR_LEN, len);
+		crc32c_pack(chunk + REQ_CHUNK_HDR_LEN + len, *digest);
+		len += CRC32C_LEN;
+	}
+
+	/* Send the header and contents in one go. */
+	return socket_send_all(sockfd, chunk, len + REQ_CHUNK_HDR_LEN);
+}
+
+/**
+ * Initializes a chunked transfer decoder.
+ *
+ * @param dec       Decoder state to be initialized.
+ * @param checksums Are the chunks followed by their checksums?
+ */
+void chunkdec_init(chunkdec_t *dec, bool checksums) {
+	dec->hdrlen = 0;
+	dec->remaining = 0;
+	dec->crc = 0;
+	dec->checksums = checksums;
+	dec->trailer = false;
+	dec->final = false;
+	dec->mismatch = false;
+	dec->done = false;
+}
+
+/**
+ * Feeds data received from the network into a chunked transfer decoder and
+ * gets the next slice of content out of it. Call this repeatedly until the
+ * received data has been consumed or the decoder is done.
+ *
+ * @param dec  Decoder state.
+ * @param buf  Pointer to the received data. Moved forward as it's consumed.
+ * @param len  Length of the received data. Decremented as it's consumed.
+ * @param data Returns a pointer to the decoded content inside the buffer.
+ * @param dlen Returns the length of the decoded content, which may be 0.
+ *
+ * @return TRUE if the data was valid, FALSE if the encoding was violated or a
+ *         checksum didn't match, in which case the mismatch flag is set.
+ */
+bool chunkdec_feed(chunkdec_t *dec, const uint8_t **buf, size_t *len,
+                   const uint8_t **data, size_t *dlen) {
+	uint32_t value;
+
+	*data = *buf;
+	*dlen = 0;
+
+	/* Are we in the middle of a chunk? */
+	if (dec->remaining > 0) {
+		*dlen = (*len < dec->remaining) ? *len : dec->remaining;
+		dec->remaining -= (uint32_t)*dlen;
+		*buf += *dlen;
+		*len -= *dlen;
+
+		/* Keep a running checksum and expect it after the chunk. */
+		if (dec->checksums) {
+			dec->crc = crc32c(dec->crc, *data, *dlen);
+			if (dec->remaining == 0)
+				dec->trailer = true;
+		}
+
+		return true;
+	}
+
+	/* Accumulate the chunk header or checksum trailer. */
+	while ((dec->hdrlen < REQ_CHUNK_HDR_LEN) && (*len > 0)) {
+		dec->hdr[dec->hdrlen++] = **buf;
+		(*buf)++;
+		(*len)--;
+	}
+	if (dec->hdrlen < REQ_CHUNK_HDR_LEN)
+		return true;
+	dec->hdrlen = 0;
+	value = ((uint32_t)dec->hdr[0] << 24) | ((uint32_t)dec->hdr[1] << 16) |
+		((uint32_t)dec->hdr[2] << 8) | dec->hdr[3];
+
+	/* Verify the checksum of the content up until the end of this chunk. */
+	if (dec->trailer) {
+		dec->trailer = false;
+		if (value != dec->crc) {
+			log_printf(LOG_ERROR, "Content checksum mismatch (expected %08X, "
+				"got %08X)", value, dec->crc);
+			dec->mismatch = true;
+			return false;
+		}
+
+		/* Only the terminating chunk's checksum ends the content. */
+		if (dec->final)
+			dec->done = true;
+
+		return true;
+	}
+
+	/* Decode the chunk length. */
+	dec->remaining = value;
+	if (dec->remaining > GL_CHUNK_MAX) {
+		log_printf(LOG_ERROR, "Chunk of %lu bytes exceeds the maximum allowed",
+			(unsigned long)dec->remaining);
+		return false;
+	}
+
+	/* A zero-length chunk terminates the content. */
+	if (dec->remaining == 0) {
+		if (dec->checksums) {
+			dec->final = true;
+			dec->trailer = true;
+		} else {
+			dec->done = true;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Sends a frame asking the client for something while verifying a transfer.
+ * The frame starts with the same magic byte as binary request headers, so that
+ * it can't be confused with a reply line.
+ *
+ * @param sockfd Client's socket handle.
+ * @param op     Operation that the client must perform.
+ * @param level  Level of the Merkle tree the indexes refer to.
+ * @param idx    Indexes of the nodes the operation refers to.
+ * @param count  Number of indexes.
+ *
+ * @return TRUE if the frame was sent, FALSE otherwise.
+ */
+bool verify_send(sockfd_t sockfd, verifyop_t op, uint8_t level,
+                 const uint64_t *idx, uint32_t count) {
+	uint8_t *buf;
+	uint8_t *cur;
+	uint32_t i;
+	size_t len;
+	bool ret;
+	int j;
+
+	/* Allocate the frame. */
+	len = REQ_VERIFY_HDR_LEN + ((size_t)count * sizeof(uint64_t));
+	buf = (uint8_t *)malloc(len);
+	if (buf == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate verification frame");
+		return false;
+	}
+
+	/* Build up the header. */
+	buf[0] = REQ_BIN_MAGIC;
+	buf[1] = (uint8_t)op;
+	buf[2] = level;
+	buf[3] = 0;
+	buf[4] = (uint8_t)((count >> 24) & 0xFF);
+	buf[5] = (uint8_t)((count >> 16) & 0xFF);
+	buf[6] = (uint8_t)((count >> 8) & 0xFF);
+	buf[7] = (uint8_t)(count & 0xFF);
+
+	/* Append the indexes. */
+	cur = buf + REQ_VERIFY_HDR_LEN;
+	for (i = 0; i < count; i++) {
+		for (j = 7; j >= 0; j--)
+			*cur++ = (uint8_t)((idx[i] >> (j * 8)) & 0xFF);
+	}
+
+	/* Send it over. */
+	ret = socket_send_all(sockfd, buf, len);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * Parses the header of a verification frame sent by the server. The indexes
+ * follow it as 64-bit big-endian integers.
+ *
+ * @param buf   Buffer with REQ_VERIFY_HDR_LEN bytes of the frame.
+ * @param op    Returns the operation requested by the server.
+ * @param level Returns the level of the Merkle tree the frame refers to.
+ * @param count Returns the number of indexes that follow the header.
+ *
+ * @return TRUE if this is a valid verification frame, FALSE otherwise.
+ */
+bool verify_parse(const uint8_t *buf, verifyop_t *op, uint8_t *level,
+                  uint32_t *count) {
+	if (buf[0] != REQ_BIN_MAGIC)
+		return false;
+
+	*op = (verifyop_t)buf[1];
+	*level = buf[2];
+	*count = ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16) |
+		((uint32_t)buf[6] << 8) | buf[7];
+
+	return (*op == VERIFY_OP_HASHES) || (*op == VERIFY_OP_RESEND);
+}
+
+/**
+ * Sends a frame of a delta transfer, where a file is rebuilt by the server from
+ * the copy it already has. The frame starts with the same magic byte as binary
+ * request headers, so that it can't be confused with a reply line.
+ *
+ * @param sockfd Socket handle to send the frame through.
+ * @param op     Operation described by the frame.
+ * @param len    Length or count the operation refers to.
+ * @param val    Index or size the operation refers to.
+ * @param data   Optional. Data that follows the frame, which is sent along
+ *               with it in a single call.
+ * @param dlen   Length of the data.
+ *
+ * @return TRUE if the frame was sent, FALSE otherwise.
+ */
+bool delta_send(sockfd_t sockfd, deltaop_t op, uint32_t len, uint64_t val,
+                const void *data, size_t dlen) {
+	uint8_t buf[REQ_DELTA_HDR_LEN];
+	sockbuf_t bufs[2];
+	int i;
+
+	/* Build up the frame. */
+	buf[0] = REQ_BIN_MAGIC;
+	buf[1] = (uint8_t)op;
+	buf[2] = 0;
+	buf[3] = 0;
+	for (i = 0; i < 4; i++)
+		buf[4 + i] = (uint8_t)((len >> ((3 - i) * 8)) & 0xFF);
+	for (i = 0; i < 8; i++)
+		buf[8 + i] = (uint8_t)((val >> ((7 - i) * 8)) & 0xFF);
+
+	SOCKBUF_SET(bufs[0], buf, REQ_DELTA_HDR_LEN);
+	SOCKBUF_SET(bufs[1], data, (data != NULL) ? dlen : 0);
+	return socket_sendv(sockfd, bufs, 2);
+}
+
+/**
+ * Parses a frame of a delta transfer.
+ *
+ * @param buf Frame that was received.
+ * @param op  Returns the operation described by the frame.
+ * @param len Returns the length or count the operation refers to.
+ * @param val Returns the index or size the operation refers to.
+ *
+ * @return TRUE if the frame is valid, FALSE otherwise.
+ */
+bool delta_parse(const uint8_t *buf, deltaop_t *op, uint32_t *len,
+                 uint64_t *val) {
+	int i;
+
+	if (buf[0] != REQ_BIN_MAGIC)
+		return false;
+
+	*op = (deltaop_t)buf[1];
+	*len = ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16) |
+		((uint32_t)buf[6] << 8) | buf[7];
+	*val = 0;
+	for (i = 8; i < REQ_DELTA_HDR_LEN; i++)
+		*val = (*val << 8) | buf[i];
+
+	return (*op == DELTA_OP_SIGNATURE) || (*op == DELTA_OP_LITERAL) ||
+		(*op == DELTA_OP_COPY) || (*op == DELTA_OP_END);
+}
+
+/**
+ * Sends a frame of a transfer whose contents are sent as content-defined
+ * chunks, only sending the ones that the server doesn't already have.
+ *
+ * @param sockfd Socket handle to send the frame through.
+ * @param op     Operation described by the frame.
+ * @param len    Number of chunks the operation refers to.
+ * @param val    Size of the contents the operation refers to.
+ * @param data   Optional. Data that follows the frame, which is sent along
+ *               with it in a single call.
+ * @param dlen   Length of the data.
+ *
+ * @return TRUE if the frame was sent, FALSE otherwise.
+ */
+bool cdc_frame_send(sockfd_t sockfd, cdcop_t op, uint32_t len, uint64_t val,
+                    const void *data, size_t dlen) {
+	uint8_t buf[REQ_CDC_HDR_LEN];
+	sockbuf_t bufs[2];
+	int i;
+
+	/* Build up the frame. */
+	buf[0] = REQ_BIN_MAGIC;
+	buf[1] = (uint8_t)op;
+	buf[2] = 0;
+	buf[3] = 0;
+	for (i = 0; i < 4; i++)
+		buf[4 + i] = (uint8_t)((len >> ((3 - i) * 8)) & 0xFF);
+	for (i = 0; i < 8; i++)
+		buf[8 + i] = (uint8_t)((val >> ((7 - i) * 8)) & 0xFF);
+
+	SOCKBUF_SET(bufs[0], buf, REQ_CDC_HDR_LEN);
+	SOCKBUF_SET(bufs[1], data, (data != NULL) ? dlen : 0);
+	return socket_sendv(sockfd, bufs, 2);
+}
+
+/**
+ * Parses a frame of a transfer whose contents are sent as chunks.
+ *
+ * @param buf Frame that was received.
+ * @param op  Returns the operation described by the frame.
+ * @param len Returns the number of chunks the operation refers to.
+ * @param val Returns the size of the contents the operation refers to.
+ *
+ * @return TRUE if the frame is valid, FALSE otherwise.
+ */
+bool cdc_frame_parse(const uint8_t *buf, cdcop_t *op, uint32_t *len,
+                     uint64_t *val) {
+	int i;
+
+	if (buf[0] != REQ_BIN_MAGIC)
+		return false;
+
+	*op = (cdcop_t)buf[1];
+	*len = ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16) |
+		((uint32_t)buf[6] << 8) | buf[7];
+	*val = 0;
+	for (i = 8; i < REQ_CDC_HDR_LEN; i++)
+		*val = (*val << 8) | buf[i];
+
+	return (*op == CDC_OP_HASHES) || (*op == CDC_OP_WANT) ||
+		(*op == CDC_OP_END);
+}
+
+/**
+ * Sends a frame of a directory synchronization to the other end.
+ *
+ * @param sockfd Socket handle.
+ * @param op     Operation described by the frame.
+ * @param len    Length of the path of the file that follows the frame, the
+ *               number of files wanted from the list that follows it, or the
+ *               number of files in the pack that follows it.
+ * @param size   Size of the contents of the file that follow its path, the
+ *               number of files in the list that follows it, or the length of
+ *               the pack that follows it.
+ * @param mtime  Modification time of the file in nanoseconds since the Unix
+ *               epoch.
+ * @param data   Optional. Data that follows the frame, which is sent along
+ *               with it in a single call.
+ * @param dlen   Length of the data.
+ *
+ * @return TRUE if the frame was sent, FALSE otherwise.
+ */
+bool sync_send(sockfd_t sockfd, syncop_t op, uint32_t len, uint64_t size,
+               uint64_t mtime, const void *data, size_t dlen) {
+	uint8_t buf[REQ_SYNC_HDR_LEN];
+	sockbuf_t bufs[2];
+	int i;
+
+	/* Build up the frame. */
+	buf[0] = REQ_BIN_MAGIC;
+	buf[1] = (uint8_t)op;
+	buf[2] = 0;
+	buf[3] = 0;
+	for (i = 0; i < 4; i++)
+		buf[4 + i] = (uint8_t)((len >> ((3 - i) * 8)) & 0xFF);
+	for (i = 0; i < 8; i++) {
+		buf[8 + i] = (uint8_t)((size >> ((7 - i) * 8)) & 0xFF);
+		buf[16 + i] = (uint8_t)((mtime >> ((7 - i) * 8)) & 0xFF);
+	}
+
+	SOCKBUF_SET(bufs[0], buf, REQ_SYNC_HDR_LEN);
+	SOCKBUF_SET(bufs[1], data, (data != NULL) ? dlen : 0);
+	return socket_sendv(sockfd, bufs, 2);
+}
+
+/**
+ * Parses a frame of a directory synchronization.
+ *
+ * @param buf   Frame that was received.
+ * @param op    Returns the operation described by the frame.
+ * @param len   Returns the length of the path of the file.
+ * @param size  Returns the size of the contents of the file.
+ * @param mtime Returns the modification time of the file.
+ *
+ * @return TRUE if the frame is valid, FALSE otherwise.
+ */
+bool sync_parse(const uint8_t *buf, syncop_t *op, uint32_t *len,
+                uint64_t *size, uint64_t *mtime) {
+	int i;
+
+	if (buf[0] != REQ_BIN_MAGIC)
+		return false;
+
+	*op = (syncop_t)buf[1];
+	*len = ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16) |
+		((uint32_t)buf[6] << 8) | buf[7];
+	*size = 0;
+	*mtime = 0;
+	for (i = 0; i < 8; i++) {
+		*size = (*size << 8) | buf[8 + i];
+		*mtime = (*mtime << 8) | buf[16 + i];
 	}
+
+	return (*op == SYNC_OP_WANT) || (*op == SYNC_OP_FILE) ||
+		(*op == SYNC_OP_PACK) || (*op == SYNC_OP_END);
+}
+
+/**
+ * Builds up the header and path of a file inside a pack of small files, which
+ * are followed by the contents of the file.
+ *
+ * @param buf   Buffer with room for the header and the path.
+ * @param path  Path of the file inside the directory being synchronized.
+ * @param size  Size of the contents of the file.
+ * @param mtime Modification time of the file in nanoseconds since the Unix
+ *              epoch.
+ *
+ * @return Number of bytes written to the buffer.
+ */
+size_t sync_entry_pack(uint8_t *buf, const char *path, uint32_t size,
+                       uint64_t mtime) {
+	size_t len;
+	int i;
+
+	len = strlen(path);
+	buf[0] = (uint8_t)((len >> 8) & 0xFF);
+	buf[1] = (uint8_t)(len & 0xFF);
+	for (i = 0; i < 4; i++)
+		buf[2 + i] = (uint8_t)((size >> ((3 - i) * 8)) & 0xFF);
+	for (i = 0; i < 8; i++)
+		buf[6 + i] = (uint8_t)((mtime >> ((7 - i) * 8)) & 0xFF);
+	memcpy(buf + REQ_SYNC_ENTRY_LEN, path, len);
+
+	return REQ_SYNC_ENTRY_LEN + len;
+}
+
+/**
+ * Parses the header of a file inside a pack of small files.
+ *
+ * @param buf   Header of the file.
+ * @param len   Returns the length of the path that follows the header.
+ * @param size  Returns the size of the contents that follow the path.
+ * @param mtime Returns the modification time of the file.
+ *
+ * @return TRUE if the header is valid, FALSE otherwise.
+ */
+bool sync_entry_parse(const uint8_t *buf, uint16_t *len, uint32_t *size,
+                      uint64_t *mtime) {
+	int i;
+
+	*len = (uint16_t)((buf[0] << 8) | buf[1]);
+	*size = ((uint32_t)buf[2] << 24) | ((uint32_t)buf[3] << 16) |
+		((uint32_t)buf[4] << 8) | buf[5];
+	*mtime = 0;
+	for (i = 0; i < 8; i++)
+		*mtime = (*mtime << 8) | buf[6 + i];
+
+	return *len > 0;
 }
 
 /**
@@ -283,71 +1123,101 @@ void reqline_dump(reqline_t *reqline) {
 }
 
 /**
- * Parses a reply line from the server and allocates a new object.
- *
- * @warning This function allocates memory that must be freed later.
+ * Allocates a new reply object.
  *
- * @param line Line from the server ending before the CRLF.
+ * @warning This function allocates memory that must later be freed.
  *
- * @return Parsed line into a server reply object or NULL if an error occurred.
+ * @return A brand new reply object, or NULL if an error occurred.
  *
  * @see reply_free
  */
-reply_t *reply_parse(const char *line) {
+reply_t *reply_new(void) {
 	reply_t *reply;
-	const char *cur;
-	char *buf;
-	uint8_t step;
 
-	/* Allocate memory for the reply object. */
 	reply = (reply_t *)malloc(sizeof(reply_t));
 	if (reply == NULL) {
 		log_syserr(LOG_CRIT, "Failed to allocate memory for reply object");
 		return NULL;
 	}
+	reply->line[0] = '\0';
+	reply->type = NULL;
+	reply->msg = NULL;
+	reply->code = 0;
+	reply->flags = 0;
+
+	return reply;
+}
+
+/**
+ * Parses a reply line in place and populates a reply object.
+ *
+ * @param line  Buffer with the reply line, which gets sliced into its fields.
+ *              Must have room for a NUL terminator after it and outlive the
+ *              reply object, which is why replies have one of their own.
+ * @param len   Number of bytes in the buffer.
+ * @param reply Reply object to be populated.
+ *
+ * @return TRUE if the reply line was valid, FALSE otherwise.
+ */
+bool reply_parse(char *line, size_t len, reply_t *reply) {
+	uint64_t num;
+	size_t flen;
+	char *field;
+	char *cur;
+	char *end;
+	uint8_t step;
+
+	/* Start with an empty reply. */
 	reply->type = NULL;
 	reply->msg = NULL;
+	reply->code = 0;
+	reply->flags = 0;
 
 	/* Parse each part of the reply line into the object. */
-	step = 0;
 	cur = line;
-	while ((buf = struntil(cur, '\t', &cur)) != NULL) {
+	end = line_end(line, len);
+	for (step = 0; (field = field_next(&cur, end, &flen)) != NULL; step++) {
 		switch (step) {
 			case 0:
 				/* Code */
-				reply->code = atoi(buf);
-				if (reply->code == 0) {
+				if (!field_to_uint(field, flen, 10, 999, &num) ||
+						(num == 0)) {
 					log_printf(LOG_ERROR, "Failed to parse reply status code");
-					free(buf);
-					goto parse_failed;
+					return false;
 				}
+				reply->code = (error_code_t)num;
 				break;
 			case 1:
 				/* Type */
-				reply->type = buf;
+				reply->type = field;
 				break;
 			case 2:
 				/* Message */
-				reply->msg = buf;
+				reply->msg = field;
+				break;
+			case 3:
+				/* Accepted request flags. */
+				if (!field_to_uint(field, flen, 16, 0xFFFF, &num)) {
+					log_printf(LOG_NOTICE, "Invalid request flags '%s' in "
+						"server reply", field);
+					return true;
+				}
+				reply->flags = (uint16_t)num;
 				break;
 			default:
 				log_printf(LOG_NOTICE, "Server replied with more information "
-					"than expected \"%s\"", line);
-				free(buf);
-				goto skip_parsing;
+					"than expected");
+				return true;
 		}
-
-		step++;
 	}
 
-skip_parsing:
-	return reply;
+	/* An empty line isn't a reply. */
+	if (step == 0) {
+		log_printf(LOG_ERROR, "Failed to parse reply status code");
+		return false;
+	}
 
-parse_failed:
-	/* In case of an error... */
-	reply_free(reply);
-	reply = NULL;
-	return NULL;
+	return true;
 }
 
 /**
@@ -356,13 +1226,116 @@ parse_failed:
  * @param reply Server reply object to be freed.
  */
 void reply_free(reply_t *reply) {
-	if (reply == NULL)
-		return;
-
-	reply->code = 0;
-	if (reply->type)
-		free(reply->type);
-	if (reply->msg)
-		free(reply->msg);
 	free(reply);
 }
+
+/**
+ * Finds where a line received from the network ends, which is the first CR,
+ * LF or NUL in it, and terminates it there.
+ *
+ * @param line Buffer with the line. Must have room for a NUL terminator.
+ * @param len  Number of bytes in the buffer.
+ *
+ * @return Position of the end of the line.
+ */
+static char *line_end(char *line, size_t len) {
+	char *end;
+
+	end = line + scan_line(line, len);
+	*end = '\0';
+
+	return end;
+}
+
+/**
+ * Slices the next field off a tab-separated line, terminating it in place.
+ *
+ * @param cur Position of the next field. Moved past it and its separator.
+ * @param end End of the line as returned by line_end.
+ * @param len Returns the length of the field.
+ *
+ * @return Beginning of the field or NULL if there are no more of them.
+ */
+static char *field_next(char **cur, char *end, size_t *len) {
+	char *field;
+	char *sep;
+
+	/* Have we reached the end? */
+	if (*cur >= end)
+		return NULL;
+
+	/* Terminate the field at its separator or the end of the line. */
+	field = *cur;
+	sep = field + scan_field(field, (size_t)(end - field));
+	*len = (size_t)(sep - field);
+	*sep = '\0';
+	*cur = (sep < end) ? (sep + 1) : end;
+
+	return field;
+}
+
+/**
+ * Converts a field made up entirely of digits into a number.
+ *
+ * @param field Field to be converted.
+ * @param len   Length of the field.
+ * @param base  Either 10 or 16.
+ * @param max   Largest value that's acceptable.
+ * @param num   Returns the number if the conversion was successful.
+ *
+ * @return TRUE if the field is a number no larger than the maximum, FALSE
+ *         otherwise.
+ */
+static bool field_to_uint(const char *field, size_t len, unsigned int base,
+                          uint64_t max, uint64_t *num) {
+	unsigned int digit;
+	size_t i;
+
+	if (len == 0)
+		return false;
+
+	*num = 0;
+	for (i = 0; i < len; i++) {
+		if ((field[i] >= '0') && (field[i] <= '9')) {
+			digit = (unsigned int)(field[i] - '0');
+		} else if ((base == 16) && (field[i] >= 'A') && (field[i] <= 'F')) {
+			digit = (unsigned int)(field[i] - 'A' + 10);
+		} else if ((base == 16) && (field[i] >= 'a') && (field[i] <= 'f')) {
+			digit = (unsigned int)(field[i] - 'a' + 10);
+		} else {
+			return false;
+		}
+
+		if (*num > ((max - digit) / base))
+			return false;
+		*num = (*num * base) + digit;
+	}
+
+	return true;
+}
+
+/**
+ * Gets a request type from its string representation in a request line.
+ *
+ * @param str String representation of the type.
+ * @param len Length of the string.
+ *
+ * @return Request type or REQ_TYPE_UNKNOWN if it isn't one that's acceptable
+ *         in request lines.
+ */
+static reqtype_t reqtype_parse(const char *str, size_t len) {
+	switch (len) {
+		case 3:
+			if (memcmp(str, "URL", 3) == 0)
+				return REQ_TYPE_URL;
+			break;
+		case 4:
+			if ((str[0] == 'F') && (memcmp(str, "FILE", 4) == 0))
+				return REQ_TYPE_FILE;
+			if ((str[0] == 'T') && (memcmp(str, "TEXT", 4) == 0))
+				return REQ_TYPE_TEXT;
+			break;
+	}
+
+	return REQ_TYPE_UNKNOWN;
+}
@@ -8,7 +8,71 @@
 #ifndef _GL_REQUEST_H
 #define _GL_REQUEST_H
 
+#include "defaults.h"
 #include "sockets.h"
+#include "crc32c.h"
+
+/**
+ * Binary request header magic byte. Text request lines always start with a
+ * printable ASCII character, so this is enough to tell both encodings apart.
+ */
+#define REQ_BIN_MAGIC 0xC7
+
+/**
+ * Binary request header format version.
+ */
+#define REQ_BIN_VERSION 1
+
+/**
+ * Length of the fixed-width prefix of a binary request header. Everything after
+ * it, up until the header length, is a list of extension TLVs.
+ */
+#define REQ_BIN_PREFIX_LEN 16
+
+/**
+ * Length of the header that precedes every chunk in a chunked transfer.
+ */
+#define REQ_CHUNK_HDR_LEN 4
+
+/**
+ * Length of the identifier that ties the stripes of a transfer together.
+ */
+#define REQ_XID_LEN 8
+
+/**
+ * Length of the digest that identifies the contents of a file.
+ */
+#define REQ_DIGEST_LEN 32
+
+/**
+ * Size of the leaves of the Merkle tree whose root is the digest of a file.
+ */
+#define REQ_DIGEST_LEAF (1024L * 1024L)
+
+/**
+ * Length of the header of the frames used while verifying a transfer.
+ */
+#define REQ_VERIFY_HDR_LEN 8
+
+/**
+ * Length of the frames used while sending only what changed in a file.
+ */
+#define REQ_DELTA_HDR_LEN 16
+
+/**
+ * Length of the header of the frames used while sending contents as chunks.
+ */
+#define REQ_CDC_HDR_LEN 16
+
+/**
+ * Length of the header of the frames used while synchronizing a directory.
+ */
+#define REQ_SYNC_HDR_LEN 24
+
+/**
+ * Length of the header of each file inside a pack of small files.
+ */
+#define REQ_SYNC_ENTRY_LEN 14
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,6 +86,7 @@ typedef enum {
 	ERR_CODE_REQ_REFUSED = 403,
 	ERR_CODE_REQ_LONG    = 417,
 	ERR_CODE_UNKNOWN     = 418,
+	ERR_CODE_CHECKSUM    = 422,
 	ERR_CODE_INTERNAL    = 500
 } error_code_t;
 
@@ -32,44 +97,183 @@ typedef enum {
 	REQ_TYPE_UNKNOWN = '?',
 	REQ_TYPE_FILE    = 'F',
 	REQ_TYPE_URL     = 'U',
-	REQ_TYPE_TEXT    = 'T'
+	REQ_TYPE_TEXT    = 'T',
+	REQ_TYPE_STRIPE  = 'S',
+	REQ_TYPE_SYNC    = 'Y'
 } reqtype_t;
 
+/**
+ * Flags that may be set in a binary request header.
+ */
+typedef enum {
+	REQ_FLAG_CHUNKED  = 0x0001,
+	REQ_FLAG_STRIPED  = 0x0002,
+	REQ_FLAG_CHECKSUM = 0x0004,
+	REQ_FLAG_MERKLE   = 0x0008,
+	REQ_FLAG_LZ       = 0x0010,
+	REQ_FLAG_ZSTD     = 0x0020,
+	REQ_FLAG_DELTA    = 0x0040,
+	REQ_FLAG_DIGEST   = 0x0080,
+	REQ_FLAG_CDC      = 0x0100
+} reqflag_t;
+
+/**
+ * Types of extensions that may be carried in a binary request header.
+ */
+typedef enum {
+	REQ_EXT_NAME   = 0x01,
+	REQ_EXT_XID    = 0x02,
+	REQ_EXT_OFFSET = 0x03,
+	REQ_EXT_CHUNK  = 0x04,
+	REQ_EXT_LEAF   = 0x05,
+	REQ_EXT_DIGEST = 0x06
+} reqext_t;
+
+/**
+ * Operations requested by the server while verifying a transfer.
+ */
+typedef enum {
+	VERIFY_OP_HASHES = 'H',
+	VERIFY_OP_RESEND = 'R'
+} verifyop_t;
+
+/**
+ * Frames exchanged while sending only what changed in a file.
+ */
+typedef enum {
+	DELTA_OP_SIGNATURE = 'S',
+	DELTA_OP_LITERAL   = 'L',
+	DELTA_OP_COPY      = 'C',
+	DELTA_OP_END       = 'E'
+} deltaop_t;
+
+/**
+ * Frames exchanged while sending contents as chunks the server may already
+ * have.
+ */
+typedef enum {
+	CDC_OP_HASHES = 'H',
+	CDC_OP_WANT   = 'W',
+	CDC_OP_END    = 'E'
+} cdcop_t;
+
+/**
+ * Frames sent while synchronizing a directory.
+ */
+typedef enum {
+	SYNC_OP_WANT = 'W',
+	SYNC_OP_FILE = 'F',
+	SYNC_OP_PACK = 'P',
+	SYNC_OP_END  = 'E'
+} syncop_t;
+
 /**
  * Information that's contained in the request line of a GL transaction.
  */
 typedef struct {
-	char *stype;
+	const char *stype;
 	char *name;
 	size_t size;
 	reqtype_t type;
+	uint16_t flags;
+
+	uint8_t xid[REQ_XID_LEN];
+	uint64_t offset;
+	uint32_t chunk;
+	uint32_t leaf;
+	uint8_t digest[REQ_DIGEST_LEN];
 } reqline_t;
 
 /**
- * Server reply line object.
+ * Decoder state for content sent using the chunked transfer encoding.
+ */
+typedef struct {
+	uint8_t hdr[REQ_CHUNK_HDR_LEN];
+	uint8_t hdrlen;
+	uint32_t remaining;
+
+	uint32_t crc;
+	bool checksums;
+	bool trailer;
+	bool final;
+	bool mismatch;
+
+	bool done;
+} chunkdec_t;
+
+/**
+ * Server reply line object. Its fields point into the line it was parsed from.
  */
 typedef struct {
-	char *type;
-	char *msg;
+	char line[GL_REPLYLINE_MAX + 1];
+
+	const char *type;
+	const char *msg;
 	error_code_t code;
+	uint16_t flags;
 } reply_t;
 
 /* Request replies. */
 void send_ok(sockfd_t sockfd);
 void send_continue(sockfd_t sockfd);
+void send_continue_flags(sockfd_t sockfd, uint16_t flags);
 void send_refused(sockfd_t sockfd);
 void send_error(sockfd_t sockfd, error_code_t code);
 
 /* Request Line */
 reqline_t *reqline_new(void);
-reqline_t *reqline_parse(const char *line);
+void reqline_init(reqline_t *reqline);
+bool reqline_parse(char *line, size_t len, reqline_t *reqline);
 size_t reqline_send(sockfd_t sockfd, reqline_t *reqline);
 void reqline_type_set(reqline_t *reqline, reqtype_t type);
 void reqline_free(reqline_t *reqline);
 void reqline_dump(reqline_t *reqline);
+const char *reqtype_str(reqtype_t type);
+
+/* Binary request header. */
+bool reqline_is_bin(const uint8_t *buf, size_t len);
+size_t reqline_bin_len(const uint8_t *buf, size_t len);
+bool reqline_parse_bin(const uint8_t *buf, size_t len, reqline_t *reqline);
+size_t reqline_send_bin(sockfd_t sockfd, reqline_t *reqline);
+
+/* Chunked transfer encoding. */
+bool chunk_send(sockfd_t sockfd, uint8_t *chunk, size_t len,
+                uint32_t *digest);
+void chunkdec_init(chunkdec_t *dec, bool checksums);
+bool chunkdec_feed(chunkdec_t *dec, const uint8_t **buf, size_t *len,
+                   const uint8_t **data, size_t *dlen);
+
+/* Transfer verification. */
+bool verify_send(sockfd_t sockfd, verifyop_t op, uint8_t level,
+                 const uint64_t *idx, uint32_t count);
+bool verify_parse(const uint8_t *buf, verifyop_t *op, uint8_t *level,
+                  uint32_t *count);
+
+/* Delta transfers. */
+bool delta_send(sockfd_t sockfd, deltaop_t op, uint32_t len, uint64_t val,
+                const void *data, size_t dlen);
+bool delta_parse(const uint8_t *buf, deltaop_t *op, uint32_t *len,
+                 uint64_t *val);
+
+/* Chunked contents. */
+bool cdc_frame_send(sockfd_t sockfd, cdcop_t op, uint32_t len, uint64_t val,
+                    const void *data, size_t dlen);
+bool cdc_frame_parse(const uint8_t *buf, cdcop_t *op, uint32_t *len,
+                     uint64_t *val);
+
+/* Directory synchronization. */
+bool sync_send(sockfd_t sockfd, syncop_t op, uint32_t len, uint64_t size,
+               uint64_t mtime, const void *data, size_t dlen);
+bool sync_parse(const uint8_t *buf, syncop_t *op, uint32_t *len,
+                uint64_t *size, uint64_t *mtime);
+size_t sync_entry_pack(uint8_t *buf, const char *path, uint32_t size,
+                       uint64_t mtime);
+bool sync_entry_parse(const uint8_t *buf, uint16_t *len, uint32_t *size,
+                      uint64_t *mtime);
 
 /* Reply message. */
-reply_t *reply_parse(const char *line);
+reply_t *reply_new(void);
+bool reply_parse(char *line, size_t len, reply_t *reply);
 void reply_free(reply_t *reply);
 
 #ifdef __cplusplus
@@ -0,0 +1,293 @@
+/**
+ * scan.c
+ * Finds the boundaries of fields and lines in text received from the network
+ * using vector instructions when available.
+ *
+ * Every implementation looks for the same set of delimiters: CR, LF and NUL,
+ * which end a line, plus an extra one that's either a TAB when looking for the
+ * end of a field or another LF when only the end of the line matters, which
+ * keeps the vector loops free of branches on what is being looked for.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "scan.h"
+
+#include <stdint.h>
+
+/* Vector implementations for the current architecture and compiler. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define SCAN_SIMD_X86
+	#define SCAN_TARGET_SSE2 __attribute__((target("sse2")))
+	#define SCAN_TARGET_AVX2 __attribute__((target("avx2")))
+	#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	#define SCAN_SIMD_X86
+	#define SCAN_TARGET_SSE2
+	#define SCAN_TARGET_AVX2
+	#include <intrin.h>
+	#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+	#define SCAN_SIMD_NEON
+	#include <arm_neon.h>
+#endif
+
+/* Private functions. */
+static size_t scan_sw(const char *buf, size_t len, char extra);
+#ifdef SCAN_SIMD_X86
+static size_t scan_sse2(const char *buf, size_t len, char extra);
+static size_t scan_avx2(const char *buf, size_t len, char extra);
+static bool scan_sse2_detect(void);
+static bool scan_avx2_detect(void);
+static unsigned int scan_ctz(uint32_t mask);
+#endif /* SCAN_SIMD_X86 */
+#ifdef SCAN_SIMD_NEON
+static size_t scan_neon(const char *buf, size_t len, char extra);
+#endif /* SCAN_SIMD_NEON */
+
+/* Implementation in use. */
+static size_t (*scan_fn)(const char *buf, size_t len, char extra) = scan_sw;
+
+/**
+ * Picks the fastest implementation available on this machine. Must be called
+ * before any threads are started.
+ */
+void scan_init(void) {
+#if defined(SCAN_SIMD_X86)
+	if (scan_avx2_detect()) {
+		scan_fn = scan_avx2;
+	} else if (scan_sse2_detect()) {
+		scan_fn = scan_sse2;
+	}
+#elif defined(SCAN_SIMD_NEON)
+	scan_fn = scan_neon;
+#endif /* SCAN_SIMD_X86 */
+}
+
+/**
+ * Finds where a line ends, which is at its first CR, LF or NUL.
+ *
+ * @param buf Text to be scanned.
+ * @param len Length of the text.
+ *
+ * @return Position of the end of the line or the length of the text if it
+ *         doesn't end in it.
+ */
+size_t scan_line(const char *buf, size_t len) {
+	return scan_fn(buf, len, '\n');
+}
+
+/**
+ * Finds where a field ends, which is at its first TAB or at the end of the
+ * line it's in.
+ *
+ * @param buf Text to be scanned.
+ * @param len Length of the text.
+ *
+ * @return Position of the end of the field or the length of the text if it
+ *         doesn't end in it.
+ */
+size_t scan_field(const char *buf, size_t len) {
+	return scan_fn(buf, len, '\t');
+}
+
+/**
+ * Software implementation, which also deals with what's left over by the
+ * vector implementations.
+ *
+ * @param buf   Text to be scanned.
+ * @param len   Length of the text.
+ * @param extra Delimiter to look for besides the ones that end a line.
+ *
+ * @return Position of the first delimiter or the length of the text.
+ */
+static size_t scan_sw(const char *buf, size_t len, char extra) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ((buf[i] == extra) || (buf[i] == '\r') || (buf[i] == '\n') ||
+				(buf[i] == '\0')) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+#ifdef SCAN_SIMD_X86
+/**
+ * SSE2 implementation, which goes through 16 bytes at a time.
+ *
+ * @param buf   Text to be scanned.
+ * @param len   Length of the text.
+ * @param extra Delimiter to look for besides the ones that end a line.
+ *
+ * @return Position of the first delimiter or the length of the text.
+ */
+SCAN_TARGET_SSE2
+static size_t scan_sse2(const char *buf, size_t len, char extra) {
+	__m128i vextra;
+	__m128i vcr;
+	__m128i vlf;
+	__m128i vnul;
+	__m128i v;
+	__m128i m;
+	uint32_t mask;
+	size_t i;
+
+	vextra = _mm_set1_epi8(extra);
+	vcr = _mm_set1_epi8('\r');
+	vlf = _mm_set1_epi8('\n');
+	vnul = _mm_setzero_si128();
+	for (i = 0; (i + 16) <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, vextra), _mm_cmpeq_epi8(v, vcr));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, vlf));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, vnul));
+		mask = (uint32_t)_mm_movemask_epi8(m);
+		if (mask != 0)
+			return i + scan_ctz(mask);
+	}
+
+	return i + scan_sw(buf + i, len - i, extra);
+}
+
+/**
+ * AVX2 implementation, which goes through 32 bytes at a time.
+ *
+ * @param buf   Text to be scanned.
+ * @param len   Length of the text.
+ * @param extra Delimiter to look for besides the ones that end a line.
+ *
+ * @return Position of the first delimiter or the length of the text.
+ */
+SCAN_TARGET_AVX2
+static size_t scan_avx2(const char *buf, size_t len, char extra) {
+	__m256i vextra;
+	__m256i vcr;
+	__m256i vlf;
+	__m256i vnul;
+	__m256i v;
+	__m256i m;
+	uint32_t mask;
+	size_t i;
+
+	vextra = _mm256_set1_epi8(extra);
+	vcr = _mm256_set1_epi8('\r');
+	vlf = _mm256_set1_epi8('\n');
+	vnul = _mm256_setzero_si256();
+	for (i = 0; (i + 32) <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(v, vextra),
+			_mm256_cmpeq_epi8(v, vcr));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, vlf));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, vnul));
+		mask = (uint32_t)_mm256_movemask_epi8(m);
+		if (mask != 0)
+			return i + scan_ctz(mask);
+	}
+
+	return i + scan_sw(buf + i, len - i, extra);
+}
+
+/**
+ * Checks if the processor supports SSE2.
+ *
+ * @return TRUE if the instructions are available, FALSE otherwise.
+ */
+static bool scan_sse2_detect(void) {
+#if defined(__x86_64__) || defined(_M_X64)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2") != 0;
+#endif /* __x86_64__ || _M_X64 */
+}
+
+/**
+ * Checks if the processor supports AVX2 and the operating system saves its
+ * registers.
+ *
+ * @return TRUE if the instructions are available, FALSE otherwise.
+ */
+static bool scan_avx2_detect(void) {
+#ifdef _MSC_VER
+	int info[4];
+
+	/* The operating system must save the AVX registers. */
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) ||
+			((_xgetbv(0) & 6) != 6)) {
+		return false;
+	}
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#endif /* _MSC_VER */
+}
+
+/**
+ * Counts the trailing zero bits of a mask of matching bytes.
+ *
+ * @param mask Mask with at least one bit set.
+ *
+ * @return Position of the lowest bit that's set.
+ */
+static unsigned int scan_ctz(uint32_t mask) {
+#ifdef _MSC_VER
+	unsigned long idx;
+
+	_BitScanForward(&idx, mask);
+	return (unsigned int)idx;
+#else
+	return (unsigned int)__builtin_ctz(mask);
+#endif /* _MSC_VER */
+}
+#endif /* SCAN_SIMD_X86 */
+
+#ifdef SCAN_SIMD_NEON
+/**
+ * NEON implementation, which goes through 16 bytes at a time.
+ *
+ * @param buf   Text to be scanned.
+ * @param len   Length of the text.
+ * @param extra Delimiter to look for besides the ones that end a line.
+ *
+ * @return Position of the first delimiter or the length of the text.
+ */
+static size_t scan_neon(const char *buf, size_t len, char extra) {
+	uint8x16_t vextra;
+	uint8x16_t vcr;
+	uint8x16_t vlf;
+	uint8x16_t v;
+	uint8x16_t m;
+	uint64_t mask;
+	size_t i;
+
+	vextra = vdupq_n_u8((uint8_t)extra);
+	vcr = vdupq_n_u8('\r');
+	vlf = vdupq_n_u8('\n');
+	for (i = 0; (i + 16) <= len; i += 16) {
+		v = vld1q_u8((const uint8_t *)(buf + i));
+		m = vorrq_u8(vceqq_u8(v, vextra), vceqq_u8(v, vcr));
+		m = vorrq_u8(m, vceqq_u8(v, vlf));
+		m = vorrq_u8(m, vceqzq_u8(v));
+
+		/* Narrow the matches down to 4 bits per byte to find the first. */
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+			vreinterpretq_u16_u8(m), 4)), 0);
+		if (mask != 0)
+			return i + ((size_t)__builtin_ctzll(mask) >> 2);
+	}
+
+	return i + scan_sw(buf + i, len - i, extra);
+}
+#endif /* SCAN_SIMD_NEON */
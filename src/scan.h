@@ -0,0 +1,28 @@
+/**
+ * scan.h
+ * Finds the boundaries of fields and lines in text received from the network
+ * using vector instructions when available.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_SCAN_H
+#define _GL_SCAN_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Scanning. */
+void scan_init(void);
+size_t scan_line(const char *buf, size_t len);
+size_t scan_field(const char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_SCAN_H */
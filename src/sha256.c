@@ -0,0 +1,200 @@
+/**
+ * sha256.c
+ * Portable implementation of the SHA-256 hash function.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "sha256.h"
+
+#include <string.h>
+
+/* Bitwise helpers. */
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define EP0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define EP1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SIG0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SIG1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+/* Private functions. */
+static void sha256_transform(sha256_t *ctx, const uint8_t *block);
+
+/* Round constants. */
+static const uint32_t k[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+	0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+	0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+	0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+	0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+	0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+	0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+	0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+	0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+/**
+ * Initializes a hashing context.
+ *
+ * @param ctx Hashing context to be initialized.
+ */
+void sha256_init(sha256_t *ctx) {
+	ctx->state[0] = 0x6A09E667;
+	ctx->state[1] = 0xBB67AE85;
+	ctx->state[2] = 0x3C6EF372;
+	ctx->state[3] = 0xA54FF53A;
+	ctx->state[4] = 0x510E527F;
+	ctx->state[5] = 0x9B05688C;
+	ctx->state[6] = 0x1F83D9AB;
+	ctx->state[7] = 0x5BE0CD19;
+	ctx->len = 0;
+	ctx->buflen = 0;
+}
+
+/**
+ * Adds more data to be hashed.
+ *
+ * @param ctx  Hashing context.
+ * @param data Data to be hashed.
+ * @param len  Length of the data.
+ */
+void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+	const uint8_t *cur;
+	size_t n;
+
+	cur = (const uint8_t *)data;
+	ctx->len += len;
+
+	/* Complete a partially filled block. */
+	if (ctx->buflen > 0) {
+		n = 64 - ctx->buflen;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buflen, cur, n);
+		ctx->buflen += n;
+		cur += n;
+		len -= n;
+
+		if (ctx->buflen < 64)
+			return;
+		sha256_transform(ctx, ctx->buf);
+		ctx->buflen = 0;
+	}
+
+	/* Hash whole blocks straight from the data. */
+	while (len >= 64) {
+		sha256_transform(ctx, cur);
+		cur += 64;
+		len -= 64;
+	}
+
+	/* Keep whatever is left for later. */
+	memcpy(ctx->buf, cur, len);
+	ctx->buflen = len;
+}
+
+/**
+ * Finishes the hashing process and gets the digest.
+ *
+ * @param ctx    Hashing context.
+ * @param digest Where to store the SHA256_LEN bytes of the digest.
+ */
+void sha256_final(sha256_t *ctx, uint8_t *digest) {
+	uint64_t bits;
+	int i;
+
+	/* Pad the message, leaving room for its length at the end. */
+	bits = ctx->len * 8;
+	ctx->buf[ctx->buflen++] = 0x80;
+	if (ctx->buflen > 56) {
+		memset(ctx->buf + ctx->buflen, 0, 64 - ctx->buflen);
+		sha256_transform(ctx, ctx->buf);
+		ctx->buflen = 0;
+	}
+	memset(ctx->buf + ctx->buflen, 0, 56 - ctx->buflen);
+
+	/* Append the length of the message in bits. */
+	for (i = 0; i < 8; i++)
+		ctx->buf[63 - i] = (uint8_t)(bits >> (i * 8));
+	sha256_transform(ctx, ctx->buf);
+
+	/* Store the digest in big-endian order. */
+	for (i = 0; i < 8; i++) {
+		digest[(i * 4)]     = (uint8_t)(ctx->state[i] >> 24);
+		digest[(i * 4) + 1] = (uint8_t)(ctx->state[i] >> 16);
+		digest[(i * 4) + 2] = (uint8_t)(ctx->state[i] >> 8);
+		digest[(i * 4) + 3] = (uint8_t)ctx->state[i];
+	}
+}
+
+/**
+ * Hashes a block of data in a single go.
+ *
+ * @param data   Data to be hashed.
+ * @param len    Length of the data.
+ * @param digest Where to store the SHA256_LEN bytes of the digest.
+ */
+void sha256(const void *data, size_t len, uint8_t *digest) {
+	sha256_t ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, digest);
+}
+
+/**
+ * Processes a single 64 byte block of data.
+ *
+ * @param ctx   Hashing context.
+ * @param block Block to be processed.
+ */
+static void sha256_transform(sha256_t *ctx, const uint8_t *block) {
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t t1, t2;
+	uint32_t w[64];
+	int i;
+
+	/* Prepare the message schedule. */
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)block[i * 4] << 24) |
+			((uint32_t)block[(i * 4) + 1] << 16) |
+			((uint32_t)block[(i * 4) + 2] << 8) | (uint32_t)block[(i * 4) + 3];
+	}
+	for (i = 16; i < 64; i++)
+		w[i] = SIG1(w[i - 2]) + w[i - 7] + SIG0(w[i - 15]) + w[i - 16];
+
+	/* Compress the block. */
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + EP1(e) + CH(e, f, g) + k[i] + w[i];
+		t2 = EP0(a) + MAJ(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	/* Add the compressed block to the current state. */
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
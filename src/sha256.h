@@ -0,0 +1,45 @@
+/**
+ * sha256.h
+ * Portable implementation of the SHA-256 hash function.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_SHA256_H
+#define _GL_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Length of a SHA-256 digest in bytes.
+ */
+#define SHA256_LEN 32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * SHA-256 hashing context.
+ */
+typedef struct {
+	uint32_t state[8];
+	uint64_t len;
+	uint8_t buf[64];
+	size_t buflen;
+} sha256_t;
+
+/* Incremental hashing. */
+void sha256_init(sha256_t *ctx);
+void sha256_update(sha256_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_t *ctx, uint8_t *digest);
+
+/* One-shot hashing. */
+void sha256(const void *data, size_t len, uint8_t *digest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_SHA256_H */
@@ -14,9 +14,12 @@
 #include "utils.h"
 
 /* Private definitions. */
-#define LISTEN_BACKLOG      5  /* Server socket listening backlog. */
+#define LISTEN_BACKLOG      16 /* Server socket listening backlog. */
 #define SERVER_TIMEOUT_SECS 1  /* Timeout of server communications in seconds. */
 
+/* Private functions. */
+static ssize_t conn_fill(conn_t *conn);
+
 /**
  * Initializes the sockets API.
  * 
@@ -240,10 +243,323 @@ sockfd_t socket_new_client(const char *addr, const char *port) {
 		sockclose(sockfd);
 		return SOCKERR;
 	}
+	socket_nodelay(sockfd);
 
 	return sockfd;
 }
 
+/**
+ * Sends an entire buffer through a socket, even if it takes multiple calls.
+ *
+ * @param sockfd Socket handle.
+ * @param buf    Data to be sent.
+ * @param len    Length of the data.
+ *
+ * @return TRUE if everything was sent, FALSE otherwise.
+ */
+bool socket_send_all(sockfd_t sockfd, const void *buf, size_t len) {
+	const char *cur;
+	ssize_t slen;
+
+	cur = (const char *)buf;
+	while (len > 0) {
+		slen = send(sockfd, cur, len, 0);
+		if (slen <= 0)
+			return false;
+
+		cur += slen;
+		len -= slen;
+	}
+
+	return true;
+}
+
+/**
+ * Sends multiple buffers through a socket at once, as if they were a single
+ * one, so that a header and what follows it go out together.
+ *
+ * @param sockfd Socket handle.
+ * @param bufs   Buffers to be sent. Will be modified to keep track of what's
+ *               left to send.
+ * @param count  Number of buffers.
+ *
+ * @return TRUE if everything was sent, FALSE otherwise.
+ */
+bool socket_sendv(sockfd_t sockfd, sockbuf_t *bufs, unsigned int count) {
+#ifdef _WIN32
+	DWORD slen;
+#else
+	ssize_t slen;
+#endif /* _WIN32 */
+
+	for (;;) {
+		/* Skip over the buffers that were already sent. */
+		while ((count > 0) && (SOCKBUF_LEN(*bufs) == 0)) {
+			bufs++;
+			count--;
+		}
+		if (count == 0)
+			break;
+
+		/* Send as much as the socket takes. */
+#ifdef _WIN32
+		if (WSASend(sockfd, bufs, count, &slen, 0, NULL, NULL) == SOCKERR)
+			return false;
+#else
+		slen = writev(sockfd, bufs, (int)count);
+		if (slen <= 0)
+			return false;
+#endif /* _WIN32 */
+
+		/* Account for what was sent, which may end in the middle of one. */
+		while ((count > 0) && ((size_t)slen >= SOCKBUF_LEN(*bufs))) {
+			slen -= SOCKBUF_LEN(*bufs);
+			bufs++;
+			count--;
+		}
+		if (count > 0) {
+			SOCKBUF_SET(*bufs, (char *)SOCKBUF_BASE(*bufs) + slen,
+				SOCKBUF_LEN(*bufs) - slen);
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Receives exactly the requested number of bytes from a socket.
+ *
+ * @param sockfd Socket handle.
+ * @param buf    Where to store the received data.
+ * @param len    Number of bytes to receive.
+ *
+ * @return TRUE if everything was received, FALSE if the connection was closed
+ *         or an error occurred before that.
+ */
+bool socket_recv_all(sockfd_t sockfd, void *buf, size_t len) {
+	char *cur;
+	ssize_t rlen;
+
+	cur = (char *)buf;
+	while (len > 0) {
+		rlen = recv(sockfd, cur, len, 0);
+		if (rlen <= 0)
+			return false;
+
+		cur += rlen;
+		len -= rlen;
+	}
+
+	return true;
+}
+
+/**
+ * Sets up a buffered connection over a socket.
+ *
+ * @param conn   Connection object to be initialized.
+ * @param sockfd Socket handle.
+ */
+void conn_init(conn_t *conn, sockfd_t sockfd) {
+	conn->sockfd = sockfd;
+	arena_init(&conn->arena);
+	conn->pos = 0;
+	conn->len = 0;
+}
+
+/**
+ * Gets the data that's waiting to be read without consuming it, receiving some
+ * if there isn't any.
+ *
+ * @param conn Connection object.
+ * @param len  Returns the number of bytes available.
+ *
+ * @return Data waiting to be read or NULL if the connection was closed or an
+ *         error occurred.
+ */
+const uint8_t *conn_peek(conn_t *conn, size_t *len) {
+	if ((conn->pos == conn->len) && (conn_fill(conn) <= 0))
+		return NULL;
+
+	*len = conn->len - conn->pos;
+	return conn->buf + conn->pos;
+}
+
+/**
+ * Receives some data from a connection, just like recv(). Small reads are
+ * served from the connection's buffer, large ones go straight to the socket
+ * once the buffer is empty.
+ *
+ * @param conn Connection object.
+ * @param buf  Where to store the received data.
+ * @param len  Maximum number of bytes to receive.
+ *
+ * @return Number of bytes received, 0 if the connection was closed, or a
+ *         negative value if an error occurred.
+ */
+ssize_t conn_recv(conn_t *conn, void *buf, size_t len) {
+	ssize_t rlen;
+
+	/* Receive directly if there's nothing buffered and it's worth it. */
+	if ((conn->pos == conn->len) && (len >= GL_CONN_BUF_LEN))
+		return recv(conn->sockfd, (char *)buf, len, 0);
+
+	/* Hand out what's buffered, getting some more if needed. */
+	if (conn->pos == conn->len) {
+		rlen = conn_fill(conn);
+		if (rlen <= 0)
+			return rlen;
+	}
+	if (len > (conn->len - conn->pos))
+		len = conn->len - conn->pos;
+	memcpy(buf, conn->buf + conn->pos, len);
+	conn->pos += len;
+
+	return (ssize_t)len;
+}
+
+/**
+ * Receives exactly the requested number of bytes from a connection.
+ *
+ * @param conn Connection object.
+ * @param buf  Where to store the received data.
+ * @param len  Number of bytes to receive.
+ *
+ * @return TRUE if everything was received, FALSE if the connection was closed
+ *         or an error occurred before that.
+ */
+bool conn_recv_all(conn_t *conn, void *buf, size_t len) {
+	char *cur;
+	ssize_t rlen;
+
+	cur = (char *)buf;
+	while (len > 0) {
+		rlen = conn_recv(conn, cur, len);
+		if (rlen <= 0)
+			return false;
+
+		cur += rlen;
+		len -= rlen;
+	}
+
+	return true;
+}
+
+/**
+ * Receives a line from a connection, leaving anything that came after it to be
+ * read later.
+ *
+ * @param conn Connection object.
+ * @param line Where to store the line, including its line ending, with room for
+ *             a NUL terminator after it.
+ * @param max  Maximum length of the line. If it's reached before a line ending
+ *             the line was too long.
+ *
+ * @return Length of the line, which may lack a line ending if the connection
+ *         was closed before it, 0 if the connection was closed before anything
+ *         was received, or a negative value if an error occurred.
+ */
+ssize_t conn_recv_line(conn_t *conn, char *line, size_t max) {
+	uint8_t *lf;
+	size_t avail;
+	size_t len;
+	ssize_t rlen;
+
+	len = 0;
+	while (len < max) {
+		/* Get some more data if we've gone through what was buffered. */
+		if (conn->pos == conn->len) {
+			rlen = conn_fill(conn);
+			if (rlen < 0)
+				return rlen;
+			if (rlen == 0)
+				break;
+		}
+
+		/* Take everything up to the end of the line. */
+		avail = conn->len - conn->pos;
+		if (avail > (max - len))
+			avail = max - len;
+		lf = (uint8_t *)memchr(conn->buf + conn->pos, '\n', avail);
+		if (lf != NULL)
+			avail = (size_t)(lf - (conn->buf + conn->pos)) + 1;
+		memcpy(line + len, conn->buf + conn->pos, avail);
+		conn->pos += avail;
+		len += avail;
+
+		if (lf != NULL)
+			break;
+	}
+	line[len] = '\0';
+
+	return (ssize_t)len;
+}
+
+/**
+ * Disables Nagle's algorithm on a socket. Everything we send is either a
+ * message that the other end is waiting for or is sent in large pieces, so
+ * holding it back only adds a round trip whenever a delayed ACK is in play.
+ *
+ * @param sockfd Socket handle.
+ *
+ * @return TRUE if the option was set, FALSE otherwise.
+ */
+bool socket_nodelay(sockfd_t sockfd) {
+#ifdef _WIN32
+	BOOL flag;
+#else
+	int flag;
+#endif /* _WIN32 */
+
+	flag = 1;
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag,
+			sizeof(flag)) == SOCKERR) {
+		log_sockerr(LOG_WARNING, "Failed to disable Nagle's algorithm");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Holds back partial segments of a socket while lots of small pieces are sent,
+ * sending them all as soon as it's released.
+ *
+ * On systems without TCP_CORK or TCP_NOPUSH, Nagle's algorithm is enabled
+ * while the socket is corked instead, which is the closest we can get.
+ *
+ * @param sockfd Socket handle.
+ * @param cork   TRUE to start holding back, FALSE to release.
+ *
+ * @return TRUE if the option was set, FALSE otherwise.
+ */
+bool socket_cork(sockfd_t sockfd, bool cork) {
+#ifdef _WIN32
+	BOOL flag;
+#else
+	int flag;
+#endif /* _WIN32 */
+	int opt;
+
+#if defined(TCP_CORK)
+	opt = TCP_CORK;
+	flag = cork;
+#elif defined(TCP_NOPUSH)
+	opt = TCP_NOPUSH;
+	flag = cork;
+#else
+	opt = TCP_NODELAY;
+	flag = !cork;
+#endif /* TCP_CORK */
+	if (setsockopt(sockfd, IPPROTO_TCP, opt, (const char *)&flag,
+			sizeof(flag)) == SOCKERR) {
+		log_sockerr(LOG_WARNING, "Failed to %s socket", (cork) ? "cork" :
+			"uncork");
+		return false;
+	}
+
+	return true;
+}
+
 /**
  * Closes a socket and optionally shut it down beforehand.
  *
@@ -267,9 +583,7 @@ int socket_close(sockfd_t sockfd, bool shut) {
 				log_sockerr(LOG_ERROR, "Failed to shutdown socket");
 				return SOCKERR;
 			} else {
-#ifdef _DEBUG
-				log_sockerr(LOG_NOTICE, "Suppressed socket shutdown error");
-#endif /* _DEBUG */
+				log_sockerr(LOG_DEBUG, "Suppressed socket shutdown error");
 			}
 		}
 #else
@@ -278,9 +592,7 @@ int socket_close(sockfd_t sockfd, bool shut) {
 				log_sockerr(LOG_ERROR, "Failed to shutdown socket");
 				return SOCKERR;
 			} else {
-#ifdef _DEBUG
-				log_sockerr(LOG_NOTICE, "Suppressed socket shutdown error");
-#endif /* _DEBUG */
+				log_sockerr(LOG_DEBUG, "Suppressed socket shutdown error");
 			}
 		}
 #endif /* _WIN32 */
@@ -290,6 +602,24 @@ int socket_close(sockfd_t sockfd, bool shut) {
 	return sockclose(sockfd);
 }
 
+/**
+ * Wakes up anything that's blocked on a socket by shutting it down, without
+ * closing it or logging anything, which makes it safe to call from a signal
+ * handler. The socket must still be closed later.
+ *
+ * @param sockfd Socket to be shut down.
+ */
+void socket_interrupt(sockfd_t sockfd) {
+	if (sockfd == SOCKERR)
+		return;
+
+#ifdef _WIN32
+	shutdown(sockfd, SD_BOTH);
+#else
+	shutdown(sockfd, SHUT_RDWR);
+#endif /* _WIN32 */
+}
+
 /**
  * Gets a string representation of a network address structure.
  *
@@ -317,3 +647,23 @@ const char* inet_addr_str(int af, void *addr, char *buf) {
 	}
 #endif /* WITHOUT_INET_NTOP */
 }
+
+/**
+ * Refills the buffer of a connection once everything in it has been read.
+ *
+ * @param conn Connection object.
+ *
+ * @return Number of bytes received, 0 if the connection was closed, or a
+ *         negative value if an error occurred.
+ */
+static ssize_t conn_fill(conn_t *conn) {
+	ssize_t rlen;
+
+	conn->pos = 0;
+	conn->len = 0;
+	rlen = recv(conn->sockfd, (char *)conn->buf, GL_CONN_BUF_LEN, 0);
+	if (rlen > 0)
+		conn->len = (size_t)rlen;
+
+	return rlen;
+}
@@ -17,7 +17,9 @@
 #else
 	#include <arpa/inet.h>
 	#include <netinet/in.h>
+	#include <netinet/tcp.h>
 	#include <netdb.h>
+	#include <sys/uio.h>
 	#include <unistd.h>
 	#include <errno.h>
 #endif /* _WIN32 */
@@ -25,11 +27,19 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "arena.h"
+#include "defaults.h"
+
 #ifdef _WIN32
 	#define SOCKERR   SOCKET_ERROR
 	#define sockclose closesocket
 	#define sockerrno WSAGetLastError()
 	typedef SOCKET sockfd_t;
+	typedef WSABUF sockbuf_t;
+	#define SOCKBUF_BASE(b) ((b).buf)
+	#define SOCKBUF_LEN(b)  ((b).len)
+	#define SOCKBUF_SET(b, p, l) \
+		do { (b).buf = (CHAR *)(p); (b).len = (ULONG)(l); } while (0)
 
 	#ifndef EWOULDBLOCK
 		#define EWOULDBLOCK WSAEWOULDBLOCK
@@ -39,6 +49,11 @@
 	#define sockclose close
 	#define sockerrno errno
 	typedef int sockfd_t;
+	typedef struct iovec sockbuf_t;
+	#define SOCKBUF_BASE(b) ((b).iov_base)
+	#define SOCKBUF_LEN(b)  ((b).iov_len)
+	#define SOCKBUF_SET(b, p, l) \
+		do { (b).iov_base = (void *)(p); (b).iov_len = (l); } while (0)
 #endif /* _WIN32 */
 
 /* Ensure we know the maximum length that the machine's hostname can be. */
@@ -64,6 +79,22 @@
 extern "C" {
 #endif
 
+/**
+ * Connection with a buffered reader. Whatever was received past what a read
+ * asked for is kept and handed out by the next one, so every read from the
+ * socket must go through it. Memory that's only needed while a request is
+ * being handled is allocated from its arena, which goes wherever the
+ * connection is handed over to.
+ */
+typedef struct {
+	sockfd_t sockfd;
+	arena_t arena;
+
+	size_t pos;
+	size_t len;
+	uint8_t buf[GL_CONN_BUF_LEN];
+} conn_t;
+
 /* Initialization */
 bool socket_init(void);
 
@@ -75,8 +106,23 @@ bool socket_addr_setup(struct sockaddr_storage *sa, int *af, socklen_t *addrlen,
 sockfd_t socket_new_server(const char *addr, const char *port);
 sockfd_t socket_new_client(const char *addr, const char *port);
 
+/* Data transfer. */
+bool socket_send_all(sockfd_t sockfd, const void *buf, size_t len);
+bool socket_sendv(sockfd_t sockfd, sockbuf_t *bufs, unsigned int count);
+bool socket_recv_all(sockfd_t sockfd, void *buf, size_t len);
+
+/* Buffered connections. */
+void conn_init(conn_t *conn, sockfd_t sockfd);
+const uint8_t *conn_peek(conn_t *conn, size_t *len);
+ssize_t conn_recv(conn_t *conn, void *buf, size_t len);
+bool conn_recv_all(conn_t *conn, void *buf, size_t len);
+ssize_t conn_recv_line(conn_t *conn, char *line, size_t max);
+
 /* Utilities */
+bool socket_nodelay(sockfd_t sockfd);
+bool socket_cork(sockfd_t sockfd, bool cork);
 int socket_close(sockfd_t sockfd, bool shut);
+void socket_interrupt(sockfd_t sockfd);
 const char* inet_addr_str(int af, void *addr, char *buf);
 
 #ifdef __cplusplus
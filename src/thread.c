@@ -0,0 +1,219 @@
+/**
+ * thread.c
+ * Platform-independent abstraction layer over threading primitives.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "thread.h"
+
+#ifndef _WIN32
+	#include <time.h>
+	#include <errno.h>
+#endif /* !_WIN32 */
+
+#include "logging.h"
+
+/**
+ * Creates and starts a new thread.
+ *
+ * @param thread Where to store the handle of the newly created thread.
+ * @param func   Thread's entry point function.
+ * @param arg    Argument to be passed to the entry point function.
+ *
+ * @return TRUE if the thread was created, FALSE otherwise.
+ */
+bool thread_create(thread_t *thread, thread_func_t func, void *arg) {
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+	if (*thread == NULL) {
+		log_syserr(LOG_CRIT, "Failed to create a new thread");
+		return false;
+	}
+#else
+	int err;
+
+	err = pthread_create(thread, NULL, func, arg);
+	if (err != 0) {
+		errno = err;
+		log_syserr(LOG_CRIT, "Failed to create a new thread");
+		return false;
+	}
+#endif /* _WIN32 */
+
+	return true;
+}
+
+/**
+ * Waits for a thread to finish and releases its resources.
+ *
+ * @param thread Thread to be joined.
+ *
+ * @return TRUE if the thread was joined, FALSE otherwise.
+ */
+bool thread_join(thread_t thread) {
+#ifdef _WIN32
+	if (WaitForSingleObject(thread, INFINITE) == WAIT_FAILED) {
+		log_syserr(LOG_ERROR, "Failed to join thread");
+		return false;
+	}
+
+	return CloseHandle(thread) != 0;
+#else
+	return pthread_join(thread, NULL) == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Lets a thread run on its own, releasing its resources once it finishes.
+ *
+ * @param thread Thread to be detached.
+ *
+ * @return TRUE if the thread was detached, FALSE otherwise.
+ */
+bool thread_detach(thread_t thread) {
+#ifdef _WIN32
+	return CloseHandle(thread) != 0;
+#else
+	return pthread_detach(thread) == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Suspends the execution of the calling thread.
+ *
+ * @param ms Number of milliseconds to sleep for.
+ */
+void thread_sleep(unsigned int ms) {
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR))
+		;
+#endif /* _WIN32 */
+}
+
+/**
+ * Initializes a mutex.
+ *
+ * @param mutex Mutex to be initialized.
+ */
+void mutex_init(mutex_t *mutex) {
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif /* _WIN32 */
+}
+
+/**
+ * Locks a mutex, waiting for it to become available if needed.
+ *
+ * @param mutex Mutex to be locked.
+ */
+void mutex_lock(mutex_t *mutex) {
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif /* _WIN32 */
+}
+
+/**
+ * Unlocks a mutex.
+ *
+ * @param mutex Mutex to be unlocked.
+ */
+void mutex_unlock(mutex_t *mutex) {
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif /* _WIN32 */
+}
+
+/**
+ * Releases the resources held by a mutex.
+ *
+ * @param mutex Mutex to be freed.
+ */
+void mutex_free(mutex_t *mutex) {
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif /* _WIN32 */
+}
+
+/**
+ * Initializes a condition variable.
+ *
+ * @param cond Condition variable to be initialized.
+ */
+void cond_init(cond_t *cond) {
+#ifdef _WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif /* _WIN32 */
+}
+
+/**
+ * Waits for a condition variable to be signaled. The mutex is released while
+ * waiting and locked again before returning.
+ *
+ * @warning Wakeups may be spurious, so the condition must be checked again.
+ *
+ * @param cond  Condition variable to wait on.
+ * @param mutex Mutex locked by the calling thread.
+ */
+void cond_wait(cond_t *cond, mutex_t *mutex) {
+#ifdef _WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+	pthread_cond_wait(cond, mutex);
+#endif /* _WIN32 */
+}
+
+/**
+ * Wakes up one of the threads waiting on a condition variable.
+ *
+ * @param cond Condition variable to be signaled.
+ */
+void cond_signal(cond_t *cond) {
+#ifdef _WIN32
+	WakeConditionVariable(cond);
+#else
+	pthread_cond_signal(cond);
+#endif /* _WIN32 */
+}
+
+/**
+ * Wakes up all of the threads waiting on a condition variable.
+ *
+ * @param cond Condition variable to be signaled.
+ */
+void cond_broadcast(cond_t *cond) {
+#ifdef _WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif /* _WIN32 */
+}
+
+/**
+ * Releases the resources held by a condition variable.
+ *
+ * @param cond Condition variable to be freed.
+ */
+void cond_free(cond_t *cond) {
+#ifdef _WIN32
+	(void)cond;
+#else
+	pthread_cond_destroy(cond);
+#endif /* _WIN32 */
+}
@@ -0,0 +1,92 @@
+/**
+ * thread.h
+ * Platform-independent abstraction layer over threading primitives.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _GL_THREAD_H
+#define _GL_THREAD_H
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#else
+	#include <pthread.h>
+#endif /* _WIN32 */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+	typedef HANDLE thread_t;
+	typedef CRITICAL_SECTION mutex_t;
+	typedef CONDITION_VARIABLE cond_t;
+	typedef DWORD thread_ret_t;
+	#define THREAD_CALL WINAPI
+#else
+	typedef pthread_t thread_t;
+	typedef pthread_mutex_t mutex_t;
+	typedef pthread_cond_t cond_t;
+	typedef void *thread_ret_t;
+	#define THREAD_CALL
+#endif /* _WIN32 */
+
+/* Variables that each thread has its own copy of. */
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif /* _MSC_VER */
+
+/* Counters that are shared between threads without taking a lock. */
+#ifdef _MSC_VER
+	typedef volatile LONG atomic32_t;
+	#define atomic32_load(p) \
+		((uint32_t)InterlockedCompareExchange((p), 0, 0))
+	#define atomic32_store(p, v) \
+		((void)InterlockedExchange((p), (LONG)(v)))
+	#define atomic32_cas(p, old, new) \
+		(InterlockedCompareExchange((p), (LONG)(new), (LONG)(old)) == \
+		 (LONG)(old))
+#else
+	typedef volatile uint32_t atomic32_t;
+	#define atomic32_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+	#define atomic32_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+	#define atomic32_cas(p, old, new) \
+		__sync_bool_compare_and_swap((p), (old), (new))
+#endif /* _MSC_VER */
+
+/**
+ * Thread entry point function prototype.
+ */
+typedef thread_ret_t (THREAD_CALL *thread_func_t)(void *arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Threads */
+bool thread_create(thread_t *thread, thread_func_t func, void *arg);
+bool thread_join(thread_t thread);
+bool thread_detach(thread_t thread);
+void thread_sleep(unsigned int ms);
+
+/* Mutexes */
+void mutex_init(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+void mutex_free(mutex_t *mutex);
+
+/* Condition variables */
+void cond_init(cond_t *cond);
+void cond_wait(cond_t *cond, mutex_t *mutex);
+void cond_signal(cond_t *cond);
+void cond_broadcast(cond_t *cond);
+void cond_free(cond_t *cond);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GL_THREAD_H */
@@ -5,16 +5,33 @@
  * @author Nathan Campos <nathan@innoveworkshop.com>
  */
 
+#ifdef __linux__
+	#define _GNU_SOURCE
+#endif /* __linux__ */
+
 #include "utils.h"
 
+#include <errno.h>
 #ifdef _WIN32
 	#define WIN32_LEAN_AND_MEAN
 	#include <windows.h>
 	#include <shlwapi.h>
+	#include <io.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
 	#include "../win32/cvtutf/Unicode.h"
 #else
 	#include <unistd.h>
 	#include <libgen.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <sys/time.h>
+	#include <dirent.h>
+	#ifdef __linux__
+		#include <sys/ioctl.h>
+		#include <linux/fs.h>
+	#endif /* __linux__ */
 #endif /* _WIN32 */
 #include <time.h>
 
@@ -26,60 +43,35 @@
 
 #include "logging.h"
 
+#ifdef _WIN32
+/* Converts a FILETIME into nanoseconds since the Unix epoch. */
+#define FILETIME_NS(ft) \
+	(((((uint64_t)(ft).dwHighDateTime << 32) | (ft).dwLowDateTime) - \
+	116444736000000000ULL) * 100)
+#else
+/* Directory that relative paths are resolved against. */
+static int dir_base = AT_FDCWD;
+
 /**
- * Gets a string from begin to token without including the token.
+ * Gets the modification time out of a file's status with the best precision
+ * that the system gives us.
  *
- * If the end of the string is reached before the token is found, the entire
- * string is returned as a new allocated string (equivalent to strdup).
+ * @param st Status of the file.
  *
- * @warning This function allocates the return string that must later be freed.
- *
- * @param begin Beginning of the string to search for the token.
- * @param token Token to search for in the string.
- * @param end   Optional. Returns the position in begin right after the token
- *              was found (skips the token), unless it's the NUL terminator.
- *
- * @return Newly allocated, NUL terminated, string with the contents from begin
- *         to token. Returns NULL when begin is the end of the string.
+ * @return Modification time in nanoseconds since the Unix epoch.
  */
-char *struntil(const char *begin, char token, const char **end) {
-	const char *cur;
-	const char *ctmp;
-	char *buf;
-	char *btmp;
-
-	/* Have we reached the end? */
-	if (*begin == '\0')
-		return NULL;
-
-	/* Search for the token or the end of the string. */
-	cur = begin;
-	while ((*cur != token) && (*cur != '\0'))
-		cur++;
-
-	/* Return the position where the token was found. */
-	if (end != NULL)
-		*end = (*cur == '\0') ? cur : cur + 1;
-
-	/* Allocate memory for our new string. */
-	buf = (char *)malloc((cur - begin + 1) * sizeof(char));
-	if (buf == NULL) {
-		log_syserr(LOG_CRIT, "Failed to allocate memory for token string");
-		return NULL;
-	}
-
-	/* Copy our string over. */
-	btmp = buf;
-	ctmp = begin;
-	while (ctmp != cur) {
-		*btmp = *ctmp;
-		ctmp++;
-		btmp++;
-	}
-	*btmp = '\0';
-
-	return buf;
+static uint64_t stat_mtime_ns(const struct stat *st) {
+#if defined(__linux__)
+	return ((uint64_t)st->st_mtim.tv_sec * 1000000000UL) +
+		(uint64_t)st->st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+	return ((uint64_t)st->st_mtimespec.tv_sec * 1000000000UL) +
+		(uint64_t)st->st_mtimespec.tv_nsec;
+#else
+	return (uint64_t)st->st_mtime * 1000000000UL;
+#endif /* __linux__ */
 }
+#endif /* _WIN32 */
 
 /**
  * Converts a string to a number and indicates in case of a failure.
@@ -142,6 +134,7 @@ bool ask_yn(const char *msg, ...) {
 	int c;
 
 	/* Print the message and options for the user. */
+	log_flush();
 	va_start(args, msg);
 	vfprintf(stderr, msg, args);
 	va_end(args);
@@ -166,7 +159,7 @@ bool ask_yn(const char *msg, ...) {
  *
  * @param name  Name of the object being transferred.
  * @param acc   Accumulated size so far.
- * @param fsize Final size of the transfer.
+ * @param fsize Final size of the transfer or SIZE_UNKNOWN if it isn't known.
  */
 void buffered_progress(const char *name, size_t acc, size_t fsize) {
 	static time_t elapsed;
@@ -183,7 +176,12 @@ void buffered_progress(const char *name, size_t acc, size_t fsize) {
 
 	/* Is it time to print? */
 	if (print) {
-		fprintf(stderr, "\r%s (%lu/%lu)", name, acc, fsize);
+		log_flush();
+		if (fsize == SIZE_UNKNOWN) {
+			fprintf(stderr, "\r%s (%lu bytes)", name, acc);
+		} else {
+			fprintf(stderr, "\r%s (%lu/%lu)", name, acc, fsize);
+		}
 		elapsed = now;
 	}
 }
@@ -246,6 +244,19 @@ size_t read_stdin(char **text, bool trim) {
 	return len;
 }
 
+/**
+ * Checks if STDIN is connected to an interactive terminal.
+ *
+ * @return TRUE if someone is typing into STDIN, FALSE if it's being piped.
+ */
+bool stdin_is_tty(void) {
+#ifdef _WIN32
+	return _isatty(_fileno(stdin)) != 0;
+#else
+	return isatty(fileno(stdin)) != 0;
+#endif /* _WIN32 */
+}
+
 /**
  * Sanitizes a file name to ensure idiots don't abuse us.
  *
@@ -273,6 +284,28 @@ int fname_sanitize(char *fname) {
 	return ret;
 }
 
+/**
+ * Checks if a file name refers to a file right inside the directory that it's
+ * relative to, without reaching into any other directory.
+ *
+ * @param fname File name to be checked.
+ *
+ * @return TRUE if the name is a plain file name, FALSE otherwise.
+ */
+bool fname_plain(const char *fname) {
+	if ((*fname == '\0') || (strcmp(fname, ".") == 0) ||
+			(strcmp(fname, "..") == 0)) {
+		return false;
+	}
+
+#ifdef _WIN32
+	/* Drive letters also take us elsewhere. */
+	return strpbrk(fname, "/\\:") == NULL;
+#else
+	return strpbrk(fname, "/\\") == NULL;
+#endif /* _WIN32 */
+}
+
 /**
  * Gets the size of an entire file.
  *
@@ -285,7 +318,7 @@ size_t file_size(const char *fname) {
 	size_t len;
 
 	/* Open the file. */
-	fh = fopen(fname, "rb");
+	fh = file_open(fname, "rb");
 	if (fh == NULL)
 		return 0L;
 
@@ -329,7 +362,767 @@ bool file_exists(const char *fname) {
 	if (fname == NULL)
 		return false;
 
-	return access(fname, F_OK) != -1;
+	return faccessat(dir_base, fname, F_OK, 0) != -1;
+#endif /* _WIN32 */
+}
+
+/**
+ * Creates a new file and opens it for reading and writing, failing if anything
+ * already exists with the same name. Checking and creating happens atomically,
+ * so there's no window for another process to take the name in between.
+ *
+ * @param fname Path of the file to be created.
+ *
+ * @return File handle or NULL if the file couldn't be created, with errno set
+ *         to EEXIST if the name was already taken.
+ */
+FILE *file_create(const char *fname) {
+	FILE *fh;
+	int fd;
+#ifdef _WIN32
+	LPTSTR szPath;
+
+	if (!UnicodeMultiByteToWideChar(fname, &szPath)) {
+		log_syserr(LOG_CRIT, "Failed to convert filename to UTF-16");
+		return NULL;
+	}
+	fd = _wopen(szPath, _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY,
+		_S_IREAD | _S_IWRITE);
+	free(szPath);
+	if (fd == -1)
+		return NULL;
+
+	fh = _fdopen(fd, "w+b");
+	if (fh == NULL)
+		_close(fd);
+#else
+	fd = openat(dir_base, fname, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0666);
+	if (fd == -1)
+		return NULL;
+
+	fh = fdopen(fd, "w+b");
+	if (fh == NULL)
+		close(fd);
+#endif /* _WIN32 */
+
+	return fh;
+}
+
+/**
+ * Opens a file just like fopen() would, resolving relative paths against the
+ * base directory.
+ *
+ * @param fname Path to the file to be opened.
+ * @param mode  Mode to open the file with, as understood by fopen().
+ *
+ * @return File handle or NULL if the file couldn't be opened.
+ */
+FILE *file_open(const char *fname, const char *mode) {
+#ifdef _WIN32
+	return fopen(fname, mode);
+#else
+	FILE *fh;
+	int flags;
+	int fd;
+
+	/* Translate the mode into what open() expects. */
+	switch (mode[0]) {
+		case 'r':
+			flags = 0;
+			break;
+		case 'w':
+			flags = O_CREAT | O_TRUNC;
+			break;
+		case 'a':
+			flags = O_CREAT | O_APPEND;
+			break;
+		default:
+			errno = EINVAL;
+			return NULL;
+	}
+	if (strchr(mode, '+') != NULL) {
+		flags |= O_RDWR;
+	} else {
+		flags |= (mode[0] == 'r') ? O_RDONLY : O_WRONLY;
+	}
+
+	fd = openat(dir_base, fname, flags | O_CLOEXEC, 0666);
+	if (fd == -1)
+		return NULL;
+
+	fh = fdopen(fd, mode);
+	if (fh == NULL)
+		close(fd);
+
+	return fh;
+#endif /* _WIN32 */
+}
+
+/**
+ * Opens a file for reading and gets its size and modification time from the
+ * handle that was opened, which saves looking up its path more than once.
+ *
+ * @param fname Path to the file to be opened.
+ * @param size  Returns the size of the file in bytes.
+ * @param mtime Returns the modification time of the file, in the same units as
+ *              file_stat.
+ *
+ * @return File handle or NULL if the file couldn't be opened or is a
+ *         directory.
+ *
+ * @see file_stat
+ */
+FILE *file_open_stat(const char *fname, uint64_t *size, uint64_t *mtime) {
+#ifdef _WIN32
+	BY_HANDLE_FILE_INFORMATION info;
+	FILE *fh;
+
+	/* Directories can't be opened as files here. */
+	fh = fopen(fname, "rb");
+	if (fh == NULL)
+		return NULL;
+	if (!GetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(fh)),
+			&info)) {
+		fclose(fh);
+		return NULL;
+	}
+
+	*size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	*mtime = FILETIME_NS(info.ftLastWriteTime);
+
+	return fh;
+#else
+	struct stat st;
+	FILE *fh;
+	int fd;
+
+	fd = openat(dir_base, fname, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) != 0)
+		goto failed;
+	if (S_ISDIR(st.st_mode)) {
+		errno = EISDIR;
+		goto failed;
+	}
+
+	*size = (uint64_t)st.st_size;
+	*mtime = stat_mtime_ns(&st);
+
+	fh = fdopen(fd, "rb");
+	if (fh == NULL)
+		goto failed;
+
+	return fh;
+
+failed:
+	close(fd);
+	return NULL;
+#endif /* _WIN32 */
+}
+
+/**
+ * Removes a file.
+ *
+ * @param fname Path to the file to be removed.
+ *
+ * @return TRUE if the file was removed, FALSE otherwise.
+ */
+bool file_remove(const char *fname) {
+#ifdef _WIN32
+	return remove(fname) == 0;
+#else
+	return unlinkat(dir_base, fname, 0) == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Renames a file, replacing the destination if it already exists.
+ *
+ * @param from Path of the file to be renamed.
+ * @param to   Path the file should have afterwards.
+ *
+ * @return TRUE if the file was renamed, FALSE otherwise.
+ */
+bool file_replace(const char *from, const char *to) {
+#ifdef _WIN32
+	LPTSTR szFrom;
+	LPTSTR szTo;
+	BOOL bRet;
+
+	/* Convert the paths to UTF-16. */
+	if (!UnicodeMultiByteToWideChar(from, &szFrom)) {
+		log_syserr(LOG_CRIT, "Failed to convert filename to UTF-16");
+		return false;
+	}
+	if (!UnicodeMultiByteToWideChar(to, &szTo)) {
+		log_syserr(LOG_CRIT, "Failed to convert filename to UTF-16");
+		free(szFrom);
+		return false;
+	}
+
+	/* Move the file over the destination. */
+	bRet = MoveFileEx(szFrom, szTo, MOVEFILE_REPLACE_EXISTING);
+	free(szFrom);
+	free(szTo);
+
+	return bRet != FALSE;
+#else
+	return renameat(dir_base, from, dir_base, to) == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Gets the size and modification time of a file.
+ *
+ * @param fname Path to the file to be inspected.
+ * @param size  Returns the size of the file in bytes.
+ * @param mtime Returns the modification time of the file in nanoseconds since
+ *              the Unix epoch, with the highest resolution available.
+ *
+ * @return TRUE if the file exists and isn't a directory, FALSE otherwise.
+ */
+bool file_stat(const char *fname, uint64_t *size, uint64_t *mtime) {
+	bool dir;
+
+	return path_stat(fname, &dir, size, mtime) && !dir;
+}
+
+/**
+ * Gets the type, size and modification time of anything in the file system.
+ *
+ * @param path  Path to be inspected.
+ * @param dir   Returns TRUE if the path is a directory.
+ * @param size  Returns the size of the file in bytes.
+ * @param mtime Returns the modification time in nanoseconds since the Unix
+ *              epoch, with the highest resolution available.
+ *
+ * @return TRUE if the path exists, FALSE otherwise.
+ */
+bool path_stat(const char *path, bool *dir, uint64_t *size, uint64_t *mtime) {
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	LPTSTR szPath;
+	BOOL bRet;
+
+	/* Get the attributes of the file. */
+	if (!UnicodeMultiByteToWideChar(path, &szPath)) {
+		log_syserr(LOG_CRIT, "Failed to convert filename to UTF-16");
+		return false;
+	}
+	bRet = GetFileAttributesEx(szPath, GetFileExInfoStandard, &attr);
+	free(szPath);
+	if (!bRet)
+		return false;
+
+	*dir = (attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	*size = ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+	*mtime = FILETIME_NS(attr.ftLastWriteTime);
+
+	return true;
+#else
+	struct stat st;
+#ifdef STATX_BASIC_STATS
+	struct statx stx;
+
+	/* Only ask for what we need, which is cheaper on network file systems. */
+	if (statx(dir_base, path, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_SIZE |
+			STATX_MTIME, &stx) == 0) {
+		*dir = S_ISDIR(stx.stx_mode) != 0;
+		*size = (uint64_t)stx.stx_size;
+		*mtime = ((uint64_t)stx.stx_mtime.tv_sec * 1000000000UL) +
+			(uint64_t)stx.stx_mtime.tv_nsec;
+
+		return true;
+	} else if (errno != ENOSYS) {
+		return false;
+	}
+#endif /* STATX_BASIC_STATS */
+
+	if (fstatat(dir_base, path, &st, 0) != 0)
+		return false;
+
+	*dir = S_ISDIR(st.st_mode) != 0;
+	*size = (uint64_t)st.st_size;
+	*mtime = stat_mtime_ns(&st);
+
+	return true;
+#endif /* _WIN32 */
+}
+
+/**
+ * Gets the identity of an open file, which changes whenever the file is
+ * replaced or modified.
+ *
+ * @param fh    Open file to be identified.
+ * @param dev   Returns the identifier of the device the file is stored in.
+ * @param ino   Returns the identifier of the file in its device.
+ * @param size  Returns the size of the file in bytes.
+ * @param mtime Returns the modification time of the file, in the same units as
+ *              file_stat.
+ *
+ * @return TRUE if the file was identified, FALSE otherwise.
+ *
+ * @see file_stat
+ */
+bool file_ident(FILE *fh, uint64_t *dev, uint64_t *ino, uint64_t *size,
+                uint64_t *mtime) {
+#ifdef _WIN32
+	BY_HANDLE_FILE_INFORMATION info;
+
+	if (!GetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(fh)),
+			&info)) {
+		return false;
+	}
+
+	*dev = info.dwVolumeSerialNumber;
+	*ino = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	*size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	*mtime = FILETIME_NS(info.ftLastWriteTime);
+
+	return true;
+#else
+	struct stat st;
+
+	if (fstat(fileno(fh), &st) != 0)
+		return false;
+
+	*dev = (uint64_t)st.st_dev;
+	*ino = (uint64_t)st.st_ino;
+	*size = (uint64_t)st.st_size;
+	*mtime = stat_mtime_ns(&st);
+
+	return true;
+#endif /* _WIN32 */
+}
+
+/**
+ * Sets the modification time of a file.
+ *
+ * @param fname Path to the file.
+ * @param mtime Modification time in nanoseconds since the Unix epoch.
+ *
+ * @return TRUE if the time was set, FALSE otherwise.
+ */
+bool file_set_mtime(const char *fname, uint64_t mtime) {
+#ifdef _WIN32
+	ULARGE_INTEGER uli;
+	FILETIME ft;
+	HANDLE hFile;
+	LPTSTR szPath;
+	BOOL bRet;
+
+	/* Open the file just to change its attributes. */
+	if (!UnicodeMultiByteToWideChar(fname, &szPath)) {
+		log_syserr(LOG_CRIT, "Failed to convert filename to UTF-16");
+		return false;
+	}
+	hFile = CreateFile(szPath, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ |
+		FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	free(szPath);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	/* Set the time. */
+	uli.QuadPart = (mtime / 100) + 116444736000000000ULL;
+	ft.dwLowDateTime = uli.LowPart;
+	ft.dwHighDateTime = uli.HighPart;
+	bRet = SetFileTime(hFile, NULL, NULL, &ft);
+	CloseHandle(hFile);
+
+	return bRet != FALSE;
+#elif defined(AT_FDCWD) && defined(UTIME_OMIT)
+	struct timespec ts[2];
+
+	ts[0].tv_sec = 0;
+	ts[0].tv_nsec = UTIME_OMIT;
+	ts[1].tv_sec = (time_t)(mtime / 1000000000UL);
+	ts[1].tv_nsec = (long)(mtime % 1000000000UL);
+
+	return utimensat(dir_base, fname, ts, 0) == 0;
+#else
+	struct timeval tv[2];
+
+	tv[0].tv_sec = tv[1].tv_sec = (time_t)(mtime / 1000000000UL);
+	tv[0].tv_usec = tv[1].tv_usec = (long)((mtime % 1000000000UL) / 1000);
+
+	/* Without utimensat the path can only be resolved from here. */
+	if (dir_base != AT_FDCWD) {
+		errno = ENOTSUP;
+		return false;
+	}
+
+	return utimes(fname, tv) == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Lists the names of everything inside a directory, in no particular order.
+ *
+ * @warning This function allocates memory that must be freed later, both for
+ *          the list and each of its names.
+ *
+ * @param path  Path to the directory.
+ * @param count Returns the number of names in the list.
+ *
+ * @return List of names or NULL if the directory couldn't be read. An empty
+ *         directory results in a list with no names.
+ */
+char **dir_list(const char *path, size_t *count) {
+	char **names;
+	char **tmp;
+	size_t alloc;
+	char *name;
+#ifdef _WIN32
+	WIN32_FIND_DATA fd;
+	HANDLE hFind;
+	LPTSTR szPath;
+	char *pattern;
+
+	/* Start looking through the directory. */
+	pattern = (char *)malloc(strlen(path) + 3);
+	if (pattern == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate directory search pattern");
+		return NULL;
+	}
+	sprintf(pattern, "%s\\*", path);
+	if (!UnicodeMultiByteToWideChar(pattern, &szPath)) {
+		log_syserr(LOG_CRIT, "Failed to convert path to UTF-16");
+		free(pattern);
+		return NULL;
+	}
+	free(pattern);
+	hFind = FindFirstFile(szPath, &fd);
+	free(szPath);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return NULL;
+#else
+	struct dirent *ent;
+	DIR *dh;
+	int fd;
+
+	/* Start looking through the directory. */
+	fd = openat(dir_base, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	dh = fdopendir(fd);
+	if (dh == NULL) {
+		close(fd);
+		return NULL;
+	}
+#endif /* _WIN32 */
+
+	/* Start with room for a few names. */
+	*count = 0;
+	alloc = 16;
+	names = (char **)malloc(alloc * sizeof(char *));
+	if (names == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate directory listing");
+		goto failed;
+	}
+
+	/* Go through every entry except for the special ones. */
+#ifdef _WIN32
+	do {
+		if ((_tcscmp(fd.cFileName, _T(".")) == 0) ||
+				(_tcscmp(fd.cFileName, _T("..")) == 0)) {
+			continue;
+		}
+		if (!UnicodeWideCharToMultiByte(fd.cFileName, &name)) {
+			log_syserr(LOG_CRIT, "Failed to convert file name to UTF-8");
+			goto failed;
+		}
+#else
+	while ((ent = readdir(dh)) != NULL) {
+		if ((strcmp(ent->d_name, ".") == 0) ||
+				(strcmp(ent->d_name, "..") == 0)) {
+			continue;
+		}
+		name = strdup(ent->d_name);
+		if (name == NULL) {
+			log_syserr(LOG_CRIT, "Failed to allocate directory entry name");
+			goto failed;
+		}
+#endif /* _WIN32 */
+
+		/* Grow the list as needed. */
+		if (*count == alloc) {
+			alloc *= 2;
+			tmp = (char **)realloc(names, alloc * sizeof(char *));
+			if (tmp == NULL) {
+				log_syserr(LOG_CRIT, "Failed to grow directory listing");
+				free(name);
+				goto failed;
+			}
+			names = tmp;
+		}
+		names[(*count)++] = name;
+#ifdef _WIN32
+	} while (FindNextFile(hFind, &fd));
+	FindClose(hFind);
+#else
+	}
+	closedir(dh);
+#endif /* _WIN32 */
+
+	return names;
+
+failed:
+#ifdef _WIN32
+	FindClose(hFind);
+#else
+	closedir(dh);
+#endif /* _WIN32 */
+	if (names != NULL) {
+		while (*count > 0)
+			free(names[--(*count)]);
+		free(names);
+	}
+
+	return NULL;
+}
+
+/**
+ * Creates a directory if it doesn't exist yet.
+ *
+ * @param path Path to the directory to be created.
+ *
+ * @return TRUE if the directory exists, FALSE if it couldn't be created.
+ */
+bool dir_create(const char *path) {
+	uint64_t size;
+	uint64_t mtime;
+	bool dir;
+#ifdef _WIN32
+	LPTSTR szPath;
+	BOOL bRet;
+#endif /* _WIN32 */
+
+	/* Check if we even need to do anything. */
+	if (path_stat(path, &dir, &size, &mtime))
+		return dir;
+
+#ifdef _WIN32
+	if (!UnicodeMultiByteToWideChar(path, &szPath)) {
+		log_syserr(LOG_CRIT, "Failed to convert path to UTF-16");
+		return false;
+	}
+	bRet = CreateDirectory(szPath, NULL);
+	free(szPath);
+
+	return bRet != FALSE;
+#else
+	return mkdirat(dir_base, path, 0777) == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Sets the directory that relative paths given to the file system functions
+ * are resolved against, creating it if needed. On platforms that support it
+ * the directory is kept open, so that its path is only looked up once and the
+ * working directory is left untouched.
+ *
+ * @param path Path to the directory, relative to the current one.
+ *
+ * @return TRUE if the directory is now the base, FALSE otherwise.
+ */
+bool dir_set_base(const char *path) {
+#ifdef _WIN32
+	LPTSTR szPath;
+	BOOL bRet;
+
+	if (!dir_create(path))
+		return false;
+
+	if (!UnicodeMultiByteToWideChar(path, &szPath)) {
+		log_syserr(LOG_CRIT, "Failed to convert path to UTF-16");
+		return false;
+	}
+	bRet = SetCurrentDirectory(szPath);
+	free(szPath);
+
+	return bRet != FALSE;
+#else
+	int fd;
+
+	if (!dir_create(path))
+		return false;
+
+	fd = openat(dir_base, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	if (dir_base != AT_FDCWD)
+		close(dir_base);
+	dir_base = fd;
+
+	return true;
+#endif /* _WIN32 */
+}
+
+/**
+ * Maps the entire contents of a file into memory.
+ *
+ * @warning The mapping must be released later.
+ *
+ * @param fname    Path to the file to be mapped.
+ * @param len      Returns the length of the mapping.
+ * @param writable Should changes to the mapping be written back to the file?
+ *
+ * @return Contents of the file or NULL if it doesn't exist, is empty, or
+ *         couldn't be mapped.
+ *
+ * @see file_unmap
+ */
+void *file_map(const char *fname, size_t *len, bool writable) {
+#ifdef _WIN32
+	LARGE_INTEGER liSize;
+	HANDLE hFile;
+	HANDLE hMap;
+	LPTSTR szPath;
+	void *map;
+
+	/* Open the file. */
+	if (!UnicodeMultiByteToWideChar(fname, &szPath)) {
+		log_syserr(LOG_CRIT, "Failed to convert filename to UTF-16");
+		return NULL;
+	}
+	hFile = CreateFile(szPath, GENERIC_READ | ((writable) ? GENERIC_WRITE :
+		0), FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	free(szPath);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return NULL;
+	if (!GetFileSizeEx(hFile, &liSize) || (liSize.QuadPart == 0) ||
+			((uint64_t)liSize.QuadPart > (uint64_t)SIZE_MAX)) {
+		CloseHandle(hFile);
+		return NULL;
+	}
+
+	/* Map it. The view keeps the mapping alive after the handles are gone. */
+	hMap = CreateFileMapping(hFile, NULL, (writable) ? PAGE_READWRITE :
+		PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(hFile);
+	if (hMap == NULL)
+		return NULL;
+	map = MapViewOfFile(hMap, (writable) ? FILE_MAP_WRITE : FILE_MAP_READ, 0,
+		0, 0);
+	CloseHandle(hMap);
+	if (map == NULL)
+		return NULL;
+	*len = (size_t)liSize.QuadPart;
+
+	return map;
+#else
+	struct stat st;
+	void *map;
+	int fd;
+
+	/* Open the file. */
+	fd = openat(dir_base, fname, ((writable) ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if ((fstat(fd, &st) != 0) || (st.st_size <= 0) ||
+			((uint64_t)st.st_size > (uint64_t)SIZE_MAX)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Map it. The mapping stays valid after the descriptor is closed. */
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ | ((writable) ?
+		PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*len = (size_t)st.st_size;
+
+	return map;
+#endif /* _WIN32 */
+}
+
+/**
+ * Releases a mapping of the contents of a file.
+ *
+ * @param map Contents of the file returned by file_map. Ignored if NULL.
+ * @param len Length of the mapping.
+ *
+ * @see file_map
+ */
+void file_unmap(void *map, size_t len) {
+	if (map == NULL)
+		return;
+
+#ifdef _WIN32
+	(void)len;
+	UnmapViewOfFile(map);
+#else
+	munmap(map, len);
+#endif /* _WIN32 */
+}
+
+/**
+ * Makes a file share the contents of another one without copying them, which
+ * is only possible on file systems that support copy-on-write clones.
+ *
+ * @param fh  Empty file that will get the contents.
+ * @param src Path to the file whose contents will be shared.
+ *
+ * @return TRUE if the file was cloned, FALSE if it's not supported.
+ */
+bool file_clone(FILE *fh, const char *src) {
+#if defined(__linux__) && defined(FICLONE)
+	int fd;
+	int ret;
+
+	fd = openat(dir_base, src, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	fflush(fh);
+	ret = ioctl(fileno(fh), FICLONE, fd);
+	close(fd);
+
+	return ret == 0;
+#else
+	(void)fh;
+	(void)src;
+
+	return false;
+#endif /* __linux__ && FICLONE */
+}
+
+/**
+ * Creates a hard link to a file.
+ *
+ * @param src Path to the existing file.
+ * @param dst Path of the link to be created, which must not exist.
+ *
+ * @return TRUE if the link was created, FALSE otherwise.
+ */
+bool file_link(const char *src, const char *dst) {
+#ifdef _WIN32
+	LPTSTR szSrc;
+	LPTSTR szDst;
+	BOOL bRet;
+
+	/* Convert the paths to UTF-16. */
+	if (!UnicodeMultiByteToWideChar(src, &szSrc)) {
+		log_syserr(LOG_CRIT, "Failed to convert filename to UTF-16");
+		return false;
+	}
+	if (!UnicodeMultiByteToWideChar(dst, &szDst)) {
+		log_syserr(LOG_CRIT, "Failed to convert filename to UTF-16");
+		free(szSrc);
+		return false;
+	}
+
+	/* Link them together. */
+	bRet = CreateHardLink(szDst, szSrc, NULL);
+	free(szSrc);
+	free(szDst);
+
+	return bRet != FALSE;
+#else
+	return linkat(dir_base, src, dir_base, dst, 0) == 0;
 #endif /* _WIN32 */
 }
 
@@ -372,3 +1165,226 @@ char *path_basename(const char *path) {
 
 	return bname;
 }
+
+/**
+ * Reserves space for a file that's about to be written out of order, setting
+ * its size beforehand.
+ *
+ * @param fh   File handle opened for writing.
+ * @param size Final size of the file.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+bool file_prealloc(FILE *fh, uint64_t size) {
+#ifdef _WIN32
+	return _chsize_s(_fileno(fh), (__int64)size) == 0;
+#else
+	int fd;
+
+	/* Try to allocate the actual blocks before settling for a sparse file. */
+	fd = fileno(fh);
+	if ((size > 0) && (posix_fallocate(fd, 0, (off_t)size) == 0))
+		return true;
+
+	return ftruncate(fd, (off_t)size) == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Writes data to a specific position of a file without moving its cursor. Safe
+ * to be called concurrently from multiple threads on the same file.
+ *
+ * @param fh     File handle opened for writing.
+ * @param buf    Data to be written.
+ * @param len    Length of the data to be written.
+ * @param offset Position in the file where the data should be written to.
+ *
+ * @return TRUE if all the data was written, FALSE otherwise.
+ */
+bool file_pwrite(FILE *fh, const void *buf, size_t len, uint64_t offset) {
+#ifdef _WIN32
+	OVERLAPPED ov;
+	DWORD dwWritten;
+
+	memset(&ov, 0, sizeof(OVERLAPPED));
+	ov.Offset = (DWORD)(offset & 0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	if (!WriteFile((HANDLE)_get_osfhandle(_fileno(fh)), buf, (DWORD)len,
+			&dwWritten, &ov)) {
+		return false;
+	}
+
+	return dwWritten == len;
+#else
+	const uint8_t *cur;
+	ssize_t wlen;
+	int fd;
+
+	fd = fileno(fh);
+	cur = (const uint8_t *)buf;
+	while (len > 0) {
+		wlen = pwrite(fd, cur, len, (off_t)offset);
+		if (wlen <= 0)
+			return false;
+
+		cur += wlen;
+		len -= wlen;
+		offset += wlen;
+	}
+
+	return true;
+#endif /* _WIN32 */
+}
+
+/**
+ * Reads a block of data from a specific position in a file without moving its
+ * current position, allowing multiple threads to read from the same file.
+ *
+ * @param fh     File handle.
+ * @param buf    Where to store the data that was read.
+ * @param len    Number of bytes to read.
+ * @param offset Position in the file to read from.
+ *
+ * @return TRUE if all of the requested bytes were read, FALSE otherwise.
+ */
+bool file_pread(FILE *fh, void *buf, size_t len, uint64_t offset) {
+#ifdef _WIN32
+	OVERLAPPED ov;
+	DWORD dwRead;
+
+	memset(&ov, 0, sizeof(OVERLAPPED));
+	ov.Offset = (DWORD)(offset & 0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	if (!ReadFile((HANDLE)_get_osfhandle(_fileno(fh)), buf, (DWORD)len,
+			&dwRead, &ov)) {
+		return false;
+	}
+
+	return dwRead == len;
+#else
+	uint8_t *cur;
+	ssize_t rlen;
+	int fd;
+
+	fd = fileno(fh);
+	cur = (uint8_t *)buf;
+	while (len > 0) {
+		rlen = pread(fd, cur, len, (off_t)offset);
+		if (rlen <= 0)
+			return false;
+
+		cur += rlen;
+		len -= rlen;
+		offset += rlen;
+	}
+
+	return true;
+#endif /* _WIN32 */
+}
+
+/**
+ * Seeks to an absolute position in a file, including ones beyond the 2GB mark.
+ *
+ * @param fh     File handle.
+ * @param offset Position in the file to seek to.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+bool file_seek(FILE *fh, uint64_t offset) {
+#ifdef _WIN32
+	return _fseeki64(fh, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(fh, (off_t)offset, SEEK_SET) == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Gets a monotonic timestamp in milliseconds, useful for measuring intervals.
+ *
+ * @return Milliseconds elapsed since an arbitrary point in time.
+ */
+uint64_t clock_ms(void) {
+#ifdef _WIN32
+	return (uint64_t)GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif /* _WIN32 */
+}
+
+/**
+ * Gets a monotonic timestamp in microseconds, useful for measuring intervals
+ * that are too short for clock_ms.
+ *
+ * @return Microseconds elapsed since an arbitrary point in time.
+ */
+uint64_t clock_us(void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return ((uint64_t)(now.QuadPart / freq.QuadPart) * 1000000) +
+		((uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 /
+		(uint64_t)freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif /* _WIN32 */
+}
+
+/**
+ * Gets the number of processors available to us.
+ *
+ * @return Number of online processors, at least 1.
+ */
+unsigned int cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0) ? si.dwNumberOfProcessors : 1;
+#else
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (unsigned int)n : 1;
+#endif /* _WIN32 */
+}
+
+/**
+ * Fills a buffer with random bytes, suitable for generating identifiers.
+ *
+ * @param buf Buffer to be filled.
+ * @param len Number of random bytes to generate.
+ */
+void random_bytes(uint8_t *buf, size_t len) {
+	static bool seeded = false;
+	size_t i;
+
+#ifndef _WIN32
+	FILE *fh;
+
+	/* Use the system's random number generator if available. */
+	fh = fopen("/dev/urandom", "rb");
+	if (fh != NULL) {
+		i = fread(buf, sizeof(uint8_t), len, fh);
+		fclose(fh);
+		if (i == len)
+			return;
+	}
+#endif /* !_WIN32 */
+
+	/* Fall back to the C library's generator. */
+	if (!seeded) {
+		srand((unsigned int)(time(NULL) ^ clock_ms()));
+		seeded = true;
+	}
+	for (i = 0; i < len; i++)
+		buf[i] = (uint8_t)(rand() >> 7);
+}
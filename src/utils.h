@@ -9,15 +9,19 @@
 #define _GL_UTILS_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdio.h>
+
+/* Transfer size used when the total length isn't known beforehand. */
+#define SIZE_UNKNOWN ((size_t)-1)
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /* String manipulation. */
-char *struntil(const char *begin, char token, const char **end);
 bool parse_num(const char *str, long *num);
 bool parse_size(const char *str, size_t *num);
 
@@ -25,12 +29,41 @@ bool parse_size(const char *str, size_t *num);
 bool ask_yn(const char *msg, ...);
 void buffered_progress(const char *name, size_t acc, size_t fsize);
 size_t read_stdin(char **text, bool trim);
+bool stdin_is_tty(void);
 
 /* File system. */
 int fname_sanitize(char *fname);
+bool fname_plain(const char *fname);
 size_t file_size(const char *fname);
 bool file_exists(const char *fname);
+FILE *file_create(const char *fname);
+FILE *file_open(const char *fname, const char *mode);
+FILE *file_open_stat(const char *fname, uint64_t *size, uint64_t *mtime);
+bool file_remove(const char *fname);
+bool file_replace(const char *from, const char *to);
+bool file_stat(const char *fname, uint64_t *size, uint64_t *mtime);
+bool path_stat(const char *path, bool *dir, uint64_t *size, uint64_t *mtime);
+bool file_ident(FILE *fh, uint64_t *dev, uint64_t *ino, uint64_t *size,
+                uint64_t *mtime);
+bool file_set_mtime(const char *fname, uint64_t mtime);
+void *file_map(const char *fname, size_t *len, bool writable);
+void file_unmap(void *map, size_t len);
+bool file_clone(FILE *fh, const char *src);
+bool file_link(const char *src, const char *dst);
 char *path_basename(const char *path);
+char **dir_list(const char *path, size_t *count);
+bool dir_create(const char *path);
+bool dir_set_base(const char *path);
+bool file_prealloc(FILE *fh, uint64_t size);
+bool file_pwrite(FILE *fh, const void *buf, size_t len, uint64_t offset);
+bool file_seek(FILE *fh, uint64_t offset);
+bool file_pread(FILE *fh, void *buf, size_t len, uint64_t offset);
+
+/* Miscellaneous. */
+uint64_t clock_ms(void);
+uint64_t clock_us(void);
+unsigned int cpu_count(void);
+void random_bytes(uint8_t *buf, size_t len);
 
 #ifdef __cplusplus
 }
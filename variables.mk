@@ -31,3 +31,9 @@ endif
 CFLAGS  = -Wall -Wno-psabi --std=gnu89 -pthread
 LDFLAGS = -pthread
 LIBS    =
+
+# Use Zstandard for compression when asked to (make ZSTD=1).
+ifdef ZSTD
+	CFLAGS += -DGL_USE_ZSTD
+	LIBS   += -lzstd
+endif